@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Compares --pair_extraction rescan (legacy) vs single_pass on one sample:
+# wall time, max RSS and whether the dumped counts are identical.
+# The post-filters are on by default (FILTER_OPTS), as they see differently weighted counts in both modes.
+
+# ---------------- user knobs (edit if needed) ----------------
+EXEC_FILTER="${EXEC_FILTER:-./bin/bkc_filter}"
+EXEC_DUMP="${EXEC_DUMP:-./bin/bkc_dump}"
+FASTQ_DIR="${FASTQ_DIR:-/oak/stanford/groups/horence/joycao1/hyena_preprocess/fastq_data/fastq}"
+ANCHORS="${ANCHORS:-/oak/stanford/groups/horence/joycao1/hyena_preprocess/8mer_list_for_single_cell_testing.txt}"
+# File with "R1,R2" lines (ERR13720418 by default)
+FL_TXT="${FL_TXT:-$FASTQ_DIR/fl.txt}"
+N_THREADS="${N_THREADS:-16}"
+MODES_LIST="${MODES_LIST:-rescan single_pass}"
+# Post-filters applied in both modes (empty to compare the unfiltered counts)
+FILTER_OPTS="${FILTER_OPTS:---leader_sample_counts_threshold 2 --poly_ACGT_len 6 --apply_filter_illumina_adapters --filter_universal_targets}"
+# Output CSV
+OUT_CSV="${OUT_CSV:-pair_extraction_ERR13720418.csv}"
+
+# ---------------- sanity checks ----------------
+[[ -x "$EXEC_FILTER" ]] || { echo "ERROR: not executable: $EXEC_FILTER"; exit 1; }
+[[ -x "$EXEC_DUMP"   ]] || { echo "ERROR: not executable: $EXEC_DUMP"; exit 1; }
+[[ -s "$ANCHORS"     ]] || { echo "ERROR: anchors missing: $ANCHORS"; exit 1; }
+[[ -s "$FL_TXT"      ]] || { echo "ERROR: input list missing: $FL_TXT"; exit 1; }
+
+WORK_DIR="/scratch/groups/horence/${USER}/pair_extraction_${SLURM_JOB_ID:-$$}"
+mkdir -p "${WORK_DIR}"
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# ---------------- utils ----------------
+to_seconds() {  # convert h:mm:ss or m:ss to seconds
+  awk -F: 'NF==3{print $1*3600+$2*60+$3} NF==2{print $1*60+$2} NF==1{print $1}'
+}
+
+measure_run () {
+  local mode="$1"
+  local bkc="${WORK_DIR}/out_${mode}.bkc"
+  local txt="${WORK_DIR}/out_${mode}.txt"
+  local tfile="${WORK_DIR}/time_${mode}.txt"
+
+  # shellcheck disable=SC2086
+  /usr/bin/time -v \
+    "$EXEC_FILTER" \
+      --mode pair \
+      --input_name "$FL_TXT" \
+      -d "$ANCHORS" \
+      --cbc_len 16 --umi_len 12 --leader_len 8 --follower_len 31 --gap_len 0 \
+      --pair_extraction "$mode" \
+      $FILTER_OPTS \
+      --n_threads "$N_THREADS" \
+      --output_name "$bkc" \
+    1>/dev/null 2>"$tfile"
+
+  "$EXEC_DUMP" --input_name "$bkc" --output_name "$txt" 1>/dev/null 2>&1
+
+  # CBCs are processed in parallel, so only the sorted dumps are comparable
+  LC_ALL=C sort -S 2G --parallel="$N_THREADS" "$txt" -o "${WORK_DIR}/sorted_${mode}.txt"
+  rm -f "$txt"
+
+  local wall=$(grep -m1 "Elapsed (wall clock) time" "$tfile" | awk '{print $8}')
+  local rss=$(grep -m1 "Maximum resident set size" "$tfile" | awk '{print $6}')  # KB
+  local wall_s=$(echo "$wall" | to_seconds)
+  local n_rec=$(wc -l < "${WORK_DIR}/sorted_${mode}.txt")
+  echo "$wall_s" "$rss" "$n_rec"
+}
+
+# ---------------- runs ----------------
+echo "mode,threads,wall_seconds,max_rss_kb,records" > "$OUT_CSV"
+
+ref_mode=""
+for m in $MODES_LIST; do
+  echo "[RUN] pair_extraction=${m}"
+  read -r wall rss n_rec < <(measure_run "$m")
+  echo "${m},${N_THREADS},${wall},${rss},${n_rec}" >> "$OUT_CSV"
+
+  if [[ -z "$ref_mode" ]]; then
+    ref_mode="$m"
+  elif cmp -s "${WORK_DIR}/sorted_${ref_mode}.txt" "${WORK_DIR}/sorted_${m}.txt"; then
+    echo "[OK] ${m} output identical to ${ref_mode}"
+  else
+    echo "[FAIL] ${m} output differs from ${ref_mode}"
+    exit 2
+  fi
+done
+
+echo "[DONE] Results -> $OUT_CSV"
+cat "$OUT_CSV"
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# End-to-end thread scaling of bkc_filter on a synthetic dataset (see src/bench/gen_10x.cpp).
+# Usage: bench_scaling.sh <dataset_prefix>
+# The dataset is generated if <dataset_prefix>.txt does not exist.
+
+# ---------------- user knobs (edit if needed) ----------------
+EXEC_FILTER="${EXEC_FILTER:-./bin/bkc_filter}"
+EXEC_GEN="${EXEC_GEN:-./bin/bench_gen_10x}"
+GEN_OPTS="${GEN_OPTS:---no_reads 2000000 --no_cbcs 3000}"
+# Thread list to test (space separated)
+THREADS_LIST="${THREADS_LIST:-1 2 4 8 16}"
+# Output CSV
+OUT_CSV="${OUT_CSV:-bench_scaling.csv}"
+
+PREFIX="${1:-bench_data/synth}"
+
+# ---------------- sanity checks ----------------
+[[ -x "$EXEC_FILTER" ]] || { echo "ERROR: not executable: $EXEC_FILTER"; exit 1; }
+
+if [[ ! -s "${PREFIX}.txt" ]]; then
+  [[ -x "$EXEC_GEN" ]] || { echo "ERROR: not executable: $EXEC_GEN"; exit 1; }
+  mkdir -p "$(dirname "$PREFIX")"
+  echo "[GEN] ${PREFIX} (${GEN_OPTS})"
+  # shellcheck disable=SC2086
+  "$EXEC_GEN" --out_prefix "$PREFIX" $GEN_OPTS
+fi
+
+WORK_DIR="$(mktemp -d "${TMPDIR:-/tmp}/bench_scaling.XXXXXX")"
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# ---------------- utils ----------------
+to_seconds() {  # convert h:mm:ss or m:ss to seconds
+  awk -F: 'NF==3{print $1*3600+$2*60+$3} NF==2{print $1*60+$2} NF==1{print $1}'
+}
+
+# 1st occurrence of a key in the stats JSON is the run total
+json_total() {
+  grep -m1 "\"$2\"" "$1" | sed -E 's/.*: *([0-9.eE+-]+).*/\1/'
+}
+
+measure_run () {
+  local nthreads="$1"
+  local tfile="${WORK_DIR}/time_${nthreads}.txt"
+  local sfile="${WORK_DIR}/stats_${nthreads}.json"
+
+  /usr/bin/time -v \
+    "$EXEC_FILTER" \
+      --mode pair \
+      --input_name "${PREFIX}.txt" \
+      -d "${PREFIX}_anchors.txt" \
+      --cbc_len 16 --umi_len 12 --leader_len 8 --follower_len 31 --gap_len 0 \
+      --n_threads "$nthreads" \
+      --stats_json "$sfile" \
+      --output_name "${WORK_DIR}/out_${nthreads}.bkc" \
+    1>/dev/null 2>"$tfile"
+
+  local wall=$(grep -m1 "Elapsed (wall clock) time" "$tfile" | awk '{print $8}')
+  local rss=$(grep -m1 "Maximum resident set size" "$tfile" | awk '{print $6}')  # KB
+  local wall_s=$(echo "$wall" | to_seconds)
+  echo "$wall_s" "$(json_total "$sfile" cpu_user_s)" "$(json_total "$sfile" cpu_sys_s)" "$rss" \
+    "$(json_total "$sfile" records_in)" "$(json_total "$sfile" records_out)" \
+    "$(json_total "$sfile" queue_pop_wait_s)" "$(json_total "$sfile" mem_pool_pop_wait_s)"
+
+  rm -f "${WORK_DIR}/out_${nthreads}.bkc"
+}
+
+# ---------------- sweep ----------------
+echo "threads,wall_seconds,cpu_user_seconds,cpu_sys_seconds,max_rss_kb,records_in,records_out,queue_pop_wait_s,mem_pool_pop_wait_s,speedup" > "$OUT_CSV"
+
+base_wall=""
+for t in $THREADS_LIST; do
+  echo "[RUN] threads=${t}"
+  read -r wall user sys rss rec_in rec_out q_wait p_wait < <(measure_run "$t")
+  [[ -z "$base_wall" ]] && base_wall="$wall"
+  speedup=$(awk -v a="$base_wall" -v b="$wall" 'BEGIN{ if (b > 0) printf "%.2f", a / b; else print "0" }')
+  echo "${t},${wall},${user},${sys},${rss},${rec_in},${rec_out},${q_wait},${p_wait},${speedup}" >> "$OUT_CSV"
+done
+
+echo "[DONE] Results -> $OUT_CSV"
+cat "$OUT_CSV"
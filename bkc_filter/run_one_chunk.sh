@@ -24,6 +24,8 @@ fi
   -d "$DICT" \
   --cbc_len 16 --umi_len 12 --leader_len 8 --follower_len 31 --gap_len 0 \
   --verbose 1 \
+  --mmap_input \
+  --stats_json "$CHUNK_LOG_DIR/${chunk_name}.stats.json" \
   --output_name "$OUT/${chunk_name}.bkc"
 rc=$?
 
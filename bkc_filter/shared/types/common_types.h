@@ -8,6 +8,10 @@ inline input_format_t input_format_from_string(const std::string& str) {
 		return input_format_t::fasta;
 	else if (str == "fq" || str == "fastq" || str == "FASTQ")
 		return input_format_t::fastq;
+	else if (str == "bam" || str == "BAM")
+		return input_format_t::bam;
+	else if (str == "cram" || str == "CRAM")
+		return input_format_t::cram;
 	else
 		return input_format_t::unknown;
 }
@@ -0,0 +1,265 @@
+// Generator of synthetic 10x-like paired FASTQ.gz files for benchmarking:
+//   R1 - CBC + UMI; CBCs are drawn from a Zipf distribution (--cbc_skew), UMIs are reused within a CBC (--umi_dup)
+//   R2 - fragments of random transcripts (also Zipf-distributed), with sequencing errors and Ns
+// Outputs: <prefix>_R1.fastq.gz, <prefix>_R2.fastq.gz, <prefix>.txt (input list for bkc_filter)
+// and <prefix>_anchors.txt (leader k-mers sampled from the transcripts, for -d)
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cmath>
+#include <zlib.h>
+
+using namespace std;
+
+// *********************************************************************************************
+struct gen_params_t {
+	uint32_t no_cbcs = 2000;
+	double cbc_skew = 1.0;
+	uint64_t no_reads = 1000000;
+	double umi_dup = 2.0;
+	uint32_t read_len = 90;
+	uint32_t cbc_len = 16;
+	uint32_t umi_len = 12;
+	uint32_t no_transcripts = 1000;
+	uint32_t transcript_len = 2000;
+	double transcript_skew = 0.8;
+	double error_rate = 0.001;
+	double n_rate = 0.0005;
+	uint32_t no_anchors = 512;
+	uint32_t anchor_len = 8;
+	int gz_level = 1;
+	uint64_t seed = 17;
+	string out_prefix = "synth";
+};
+
+gen_params_t params;
+
+// *********************************************************************************************
+void usage()
+{
+	gen_params_t def;
+
+	cerr << "gen_10x - synthetic 10x-like R1/R2 FASTQ.gz generator\n"
+		<< "Usage: gen_10x [options]\n"
+		<< "    --out_prefix <str> - prefix of output files (default: " << def.out_prefix << ")\n"
+		<< "    --no_reads <int> - no. of read pairs (default: " << def.no_reads << ")\n"
+		<< "    --no_cbcs <int> - no. of distinct CBCs (default: " << def.no_cbcs << ")\n"
+		<< "    --cbc_skew <float> - Zipf exponent of CBC sizes; 0 means uniform (default: " << def.cbc_skew << ")\n"
+		<< "    --umi_dup <float> - mean no. of reads per UMI (default: " << def.umi_dup << ")\n"
+		<< "    --read_len <int> - R2 read length (default: " << def.read_len << ")\n"
+		<< "    --cbc_len <int> - CBC length (default: " << def.cbc_len << ")\n"
+		<< "    --umi_len <int> - UMI length (default: " << def.umi_len << ")\n"
+		<< "    --no_transcripts <int> - no. of random transcripts (default: " << def.no_transcripts << ")\n"
+		<< "    --transcript_len <int> - transcript length (default: " << def.transcript_len << ")\n"
+		<< "    --transcript_skew <float> - Zipf exponent of transcript expression (default: " << def.transcript_skew << ")\n"
+		<< "    --error_rate <float> - substitution rate in R2 (default: " << def.error_rate << ")\n"
+		<< "    --n_rate <float> - rate of Ns in R2 (default: " << def.n_rate << ")\n"
+		<< "    --no_anchors <int> - no. of anchors in the anchors file (default: " << def.no_anchors << ")\n"
+		<< "    --anchor_len <int> - anchor length (default: " << def.anchor_len << ")\n"
+		<< "    --gz_level <int> - gzip compression level (default: " << def.gz_level << ")\n"
+		<< "    --seed <int> - random seed (default: " << def.seed << ")\n";
+}
+
+// *********************************************************************************************
+bool parse_args(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 >= argc)
+			return false;
+
+		string opt = argv[i];
+		string val = argv[++i];
+
+		if (opt == "--out_prefix")
+			params.out_prefix = val;
+		else if (opt == "--no_reads")
+			params.no_reads = stoull(val);
+		else if (opt == "--no_cbcs")
+			params.no_cbcs = stoul(val);
+		else if (opt == "--cbc_skew")
+			params.cbc_skew = stod(val);
+		else if (opt == "--umi_dup")
+			params.umi_dup = stod(val);
+		else if (opt == "--read_len")
+			params.read_len = stoul(val);
+		else if (opt == "--cbc_len")
+			params.cbc_len = stoul(val);
+		else if (opt == "--umi_len")
+			params.umi_len = stoul(val);
+		else if (opt == "--no_transcripts")
+			params.no_transcripts = stoul(val);
+		else if (opt == "--transcript_len")
+			params.transcript_len = stoul(val);
+		else if (opt == "--transcript_skew")
+			params.transcript_skew = stod(val);
+		else if (opt == "--error_rate")
+			params.error_rate = stod(val);
+		else if (opt == "--n_rate")
+			params.n_rate = stod(val);
+		else if (opt == "--no_anchors")
+			params.no_anchors = stoul(val);
+		else if (opt == "--anchor_len")
+			params.anchor_len = stoul(val);
+		else if (opt == "--gz_level")
+			params.gz_level = stoi(val);
+		else if (opt == "--seed")
+			params.seed = stoull(val);
+		else
+		{
+			cerr << "Unknown option: " << opt << endl;
+			return false;
+		}
+	}
+
+	if (!params.no_cbcs || !params.no_transcripts || params.umi_dup < 1.0 || params.transcript_len < params.read_len ||
+		params.cbc_len > 32 || params.umi_len > 32 || params.anchor_len > params.transcript_len)
+	{
+		cerr << "Incorrect parameters\n";
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+string random_dna(size_t len, mt19937_64& mt)
+{
+	string s(len, 'A');
+
+	for (auto& c : s)
+		c = "ACGT"[mt() & 3];
+
+	return s;
+}
+
+// *********************************************************************************************
+discrete_distribution<uint32_t> zipf_distribution(uint32_t n, double skew)
+{
+	vector<double> weights(n);
+
+	for (uint32_t i = 0; i < n; ++i)
+		weights[i] = 1.0 / pow((double) (i + 1), skew);
+
+	return discrete_distribution<uint32_t>(weights.begin(), weights.end());
+}
+
+// *********************************************************************************************
+gzFile open_gz(const string& file_name)
+{
+	gzFile f = gzopen(file_name.c_str(), ("wb" + to_string(params.gz_level)).c_str());
+
+	if (!f)
+	{
+		cerr << "Cannot create: " << file_name << endl;
+		exit(1);
+	}
+
+	gzbuffer(f, 8 << 20);
+
+	return f;
+}
+
+// *********************************************************************************************
+int main(int argc, char** argv)
+{
+	if (!parse_args(argc, argv))
+	{
+		usage();
+		return 1;
+	}
+
+	mt19937_64 mt(params.seed);
+	uniform_real_distribution<double> unif(0.0, 1.0);
+
+	vector<string> cbcs(params.no_cbcs);
+	for (auto& x : cbcs)
+		x = random_dna(params.cbc_len, mt);
+
+	vector<string> transcripts(params.no_transcripts);
+	for (auto& x : transcripts)
+		x = random_dna(params.transcript_len, mt);
+
+	auto cbc_dist = zipf_distribution(params.no_cbcs, params.cbc_skew);
+	auto transcript_dist = zipf_distribution(params.no_transcripts, params.transcript_skew);
+	uniform_int_distribution<uint32_t> pos_dist(0, params.transcript_len - params.read_len);
+
+	// Molecules (UMIs) seen so far in each CBC; a read is a duplicate of one of them with prob. 1 - 1/umi_dup
+	struct molecule_t {
+		string umi;
+		uint32_t transcript_id;
+		uint32_t pos;
+	};
+
+	vector<vector<molecule_t>> cbc_molecules(params.no_cbcs);
+
+	string r1_name = params.out_prefix + "_R1.fastq.gz";
+	string r2_name = params.out_prefix + "_R2.fastq.gz";
+
+	gzFile r1 = open_gz(r1_name);
+	gzFile r2 = open_gz(r2_name);
+
+	string r1_qual(params.cbc_len + params.umi_len, 'F');
+	string r2_qual(params.read_len, 'F');
+	string r2_seq;
+
+	for (uint64_t i = 0; i < params.no_reads; ++i)
+	{
+		uint32_t cbc_id = cbc_dist(mt);
+		auto& molecules = cbc_molecules[cbc_id];
+
+		if (molecules.empty() || unif(mt) < 1.0 / params.umi_dup)
+			molecules.push_back(molecule_t{ random_dna(params.umi_len, mt), transcript_dist(mt), pos_dist(mt) });
+
+		auto& mol = molecules[mt() % molecules.size()];
+
+		r2_seq.assign(transcripts[mol.transcript_id], mol.pos, params.read_len);
+		for (auto& c : r2_seq)
+		{
+			double r = unif(mt);
+			if (r < params.n_rate)
+				c = 'N';
+			else if (r < params.n_rate + params.error_rate)
+				c = "ACGT"[mt() & 3];
+		}
+
+		string header = "@synth." + to_string(i);
+
+		gzprintf(r1, "%s 1\n%s%s\n+\n%s\n", header.c_str(), cbcs[cbc_id].c_str(), mol.umi.c_str(), r1_qual.c_str());
+		gzprintf(r2, "%s 2\n%s\n+\n%s\n", header.c_str(), r2_seq.c_str(), r2_qual.c_str());
+	}
+
+	gzclose(r1);
+	gzclose(r2);
+
+	FILE* f_list = fopen((params.out_prefix + ".txt").c_str(), "w");
+	FILE* f_anchors = fopen((params.out_prefix + "_anchors.txt").c_str(), "w");
+
+	if (!f_list || !f_anchors)
+	{
+		cerr << "Cannot create output files\n";
+		return 1;
+	}
+
+	fprintf(f_list, "%s,%s\n", r1_name.c_str(), r2_name.c_str());
+
+	// Anchors come from expressed transcripts, so they are present in the reads
+	uniform_int_distribution<uint32_t> anchor_pos_dist(0, params.transcript_len - params.anchor_len);
+	for (uint32_t i = 0; i < params.no_anchors; ++i)
+		fprintf(f_anchors, "%s\n", transcripts[transcript_dist(mt)].substr(anchor_pos_dist(mt), params.anchor_len).c_str());
+
+	fclose(f_list);
+	fclose(f_anchors);
+
+	uint64_t no_molecules = 0;
+	for (auto& x : cbc_molecules)
+		no_molecules += x.size();
+
+	cerr << "Generated " << params.no_reads << " read pairs, " << params.no_cbcs << " CBCs, " << no_molecules << " UMIs\n";
+
+	return 0;
+}
+
+// EOF
@@ -0,0 +1,429 @@
+// Microbenchmarks of the hot paths of bkc_filter (results as CSV on stdout):
+//   read_block      - CFastXReader::ReadBlock (I/O + decompression) over a FASTQ(.gz) file
+//   get_read        - CReadReader::GetRead (record splitting) over the loaded blocks
+//   base_coding4    - BaseCoding4::encode_bases_2b of CBC-length prefixes
+//   base_coding3    - BaseCoding3::encode_bases + decode_bases of whole reads
+//   dna_pack        - dna_pack (2-bit packing used for stored reads)
+//   is_accepted_*   - AcceptedAnchors::IsAccepted (bitmap and bloom+hash variants)
+//   pair_gather_*   - CPairCounter Add + Gather, i.e., sort_and_gather_kmer_pairs_for_cbc, for several CBC sizes
+//   bkc_pack/write/read - record packing (as in pack_records), CBKCFile::AddPacked and CBKCFile::ReadFrame
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <cstdio>
+
+#include "../bkc/fq_reader.h"
+#include "../common/bkc_file.h"
+#include "../common/utils.h"
+#include "../common/dna_packing.h"
+#include "../bkc_filter/processreads.h"			// also BaseCoding3/4 and CPairCounter
+#include "../bkc_filter/accepted_anchors.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Results of the benchmarked calls are accumulated here, so they are not optimized out
+volatile uint64_t sink = 0;
+
+// *********************************************************************************************
+class CBenchReport
+{
+public:
+	// *********************************************************************************************
+	CBenchReport()
+	{
+		cout << "benchmark,items,seconds,ns_per_item,mb_per_s" << endl;
+	}
+
+	// *********************************************************************************************
+	void Add(const string& name, uint64_t no_items, uint64_t no_bytes, high_resolution_clock::time_point t0, high_resolution_clock::time_point t1)
+	{
+		double secs = duration<double>(t1 - t0).count();
+
+		cout << name << "," << no_items << "," << fixed << setprecision(6) << secs << ","
+			<< setprecision(3) << (no_items ? secs * 1e9 / (double) no_items : 0.0) << ","
+			<< (secs > 0 ? (double) no_bytes / secs / 1e6 : 0.0) << endl;
+	}
+};
+
+// *********************************************************************************************
+struct block_t {
+	vector<char> data;
+};
+
+// *********************************************************************************************
+bool bench_read_block(CBenchReport& report, const string& file_name, vector<block_t>& blocks)
+{
+	const size_t block_size = 16 << 20;
+
+	CFastXReader reader(true);
+	reader.SetNoGzThreads(2);
+
+	if (!reader.Open(file_name))
+	{
+		cerr << "Cannot open: " << file_name << endl;
+		return false;
+	}
+
+	vector<char> buffer(block_size);
+	memory_chunk<char> mc(buffer.data(), block_size);
+	uint64_t no_bytes = 0;
+
+	auto t0 = high_resolution_clock::now();
+
+	while (!reader.Eof())
+	{
+		mc = memory_chunk<char>(buffer.data(), block_size);
+		if (!reader.ReadBlock(mc))
+			break;
+
+		no_bytes += mc.size();
+		blocks.push_back(block_t{ vector<char>(mc.data(), mc.data() + mc.size()) });
+	}
+
+	auto t1 = high_resolution_clock::now();
+
+	report.Add("read_block", blocks.size(), no_bytes, t0, t1);
+
+	return true;
+}
+
+// *********************************************************************************************
+void bench_get_read(CBenchReport& report, vector<block_t>& blocks, vector<string>& reads)
+{
+	// GetRead modifies the block (EOLs -> 0), so it works on copies
+	vector<vector<char>> copies;
+	uint64_t no_bytes = 0;
+
+	for (auto& x : blocks)
+	{
+		copies.emplace_back(x.data);
+		no_bytes += x.data.size();
+	}
+
+	CReadReader read_reader(true);
+	read_desc_t read_desc;
+	uint64_t no_reads = 0;
+	uint64_t sum_lens = 0;
+
+	auto t0 = high_resolution_clock::now();
+
+	for (auto& x : copies)
+	{
+		memory_chunk<char> mc(x.data(), x.size());
+		mc.resize(x.size());
+		read_reader.Assign(mc);
+
+		while (read_reader.GetRead(read_desc))
+		{
+			++no_reads;
+			sum_lens += read_desc.bases[0];
+		}
+	}
+
+	auto t1 = high_resolution_clock::now();
+
+	report.Add("get_read", no_reads, no_bytes, t0, t1);
+
+	// Bases of at most 1M reads for the base coding benchmarks
+	for (auto& x : copies)
+	{
+		memory_chunk<char> mc(x.data(), x.size());
+		mc.resize(x.size());
+		read_reader.Assign(mc);
+
+		while (reads.size() < (1u << 20) && read_reader.GetRead(read_desc))
+			reads.emplace_back(read_desc.bases);
+	}
+
+	sink = sink + sum_lens;
+}
+
+// *********************************************************************************************
+void bench_base_coding(CBenchReport& report, vector<string>& reads, uint32_t cbc_len)
+{
+	BaseCoding4 bc4;
+	uint64_t no_bytes = 0;
+	uint64_t x = 0;
+
+	auto t0 = high_resolution_clock::now();
+	for (auto& r : reads)
+		if (r.size() >= cbc_len)
+		{
+			x += bc4.encode_bases_2b(r.c_str(), r.c_str() + cbc_len);
+			no_bytes += cbc_len;
+		}
+	auto t1 = high_resolution_clock::now();
+
+	report.Add("base_coding4", reads.size(), no_bytes, t0, t1);
+
+	BaseCoding3 bc3;
+	vector<uint8_t> packed;
+	vector<uint8_t> unpacked;
+	vector<char> raw;
+	no_bytes = 0;
+
+	t0 = high_resolution_clock::now();
+	for (auto& r : reads)
+	{
+		raw.assign(r.begin(), r.end());
+		raw.resize(r.size() + 3, 0);
+		packed.resize(r.size() / 3 + 3);
+
+		bc3.encode_bases(raw.data(), r.size(), packed.data());
+		bc3.decode_bases(packed.data(), unpacked);
+
+		x += unpacked.size();
+		no_bytes += r.size();
+	}
+	t1 = high_resolution_clock::now();
+
+	report.Add("base_coding3", reads.size(), no_bytes, t0, t1);
+
+	vector<uint8_t> n_mask;
+	no_bytes = 0;
+
+	t0 = high_resolution_clock::now();
+	for (auto& r : reads)
+	{
+		packed.resize(dna_packed_bytes(r.size()));
+		n_mask.resize(dna_mask_bytes(r.size()));
+
+		x += dna_pack(r.c_str(), r.size(), packed.data(), n_mask.data());
+		no_bytes += r.size();
+	}
+	t1 = high_resolution_clock::now();
+
+	report.Add("dna_pack", reads.size(), no_bytes, t0, t1);
+
+	sink = sink + x;
+}
+
+// *********************************************************************************************
+void bench_is_accepted(CBenchReport& report, mt19937_64& mt)
+{
+	const size_t no_queries = 1 << 24;
+
+	for (uint32_t leader_len : { 8u, 27u })
+	{
+		uint64_t mask = (1ull << (2 * leader_len)) - 1;
+
+		vector<uint64_t> anchors(4096);
+		for (auto& a : anchors)
+			a = mt() & mask;
+
+		AcceptedAnchors accepted_anchors(anchors, leader_len);
+
+		vector<uint64_t> queries(no_queries);
+		for (size_t i = 0; i < no_queries; ++i)
+			queries[i] = (i % 8 == 0) ? anchors[mt() % anchors.size()] : (mt() & mask);
+
+		uint64_t no_accepted = 0;
+
+		auto t0 = high_resolution_clock::now();
+		for (auto q : queries)
+			no_accepted += accepted_anchors.IsAccepted(q);
+		auto t1 = high_resolution_clock::now();
+
+		report.Add(string("is_accepted_") + (accepted_anchors.UsesBitmap() ? "bitmap_" : "hash_") + to_string(leader_len), no_queries, no_queries * 8, t0, t1);
+
+		sink = sink + no_accepted;
+	}
+}
+
+// *********************************************************************************************
+void bench_pair_gather(CBenchReport& report, mt19937_64& mt, uint32_t leader_len, uint32_t follower_len)
+{
+	const size_t total_pairs = 1 << 24;
+
+	uint64_t leader_mask = (1ull << (2 * leader_len)) - 1;
+	uint64_t follower_mask = follower_len >= 32 ? ~0ull : (1ull << (2 * follower_len)) - 1;
+
+	CPairCounter pair_counter(leader_len, follower_len);
+	vector<leader_follower_count_t> kmer_pair_counts;
+
+	for (size_t no_pairs : { (size_t) 256, (size_t) 4096, (size_t) 65536, (size_t) 1 << 20 })
+	{
+		// ~8 occurrences of each distinct pair, few leaders per CBC
+		vector<leader_follower_t> distinct(max<size_t>(no_pairs / 8, 1));
+		uint64_t no_leaders = max<uint64_t>(distinct.size() / 64, 1);
+		for (auto& x : distinct)
+			x = leader_follower_t((mt() % no_leaders) & leader_mask, mt() & follower_mask);
+
+		vector<leader_follower_t> pairs(no_pairs);
+		for (auto& x : pairs)
+			x = distinct[mt() % distinct.size()];
+
+		size_t no_reps = max<size_t>(total_pairs / no_pairs, 1);
+
+		auto t0 = high_resolution_clock::now();
+		for (size_t i = 0; i < no_reps; ++i)
+		{
+			pair_counter.Reset();
+			for (auto& x : pairs)
+				pair_counter.Add(x.leader, x.follower);
+			pair_counter.Gather(kmer_pair_counts);
+		}
+		auto t1 = high_resolution_clock::now();
+
+		report.Add("pair_gather_" + to_string(no_pairs), no_reps * no_pairs, no_reps * no_pairs * sizeof(leader_follower_t), t0, t1);
+	}
+}
+
+// *********************************************************************************************
+void bench_bkc_file(CBenchReport& report, mt19937_64& mt, const string& tmp_name, uint32_t leader_len, uint32_t follower_len)
+{
+	const size_t no_records = 1 << 22;
+	const size_t records_in_frame = 1 << 16;
+
+	uint8_t sample_id_size = 1, barcode_size = 4, leader_size = (leader_len + 3) / 4, follower_size = (follower_len + 3) / 4, counter_size = 2;
+
+	// Records of consecutive CBCs, sorted within a CBC (as written by the counting threads)
+	vector<bkc_record_t> records;
+	records.reserve(no_records);
+
+	for (uint64_t barcode = 0; records.size() < no_records; ++barcode)
+	{
+		uint64_t leader = mt() & ((1ull << (2 * leader_len)) - 1);
+		for (int i = 0; i < 64 && records.size() < no_records; ++i)
+		{
+			if (mt() % 4 == 0)
+				leader += 1 + mt() % 16;
+			records.emplace_back(0, barcode, leader & ((1ull << (2 * leader_len)) - 1), mt() & ((1ull << (2 * follower_len)) - 1), 1 + mt() % 8);
+		}
+	}
+
+	vector<vector<uint8_t>> packed_frames;
+	vector<uint8_t> rec_prev, rec_curr;
+
+	auto t0 = high_resolution_clock::now();
+	for (size_t i = 0; i < no_records; i += records_in_frame)
+	{
+		packed_frames.emplace_back();
+		auto& packed = packed_frames.back();
+		rec_prev.clear();
+
+		for (size_t j = i; j < min(i + records_in_frame, no_records); ++j)
+		{
+			auto& x = records[j];
+			rec_curr.clear();
+
+			append_int_msb(rec_curr, x.sample_id, sample_id_size);
+			append_int_msb(rec_curr, x.barcode, barcode_size);
+			append_int_msb(rec_curr, x.leader, leader_size);
+			append_int_msb(rec_curr, x.follower, follower_size);
+			append_int_msb(rec_curr, x.count, counter_size);
+
+			encode_shared_prefix(packed, rec_prev, rec_curr);
+			swap(rec_prev, rec_curr);
+		}
+	}
+	auto t1 = high_resolution_clock::now();
+
+	uint64_t packed_size = 0;
+	for (auto& x : packed_frames)
+		packed_size += x.size();
+
+	report.Add("bkc_pack", no_records, packed_size, t0, t1);
+
+	{
+		CBKCFile bkc_file;
+		bkc_file.SetParams(sample_id_size, barcode_size, leader_size, follower_size, counter_size, 16, leader_len, 0, follower_len, 6);
+
+		if (!bkc_file.Create(tmp_name, output_format_t::bkc))
+		{
+			cerr << "Cannot create: " << tmp_name << endl;
+			return;
+		}
+
+		t0 = high_resolution_clock::now();
+		for (auto& x : packed_frames)
+			bkc_file.AddPacked(x);
+		bkc_file.Close();
+		t1 = high_resolution_clock::now();
+
+		report.Add("bkc_write", no_records, packed_size, t0, t1);
+	}
+
+	{
+		CBKCFile bkc_file;
+
+		if (!bkc_file.Open(tmp_name))
+		{
+			cerr << "Cannot open: " << tmp_name << endl;
+			return;
+		}
+
+		vector<bkc_record_t> frame_records;
+		uint64_t no_read = 0;
+
+		t0 = high_resolution_clock::now();
+		for (size_t i = 0; i < bkc_file.GetFrames().size(); ++i)
+			if (bkc_file.ReadFrame(i, frame_records))
+				no_read += frame_records.size();
+		t1 = high_resolution_clock::now();
+
+		report.Add("bkc_read", no_read, packed_size, t0, t1);
+
+		if (no_read != no_records)
+			cerr << "Error: " << no_read << " records read of " << no_records << " written\n";
+	}
+
+	remove(tmp_name.c_str());
+}
+
+// *********************************************************************************************
+int main(int argc, char** argv)
+{
+	string input_name;
+	string tmp_name = "micro_bench.tmp.bkc";
+	uint32_t leader_len = 8;
+	uint32_t follower_len = 31;
+	uint32_t cbc_len = 16;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (argv[i] == "--input"s)
+			input_name = argv[i + 1];
+		else if (argv[i] == "--tmp_name"s)
+			tmp_name = argv[i + 1];
+		else if (argv[i] == "--leader_len"s)
+			leader_len = stoul(argv[i + 1]);
+		else if (argv[i] == "--follower_len"s)
+			follower_len = stoul(argv[i + 1]);
+		else if (argv[i] == "--cbc_len"s)
+			cbc_len = stoul(argv[i + 1]);
+	}
+
+	if (input_name.empty() || leader_len < 1 || leader_len > 31 || follower_len < 1 || follower_len > 31)
+	{
+		cerr << "Usage: micro_bench --input <fastq[.gz]> [--tmp_name <file>] [--leader_len <int>] [--follower_len <int>] [--cbc_len <int>]\n";
+		return 1;
+	}
+
+	mt19937_64 mt(17);
+	CBenchReport report;
+
+	vector<block_t> blocks;
+	vector<string> reads;
+
+	if (!bench_read_block(report, input_name, blocks))
+		return 1;
+
+	bench_get_read(report, blocks, reads);
+	blocks.clear();
+
+	bench_base_coding(report, reads, cbc_len);
+	bench_is_accepted(report, mt);
+	bench_pair_gather(report, mt, leader_len, follower_len);
+	bench_bkc_file(report, mt, tmp_name, leader_len, follower_len);
+
+	return 0;
+}
+
+// EOF
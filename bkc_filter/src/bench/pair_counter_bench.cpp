@@ -0,0 +1,149 @@
+// Microbenchmark of per-CBC (leader, follower) pair counting:
+//   sort  - materialized pair vector + pdqsort + collapse (the former sort_and_gather_kmer_pairs_for_cbc)
+//   count - CPairCounter (counting table / LSD radix sort)
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+
+#include "../bkc_filter/pair_counter.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// *********************************************************************************************
+struct bench_case_t {
+	size_t no_pairs;
+	size_t dup_factor;
+};
+
+// *********************************************************************************************
+void generate_pairs(size_t no_pairs, size_t dup_factor, uint32_t leader_len, uint32_t follower_len, mt19937_64& mt, vector<leader_follower_t>& pairs)
+{
+	uint64_t leader_mask = leader_len >= 32 ? ~0ull : (1ull << (2 * leader_len)) - 1;
+	uint64_t follower_mask = follower_len >= 32 ? ~0ull : (1ull << (2 * follower_len)) - 1;
+
+	vector<leader_follower_t> distinct(max<size_t>(no_pairs / dup_factor, 1));
+	for (auto& x : distinct)
+		x = leader_follower_t(mt() & leader_mask, mt() & follower_mask);
+
+	// Few anchors per CBC, so leaders of distinct pairs are also shared
+	uint64_t no_leaders = max<uint64_t>(distinct.size() / 64, 1);
+	for (auto& x : distinct)
+		x.leader = (x.leader % no_leaders) & leader_mask;
+
+	pairs.clear();
+	pairs.reserve(no_pairs);
+
+	for (size_t i = 0; i < no_pairs; ++i)
+		pairs.emplace_back(distinct[mt() % distinct.size()]);
+}
+
+// *********************************************************************************************
+void count_by_sort(vector<leader_follower_t>& input, vector<leader_follower_t>& kmer_pairs, vector<leader_follower_count_t>& kmer_pair_counts)
+{
+	kmer_pairs.clear();
+	for (const auto& x : input)
+		kmer_pairs.emplace_back(x);
+
+	refresh::sort::pdqsort(kmer_pairs.begin(), kmer_pairs.end());
+
+	kmer_pair_counts.clear();
+
+	if (kmer_pairs.empty())
+		return;
+
+	kmer_pair_counts.emplace_back(kmer_pairs.front());
+
+	for (size_t i = 1; i < kmer_pairs.size(); ++i)
+		if (kmer_pair_counts.back().equal_lf(kmer_pairs[i]))
+			kmer_pair_counts.back().count++;
+		else
+			kmer_pair_counts.emplace_back(kmer_pairs[i]);
+}
+
+// *********************************************************************************************
+void count_by_counter(vector<leader_follower_t>& input, CPairCounter& pair_counter, vector<leader_follower_count_t>& kmer_pair_counts)
+{
+	for (const auto& x : input)
+		pair_counter.Add(x.leader, x.follower);
+
+	pair_counter.Gather(kmer_pair_counts);
+}
+
+// *********************************************************************************************
+bool same_counts(vector<leader_follower_count_t>& a, vector<leader_follower_count_t>& b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	for (size_t i = 0; i < a.size(); ++i)
+		if (!a[i].equal_lf(b[i]) || a[i].count != b[i].count)
+			return false;
+
+	return true;
+}
+
+// *********************************************************************************************
+int main(int argc, char** argv)
+{
+	uint32_t leader_len = 8;
+	uint32_t follower_len = 31;
+	size_t total_pairs = 1 << 24;
+
+	if (argc > 1)
+		total_pairs = stoull(argv[1]);
+
+	vector<bench_case_t> cases = {
+		{ 256, 1 }, { 256, 8 },
+		{ 4096, 1 }, { 4096, 8 }, { 4096, 64 },
+		{ 65536, 1 }, { 65536, 8 }, { 65536, 64 },
+		{ 1 << 20, 1 }, { 1 << 20, 8 }, { 1 << 20, 64 },
+	};
+
+	mt19937_64 mt(17);
+
+	vector<leader_follower_t> input, kmer_pairs;
+	vector<leader_follower_count_t> counts_sort, counts_counter;
+	CPairCounter pair_counter(leader_len, follower_len);
+
+	cout << "leader_len: " << leader_len << "  follower_len: " << follower_len << endl;
+	cout << setw(10) << "pairs" << setw(6) << "dup" << setw(8) << "reps" << setw(14) << "sort [ns/p]" << setw(15) << "count [ns/p]" << setw(10) << "speedup" << endl;
+
+	for (const auto& c : cases)
+	{
+		generate_pairs(c.no_pairs, c.dup_factor, leader_len, follower_len, mt, input);
+
+		size_t no_reps = max<size_t>(total_pairs / c.no_pairs, 1);
+
+		count_by_sort(input, kmer_pairs, counts_sort);
+		count_by_counter(input, pair_counter, counts_counter);
+
+		if (!same_counts(counts_sort, counts_counter))
+		{
+			cerr << "Error: different results for " << c.no_pairs << " pairs (dup: " << c.dup_factor << ")\n";
+			return 1;
+		}
+
+		auto t0 = high_resolution_clock::now();
+		for (size_t i = 0; i < no_reps; ++i)
+			count_by_sort(input, kmer_pairs, counts_sort);
+		auto t1 = high_resolution_clock::now();
+		for (size_t i = 0; i < no_reps; ++i)
+			count_by_counter(input, pair_counter, counts_counter);
+		auto t2 = high_resolution_clock::now();
+
+		double ns_sort = duration<double, nano>(t1 - t0).count() / (double) (no_reps * c.no_pairs);
+		double ns_counter = duration<double, nano>(t2 - t1).count() / (double) (no_reps * c.no_pairs);
+
+		cout << setw(10) << c.no_pairs << setw(6) << c.dup_factor << setw(8) << no_reps
+			<< setw(14) << fixed << setprecision(2) << ns_sort << setw(15) << ns_counter << setw(10) << ns_sort / ns_counter << endl;
+	}
+
+	return 0;
+}
+
+// EOF
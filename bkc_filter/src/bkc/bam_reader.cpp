@@ -0,0 +1,350 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "bam_reader.h"
+#include "../common/run_stats.h"
+
+// *********************************************************************************************
+// BAM record layout (after block_size), see SAMv1 spec, section 4.2
+// *********************************************************************************************
+
+namespace {
+	const uint32_t BAM_CORE_SIZE = 32;
+
+	const uint16_t BAM_FPAIRED = 0x1;
+	const uint16_t BAM_FREVERSE = 0x10;
+	const uint16_t BAM_FREAD1 = 0x40;
+	const uint16_t BAM_FSECONDARY = 0x100;
+	const uint16_t BAM_FSUPPLEMENTARY = 0x800;
+
+	const char missing_qual = '?';
+
+	// *********************************************************************************************
+	template<typename T> T load_le(const uint8_t* p)
+	{
+		T x;
+		memcpy(&x, p, sizeof(T));
+		return x;
+	}
+
+	// *********************************************************************************************
+	char decode_base(uint8_t code)
+	{
+		static const char bases[] = "NACNGNNNTNNNNNNN";		// "=ACMGRSVTWYHKDBN" with other than ACGT as N
+
+		return bases[code & 0xf];
+	}
+
+	// *********************************************************************************************
+	char complement(char c)
+	{
+		switch (c)
+		{
+		case 'A': return 'T';
+		case 'C': return 'G';
+		case 'G': return 'C';
+		case 'T': return 'A';
+		default: return 'N';
+		}
+	}
+}
+
+// *********************************************************************************************
+CBamReader::CBamReader(FILE* in, const string& _file_name, int no_threads, bam_view_t _view, uint32_t _cbc_len, uint32_t _umi_len) :
+	file_name(_file_name),
+	view(_view),
+	cbc_len(_cbc_len),
+	umi_len(_umi_len)
+{
+	bgzf_reader = make_unique<CBgzfReader>(in, _file_name, no_threads);
+}
+
+// *********************************************************************************************
+bool CBamReader::IsBamName(const string& fn)
+{
+	return fn.size() > 4 && fn.substr(fn.size() - 4, 4) == ".bam";
+}
+
+// *********************************************************************************************
+bool CBamReader::IsCramName(const string& fn)
+{
+	return fn.size() > 5 && fn.substr(fn.size() - 5, 5) == ".cram";
+}
+
+// *********************************************************************************************
+// Makes at least size bytes available from raw_pos
+bool CBamReader::fill(size_t size)
+{
+	if (raw.size() - raw_pos >= size)
+		return true;
+
+	raw.erase(raw.begin(), raw.begin() + raw_pos);
+	raw_pos = 0;
+
+	while (raw.size() < size && !bgzf_reader->Eof())
+	{
+		size_t filled = raw.size();
+		raw.resize(filled + max(raw_read_size, size - filled));
+
+		size_t readed = bgzf_reader->Read(raw.data() + filled, raw.size() - filled);
+		raw.resize(filled + readed);
+
+		run_stats.Add(CRunStats::counter_t::bytes_decompressed, readed);
+	}
+
+	return raw.size() >= size;
+}
+
+// *********************************************************************************************
+bool CBamReader::read_header()
+{
+	if (!fill(8) || memcmp(raw.data() + raw_pos, "BAM\1", 4) != 0)
+	{
+		std::cerr << "Error: Not a BAM file: " + file_name + "\n";
+		return false;
+	}
+
+	uint32_t l_text = load_le<uint32_t>((uint8_t*) raw.data() + raw_pos + 4);
+	raw_pos += 8;
+
+	if (!fill(l_text + 4))
+	{
+		std::cerr << "Error: Truncated BAM header: " + file_name + "\n";
+		return false;
+	}
+
+	raw_pos += l_text;
+	uint32_t n_ref = load_le<uint32_t>((uint8_t*) raw.data() + raw_pos);
+	raw_pos += 4;
+
+	for (uint32_t i = 0; i < n_ref; ++i)
+	{
+		if (!fill(4))
+		{
+			std::cerr << "Error: Truncated BAM header: " + file_name + "\n";
+			return false;
+		}
+
+		uint32_t l_name = load_le<uint32_t>((uint8_t*) raw.data() + raw_pos);
+
+		if (!fill(4 + l_name + 4))
+		{
+			std::cerr << "Error: Truncated BAM header: " + file_name + "\n";
+			return false;
+		}
+
+		raw_pos += 4 + l_name + 4;
+	}
+
+	header_ok = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Value of a Z-type (string) tag
+bool CBamReader::find_tag(const uint8_t* tags, const uint8_t* tags_end, const char* tag, const char*& val, size_t& len) const
+{
+	auto fixed_size = [](uint8_t type) -> size_t {
+		switch (type)
+		{
+		case 'A': case 'c': case 'C': return 1;
+		case 's': case 'S': return 2;
+		case 'i': case 'I': case 'f': return 4;
+		default: return 0;
+		}
+	};
+
+	const uint8_t* p = tags;
+
+	while (p + 3 <= tags_end)
+	{
+		bool is_searched = p[0] == (uint8_t) tag[0] && p[1] == (uint8_t) tag[1];
+		uint8_t type = p[2];
+		p += 3;
+
+		if (type == 'Z' || type == 'H')
+		{
+			auto q = (const uint8_t*) memchr(p, 0, tags_end - p);
+			if (!q)
+				return false;
+
+			if (is_searched && type == 'Z')
+			{
+				val = (const char*) p;
+				len = q - p;
+				return true;
+			}
+
+			p = q + 1;
+		}
+		else if (type == 'B')
+		{
+			if (p + 5 > tags_end)
+				return false;
+
+			size_t el_size = fixed_size(p[0]);
+			uint32_t count = load_le<uint32_t>(p + 1);
+
+			if (!el_size)
+				return false;
+
+			p += 5 + el_size * count;
+		}
+		else if (size_t size = fixed_size(type); size)
+			p += size;
+		else
+			return false;
+	}
+
+	return false;
+}
+
+// *********************************************************************************************
+// Exactly len bases: the tag (or raw_tag if missing) without -<gem group> suffix, or Ns if none is valid
+void CBamReader::append_tag_bases(string& out, const uint8_t* tags, const uint8_t* tags_end, const char* tag, const char* raw_tag, uint32_t len) const
+{
+	const char* val = nullptr;
+	size_t val_len = 0;
+
+	if (find_tag(tags, tags_end, tag, val, val_len) || find_tag(tags, tags_end, raw_tag, val, val_len))
+	{
+		if (auto p = (const char*) memchr(val, '-', val_len); p)
+			val_len = p - val;
+
+		if (val_len == len && all_of(val, val + val_len, [](char c) { return c == 'A' || c == 'C' || c == 'G' || c == 'T'; }))
+		{
+			out.append(val, val_len);
+			return;
+		}
+	}
+
+	out.append(len, 'N');
+}
+
+// *********************************************************************************************
+void CBamReader::append_record(memory_chunk<char>& mc, const uint8_t* rec, uint32_t rec_size, string& tmp)
+{
+	uint8_t l_read_name = rec[8];
+	uint16_t n_cigar_op = load_le<uint16_t>(rec + 12);
+	uint16_t flag = load_le<uint16_t>(rec + 14);
+	uint32_t l_seq = load_le<uint32_t>(rec + 16);
+
+	tmp.clear();
+
+	if ((flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) || ((flag & BAM_FPAIRED) && (flag & BAM_FREAD1)))
+		return;
+
+	const char* read_name = (const char*) rec + BAM_CORE_SIZE;
+	const uint8_t* seq = rec + BAM_CORE_SIZE + l_read_name + 4 * n_cigar_op;
+	const uint8_t* qual = seq + (l_seq + 1) / 2;
+	const uint8_t* tags = qual + l_seq;
+	const uint8_t* tags_end = rec + rec_size;
+
+	if (tags > tags_end)
+	{
+		std::cerr << "Error: Broken BAM record in: " + file_name + "\n";
+		exit(1);
+	}
+
+	tmp.push_back('@');
+	tmp.append(read_name, l_read_name ? l_read_name - 1 : 0);
+	tmp.push_back('\n');
+
+	size_t bases_pos = tmp.size();
+
+	if (view == bam_view_t::cbc_umi)
+	{
+		append_tag_bases(tmp, tags, tags_end, "CB", "CR", cbc_len);
+		append_tag_bases(tmp, tags, tags_end, "UB", "UR", umi_len);
+		size_t len = tmp.size() - bases_pos;
+
+		tmp.append("\n+\n");
+		tmp.append(len, missing_qual);
+		tmp.push_back('\n');
+
+		return;
+	}
+
+	if (l_seq == 0)
+	{
+		tmp.append("N\n+\n");
+		tmp.push_back(missing_qual);
+		tmp.push_back('\n');
+		return;
+	}
+
+	for (uint32_t i = 0; i < l_seq; ++i)
+		tmp.push_back(decode_base((seq[i / 2] >> ((~i & 1) * 4)) & 0xf));
+
+	tmp.append("\n+\n");
+	size_t qual_pos = tmp.size();
+
+	if (qual[0] == 0xff)
+		tmp.append(l_seq, missing_qual);
+	else
+		for (uint32_t i = 0; i < l_seq; ++i)
+			tmp.push_back((char) (qual[i] + 33));
+
+	// Reverse-strand alignments store the reverse complement of the read
+	if (flag & BAM_FREVERSE)
+	{
+		reverse(tmp.begin() + bases_pos, tmp.begin() + bases_pos + l_seq);
+		for (size_t i = bases_pos; i < bases_pos + l_seq; ++i)
+			tmp[i] = complement(tmp[i]);
+		reverse(tmp.begin() + qual_pos, tmp.end());
+	}
+
+	tmp.push_back('\n');
+}
+
+// *********************************************************************************************
+bool CBamReader::ReadBlock(memory_chunk<char>& mc)
+{
+	mc.resize(0);
+
+	if (!header_ok && !read_header())
+		exit(1);
+
+	string tmp;
+
+	while (fill(4))
+	{
+		uint32_t block_size = load_le<uint32_t>((uint8_t*) raw.data() + raw_pos);
+
+		if (block_size < BAM_CORE_SIZE || !fill(4 + (size_t) block_size))
+		{
+			std::cerr << "Error: Truncated BAM file: " + file_name + "\n";
+			exit(1);
+		}
+
+		append_record(mc, (uint8_t*) raw.data() + raw_pos + 4, block_size, tmp);
+
+		if (mc.size() + tmp.size() > mc.capacity())
+		{
+			// A record larger than the whole block could never be passed on, so the input would be silently truncated
+			if (mc.size() == 0)
+			{
+				std::cerr << "Error: BAM record of " + to_string(tmp.size()) + " bytes (as FASTQ) does not fit in a block of " + 
+					to_string(mc.capacity()) + " bytes in: " + file_name + "\n";
+				exit(1);
+			}
+			break;
+		}
+
+		memcpy(mc.data() + mc.size(), tmp.data(), tmp.size());
+		mc.resize(mc.size() + tmp.size());
+
+		raw_pos += 4 + block_size;
+	}
+
+	return mc.size() > 0;
+}
+
+// *********************************************************************************************
+bool CBamReader::Eof()
+{
+	return header_ok && raw_pos == raw.size() && bgzf_reader->Eof();
+}
+
+// EOF
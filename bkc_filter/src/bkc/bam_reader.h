@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "../../libs/refresh/memory_chunk/lib/memory_chunk.h"
+#include "gz_reader.h"
+
+using namespace std;
+using namespace refresh;
+
+// *********************************************************************************************
+// Which FASTQ record is made of a BAM record
+enum class bam_view_t { read, cbc_umi };
+
+// *********************************************************************************************
+// Unaligned (or aligned) BAM input turned in memory into blocks of FASTQ records, so the R1/R2 stages work on it
+// without any changes. BGZF blocks are inflated in parallel by CBgzfReader, records are converted by the calling thread.
+// The read view gives the bases and qualities (in the sequencing orientation), the CBC/UMI view gives the CB (or CR)
+// tag followed by the UB (or UR) tag; the -<gem group> suffix is removed and missing or wrong-length tags give Ns,
+// so the read is dropped as one without a valid CBC.
+// Both views produce the same sequence of records: secondary, supplementary and first-in-pair records are skipped.
+class CBamReader
+{
+	const size_t raw_read_size = 16 << 20;
+
+	unique_ptr<CBgzfReader> bgzf_reader;
+	string file_name;
+
+	bam_view_t view;
+	uint32_t cbc_len;
+	uint32_t umi_len;
+
+	vector<char> raw;			// inflated BAM data not converted yet
+	size_t raw_pos = 0;
+	bool header_ok = false;
+
+	bool fill(size_t size);
+	bool read_header();
+
+	bool find_tag(const uint8_t* tags, const uint8_t* tags_end, const char* tag, const char*& val, size_t& len) const;
+	void append_tag_bases(string& out, const uint8_t* tags, const uint8_t* tags_end, const char* tag, const char* raw_tag, uint32_t len) const;
+	void append_record(memory_chunk<char>& mc, const uint8_t* rec, uint32_t rec_size, string& tmp);
+
+public:
+	// in is not closed here
+	CBamReader(FILE* in, const string& _file_name, int no_threads, bam_view_t _view, uint32_t _cbc_len, uint32_t _umi_len);
+
+	static bool IsBamName(const string& fn);
+	static bool IsCramName(const string& fn);
+
+	// Complete FASTQ records (at least one) are stored in mc; false at the end of file
+	// A broken file or a record not fitting in mc is reported and stops the run (the input would be truncated otherwise)
+	bool ReadBlock(memory_chunk<char>& mc);
+	bool Eof();
+};
+
+// EOF
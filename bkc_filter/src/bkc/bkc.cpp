@@ -192,7 +192,7 @@ bool parse_args(int argc, char** argv)
 		{
 			++i;
 			params.input_format = input_format_from_string(argv[i]);
-			if (params.input_format == input_format_t::unknown)
+			if (params.input_format != input_format_t::fasta && params.input_format != input_format_t::fastq)
 			{
 				cerr << "Wrong value for input_format: " << argv[i] << endl;
 				return false;
@@ -1,10 +1,25 @@
 #include <iostream>
 #include <cstring>
 #include "fq_reader.h"
+#include "../common/run_stats.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // *********************************************************************************************
 void CFastXReader::close()
 {
+	// Pipelined readers have to be stopped before closing the underlying files
+	bgzf_reader.reset();
+	gz_pipelined_reader.reset();
+	bam_reader.reset();
+
+	close_mapped();
+
 	if (in)
 	{
 		fclose(in);
@@ -17,6 +32,7 @@ void CFastXReader::close()
 	}
 
 	file_name.clear();
+	internal_buffer.clear();
 
 	is_gzipped = false;
 }
@@ -24,19 +40,56 @@ void CFastXReader::close()
 // *********************************************************************************************
 bool CFastXReader::Open(const string &_file_name)
 {
-	if (in || gz_in)
+	if (in || gz_in || map_data)
 		close();
 
-	if (is_gzipped_name(_file_name))
+	if (CBamReader::IsCramName(_file_name))
+	{
+		std::cerr << "Error: CRAM input is not supported (convert it to BAM, e.g., samtools view -b): " + _file_name + "\n";
+		return false;
+	}
+	else if (CBamReader::IsBamName(_file_name))
 	{
-		gz_in = gzopen(_file_name.c_str(), "rb");
+		in = fopen(_file_name.c_str(), "rb");
 
-		if (!gz_in)
+		if (!in)
 			return false;
 
-		gzbuffer(gz_in, ZLIB_BUFFER_SIZE);
+		setvbuf(in, nullptr, _IOFBF, BUFFER_SIZE);
+		bam_reader = make_unique<CBamReader>(in, _file_name, no_gz_threads, bam_view, bam_cbc_len, bam_umi_len);
+
+		is_gzipped = true;
+	}
+	else if (is_gzipped_name(_file_name))
+	{
+		in = fopen(_file_name.c_str(), "rb");
+
+		if (!in)
+			return false;
+
+		if (CBgzfReader::IsBgzf(in))
+		{
+			setvbuf(in, nullptr, _IOFBF, BUFFER_SIZE);
+			bgzf_reader = make_unique<CBgzfReader>(in, _file_name, no_gz_threads);
+		}
+		else
+		{
+			fclose(in);
+			in = nullptr;
+
+			gz_in = gzopen(_file_name.c_str(), "rb");
+
+			if (!gz_in)
+				return false;
+
+			gzbuffer(gz_in, ZLIB_BUFFER_SIZE);
+			gz_pipelined_reader = make_unique<CGzPipelinedReader>(gz_in, _file_name);
+		}
+
 		is_gzipped = true;
 	}
+	else if (use_mmap && open_mapped(_file_name))
+		is_gzipped = false;
 	else
 	{
 		in = fopen(_file_name.c_str(), "rb");
@@ -59,12 +112,157 @@ void CFastXReader::Close()
 	close();
 }
 
+// *********************************************************************************************
+bool CFastXReader::open_mapped(const string& fn)
+{
+#if defined(__linux__) || defined(__APPLE__)
+	int fd = open(fn.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void* p = mmap(nullptr, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (p == MAP_FAILED)
+		return false;
+
+	map_data = (char*) p;
+	map_size = (size_t) st.st_size;
+	map_pos = 0;
+
+	// The last line must be terminated, as CReadReader needs '\0' after it
+	if (map_data[map_size - 1] != '\n')
+	{
+		close_mapped();
+		return false;
+	}
+
+	madvise(map_data, map_size, MADV_SEQUENTIAL);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+// *********************************************************************************************
+void CFastXReader::close_mapped()
+{
+#if defined(__linux__) || defined(__APPLE__)
+	if (map_data)
+		munmap(map_data, map_size);
+#endif
+
+	map_data = nullptr;
+	map_size = 0;
+	map_pos = 0;
+}
+
+// *********************************************************************************************
+// pos must be a line start
+bool CFastXReader::is_record_start(size_t pos) const
+{
+	if (pos == map_size)
+		return true;
+
+	if (map_data[pos] != (is_fastq ? '@' : '>'))
+		return false;
+
+	if (!is_fastq)
+		return true;
+
+	// A quality line can also start with '@', but then the 2nd next line is the bases line of the next record
+	for (int i = 0; i < 2; ++i)
+	{
+		auto p = (char*) memchr(map_data + pos, '\n', map_size - pos);
+		if (!p)
+			return false;
+		pos = p - map_data + 1;
+	}
+
+	return pos < map_size && map_data[pos] == '+';
+}
+
+// *********************************************************************************************
+// Next range of complete records of at most max_size bytes, starting just after the previous one
+// A record not fitting in max_size is reported and stops the run (false is returned only at the end of data)
+bool CFastXReader::NextMappedRange(char*& data, size_t& size, size_t max_size)
+{
+	if (!map_data || map_pos >= map_size)
+		return false;
+
+	size_t end = map_pos + max_size;
+
+	if (end >= map_size)
+		end = map_size;
+	else
+	{
+		// The last record start in (map_pos, map_pos + max_size]
+		for (; end > map_pos; --end)
+			if (map_data[end - 1] == '\n' && is_record_start(end))
+				break;
+
+		// A record larger than the whole range could never be passed on, so the input would be silently truncated
+		if (end == map_pos)
+		{
+			std::cerr << "Error: FASTQ record larger than a block of " + to_string(max_size) + " bytes (or broken input) at offset " + 
+				to_string(map_pos) + " in: " + file_name + "\n";
+			exit(1);
+		}
+	}
+
+	data = map_data + map_pos;
+	size = end - map_pos;
+	map_pos = end;
+
+	run_stats.Add(CRunStats::counter_t::bytes_read, size);
+
+#if defined(__linux__) || defined(__APPLE__)
+	// Readahead of the next range
+	if (map_pos < map_size)
+	{
+		size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+		size_t ra_begin = map_pos / page_size * page_size;
+
+		madvise(map_data + ra_begin, min(max_size, map_size - ra_begin), MADV_WILLNEED);
+	}
+#endif
+
+	return true;
+}
+
+// *********************************************************************************************
+// Drops the private copies of the pages (modified by CReadReader) that lie entirely inside a processed range;
+// the boundary pages are shared with the neighbouring ranges and are released when the file is unmapped
+void CFastXReader::ReleaseMappedRange(memory_chunk<char>& mc)
+{
+#if defined(__linux__) || defined(__APPLE__)
+	uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+	uintptr_t begin = ((uintptr_t) mc.data() + page_size - 1) / page_size * page_size;
+	uintptr_t end = ((uintptr_t) mc.data() + mc.size()) / page_size * page_size;
+
+	if (begin < end)
+		madvise((void*) begin, end - begin, MADV_DONTNEED);
+#endif
+}
+
 // *********************************************************************************************
 bool CFastXReader::ReadBlock(memory_chunk<char>& mc)
 {
 	if (!in && !gz_in)
 		return false;
 
+	if (bam_reader)
+		return bam_reader->ReadBlock(mc);
+
 	mc.resize(internal_buffer.size());
 	memcpy(mc.data(), internal_buffer.data(), internal_buffer.size());
 	internal_buffer.clear();
@@ -75,11 +273,15 @@ bool CFastXReader::ReadBlock(memory_chunk<char>& mc)
 
 	mc.resize(mc.capacity());
 
-	if (is_gzipped)
-		readed = gzread(gz_in, mc.data() + filled, to_read);
+	if (bgzf_reader)
+		readed = bgzf_reader->Read(mc.data() + filled, to_read);
+	else if (gz_pipelined_reader)
+		readed = gz_pipelined_reader->Read(mc.data() + filled, to_read);
 	else
 		readed = fread(mc.data() + filled, 1, to_read, in);
 
+	run_stats.Add(is_gzipped ? CRunStats::counter_t::bytes_decompressed : CRunStats::counter_t::bytes_read, readed);
+
 	mc.resize(filled + readed);
 
 	find_last_eols(mc);
@@ -98,6 +300,18 @@ bool CFastXReader::ReadBlock(memory_chunk<char>& mc)
 // *********************************************************************************************
 bool CFastXReader::Eof()
 {
+	if (map_data)
+		return map_pos >= map_size;
+
+	if (bam_reader)
+		return bam_reader->Eof();
+
+	if (bgzf_reader)
+		return internal_buffer.empty() && bgzf_reader->Eof();
+
+	if (gz_pipelined_reader)
+		return internal_buffer.empty() && gz_pipelined_reader->Eof();
+
 	if (in)
 		return internal_buffer.empty() && feof(in);
 
@@ -5,8 +5,11 @@
 #include <zlib.h>
 #include <vector>
 #include <array>
+#include <memory>
 
 #include "../../libs/refresh/memory_chunk/lib/memory_chunk.h"
+#include "gz_reader.h"
+#include "bam_reader.h"
 
 using namespace std;
 using namespace refresh;
@@ -24,13 +27,35 @@ protected:
 	bool is_fastq = true;
 	int rec_lines;
 
+	// BGZF input is inflated in parallel; plain gzip is inflated in a separate thread
+	int no_gz_threads = 2;
+	unique_ptr<CBgzfReader> bgzf_reader;
+	unique_ptr<CGzPipelinedReader> gz_pipelined_reader;
+
+	// BAM files are converted in memory to FASTQ records of the selected view
+	unique_ptr<CBamReader> bam_reader;
+	bam_view_t bam_view = bam_view_t::read;
+	uint32_t bam_cbc_len = 16;
+	uint32_t bam_umi_len = 12;
+
 	string file_name;
 
 	array<int, 4> eol_positions;
 	vector<char> internal_buffer;
 
+	// Uncompressed input can be memory-mapped; blocks are then record-aligned views into the mapping (no copying),
+	// which is private (copy-on-write), as CReadReader changes EOLs into '\0'
+	bool use_mmap = false;
+	char* map_data = nullptr;
+	size_t map_size = 0;
+	size_t map_pos = 0;
+
 	void close();
 
+	bool open_mapped(const string& fn);
+	void close_mapped();
+	bool is_record_start(size_t pos) const;
+
 	bool is_gzipped_name(const string& fn)
 	{
 		return fn.size() > 3 && fn.substr(fn.size() - 3, 3) == ".gz";
@@ -47,11 +72,35 @@ public:
 		close();
 	}
 
+	void SetNoGzThreads(int _no_gz_threads)
+	{
+		no_gz_threads = max(_no_gz_threads, 1);
+	}
+
+	// Applies to the files opened later; gzipped (and empty) files are always read in the regular way
+	void SetUseMmap(bool _use_mmap)
+	{
+		use_mmap = _use_mmap;
+	}
+
+	// Applies to the BAM files opened later (CBC and UMI lengths are used only for the CBC/UMI view)
+	void SetBamView(bam_view_t _bam_view, uint32_t cbc_len, uint32_t umi_len)
+	{
+		bam_view = _bam_view;
+		bam_cbc_len = cbc_len;
+		bam_umi_len = umi_len;
+	}
+
 	bool Open(const string& _file_name);
 	void Close();
+	bool IsBgzf() const { return (bool) bgzf_reader; }
+	bool IsMapped() const { return map_data != nullptr; }
 
 	bool ReadBlock(memory_chunk<char>& mc);
+	bool NextMappedRange(char*& data, size_t& size, size_t max_size);
 	bool Eof();
+
+	static void ReleaseMappedRange(memory_chunk<char>& mc);
 };
 
 // *********************************************************************************************
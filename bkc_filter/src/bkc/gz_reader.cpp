@@ -0,0 +1,359 @@
+#include <iostream>
+#include <cstring>
+#include "gz_reader.h"
+#include "../common/run_stats.h"
+
+#include "../../libs/libdeflate/libdeflate.h"
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CBgzfReader::CBgzfReader(FILE* _in, const string& _file_name, int _no_threads) :
+	in(_in),
+	file_name(_file_name),
+	no_threads(max(_no_threads, 1))
+{
+	max_batches_in_flight = 2 * no_threads + 2;
+
+	batch_queue = make_unique<parallel_queue<shared_ptr<batch_t>>>(max_batches_in_flight);
+
+	reading_thread = thread([this] { reading_loop(); });
+
+	inflating_threads.reserve(no_threads);
+	for (int i = 0; i < no_threads; ++i)
+		inflating_threads.emplace_back([this] { inflating_loop(); });
+}
+
+// *********************************************************************************************
+CBgzfReader::~CBgzfReader()
+{
+	{
+		lock_guard<mutex> lck(mtx);
+		stop = true;
+	}
+	cv_space.notify_all();
+
+	reading_thread.join();
+
+	for (auto& t : inflating_threads)
+		t.join();
+}
+
+// *********************************************************************************************
+// Checks gzip header for BGZF extra subfield ('B', 'C', SLEN = 2); rewinds the file
+bool CBgzfReader::IsBgzf(FILE* f)
+{
+	uint8_t header[18];
+
+	size_t readed = fread(header, 1, sizeof(header), f);
+	fseek(f, 0, SEEK_SET);
+
+	if (readed != sizeof(header))
+		return false;
+
+	return header[0] == 0x1f && header[1] == 0x8b && header[2] == 8 && (header[3] & 4) &&
+		header[10] + (header[11] << 8) >= 6 &&
+		header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+}
+
+// *********************************************************************************************
+bool CBgzfReader::read_block(batch_t& batch)
+{
+	uint8_t header[12];
+	size_t readed = fread(header, 1, sizeof(header), in);
+
+	if (readed == 0)
+		return false;
+
+	if (readed != sizeof(header) || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4))
+	{
+		cerr << "Error: Corrupted BGZF block in file: " + file_name + "\n";
+		exit(1);
+	}
+
+	uint32_t xlen = header[10] + (header[11] << 8);
+	extra.resize(xlen);
+
+	if (fread(extra.data(), 1, xlen, in) != xlen)
+	{
+		cerr << "Error: Corrupted BGZF block in file: " + file_name + "\n";
+		exit(1);
+	}
+
+	int64_t bsize = -1;
+
+	for (uint32_t i = 0; i + 4 <= xlen; )
+	{
+		uint32_t slen = extra[i + 2] + (extra[i + 3] << 8);
+
+		if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+		{
+			bsize = extra[i + 4] + (extra[i + 5] << 8);
+			break;
+		}
+
+		i += 4 + slen;
+	}
+
+	if (bsize < 0 || bsize + 1 < (int64_t) (sizeof(header) + xlen + 8))
+	{
+		cerr << "Error: Missing BGZF block size in file: " + file_name + "\n";
+		exit(1);
+	}
+
+	size_t rest_size = bsize + 1 - sizeof(header) - xlen;
+	size_t in_pos = batch.in.size();
+
+	batch.in.resize(in_pos + rest_size);
+
+	if (fread(batch.in.data() + in_pos, 1, rest_size, in) != rest_size)
+	{
+		cerr << "Error: Truncated BGZF block in file: " + file_name + "\n";
+		exit(1);
+	}
+
+	run_stats.Add(CRunStats::counter_t::bytes_read, bsize + 1);
+
+	const uint8_t* footer = batch.in.data() + in_pos + rest_size - 8;
+
+	bgzf_block_t block;
+	block.in_pos = in_pos;
+	block.in_size = rest_size - 8;
+	block.crc = footer[0] + (footer[1] << 8) + (footer[2] << 16) + ((uint32_t) footer[3] << 24);
+	block.out_size = footer[4] + (footer[5] << 8) + (footer[6] << 16) + ((uint32_t) footer[7] << 24);
+	block.out_pos = batch.blocks.empty() ? 0 : batch.blocks.back().out_pos + batch.blocks.back().out_size;
+
+	batch.blocks.emplace_back(block);
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CBgzfReader::read_batch(batch_t& batch)
+{
+	while (batch.in.size() < batch_in_size)
+		if (!read_block(batch))
+			break;
+
+	return !batch.blocks.empty();
+}
+
+// *********************************************************************************************
+void CBgzfReader::inflate_batch(batch_t& batch, libdeflate_decompressor* decompressor)
+{
+	auto& last = batch.blocks.back();
+	batch.out.resize(last.out_pos + last.out_size);
+
+	for (const auto& block : batch.blocks)
+	{
+		size_t out_size = 0;
+
+		auto r = libdeflate_deflate_decompress(decompressor, batch.in.data() + block.in_pos, block.in_size,
+			batch.out.data() + block.out_pos, block.out_size, &out_size);
+
+		if (r != LIBDEFLATE_SUCCESS || out_size != block.out_size ||
+			libdeflate_crc32(0, batch.out.data() + block.out_pos, block.out_size) != block.crc)
+		{
+			cerr << "Error: Cannot decompress BGZF block in file: " + file_name + "\n";
+			exit(1);
+		}
+	}
+
+	vector<uint8_t>().swap(batch.in);
+}
+
+// *********************************************************************************************
+void CBgzfReader::reading_loop()
+{
+	while (true)
+	{
+		auto batch = make_shared<batch_t>();
+
+		if (!read_batch(*batch))
+			break;
+
+		{
+			unique_lock<mutex> lck(mtx);
+			cv_space.wait(lck, [this] { return stop || batches.size() < max_batches_in_flight; });
+
+			if (stop)
+				break;
+
+			batches.emplace_back(batch);
+		}
+
+		batch_queue->push(batch);
+	}
+
+	batch_queue->mark_completed();
+
+	{
+		lock_guard<mutex> lck(mtx);
+		reading_completed = true;
+	}
+	cv_done.notify_all();
+}
+
+// *********************************************************************************************
+void CBgzfReader::inflating_loop()
+{
+	auto decompressor = libdeflate_alloc_decompressor();
+	shared_ptr<batch_t> batch;
+
+	while (batch_queue->pop(batch))
+	{
+		inflate_batch(*batch, decompressor);
+
+		{
+			lock_guard<mutex> lck(mtx);
+			batch->done = true;
+		}
+		cv_done.notify_all();
+
+		batch.reset();
+	}
+
+	libdeflate_free_decompressor(decompressor);
+}
+
+// *********************************************************************************************
+size_t CBgzfReader::Read(char* dest, size_t size)
+{
+	size_t readed = 0;
+
+	while (readed < size)
+	{
+		if (!curr_batch || curr_pos == curr_batch->out.size())
+		{
+			curr_batch.reset();
+
+			unique_lock<mutex> lck(mtx);
+			cv_done.wait(lck, [this] { return (!batches.empty() && batches.front()->done) || (batches.empty() && reading_completed); });
+
+			if (batches.empty())
+			{
+				eof = true;
+				break;
+			}
+
+			curr_batch = batches.front();
+			batches.pop_front();
+			curr_pos = 0;
+
+			lck.unlock();
+			cv_space.notify_one();
+
+			continue;
+		}
+
+		size_t to_copy = min(size - readed, curr_batch->out.size() - curr_pos);
+		memcpy(dest + readed, curr_batch->out.data() + curr_pos, to_copy);
+
+		readed += to_copy;
+		curr_pos += to_copy;
+	}
+
+	return readed;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CGzPipelinedReader::CGzPipelinedReader(gzFile _gz_in, const string& _file_name) :
+	gz_in(_gz_in),
+	file_name(_file_name)
+{
+	filled_parts = make_unique<parallel_queue<vector<char>>>(no_parts);
+	empty_parts = make_unique<parallel_queue<vector<char>>>(no_parts);
+
+	for (size_t i = 0; i < no_parts; ++i)
+		empty_parts->push(vector<char>(part_size));
+
+	inflating_thread = thread([this] { inflating_loop(); });
+}
+
+// *********************************************************************************************
+CGzPipelinedReader::~CGzPipelinedReader()
+{
+	empty_parts->mark_completed();
+
+	vector<char> part;
+	while (filled_parts->pop(part))
+		;
+
+	inflating_thread.join();
+}
+
+// *********************************************************************************************
+void CGzPipelinedReader::inflating_loop()
+{
+	vector<char> part;
+	z_off_t in_offset = 0;
+
+	while (empty_parts->pop(part))
+	{
+		part.resize(part_size);
+		int readed = gzread(gz_in, part.data(), (unsigned) part.size());
+
+		z_off_t new_in_offset = gzoffset(gz_in);
+		if (new_in_offset > in_offset)
+		{
+			run_stats.Add(CRunStats::counter_t::bytes_read, new_in_offset - in_offset);
+			in_offset = new_in_offset;
+		}
+
+		if (readed < 0)
+		{
+			cerr << "Error: Cannot decompress file: " + file_name + "\n";
+			exit(1);
+		}
+
+		if (readed == 0)
+			break;
+
+		part.resize(readed);
+		filled_parts->push(move(part));
+	}
+
+	filled_parts->mark_completed();
+}
+
+// *********************************************************************************************
+size_t CGzPipelinedReader::Read(char* dest, size_t size)
+{
+	size_t readed = 0;
+
+	while (readed < size)
+	{
+		if (curr_pos == curr_part.size())
+		{
+			if (curr_part.capacity())
+				empty_parts->push(move(curr_part));
+
+			curr_part = vector<char>();
+			curr_pos = 0;
+
+			if (!filled_parts->pop(curr_part))
+			{
+				eof = true;
+				break;
+			}
+
+			continue;
+		}
+
+		size_t to_copy = min(size - readed, curr_part.size() - curr_pos);
+		memcpy(dest + readed, curr_part.data() + curr_pos, to_copy);
+
+		readed += to_copy;
+		curr_pos += to_copy;
+	}
+
+	return readed;
+}
+
+// EOF
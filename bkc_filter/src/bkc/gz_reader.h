@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <zlib.h>
+
+#include "../../libs/refresh/parallel_queues/lib/parallel-queues.h"
+
+struct libdeflate_decompressor;
+
+using namespace std;
+using namespace refresh;
+
+// *********************************************************************************************
+// Parallel decompression of BGZF files
+// BGZF is a series of independent gzip members (<= 64KB of data each), so batches of blocks are read by one thread
+// and inflated with libdeflate by several threads; the decompressed stream is returned in the original order
+class CBgzfReader
+{
+	const size_t batch_in_size = 1 << 20;
+
+	struct bgzf_block_t
+	{
+		size_t in_pos;			// position of deflate data in batch
+		size_t in_size;
+		size_t out_pos;
+		uint32_t out_size;
+		uint32_t crc;
+	};
+
+	struct batch_t
+	{
+		vector<uint8_t> in;
+		vector<uint8_t> out;
+		vector<bgzf_block_t> blocks;
+		bool done = false;
+	};
+
+	FILE* in = nullptr;
+	string file_name;
+	int no_threads;
+	size_t max_batches_in_flight;
+
+	thread reading_thread;
+	vector<thread> inflating_threads;
+
+	unique_ptr<parallel_queue<shared_ptr<batch_t>>> batch_queue;
+
+	deque<shared_ptr<batch_t>> batches;			// in order of reading
+	mutex mtx;
+	condition_variable cv_done;
+	condition_variable cv_space;
+	bool reading_completed = false;
+	bool stop = false;
+
+	shared_ptr<batch_t> curr_batch;
+	size_t curr_pos = 0;
+	bool eof = false;
+
+	vector<uint8_t> extra;
+
+	bool read_block(batch_t& batch);
+	bool read_batch(batch_t& batch);
+	void inflate_batch(batch_t& batch, libdeflate_decompressor* decompressor);
+
+	void reading_loop();
+	void inflating_loop();
+
+public:
+	CBgzfReader(FILE* _in, const string& _file_name, int _no_threads);
+	~CBgzfReader();
+
+	static bool IsBgzf(FILE* f);
+
+	size_t Read(char* dest, size_t size);
+	bool Eof() const { return eof; }
+};
+
+// *********************************************************************************************
+// Plain gzip cannot be inflated in parallel, but inflating in a separate thread overlaps it with record splitting
+class CGzPipelinedReader
+{
+	const size_t part_size = 8 << 20;
+	const size_t no_parts = 4;
+
+	gzFile gz_in = nullptr;
+	string file_name;
+
+	thread inflating_thread;
+
+	unique_ptr<parallel_queue<vector<char>>> filled_parts;
+	unique_ptr<parallel_queue<vector<char>>> empty_parts;
+
+	vector<char> curr_part;
+	size_t curr_pos = 0;
+	bool eof = false;
+
+	void inflating_loop();
+
+public:
+	CGzPipelinedReader(gzFile _gz_in, const string& _file_name);
+	~CGzPipelinedReader();
+
+	size_t Read(char* dest, size_t size);
+	bool Eof() const { return eof; }
+};
+
+// EOF
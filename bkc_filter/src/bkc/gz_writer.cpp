@@ -0,0 +1,180 @@
+#include <iostream>
+#include <cstring>
+#include "gz_writer.h"
+
+#include "../../libs/libdeflate/libdeflate.h"
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CBgzfWriter::CBgzfWriter(FILE* _out, const string& _file_name, int _no_threads, int _level) :
+	out(_out),
+	file_name(_file_name),
+	no_threads(max(_no_threads, 1)),
+	level(_level)
+{
+	max_batches_in_flight = 2 * no_threads + 2;
+
+	batch_queue = make_unique<parallel_queue<shared_ptr<batch_t>>>(max_batches_in_flight);
+
+	curr_batch = make_shared<batch_t>();
+	curr_batch->in.reserve(batch_size + (64 << 10));
+
+	writing_thread = thread([this] { writing_loop(); });
+
+	deflating_threads.reserve(no_threads);
+	for (int i = 0; i < no_threads; ++i)
+		deflating_threads.emplace_back([this] { deflating_loop(); });
+}
+
+// *********************************************************************************************
+CBgzfWriter::~CBgzfWriter()
+{
+	if (!curr_batch->in.empty())
+		submit_batch();
+
+	batch_queue->mark_completed();
+
+	for (auto& t : deflating_threads)
+		t.join();
+
+	{
+		lock_guard<mutex> lck(mtx);
+		input_completed = true;
+	}
+	cv_done.notify_all();
+
+	writing_thread.join();
+
+	// Empty block marking the end of BGZF file
+	const uint8_t eof_block[28] = {
+		0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+		0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+	if (fwrite(eof_block, 1, sizeof(eof_block), out) != sizeof(eof_block) || fclose(out) != 0)
+	{
+		cerr << "Error: Cannot write to file: " + file_name + "\n";
+		exit(1);
+	}
+}
+
+// *********************************************************************************************
+void CBgzfWriter::submit_batch()
+{
+	{
+		unique_lock<mutex> lck(mtx);
+		cv_space.wait(lck, [this] { return batches.size() < max_batches_in_flight; });
+
+		batches.emplace_back(curr_batch);
+	}
+
+	batch_queue->push(curr_batch);
+
+	curr_batch = make_shared<batch_t>();
+	curr_batch->in.reserve(batch_size + (64 << 10));
+}
+
+// *********************************************************************************************
+void CBgzfWriter::deflate_batch(batch_t& batch, libdeflate_compressor* compressor)
+{
+	const size_t header_size = 18;
+	const size_t footer_size = 8;
+	const size_t max_block_size = 1 << 16;
+
+	size_t no_blocks = (batch.in.size() + block_data_size - 1) / block_data_size;
+	batch.out.resize(no_blocks * max_block_size);
+
+	size_t out_pos = 0;
+
+	for (size_t in_pos = 0; in_pos < batch.in.size(); in_pos += block_data_size)
+	{
+		size_t in_size = min(block_data_size, batch.in.size() - in_pos);
+		uint8_t* block = batch.out.data() + out_pos;
+		size_t max_deflate_size = max_block_size - header_size - footer_size;
+
+		// Always fits, as the deflate bound of block_data_size bytes is below max_deflate_size
+		size_t deflate_size = libdeflate_deflate_compress(compressor, batch.in.data() + in_pos, in_size, block + header_size, max_deflate_size);
+
+		if (!deflate_size)
+		{
+			cerr << "Error: Cannot compress BGZF block for file: " + file_name + "\n";
+			exit(1);
+		}
+
+		uint32_t bsize = (uint32_t) (header_size + deflate_size + footer_size - 1);
+		uint32_t crc = libdeflate_crc32(0, batch.in.data() + in_pos, in_size);
+
+		const uint8_t header[header_size] = {
+			0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 'B', 'C', 0x02, 0x00,
+			(uint8_t) (bsize & 0xff), (uint8_t) (bsize >> 8) };
+
+		memcpy(block, header, header_size);
+
+		uint8_t* footer = block + header_size + deflate_size;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			footer[i] = (uint8_t) (crc >> (8 * i));
+			footer[4 + i] = (uint8_t) (in_size >> (8 * i));
+		}
+
+		out_pos += bsize + 1;
+	}
+
+	batch.out.resize(out_pos);
+
+	vector<uint8_t>().swap(batch.in);
+}
+
+// *********************************************************************************************
+void CBgzfWriter::deflating_loop()
+{
+	auto compressor = libdeflate_alloc_compressor(level);
+	shared_ptr<batch_t> batch;
+
+	while (batch_queue->pop(batch))
+	{
+		deflate_batch(*batch, compressor);
+
+		{
+			lock_guard<mutex> lck(mtx);
+			batch->done = true;
+		}
+		cv_done.notify_all();
+
+		batch.reset();
+	}
+
+	libdeflate_free_compressor(compressor);
+}
+
+// *********************************************************************************************
+void CBgzfWriter::writing_loop()
+{
+	while (true)
+	{
+		shared_ptr<batch_t> batch;
+
+		{
+			unique_lock<mutex> lck(mtx);
+			cv_done.wait(lck, [this] { return (!batches.empty() && batches.front()->done) || (batches.empty() && input_completed); });
+
+			if (batches.empty())
+				break;
+
+			batch = batches.front();
+			batches.pop_front();
+		}
+		cv_space.notify_one();
+
+		if (fwrite(batch->out.data(), 1, batch->out.size(), out) != batch->out.size())
+		{
+			cerr << "Error: Cannot write to file: " + file_name + "\n";
+			exit(1);
+		}
+	}
+}
+
+// EOF
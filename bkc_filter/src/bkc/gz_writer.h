@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "../../libs/refresh/parallel_queues/lib/parallel-queues.h"
+
+struct libdeflate_compressor;
+
+using namespace std;
+using namespace refresh;
+
+// *********************************************************************************************
+// Parallel compression to BGZF files (readable by any gzip tool and inflated in parallel by CBgzfReader)
+// The calling thread only copies bytes to the current batch; full batches are split into BGZF blocks and deflated
+// with libdeflate by several threads, and a writing thread stores them in the original order
+class CBgzfWriter
+{
+	const size_t batch_size = 1 << 20;
+	const size_t block_data_size = 0xff00;			// as in htslib, so each block fits in 64KB also if not compressible
+
+	struct batch_t
+	{
+		vector<uint8_t> in;
+		vector<uint8_t> out;
+		bool done = false;
+	};
+
+	FILE* out = nullptr;
+	string file_name;
+	int no_threads;
+	int level;
+	size_t max_batches_in_flight;
+
+	thread writing_thread;
+	vector<thread> deflating_threads;
+
+	unique_ptr<parallel_queue<shared_ptr<batch_t>>> batch_queue;
+
+	deque<shared_ptr<batch_t>> batches;			// in order of writing
+	mutex mtx;
+	condition_variable cv_done;
+	condition_variable cv_space;
+	bool input_completed = false;
+
+	shared_ptr<batch_t> curr_batch;
+
+	void submit_batch();
+	void deflate_batch(batch_t& batch, libdeflate_compressor* compressor);
+
+	void writing_loop();
+	void deflating_loop();
+
+public:
+	// Takes the ownership of _out (closed at destruction, after the remaining data and the BGZF EOF block are written)
+	CBgzfWriter(FILE* _out, const string& _file_name, int _no_threads, int _level = 3);
+	~CBgzfWriter();
+
+	// *********************************************************************************************
+	void Write(const char* data, size_t size)
+	{
+		auto& in = curr_batch->in;
+
+		in.insert(in.end(), (const uint8_t*) data, (const uint8_t*) data + size);
+
+		if (in.size() >= batch_size)
+			submit_batch();
+	}
+
+	// *********************************************************************************************
+	void Put(char c)
+	{
+		auto& in = curr_batch->in;
+
+		in.push_back((uint8_t) c);
+
+		if (in.size() >= batch_size)
+			submit_batch();
+	}
+
+	// *********************************************************************************************
+	// Zero-terminated string followed by EOL
+	void PutLine(const char* str)
+	{
+		Write(str, strlen(str));
+		Put('\n');
+	}
+};
+
+// EOF
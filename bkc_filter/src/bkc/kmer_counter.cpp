@@ -32,6 +32,7 @@ void CBarcodedCounter::join_threads(vector<thread>& threads)
 void CBarcodedCounter::SetParams(const CParams& params)
 {
 	no_threads = params.no_threads.get();
+	thread_pool = make_unique<CThreadPool>(max(no_threads, 1));
 	cbc_len = params.cbc_len.get();
 	umi_len = params.umi_len.get();
 	soft_cbc_umi_len_limit = params.soft_cbc_umi_len_limit.get();
@@ -163,7 +164,7 @@ void CBarcodedCounter::start_reading_threads()
 
 					if (!fqx.ReadBlock(mc))
 					{
-						memory_pools[thread_id]->Push(mc);
+						memory_pools[thread_id]->Unpop(mc);
 						break;
 					}
 					else
@@ -608,8 +609,6 @@ bool CBarcodedCounter::init_bkc_files()
 // *********************************************************************************************
 void CBarcodedCounter::merge_cbc_dict()
 {
-	vector<thread> threads;
-
 	vector<cbc_t> cbcs;
 	atomic_int id{ 0 };
 
@@ -623,10 +622,7 @@ void CBarcodedCounter::merge_cbc_dict()
 	for (auto& x : cbc_dict[0])
 		cbcs.emplace_back(x.first);
 
-	threads.reserve(no_threads);
-
-	for (int t = 0; t < no_threads; ++t)
-		threads.emplace_back([&] {
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
 		int curr_id;
 
 		vector<vector<umi_readfid_t>*> ptrs(cbc_dict.size(), nullptr);
@@ -664,9 +660,7 @@ void CBarcodedCounter::merge_cbc_dict()
 				clear_vec(*ptrs[i]);
 			}
 		}
-			});
-
-	join_threads(threads);
+		});
 
 	for (int i = 1; i < (int) cbc_dict.size(); ++i)
 		cbc_dict[i].clear();
@@ -677,18 +671,13 @@ void CBarcodedCounter::sort_cbc_dict()
 {
 	atomic_int id{ 0 };
 
-	vector<thread> threads;
-
 	vector<vector<umi_readfid_t>*> umis;
 
 	umis.reserve(cbc_dict[0].size());
 	for (auto& x : cbc_dict[0])
 		umis.emplace_back(&(x.second));
 
-	threads.reserve(no_threads);
-
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
 		int curr_id = -1;
 		while (true)
 		{
@@ -698,9 +687,7 @@ void CBarcodedCounter::sort_cbc_dict()
 
 			stable_sort(umis[curr_id]->begin(), umis[curr_id]->end());
 		}
-			});
-
-	join_threads(threads);
+		});
 }
 
 // *********************************************************************************************
@@ -795,8 +782,6 @@ void CBarcodedCounter::remove_duplicated_UMI()
 	atomic_uint64_t total_no_after_removal { 0 };
 	atomic<uint64_t> a_total_no_reads_before_UMI_cleaning{ 0 };
 
-	vector<thread> threads;
-
 	vector<cbc_t> v_cbc;
 
 	global_cbc_dict.reserve(global_cbc_umi_dict.size());
@@ -813,10 +798,7 @@ void CBarcodedCounter::remove_duplicated_UMI()
 		cbc_vec.emplace_back(0, x.first);
 	}
 
-	threads.reserve(no_threads);
-
-	for (int i_thread = 0; i_thread < no_threads; ++i_thread)
-		threads.emplace_back([&id, &v_cbc, this, &a_total_no_reads_before_UMI_cleaning, &total_no_after_removal] {
+	thread_pool->ParallelFor(no_threads, [&id, &v_cbc, this, &a_total_no_reads_before_UMI_cleaning, &total_no_after_removal](uint32_t) {
 		int curr_id = -1;
 		
 		vector<vector<umi_readfid_t>::iterator> p_src;
@@ -914,8 +896,6 @@ void CBarcodedCounter::remove_duplicated_UMI()
 		}
 		});
 
-	join_threads(threads);
-
 	global_cbc_umi_dict.clear();
 
 	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
@@ -1526,7 +1506,6 @@ void CBarcodedCounter::count_leaders()
 	atomic_int id{ 0 };
 	atomic_uint64_t total_no_after_removal{ 0 };
 
-	vector<thread> threads;
 	vector<cbc_t> cbcs;
 
 	total_no_kmer_leaders_counts = 0;
@@ -1538,10 +1517,7 @@ void CBarcodedCounter::count_leaders()
 
 	leader_counts.resize(no_threads);
 
-	threads.reserve(no_threads);
-
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&, i] {
+	thread_pool->ParallelFor(no_threads, [&](uint32_t i) {
 		int thread_id = i;
 		int curr_id = -1;
 
@@ -1561,9 +1537,7 @@ void CBarcodedCounter::count_leaders()
 			for (auto x : kmer_leaders)
 				my_leader_counts[x] += 1;
 		}
-			});
-
-	join_threads(threads);
+		});
 
 	if (verbosity_level >= 2)
 	{
@@ -1605,7 +1579,6 @@ void CBarcodedCounter::count_kmer_pairs()
 	atomic_int id{ 0 };
 	atomic_uint64_t total_no_after_removal{ 0 };
 
-	vector<thread> threads;
 	vector<cbc_t> cbcs;
 	
 	total_no_kmer_pair_counts = 0;
@@ -1615,10 +1588,7 @@ void CBarcodedCounter::count_kmer_pairs()
 	for (auto& x : global_cbc_dict)
 		cbcs.emplace_back(x.first);
 
-	threads.reserve(no_threads);
-
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
 		int curr_id = -1;
 
 		vector<leader_follower_t> kmer_pairs;
@@ -1666,8 +1636,6 @@ void CBarcodedCounter::count_kmer_pairs()
 		}
 		});
 
-	join_threads(threads);
-
 	if (verbosity_level >= 2)
 	{
 		std::cerr << "Total no. k-mer pair counts: " << total_no_kmer_pair_counts << endl;
@@ -1681,7 +1649,6 @@ void CBarcodedCounter::count_kmers()
 	atomic_int id{ 0 };
 	atomic_uint64_t total_no_after_removal{ 0 };
 
-	vector<thread> threads;
 	vector<cbc_t> cbcs;
 	
 	total_no_kmer_counts = 0;
@@ -1691,10 +1658,7 @@ void CBarcodedCounter::count_kmers()
 	for (auto& x : global_cbc_dict)
 		cbcs.emplace_back(x.first);
 
-	threads.reserve(no_threads);
-
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
 		int curr_id = -1;
 
 		vector<kmer_t> kmers;
@@ -1742,8 +1706,6 @@ void CBarcodedCounter::count_kmers()
 		}
 		});
 
-	join_threads(threads);
-
 	if (verbosity_level >= 2)
 	{
 		std::cerr << "Total no. k-mers: " << total_no_kmer_counts << endl;
@@ -19,6 +19,7 @@
 #include "memory_pool.h"
 #include "../common/utils.h"
 #include "../common/bkc_file.h"
+#include "../common/thread_pool.h"
 #include "params.h"
 
 #include <filters/poly_ACGT_filter.h>
@@ -131,6 +132,7 @@ class CBarcodedCounter
 
 	vector<string> file_names;
 	int no_threads = 1;
+	unique_ptr<CThreadPool> thread_pool;				// shared by all parallel stages (pipeline threads are dedicated)
 	int no_reading_threads = 0;
 
 	string out_file_name = "./results.bkc";
@@ -1,37 +1,59 @@
 #pragma once
 
-#include <mutex>
-#include <condition_variable>
 #include <vector>
-#include <stack>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 #include "../../libs/refresh/memory_chunk/lib/memory_chunk.h"
+#include "../common/run_stats.h"
+#include "spsc_queue.h"
 
 using namespace std;
 using namespace refresh;
 
+// Pool of chunks of a single reading thread: chunks are taken (Pop, PopExternal) only by the reading thread
+// and returned (Push) only by the thread consuming its blocks, so free chunks are passed through a lock-free SPSC ring.
+// A chunk taken but not used by the reading thread is given back with Unpop()
 template<typename T> class CMemoryPool
 {
 	size_t max_no_chunks;
 	size_t chunk_size;
 
-	stack<memory_chunk<T>, vector<memory_chunk<T>>> chunks;
+	unique_ptr<CSpscQueue<memory_chunk<T>>> chunks;
+	vector<T*> own_data;
+	memory_chunk<T> spare;					// chunk given back by the reading thread
 
-	mutex mtx;
-	condition_variable cv;
+	// Chunks not allocated here (views into memory-mapped files) travel through the same queues as own chunks.
+	// At most max_no_chunks of them are in flight; Push() passes them to release_external instead of storing them
+	atomic<uint64_t> no_external{ 0 };
+	function<void(memory_chunk<T>&)> release_external;
 
 	void deallocate()
 	{
-		while (!chunks.empty())
-		{
-			delete[] chunks.top().data();
-			chunks.pop();
-		}
+		chunks.reset();
+		spare = memory_chunk<T>();
+
+		for (auto p : own_data)
+			delete[] p;
+
+		own_data.clear();
 	}
 
 	void allocate()
 	{
+		chunks = make_unique<CSpscQueue<memory_chunk<T>>>(max_no_chunks);
+
 		for (size_t i = 0; i < max_no_chunks; ++i)
-			chunks.push(memory_chunk<T>(new T[chunk_size], chunk_size));
+		{
+			own_data.push_back(new T[chunk_size]);
+			chunks->push(memory_chunk<T>(own_data.back(), chunk_size));
+		}
+	}
+
+	bool is_own(memory_chunk<T>& mc)
+	{
+		return find(own_data.begin(), own_data.end(), mc.data()) != own_data.end();
 	}
 
 public:
@@ -48,28 +70,16 @@ public:
 	}
 
 	CMemoryPool(const CMemoryPool<T>&) = delete;
-	
-	CMemoryPool(CMemoryPool<T>&& x)
-	{
-		lock_guard<mutex> lck(x.mtx);
-
-		chunks = move(x.chunks);
-		max_no_chunks = x.max_no_chunks;
-		chunk_size = x.chunk_size;
-
-		x.max_no_chunks = 0;
-		x.chunk_size = 0;
-	}
+	CMemoryPool(CMemoryPool<T>&& x) = delete;
 
 	~CMemoryPool()
 	{
 		deallocate();
 	}
 
+	// Not thread-safe (all chunks must be returned)
 	void Resize(size_t _max_no_chunks, size_t _chunk_size)
 	{
-		lock_guard<mutex> lck(mtx);
-
 		deallocate();
 
 		max_no_chunks = _max_no_chunks;
@@ -78,45 +88,85 @@ public:
 		allocate();
 	}
 
+	// Not thread-safe (all chunks must be returned)
 	void Clear()
 	{
-		lock_guard<mutex> lck(mtx);
-
 		deallocate();
 	}
 
 	size_t Capacity()
 	{
-		lock_guard<mutex> lck(mtx);
-
 		return max_no_chunks;
 	}
 
-	size_t AvailableChunks()
+	// Reading thread only
+	void Pop(memory_chunk<T>& mc)
 	{
-		lock_guard<mutex> lck(mtx);
+		if (spare.data())
+		{
+			mc = move(spare);
+			spare = memory_chunk<T>();
+			return;
+		}
+
+		if (chunks->try_pop(mc))
+			return;
 
-		return chunks.size();
+		CWaitTimer timer(CRunStats::counter_t::mem_pool_pop_wait_ns);
+		chunks->pop(mc);
 	}
 
-	void Pop(memory_chunk<T>& mc)
+	// Reading thread only; gives back a chunk taken by Pop()
+	void Unpop(memory_chunk<T>& mc)
+	{
+		spare = move(mc);
+		mc = memory_chunk<T>();
+	}
+
+	// Consuming thread only
+	void Push(memory_chunk<T>& mc)
 	{
-		unique_lock<mutex> lck(mtx);
+		if (!is_own(mc))
+		{
+			if (release_external)
+				release_external(mc);
+			mc = memory_chunk<T>();
 
-		cv.wait(lck, [&] {return !chunks.empty(); });
+			no_external.fetch_sub(1, memory_order_release);
+			no_external.notify_all();
+
+			return;
+		}
 
-		mc = move(chunks.top());
-		chunks.pop();
+		chunks->push(move(mc));
 	}
 
-	void Push(memory_chunk<T>& mc)
+	// Function called for each external chunk returned by Push(); set before the chunks are in flight
+	void SetExternalRelease(function<void(memory_chunk<T>&)> _release_external)
 	{
-		lock_guard<mutex> lck(mtx);
+		release_external = _release_external;
+	}
 
-		chunks.push(move(mc));
+	// Reading thread only; makes mc a view of external memory; waits while max_no_chunks external chunks are in flight
+	void PopExternal(memory_chunk<T>& mc, T* data, size_t size)
+	{
+		if (no_external.load(memory_order_acquire) >= max_no_chunks)
+		{
+			CWaitTimer timer(CRunStats::counter_t::mem_pool_pop_wait_ns);
+			spsc_wait_for(no_external, [this](uint64_t x) { return x < max_no_chunks; });
+		}
 
-		cv.notify_one();
+		no_external.fetch_add(1, memory_order_relaxed);
+
+		mc = memory_chunk<T>(data, size);
+		mc.resize(size);
+	}
+
+	// Reading thread only; waits until all external chunks are returned (e.g., before unmapping a file)
+	void WaitForExternal()
+	{
+		spsc_wait_for(no_external, [](uint64_t x) { return x == 0; });
 	}
 };
 
-// EOF
\ No newline at end of file
+// EOF
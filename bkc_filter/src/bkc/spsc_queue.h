@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cinttypes>
+#include <algorithm>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// *********************************************************************************************
+inline void spsc_cpu_relax()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	_mm_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+// *********************************************************************************************
+// No. of spins before parking; no spinning on a single core, as the other side cannot progress meanwhile
+inline uint32_t spsc_no_spins()
+{
+	static const uint32_t no_spins = thread::hardware_concurrency() > 1 ? 1 << 10 : 0;
+
+	return no_spins;
+}
+
+// *********************************************************************************************
+// Spins for a while (the other side is usually close to the hand-over) and then parks the thread
+// in atomic wait until pred(x) holds; the other side must notify x after each change
+template<typename PRED> void spsc_wait_for(const atomic<uint64_t>& x, PRED&& pred)
+{
+	for (uint32_t i = 0, no_spins = spsc_no_spins(); i < no_spins; ++i)
+	{
+		if (pred(x.load(memory_order_acquire)))
+			return;
+		spsc_cpu_relax();
+	}
+
+	while (true)
+	{
+		uint64_t v = x.load(memory_order_acquire);
+		if (pred(v))
+			return;
+		x.wait(v, memory_order_acquire);
+	}
+}
+
+// *********************************************************************************************
+// Bounded lock-free queue for exactly one producer and one consumer thread, e.g., a reading thread and its
+// counting/loading thread. Interface as in refresh::parallel_queue (push, pop, mark_completed), so it can be
+// used with timed_push/timed_pop. Each side keeps a cached copy of the other side's index, so in the common case
+// push/pop touch only their own cache line.
+template<typename T> class CSpscQueue
+{
+	static constexpr uint64_t completed_flag = 1ull << 63;
+
+	vector<T> slots;
+	uint64_t capacity;
+
+	alignas(64) atomic<uint64_t> head{ 0 };			// no. of popped items; written by the consumer
+	uint64_t cached_tail = 0;						// consumer's copy of tail
+
+	alignas(64) atomic<uint64_t> tail{ 0 };			// no. of pushed items (+ completed_flag); written by the producer
+	uint64_t cached_head = 0;						// producer's copy of head
+
+public:
+	explicit CSpscQueue(size_t _capacity) :
+		slots(max<size_t>(_capacity, 1)),
+		capacity(slots.size())
+	{}
+
+	CSpscQueue(const CSpscQueue&) = delete;
+	CSpscQueue& operator=(const CSpscQueue&) = delete;
+
+	// *********************************************************************************************
+	// Producer only; waits while the queue is full
+	void push(T&& x)
+	{
+		uint64_t t = tail.load(memory_order_relaxed) & ~completed_flag;
+
+		if (t - cached_head >= capacity)
+		{
+			spsc_wait_for(head, [t, this](uint64_t h) { return t - h < capacity; });
+			cached_head = head.load(memory_order_acquire);
+		}
+
+		slots[t % capacity] = move(x);
+
+		tail.store(t + 1, memory_order_release);
+		tail.notify_one();
+	}
+
+	// *********************************************************************************************
+	// Producer only; no push is allowed after it
+	void mark_completed()
+	{
+		tail.fetch_or(completed_flag, memory_order_release);
+		tail.notify_all();
+	}
+
+	// *********************************************************************************************
+	// Consumer only; waits while the queue is empty, returns false if it is empty and completed
+	bool pop(T& x)
+	{
+		uint64_t h = head.load(memory_order_relaxed);
+
+		if (h == cached_tail)
+		{
+			spsc_wait_for(tail, [h](uint64_t t) { return (t & completed_flag) || t != h; });
+			cached_tail = tail.load(memory_order_acquire) & ~completed_flag;
+
+			if (h == cached_tail)
+				return false;
+		}
+
+		x = move(slots[h % capacity]);
+
+		head.store(h + 1, memory_order_release);
+		head.notify_one();
+
+		return true;
+	}
+
+	// *********************************************************************************************
+	// Consumer only; returns false (immediately) if the queue is empty
+	bool try_pop(T& x)
+	{
+		uint64_t h = head.load(memory_order_relaxed);
+
+		if (h == cached_tail)
+		{
+			cached_tail = tail.load(memory_order_acquire) & ~completed_flag;
+
+			if (h == cached_tail)
+				return false;
+		}
+
+		x = move(slots[h % capacity]);
+
+		head.store(h + 1, memory_order_release);
+		head.notify_one();
+
+		return true;
+	}
+};
+
+// EOF
@@ -0,0 +1,572 @@
+#include "carrots.h"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <memory>
+#include <filesystem>
+#include <algorithm>
+
+#include <refresh/conversions/lib/conversions.h>
+#include "../common/utils.h"
+
+namespace fs = std::filesystem;
+
+// *********************************************************************************************
+bool CCarrots::SetParams(const CParams& _params)
+{
+	params = _params;
+
+	if (params.input_file_names.empty())
+	{
+		cerr << "No input files\n";
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+string CCarrots::split_name(const string& base_name, uint32_t split_id) const
+{
+	if (params.no_splits.get() > 1)
+		return base_name + "." + to_string(split_id);
+
+	return base_name;
+}
+
+// *********************************************************************************************
+// All inputs must be produced with the same k-mer lengths
+bool CCarrots::check_inputs()
+{
+	bool first = true;
+
+	for (const auto& base_name : params.input_file_names)
+		for (uint32_t i = 0; i < params.no_splits.get(); ++i)
+		{
+			string fn = split_name(base_name, i);
+			CBKCFile bkc_file;
+
+			if (!bkc_file.Open(fn))
+			{
+				cerr << "Cannot open: " << fn << endl;
+				return false;
+			}
+
+			uint8_t barcode_len, leader_len, follower_len, counter_size;
+			bkc_file.GetLens(barcode_len, leader_len, follower_len, counter_size);
+
+			if (first)
+			{
+				barcode_len_in_symbols = barcode_len;
+				leader_len_in_symbols = leader_len;
+				follower_len_in_symbols = follower_len;
+				first = false;
+			}
+			else if (barcode_len != barcode_len_in_symbols || leader_len != leader_len_in_symbols || follower_len != follower_len_in_symbols)
+			{
+				cerr << "Incompatible k-mer lengths in: " << fn << endl;
+				return false;
+			}
+		}
+
+	if (follower_len_in_symbols == 0)
+	{
+		cerr << "Inputs contain no followers (bkc must be run in pair mode)\n";
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Records of the split are collected up to max_run_mb; then they are sorted and summed and, unless this halved them,
+// stored as a run, so memory does not depend on the split size
+bool CCarrots::make_split_runs(uint32_t split_id, vector<bkc_record_t>& records)
+{
+	vector<bkc_record_t> frame_records;
+	size_t max_run_records = max<size_t>(((size_t) params.max_run_mb.get() << 20) / sizeof(bkc_record_t), 1);
+
+	records.clear();
+
+	auto flush = [&] {
+		sort_and_sum(records);
+
+		if (2 * records.size() >= max_run_records)
+		{
+			if (!store_run(split_id, records))
+				return false;
+			records.clear();
+		}
+
+		return true;
+	};
+
+	for (const auto& base_name : params.input_file_names)
+	{
+		string fn = split_name(base_name, split_id);
+		CBKCFile bkc_file;
+
+		if (!bkc_file.Open(fn))
+		{
+			cerr << "Cannot open: " << fn << endl;
+			return false;
+		}
+
+		if (bkc_file.IsIndexed())
+		{
+			for (size_t i = 0; i < bkc_file.GetFrames().size(); ++i)
+			{
+				if (!bkc_file.ReadFrame(i, frame_records))
+				{
+					cerr << "Cannot read frame " << i << " from: " << fn << endl;
+					return false;
+				}
+
+				for (const auto& rec : frame_records)
+				{
+					records.emplace_back(rec);
+					if (records.size() >= max_run_records && !flush())
+						return false;
+				}
+			}
+		}
+		else
+		{
+			bkc_record_t rec;
+
+			while (bkc_file.GetRecord(rec.sample_id, rec.barcode, rec.leader, rec.follower, rec.count))
+			{
+				records.emplace_back(rec);
+				if (records.size() >= max_run_records && !flush())
+					return false;
+			}
+		}
+	}
+
+	if (records.empty())
+		return true;
+
+	sort_and_sum(records);
+
+	return store_run(split_id, records);
+}
+
+// *********************************************************************************************
+// Sample ids are ignored, so counts of the same (cbc, leader, follower) are summed also over samples
+void CCarrots::sort_and_sum(vector<bkc_record_t>& records)
+{
+	sort(records.begin(), records.end(), [](const bkc_record_t& a, const bkc_record_t& b) {
+		if (a.barcode != b.barcode)
+			return a.barcode < b.barcode;
+		if (a.leader != b.leader)
+			return a.leader < b.leader;
+		return a.follower < b.follower;
+		});
+
+	size_t out = 0;
+
+	for (size_t i = 0; i < records.size(); ++out)
+	{
+		records[out] = records[i];
+		records[out].sample_id = 0;
+
+		for (++i; i < records.size() && records[i].barcode == records[out].barcode && records[i].leader == records[out].leader && records[i].follower == records[out].follower; ++i)
+			records[out].count += records[i].count;
+	}
+
+	records.resize(out);
+}
+
+// *********************************************************************************************
+// Runs are BKC files with sorted records (without sample id and with 8B counters)
+bool CCarrots::create_run(CBKCFile& run, const string& fn)
+{
+	run.SetParams(0, barcode_size_in_bytes(), leader_size_in_bytes(), follower_size_in_bytes(), 8,
+		barcode_len_in_symbols, leader_len_in_symbols, 0, follower_len_in_symbols, run_zstd_level);
+
+	if (!run.Create(fn, output_format_t::bkc))
+	{
+		cerr << "Cannot create: " << fn << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+void CCarrots::add_to_run(CBKCFile& run, const vector<bkc_record_t>& records)
+{
+	vector<uint8_t> packed, rec_prev, rec_curr;
+
+	for (size_t i = 0; i < records.size(); i += max_records_in_buffer)
+	{
+		packed.clear();
+		rec_prev.clear();
+
+		for (size_t j = i; j < min(records.size(), i + max_records_in_buffer); ++j)
+		{
+			rec_curr.clear();
+
+			append_int_msb(rec_curr, records[j].barcode, barcode_size_in_bytes());
+			append_int_msb(rec_curr, records[j].leader, leader_size_in_bytes());
+			append_int_msb(rec_curr, records[j].follower, follower_size_in_bytes());
+			append_int_msb(rec_curr, records[j].count, 8);
+
+			encode_shared_prefix(packed, rec_prev, rec_curr);
+
+			swap(rec_prev, rec_curr);
+		}
+
+		run.AddPacked(packed);
+	}
+}
+
+// *********************************************************************************************
+bool CCarrots::store_run(uint32_t split_id, vector<bkc_record_t>& records)
+{
+	CBKCFile run;
+
+	auto& split_run_file_names = run_file_names[split_id];
+	split_run_file_names.emplace_back(run_prefix + ".run." + to_string(split_id) + "." + to_string(split_run_file_names.size()) + ".bkc");
+
+	if (!create_run(run, split_run_file_names.back()))
+		return false;
+
+	add_to_run(run, records);
+
+	return run.Close();
+}
+
+// *********************************************************************************************
+// Splits are independent, so they are processed in parallel
+bool CCarrots::make_runs()
+{
+	run_prefix = (fs::path(params.tmp_path) / fs::path(params.output_file_name).filename()).string();
+
+	run_file_names.assign(params.no_splits.get(), {});
+
+	atomic<uint32_t> split_id{ 0 };
+	atomic<bool> ok{ true };
+
+	vector<thread> threads;
+	uint32_t no_threads = min(params.no_threads.get(), params.no_splits.get());
+
+	for (uint32_t i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+			vector<bkc_record_t> records;
+
+			while (ok)
+			{
+				uint32_t curr_id = split_id.fetch_add(1);
+				if (curr_id >= params.no_splits.get())
+					break;
+
+				if (!make_split_runs(curr_id, records))
+				{
+					ok = false;
+					break;
+				}
+			}
+			});
+
+	for (auto& t : threads)
+		t.join();
+
+	return ok;
+}
+
+// *********************************************************************************************
+// Marks targets present in all anchors of a CBC (only for CBCs with > 1 anchors)
+void CCarrots::filter_universal_targets(vector<leader_follower_count_t>& lfc, vector<uint64_t>& universal)
+{
+	universal.clear();
+
+	size_t no_anchors = 0;
+	for (size_t i = 0; i < lfc.size(); ++i)
+		if (i == 0 || lfc[i].leader != lfc[i - 1].leader)
+			++no_anchors;
+
+	if (no_anchors < 2)
+		return;
+
+	// (leader, follower) pairs are unique, so the no. of occurrences of a follower is its no. of anchors
+	vector<uint64_t> followers;
+	followers.reserve(lfc.size());
+	for (const auto& x : lfc)
+		followers.emplace_back(x.follower);
+
+	sort(followers.begin(), followers.end());
+
+	for (size_t i = 0; i < followers.size(); )
+	{
+		size_t j = i + 1;
+		while (j < followers.size() && followers[j] == followers[i])
+			++j;
+
+		if (j - i == no_anchors)
+			universal.emplace_back(followers[i]);
+
+		i = j;
+	}
+}
+
+// *********************************************************************************************
+// FASTA record: >CBC, then the concatenation of [anchor][targets of the anchor] over all anchors
+void CCarrots::write_fasta_record(FILE* f_out, uint64_t cbc, vector<leader_follower_count_t>& lfc, string& seq)
+{
+	thread_local vector<uint64_t> universal;
+	char kmer[64];
+
+	filter_universal_targets(lfc, universal);
+
+	seq.clear();
+	seq.push_back('>');
+	seq.append(kmer, refresh::kmer_to_pchar(cbc, kmer, barcode_len_in_symbols, false, '\n'));
+
+	for (size_t i = 0; i < lfc.size(); )
+	{
+		size_t j = i + 1;
+		while (j < lfc.size() && lfc[j].leader == lfc[i].leader)
+			++j;
+
+		sort(lfc.begin() + i, lfc.begin() + j, [](const leader_follower_count_t& a, const leader_follower_count_t& b) {
+			if (a.count != b.count)
+				return a.count > b.count;
+			return a.follower < b.follower;
+			});
+
+		seq.append(kmer, refresh::kmer_to_pchar(lfc[i].leader, kmer, leader_len_in_symbols, false));
+
+		for (size_t k = i; k < j; ++k)
+			if (!binary_search(universal.begin(), universal.end(), lfc[k].follower))
+				seq.append(kmer, refresh::kmer_to_pchar(lfc[k].follower, kmer, follower_len_in_symbols, false));
+
+		i = j;
+	}
+
+	seq.push_back('\n');
+
+	fwrite(seq.data(), 1, seq.size(), f_out);
+}
+
+// *********************************************************************************************
+// K-way merge of runs: fun(rec) gets the records in (cbc, leader, follower) order; the same key can come from
+// many runs (e.g., if the split function differs between inputs), so the caller sums them
+template<typename FUN> bool CCarrots::merge_run_files(const vector<string>& file_names, FUN&& fun)
+{
+	struct run_reader_t {
+		CBKCFile file;
+		bkc_record_t rec;
+
+		bool next()
+		{
+			return file.GetRecord(rec.sample_id, rec.barcode, rec.leader, rec.follower, rec.count);
+		}
+	};
+
+	vector<unique_ptr<run_reader_t>> runs;
+
+	for (const auto& fn : file_names)
+	{
+		runs.emplace_back(make_unique<run_reader_t>());
+
+		if (!runs.back()->file.Open(fn, run_read_buffer_size))
+		{
+			cerr << "Cannot open: " << fn << endl;
+			return false;
+		}
+	}
+
+	auto heap_cmp = [&](uint32_t a, uint32_t b) {
+		const auto& ra = runs[a]->rec;
+		const auto& rb = runs[b]->rec;
+
+		if (ra.barcode != rb.barcode)
+			return ra.barcode > rb.barcode;
+		if (ra.leader != rb.leader)
+			return ra.leader > rb.leader;
+		return ra.follower > rb.follower;
+	};
+
+	priority_queue<uint32_t, vector<uint32_t>, decltype(heap_cmp)> heap(heap_cmp);
+
+	for (uint32_t i = 0; i < runs.size(); ++i)
+		if (runs[i]->next())
+			heap.push(i);
+
+	while (!heap.empty())
+	{
+		uint32_t id = heap.top();
+		heap.pop();
+
+		fun(runs[id]->rec);
+
+		if (runs[id]->next())
+			heap.push(id);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Merges a group of runs into a single run (with counts of the same key summed)
+bool CCarrots::merge_run_group(const vector<string>& file_names, const string& out_file_name)
+{
+	CBKCFile run;
+
+	if (!create_run(run, out_file_name))
+		return false;
+
+	vector<bkc_record_t> records;
+
+	bool ok = merge_run_files(file_names, [&](const bkc_record_t& rec) {
+		if (!records.empty() && records.back().barcode == rec.barcode && records.back().leader == rec.leader && records.back().follower == rec.follower)
+		{
+			records.back().count += rec.count;
+			return;
+		}
+
+		// The last record is kept, as the next one can have the same key
+		if ((int) records.size() > max_records_in_buffer)
+		{
+			bkc_record_t tmp = records.back();
+			records.pop_back();
+			add_to_run(run, records);
+			records.assign(1, tmp);
+		}
+
+		records.emplace_back(rec);
+		});
+
+	add_to_run(run, records);
+
+	return run.Close() && ok;
+}
+
+// *********************************************************************************************
+// Runs are merged in passes of at most max_merge_fan_in runs (groups in parallel), so the no. of open files
+// and their buffers are bounded whatever the no. of runs is
+bool CCarrots::reduce_runs()
+{
+	merge_file_names.clear();
+	for (const auto& split_run_file_names : run_file_names)
+		merge_file_names.insert(merge_file_names.end(), split_run_file_names.begin(), split_run_file_names.end());
+
+	for (uint32_t pass = 0; merge_file_names.size() > max_merge_fan_in; ++pass)
+	{
+		uint32_t no_groups = (uint32_t) ((merge_file_names.size() + max_merge_fan_in - 1) / max_merge_fan_in);
+		vector<string> out_file_names;
+
+		for (uint32_t i = 0; i < no_groups; ++i)
+			out_file_names.emplace_back(run_prefix + ".merge." + to_string(pass) + "." + to_string(i) + ".bkc");
+
+		atomic<uint32_t> group_id{ 0 };
+		atomic<bool> ok{ true };
+
+		vector<thread> threads;
+		uint32_t no_threads = min(params.no_threads.get(), no_groups);
+
+		for (uint32_t i = 0; i < no_threads; ++i)
+			threads.emplace_back([&] {
+				while (ok)
+				{
+					uint32_t curr_id = group_id.fetch_add(1);
+					if (curr_id >= no_groups)
+						break;
+
+					auto first = merge_file_names.begin() + (size_t) curr_id * max_merge_fan_in;
+					auto last = merge_file_names.begin() + min<size_t>((size_t) (curr_id + 1) * max_merge_fan_in, merge_file_names.size());
+
+					if (!merge_run_group(vector<string>(first, last), out_file_names[curr_id]))
+						ok = false;
+				}
+				});
+
+		for (auto& t : threads)
+			t.join();
+
+		error_code ec;
+		for (const auto& fn : merge_file_names)
+			fs::remove(fn, ec);
+
+		merge_file_names.swap(out_file_names);
+
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CCarrots::merge_runs()
+{
+	if (!reduce_runs())
+		return false;
+
+	FILE* f_out = fopen(params.output_file_name.c_str(), "wb");
+	if (!f_out)
+	{
+		cerr << "Cannot open: " << params.output_file_name << endl;
+		return false;
+	}
+
+	setvbuf(f_out, nullptr, _IOFBF, 16 << 20);
+
+	vector<leader_follower_count_t> lfc;
+	string seq;
+	uint64_t curr_cbc = 0;
+
+	bool ok = merge_run_files(merge_file_names, [&](const bkc_record_t& rec) {
+		if (!lfc.empty() && rec.barcode != curr_cbc)
+		{
+			write_fasta_record(f_out, curr_cbc, lfc, seq);
+			lfc.clear();
+		}
+
+		curr_cbc = rec.barcode;
+
+		if (!lfc.empty() && lfc.back().leader == rec.leader && lfc.back().follower == rec.follower)
+			lfc.back().count += rec.count;
+		else
+			lfc.push_back({ rec.leader, rec.follower, rec.count });
+		});
+
+	if (!lfc.empty())
+		write_fasta_record(f_out, curr_cbc, lfc, seq);
+
+	fclose(f_out);
+
+	return ok;
+}
+
+// *********************************************************************************************
+void CCarrots::remove_runs()
+{
+	error_code ec;
+
+	for (const auto& split_run_file_names : run_file_names)
+		for (const auto& fn : split_run_file_names)
+			fs::remove(fn, ec);
+
+	for (const auto& fn : merge_file_names)
+		fs::remove(fn, ec);
+}
+
+// *********************************************************************************************
+bool CCarrots::Run()
+{
+	if (!check_inputs())
+		return false;
+
+	bool ok = make_runs() && merge_runs();
+
+	remove_runs();
+
+	return ok;
+}
+
+// EOF
@@ -0,0 +1,70 @@
+#pragma once
+#include "params.h"
+
+#include <cstdio>
+#include <vector>
+#include <string>
+
+#include "../common/bkc_file.h"
+
+// *********************************************************************************************
+// Native replacement of the dump | sort | carrots_ultra.py pipeline:
+// 1. records of each split (of all inputs) are sorted by (cbc, leader, follower) with duplicates summed and stored
+//    as binary runs of bounded size (max_run_mb per thread; a large split gives many runs),
+// 2. runs are k-way merged (in passes of at most max_merge_fan_in runs), so records of a single CBC come together (in leader order),
+// 3. targets present in all anchors of a CBC (if it has > 1 anchors) are dropped and the FASTA record is written.
+// Within an anchor the targets are ordered by count (desc.), then by target, as in `sort -k1,1 -k2,2 -k4,4nr`
+class CCarrots
+{
+	const int max_records_in_buffer = 128 << 10;
+	const uint32_t run_zstd_level = 1;
+	const size_t max_merge_fan_in = 32;
+	const size_t run_read_buffer_size = 1 << 20;
+
+	struct leader_follower_count_t {
+		uint64_t leader;
+		uint64_t follower;
+		uint64_t count;
+	};
+
+	CParams params;
+
+	uint8_t barcode_len_in_symbols = 0;
+	uint8_t leader_len_in_symbols = 0;
+	uint8_t follower_len_in_symbols = 0;
+
+	string run_prefix;
+	vector<vector<string>> run_file_names;		// per split (each split is processed by a single thread)
+	vector<string> merge_file_names;			// runs left for the final merge
+
+	uint8_t barcode_size_in_bytes() const { return (barcode_len_in_symbols + 3) / 4; }
+	uint8_t leader_size_in_bytes() const { return (leader_len_in_symbols + 3) / 4; }
+	uint8_t follower_size_in_bytes() const { return (follower_len_in_symbols + 3) / 4; }
+
+	string split_name(const string& base_name, uint32_t split_id) const;
+	bool check_inputs();
+
+	bool make_split_runs(uint32_t split_id, vector<bkc_record_t>& records);
+	void sort_and_sum(vector<bkc_record_t>& records);
+	bool create_run(CBKCFile& run, const string& fn);
+	void add_to_run(CBKCFile& run, const vector<bkc_record_t>& records);
+	bool store_run(uint32_t split_id, vector<bkc_record_t>& records);
+	bool make_runs();
+
+	template<typename FUN> bool merge_run_files(const vector<string>& file_names, FUN&& fun);
+	bool merge_run_group(const vector<string>& file_names, const string& out_file_name);
+	bool reduce_runs();
+	bool merge_runs();
+	void filter_universal_targets(vector<leader_follower_count_t>& lfc, vector<uint64_t>& universal);
+	void write_fasta_record(FILE* f_out, uint64_t cbc, vector<leader_follower_count_t>& lfc, string& seq);
+
+	void remove_runs();
+
+public:
+	CCarrots() = default;
+
+	bool SetParams(const CParams& _params);
+	bool Run();
+};
+
+// EOF
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+#include "../common/defs.h"
+
+// *********************************************************************************************
+struct CParams
+{
+	param_t<uint32_t> no_splits{ 1, 256, 1 };
+	param_t<uint32_t> no_threads{ 1, 256, 8 };
+	param_t<uint32_t> max_run_mb{ 1, 1 << 20, 1024 };
+	vector<string> input_file_names{ };
+	string output_file_name{ "./carrots.fasta" };
+	string tmp_path{ "./" };
+};
+
+// EOF
@@ -18,9 +18,12 @@ void usage()
         << "Usage:\n"
         << "    bxc-dump [options]\n"
         << "    --input_name <file_name> - BKC file name\n"
-//        << "    --n_threads <int> - no. threads " << params.no_threads.str() << endl
+        << "    --n_threads <int> - no. threads " << params.no_threads.str() << endl
         << "    --output_name <file_name> - output file name (default: " << params.output_file_name << ")\n"
-        << "    --n_splits <int> - no. splits " << params.no_splits.str() << endl;
+        << "    --per_split_output - separate output file for each split (<output_name>.<split_id>)\n"
+        << "    --n_splits <int> - no. splits " << params.no_splits.str() << endl
+        << "    --cbc <string> - dump only records of given CBC\n"
+        << "    --leader <string> - dump only records of given leader (anchor)\n";
 }
 
 // *********************************************************************************************
@@ -36,14 +39,18 @@ bool parse_args(int argc, char** argv)
 				return false;
 			}
 		}
-/*		else if (argv[i] == "--n_threads"s && i + 1 < argc)
+		else if (argv[i] == "--n_threads"s && i + 1 < argc)
 		{
 			if (!params.no_threads.set(atoi(argv[++i])))
 			{
 				cerr << "Incorrect value for n_threads: " << argv[i] << endl;
 				return false;
 			}
-		}*/
+		}
+		else if (argv[i] == "--per_split_output"s)
+		{
+			params.per_split_output = true;
+		}
 		else if (argv[i] == "--input_name"s && i + 1 < argc)
 		{
 			params.input_file_name = argv[++i];
@@ -52,6 +59,14 @@ bool parse_args(int argc, char** argv)
 		{
 			params.output_file_name = argv[++i];
 		}
+		else if (argv[i] == "--cbc"s && i + 1 < argc)
+		{
+			params.cbc_filter = argv[++i];
+		}
+		else if (argv[i] == "--leader"s && i + 1 < argc)
+		{
+			params.leader_filter = argv[++i];
+		}
 		else
 		{
 			cerr << "Unknown parameter: " << argv[i] << endl;
@@ -76,8 +91,11 @@ int main(int argc, char **argv)
 
 	CDumper dumper;
 
-	dumper.SetParams(params);
-	dumper.Dump();
+	if (!dumper.SetParams(params))
+		return 1;
+
+	if (!dumper.Dump())
+		return 1;
 
     return 0;
 }
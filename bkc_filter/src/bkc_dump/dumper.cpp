@@ -1,6 +1,7 @@
 #include "dumper.h"
 
 #include <string>
+#include <thread>
 
 #include <refresh/conversions/lib/conversions.h>
 #include "../common/bkc_file.h"
@@ -10,68 +11,410 @@ bool CDumper::SetParams(const CParams& _params)
 {
 	params = _params;
 
+	use_cbc_filter = !params.cbc_filter.empty();
+	use_leader_filter = !params.leader_filter.empty();
+
+	if (use_cbc_filter && !encode_kmer(params.cbc_filter, cbc_filter))
+	{
+		cerr << "Incorrect CBC: " << params.cbc_filter << endl;
+		return false;
+	}
+
+	if (use_leader_filter && !encode_kmer(params.leader_filter, leader_filter))
+	{
+		cerr << "Incorrect leader: " << params.leader_filter << endl;
+		return false;
+	}
+
 	return true;
 }
 
 // *********************************************************************************************
-bool CDumper::Dump()
+// 2 bits per symbol (A, C, G, T), the first symbol is the most significant one
+bool CDumper::encode_kmer(const string& str, uint64_t& kmer)
 {
-	FILE* f_out = fopen(params.output_file_name.c_str(), "wb");
+	if (str.size() > 32)
+		return false;
 
-	if (!f_out)
+	kmer = 0;
+
+	for (auto c : str)
 	{
-		cerr << "Cannot open: " << params.output_file_name << endl;
-		return false;
+		kmer <<= 2;
+
+		switch (c)
+		{
+		case 'A': case 'a':	kmer += 0;	break;
+		case 'C': case 'c':	kmer += 1;	break;
+		case 'G': case 'g':	kmer += 2;	break;
+		case 'T': case 't':	kmer += 3;	break;
+		default:
+			return false;
+		}
 	}
 
-	setvbuf(f_out, nullptr, _IOFBF, 16 << 20);
+	return true;
+}
 
-	char line[1024];
+// *********************************************************************************************
+char* CDumper::format_record(char* p, uint64_t sample_id, uint64_t cbc, uint64_t leader, uint64_t follower, uint64_t counter,
+	uint8_t barcode_len_in_symbols, uint8_t leader_len_in_symbols, uint8_t follower_len_in_symbols)
+{
+	p += refresh::int_to_pchar(sample_id, p, '\t');
+	p += refresh::kmer_to_pchar(cbc, p, barcode_len_in_symbols, false, '\t');
+	p += refresh::kmer_to_pchar(leader, p, leader_len_in_symbols, false, '\t');
+	if (follower_len_in_symbols)
+		p += refresh::kmer_to_pchar(follower, p, follower_len_in_symbols, false, '\t');
+	p += refresh::int_to_pchar(counter, p, '\n');
+
+	return p;
+}
+
+// *********************************************************************************************
+bool CDumper::frame_may_match(const bkc_frame_desc_t& frame) const
+{
+	if (use_cbc_filter && use_leader_filter)
+		return frame.may_contain(cbc_filter, leader_filter);
+	if (use_cbc_filter)
+		return frame.may_contain_barcode(cbc_filter);
+	if (use_leader_filter)
+		return frame.may_contain_leader(leader_filter);
+
+	return true;
+}
+
+// *********************************************************************************************
+string CDumper::split_name(const string& base_name, uint32_t split_id) const
+{
+	if (params.no_splits.get() > 1)
+		return base_name + "." + to_string(split_id);
+
+	return base_name;
+}
+
+// *********************************************************************************************
+// Reads indexes of all splits; files are closed here and reopened on demand by workers
+bool CDumper::prepare_tasks()
+{
+	tasks.clear();
+	splits.clear();
 
 	for (uint32_t i = 0; i < params.no_splits.get(); ++i)
 	{
-		CBKCFile bkc_file;
-		string fn = params.input_file_name;
+		splits.emplace_back(make_unique<split_desc_t>());
+		auto& split = *splits.back();
 
-		uint8_t barcode_len_in_symbols;
-		uint8_t leader_len_in_symbols;
-		uint8_t follower_len_in_symbols;
-		uint8_t counter_size_in_bytes;
+		split.file_name = split_name(params.input_file_name, i);
 
-		if (params.no_splits.get() > 1)
-			fn += "." + to_string(i);
+		CBKCFile bkc_file;
+		uint8_t counter_size_in_bytes;
 
-		if (!bkc_file.Open(fn))
+		if (!bkc_file.Open(split.file_name))
 		{
-			cerr << "Cannot open: " << fn << endl;
-			fclose(f_out);
+			cerr << "Cannot open: " << split.file_name << endl;
 			return false;
 		}
 
-		bkc_file.GetLens(barcode_len_in_symbols, leader_len_in_symbols, follower_len_in_symbols, counter_size_in_bytes);
+		bkc_file.GetLens(split.barcode_len_in_symbols, split.leader_len_in_symbols, split.follower_len_in_symbols, counter_size_in_bytes);
+
+		if (bkc_file.IsIndexed())
+		{
+			// Indexed (v2) files allow to skip frames that cannot contain the requested records
+			const auto& frames = bkc_file.GetFrames();
+
+			for (size_t j = 0; j < frames.size(); ++j)
+				if (frames[j].no_records && frame_may_match(frames[j]))
+				{
+					tasks.push_back({ i, (int64_t)j });
+					++split.no_remaining_tasks;
+				}
+		}
+		else
+		{
+			tasks.push_back({ i, -1 });
+			++split.no_remaining_tasks;
+		}
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Tasks are taken in order, so only a few splits are open at the same time
+CBKCFile* CDumper::acquire_split(uint32_t split_id)
+{
+	lock_guard<mutex> lck(mtx);
+
+	auto& split = *splits[split_id];
+
+	if (!split.bkc_file)
+	{
+		split.bkc_file = make_shared<CBKCFile>();
+		if (!split.bkc_file->Open(split.file_name))
+		{
+			cerr << "Cannot open: " << split.file_name << endl;
+			split.bkc_file.reset();
+			return nullptr;
+		}
+	}
+
+	return split.bkc_file.get();
+}
+
+// *********************************************************************************************
+void CDumper::release_split(uint32_t split_id)
+{
+	auto& split = *splits[split_id];
+
+	if (--split.no_remaining_tasks == 0)
+	{
+		lock_guard<mutex> lck(mtx);
+		split.bkc_file.reset();
+	}
+}
+
+// *********************************************************************************************
+void CDumper::push_chunk(size_t task_id, vector<char>& chunk, bool done)
+{
+	{
+		unique_lock<mutex> lck(mtx);
+
+		// Tasks ahead of the writer must not buffer an unbounded amount of text (e.g., whole v1 splits)
+		if (!done)
+			cv_space.wait(lck, [&] { return failed || task_id == no_written_tasks || buffered_bytes < max_buffered_bytes; });
+
+		auto& out = task_outputs[task_id];
+
+		buffered_bytes += chunk.size();
+		if (!chunk.empty())
+			out.chunks.emplace_back(move(chunk));
+		out.done = done;
+	}
+
+	cv_output.notify_one();
+
+	chunk = vector<char>();
+	chunk.reserve(chunk_size + 1024);
+}
+
+// *********************************************************************************************
+bool CDumper::run_task(size_t task_id, vector<char>& chunk)
+{
+	const auto& task = tasks[task_id];
+	const auto& split = *splits[task.split];
+
+	auto bkc_file = acquire_split(task.split);
+	if (!bkc_file)
+		return false;
+
+	char line[1024];
+
+	auto add_record = [&](uint64_t sample_id, uint64_t cbc, uint64_t leader, uint64_t follower, uint64_t counter) {
+		char* p = format_record(line, sample_id, cbc, leader, follower, counter, split.barcode_len_in_symbols, split.leader_len_in_symbols, split.follower_len_in_symbols);
+		chunk.insert(chunk.end(), line, p);
 
+		if (chunk.size() >= chunk_size)
+			push_chunk(task_id, chunk, false);
+	};
+
+	bool ok = true;
+
+	if (task.frame >= 0)
+	{
+		thread_local vector<bkc_record_t> records;
+
+		if (bkc_file->ReadFrame(task.frame, records))
+		{
+			for (const auto& x : records)
+				if (accept(x.barcode, x.leader))
+					add_record(x.sample_id, x.barcode, x.leader, x.follower, x.count);
+		}
+		else
+		{
+			cerr << "Cannot read frame " << task.frame << " from: " << split.file_name << endl;
+			ok = false;
+		}
+	}
+	else
+	{
 		uint64_t sample_id;
 		cbc_t cbc;
 		leader_t leader;
 		follower_t follower;
 		uint64_t counter;
 
-		while (bkc_file.GetRecord(sample_id, cbc, leader, follower, counter))
+		while (bkc_file->GetRecord(sample_id, cbc, leader, follower, counter))
+			if (accept(cbc, leader))
+				add_record(sample_id, cbc, leader, follower, counter);
+	}
+
+	push_chunk(task_id, chunk, true);
+	release_split(task.split);
+
+	return ok;
+}
+
+// *********************************************************************************************
+void CDumper::worker()
+{
+	vector<char> chunk;
+	chunk.reserve(chunk_size + 1024);
+
+	while (true)
+	{
+		size_t task_id;
+
+		{
+			unique_lock<mutex> lck(mtx);
+			cv_space.wait(lck, [this] { return failed || next_task >= tasks.size() || next_task < no_written_tasks + max_tasks_in_flight; });
+
+			if (failed || next_task >= tasks.size())
+				break;
+
+			task_id = next_task++;
+		}
+
+		if (!run_task(task_id, chunk))
+		{
+			{
+				lock_guard<mutex> lck(mtx);
+				failed = true;
+			}
+			cv_output.notify_all();
+			cv_space.notify_all();
+			break;
+		}
+	}
+}
+
+// *********************************************************************************************
+// Chunks are written in task order, so the output does not depend on the no. of threads
+bool CDumper::write_outputs()
+{
+	FILE* f_out = nullptr;
+	uint32_t f_out_split = 0;
+
+	auto open_output = [&](uint32_t split_id) {
+		string fn = params.per_split_output ? split_name(params.output_file_name, split_id) : params.output_file_name;
+
+		f_out = fopen(fn.c_str(), "wb");
+		if (!f_out)
+		{
+			cerr << "Cannot open: " << fn << endl;
+			return false;
+		}
+
+		setvbuf(f_out, nullptr, _IOFBF, 16 << 20);
+		f_out_split = split_id;
+
+		return true;
+	};
+
+	// Files are created also for splits without any records
+	uint32_t no_created_outputs = 0;
+	auto create_outputs_up_to = [&](uint32_t split_id) {
+		for (; no_created_outputs <= split_id; ++no_created_outputs)
 		{
-			char* p = line;
+			if (f_out)
+				fclose(f_out);
+			f_out = nullptr;
 
-			p += refresh::int_to_pchar(sample_id, p, '\t');
-			p += refresh::kmer_to_pchar(cbc, p, barcode_len_in_symbols, false, '\t');
-			p += refresh::kmer_to_pchar(leader, p, leader_len_in_symbols, false, '\t');
-			if (follower_len_in_symbols)
-				p += refresh::kmer_to_pchar(follower, p, follower_len_in_symbols, false, '\t');
-			p += refresh::int_to_pchar(counter, p, '\n');
+			if (!open_output(no_created_outputs))
+				return false;
+		}
+
+		return true;
+	};
+
+	if (!create_outputs_up_to(0))
+		return false;
+
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		if (params.per_split_output && tasks[i].split != f_out_split && !create_outputs_up_to(tasks[i].split))
+			return false;
+
+		while (true)
+		{
+			vector<vector<char>> chunks;
+			bool done;
+
+			{
+				unique_lock<mutex> lck(mtx);
+				cv_output.wait(lck, [&] { return failed || !task_outputs[i].chunks.empty() || task_outputs[i].done; });
+
+				if (failed)
+				{
+					fclose(f_out);
+					return false;
+				}
+
+				swap(chunks, task_outputs[i].chunks);
+				done = task_outputs[i].done;
+
+				for (const auto& chunk : chunks)
+					buffered_bytes -= chunk.size();
+			}
+			cv_space.notify_all();
+
+			for (auto& chunk : chunks)
+				fwrite(chunk.data(), 1, chunk.size(), f_out);
+
+			if (done)
+				break;
+		}
 
-			fwrite(line, 1, p - line, f_out);
+		{
+			lock_guard<mutex> lck(mtx);
+			++no_written_tasks;
 		}
+		cv_space.notify_all();
 	}
 
+	if (params.per_split_output && !create_outputs_up_to(params.no_splits.get() - 1))
+		return false;
+
 	fclose(f_out);
 
 	return true;
 }
+
+// *********************************************************************************************
+bool CDumper::Dump()
+{
+	if (!prepare_tasks())
+		return false;
+
+	uint32_t no_threads = max(params.no_threads.get(), 1u);
+
+	task_outputs.clear();
+	task_outputs.resize(tasks.size());
+	next_task = 0;
+	no_written_tasks = 0;
+	max_tasks_in_flight = 4 * no_threads;
+	buffered_bytes = 0;
+	max_buffered_bytes = 4 * no_threads * chunk_size;
+	failed = false;
+
+	vector<thread> threads;
+	threads.reserve(no_threads);
+
+	for (uint32_t i = 0; i < no_threads; ++i)
+		threads.emplace_back([this] { worker(); });
+
+	bool ok = write_outputs();
+
+	if (!ok)
+	{
+		{
+			lock_guard<mutex> lck(mtx);
+			failed = true;
+		}
+		cv_space.notify_all();
+	}
+
+	for (auto& t : threads)
+		t.join();
+
+	return ok && !failed;
+}
@@ -1,15 +1,84 @@
 #pragma once
 #include "params.h"
 
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "../common/bkc_file.h"
+
 class CDumper
 {
+	const size_t chunk_size = 8 << 20;				// size of text buffers passed to the writer
+
+	// Unit of work: a single frame of an indexed (v2) file or the whole split for v1 files
+	struct dump_task_t {
+		uint32_t split;
+		int64_t frame;					// -1 means sequential reading of the whole split
+	};
+
+	struct task_output_t {
+		vector<vector<char>> chunks;
+		bool done = false;
+	};
+
+	struct split_desc_t {
+		string file_name;
+		shared_ptr<CBKCFile> bkc_file;
+		atomic<uint64_t> no_remaining_tasks{ 0 };
+		uint8_t barcode_len_in_symbols;
+		uint8_t leader_len_in_symbols;
+		uint8_t follower_len_in_symbols;
+	};
+
 	CParams params;
 
-//	bool open_file()
+	bool use_cbc_filter = false;
+	bool use_leader_filter = false;
+	uint64_t cbc_filter = 0;
+	uint64_t leader_filter = 0;
+
+	vector<dump_task_t> tasks;
+	vector<unique_ptr<split_desc_t>> splits;
+
+	// Ordered output: workers may run ahead of the writer by at most max_tasks_in_flight tasks
+	mutex mtx;
+	condition_variable cv_output;
+	condition_variable cv_space;
+	vector<task_output_t> task_outputs;
+	size_t next_task = 0;
+	size_t no_written_tasks = 0;
+	size_t max_tasks_in_flight = 0;
+	size_t buffered_bytes = 0;
+	size_t max_buffered_bytes = 0;
+	bool failed = false;
+
+	bool encode_kmer(const string& str, uint64_t& kmer);
+	bool accept(uint64_t cbc, uint64_t leader) const
+	{
+		return (!use_cbc_filter || cbc == cbc_filter) && (!use_leader_filter || leader == leader_filter);
+	}
+
+	bool frame_may_match(const bkc_frame_desc_t& frame) const;
+
+	char* format_record(char* p, uint64_t sample_id, uint64_t cbc, uint64_t leader, uint64_t follower, uint64_t counter,
+		uint8_t barcode_len_in_symbols, uint8_t leader_len_in_symbols, uint8_t follower_len_in_symbols);
+
+	string split_name(const string& base_name, uint32_t split_id) const;
+	bool prepare_tasks();
+	CBKCFile* acquire_split(uint32_t split_id);
+	void release_split(uint32_t split_id);
+	void push_chunk(size_t task_id, vector<char>& chunk, bool done);
+	bool run_task(size_t task_id, vector<char>& chunk);
+	void worker();
+	bool write_outputs();
 
 public:
 	CDumper() = default;
 
 	bool SetParams(const CParams& _params);
 	bool Dump();
-};
\ No newline at end of file
+};
@@ -9,5 +9,8 @@ struct CParams
 	param_t<uint32_t> no_threads{ 0, 256, 8 };
 	string input_file_name{  };
 	string output_file_name{ "./results.txt" };
+	bool per_split_output = false;		// separate output file for each split
+	string cbc_filter{};				// dump only records of this CBC
+	string leader_filter{};				// dump only records of this leader (anchor)
 };
 
@@ -1,6 +1,7 @@
 #pragma once
 #include "../../shared/types/satc_data.h" // Adjusted the relative path to locate the file
 #include <unordered_set>
+#include <algorithm>
 #include <sstream>
 
 #include "../../libs/refresh/hash_tables/lib/hash_set.h"
@@ -148,10 +149,33 @@ class AcceptedAnchors {
 	refresh::bloom_set<uint64_t, refresh::MurMur64Hash, 2> bf_accepted_anchors;
 	refresh::hash_set_lp<uint64_t, std::equal_to<uint64_t>, refresh::MurMur64Hash> accepted_anchors;
 
+	// For short leaders all 4^leader_len anchors are directly indexed in a bitmap
+	std::vector<uint64_t> bm_accepted_anchors;
+	bool use_bitmap = false;
+
 	uint32_t leader_len;
+	uint64_t leader_mask;
 
 	bool use_filter = false;
 
+	// Several anchor panels (-d files) can be evaluated in one run: the structures above store their union
+	// and the panels containing an anchor are given as a bitmask (only for more than one panel).
+	// The masks are kept within the anchor lookup, so a single lookup gives both membership and mask:
+	// - bitmap: masks of anchors in their order, indexed by the rank of the anchor bit (prefix popcounts per word),
+	// - bloom+hash: (anchor, mask) entries of an open-addressing table replace the hash set.
+	uint32_t no_panels = 1;
+
+	struct masked_anchor_t {
+		uint64_t anchor;
+		uint64_t mask;				// 0 for empty slots
+	};
+
+	std::vector<uint32_t> bm_ranks;
+	std::vector<uint64_t> bm_panel_masks;
+
+	std::vector<masked_anchor_t> masked_anchors;
+	uint64_t masked_anchors_mask = 0;
+
 	void insert(const std::vector<uint64_t>& anchors)
 	{
 		bf_accepted_anchors.resize(anchors.size());
@@ -159,29 +183,195 @@ class AcceptedAnchors {
 
 		for (const auto anchor : anchors)
 		{
-			bf_accepted_anchors.insert(anchor);
-			accepted_anchors.insert(anchor);
+			uint64_t norm_a = anchor & leader_mask;
+			bf_accepted_anchors.insert(norm_a);
+			accepted_anchors.insert(norm_a);
 		}
 	}
 
+	void insert_bitmap(const std::vector<uint64_t>& anchors)
+	{
+		bm_accepted_anchors.assign((1ull << (2 * leader_len)) / 64 + 1, 0);
+
+		for (const auto anchor : anchors)
+		{
+			uint64_t norm_a = anchor & leader_mask;
+			bm_accepted_anchors[norm_a >> 6] |= 1ull << (norm_a & 63);
+		}
+	}
+
+	// anchors_masks: sorted by anchor, distinct anchors
+	void insert_masked_bitmap(const std::vector<std::pair<uint64_t, uint64_t>>& anchors_masks)
+	{
+		bm_accepted_anchors.assign((1ull << (2 * leader_len)) / 64 + 1, 0);
+		bm_panel_masks.reserve(anchors_masks.size());
+
+		for (const auto& x : anchors_masks)
+		{
+			bm_accepted_anchors[x.first >> 6] |= 1ull << (x.first & 63);
+			bm_panel_masks.emplace_back(x.second);
+		}
+
+		bm_ranks.resize(bm_accepted_anchors.size());
+
+		uint32_t rank = 0;
+		for (size_t i = 0; i < bm_accepted_anchors.size(); ++i)
+		{
+			bm_ranks[i] = rank;
+			rank += (uint32_t) __builtin_popcountll(bm_accepted_anchors[i]);
+		}
+	}
+
+	void insert_masked(const std::vector<std::pair<uint64_t, uint64_t>>& anchors_masks)
+	{
+		bf_accepted_anchors.resize(anchors_masks.size());
+
+		size_t size = 16;
+		while (size < 2 * anchors_masks.size())
+			size *= 2;
+
+		masked_anchors.assign(size, masked_anchor_t{ 0, 0 });
+		masked_anchors_mask = size - 1;
+
+		for (const auto& x : anchors_masks)
+		{
+			bf_accepted_anchors.insert(x.first);
+
+			size_t i = refresh::MurMur64Hash{}(x.first) & masked_anchors_mask;
+			while (masked_anchors[i].mask)
+				i = (i + 1) & masked_anchors_mask;
+
+			masked_anchors[i] = masked_anchor_t{ x.first, x.second };
+		}
+	}
+
+	// Panel mask of the normalized anchor (0 if not accepted); only for more than one panel
+	uint64_t find_mask(uint64_t norm_anchor) const
+	{
+		if (use_bitmap)
+		{
+			uint64_t word = bm_accepted_anchors[norm_anchor >> 6];
+			uint64_t bit = 1ull << (norm_anchor & 63);
+
+			if (!(word & bit))
+				return 0;
+
+			return bm_panel_masks[bm_ranks[norm_anchor >> 6] + __builtin_popcountll(word & (bit - 1))];
+		}
+
+		if (!bf_accepted_anchors.check(norm_anchor))
+			return 0;
+
+		for (size_t i = refresh::MurMur64Hash{}(norm_anchor) & masked_anchors_mask; masked_anchors[i].mask; i = (i + 1) & masked_anchors_mask)
+			if (masked_anchors[i].anchor == norm_anchor)
+				return masked_anchors[i].mask;
+
+		return 0;
+	}
+
 	public:
 	// accepted_anchors revised to handle right-shifting of characters like in bkc
-    AcceptedAnchors(const std::vector<uint64_t>& anchors, uint32_t leader_len_)
-        : leader_len(leader_len_) 
-    {
-        for (auto a : anchors) {
-            uint64_t norm_a = a & ((1ULL << (2 * leader_len)) - 1);
-            bf_accepted_anchors.insert(norm_a);
-            accepted_anchors.insert(norm_a);
-        }
-        use_filter = true;
-		
-    }
-
-    bool IsAccepted(uint64_t anchor) const {
-        uint64_t norm_anchor = anchor & ((1ULL << (2 * leader_len)) - 1);
-        return bf_accepted_anchors.check(norm_anchor) &&
-               accepted_anchors.check(norm_anchor);
-    }
+	// bitmap_max_len - max. leader len for which the bitmap (4^leader_len bits) is used instead of bloom+hash
+	AcceptedAnchors(const std::vector<uint64_t>& anchors, uint32_t leader_len_, uint32_t bitmap_max_len = 14)
+		: leader_len(leader_len_)
+	{
+		leader_mask = leader_len >= 32 ? ~0ull : (1ull << (2 * leader_len)) - 1;
+		use_bitmap = leader_len <= bitmap_max_len && leader_len < 32;
+
+		if (use_bitmap)
+			insert_bitmap(anchors);
+		else
+			insert(anchors);
+
+		use_filter = true;
+	}
+
+	// Anchors of panel i get bit i in the panel mask (max. 64 panels)
+	AcceptedAnchors(const std::vector<std::vector<uint64_t>>& panels, uint32_t leader_len_, uint32_t bitmap_max_len = 14)
+		: leader_len(leader_len_)
+	{
+		leader_mask = leader_len >= 32 ? ~0ull : (1ull << (2 * leader_len)) - 1;
+		use_bitmap = leader_len <= bitmap_max_len && leader_len < 32;
+		use_filter = true;
+
+		no_panels = (uint32_t) panels.size();
+
+		if (no_panels < 2)
+		{
+			auto anchors = merge_panels(panels, leader_len);
+
+			if (use_bitmap)
+				insert_bitmap(anchors);
+			else
+				insert(anchors);
+
+			return;
+		}
+
+		std::vector<std::pair<uint64_t, uint64_t>> anchors_masks;
+
+		for (uint32_t i = 0; i < no_panels; ++i)
+			for (const auto anchor : panels[i])
+				anchors_masks.emplace_back(anchor & leader_mask, 1ull << i);
+
+		std::sort(anchors_masks.begin(), anchors_masks.end());
+
+		size_t no_anchors = 0;
+		for (size_t i = 0; i < anchors_masks.size(); ++i)
+			if (no_anchors && anchors_masks[no_anchors - 1].first == anchors_masks[i].first)
+				anchors_masks[no_anchors - 1].second |= anchors_masks[i].second;
+			else
+				anchors_masks[no_anchors++] = anchors_masks[i];
+		anchors_masks.resize(no_anchors);
+
+		if (use_bitmap)
+			insert_masked_bitmap(anchors_masks);
+		else
+			insert_masked(anchors_masks);
+	}
+
+	static std::vector<uint64_t> merge_panels(const std::vector<std::vector<uint64_t>>& panels, uint32_t leader_len_)
+	{
+		uint64_t mask = leader_len_ >= 32 ? ~0ull : (1ull << (2 * leader_len_)) - 1;
+		std::vector<uint64_t> anchors;
+
+		for (const auto& panel : panels)
+			for (const auto anchor : panel)
+				anchors.emplace_back(anchor & mask);
+
+		std::sort(anchors.begin(), anchors.end());
+		anchors.erase(std::unique(anchors.begin(), anchors.end()), anchors.end());
+
+		return anchors;
+	}
+
+	bool IsAccepted(uint64_t anchor) const {
+		uint64_t norm_anchor = anchor & leader_mask;
+
+		if (use_bitmap)
+			return (bm_accepted_anchors[norm_anchor >> 6] >> (norm_anchor & 63)) & 1;
+
+		if (no_panels > 1)
+			return find_mask(norm_anchor) != 0;
+
+		return bf_accepted_anchors.check(norm_anchor) &&
+			accepted_anchors.check(norm_anchor);
+	}
+
+	bool UsesBitmap() const {
+		return use_bitmap;
+	}
+
+	uint32_t NoPanels() const {
+		return no_panels;
+	}
+
+	// Bitmask of panels containing the anchor (0 if not accepted)
+	uint64_t PanelMask(uint64_t anchor) const {
+		if (no_panels < 2)
+			return IsAccepted(anchor) ? 1 : 0;
+
+		return find_mask(anchor & leader_mask);
+	}
 };
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
  * - usage: Displays usage information and available options for the tool.
  * - load_predefined_cbc_visium: Loads predefined CBCs for Visium technology.
  * - load_predefined_cbc_plain: Loads predefined CBCs for plain technology.
+ * - load_predefined_cbc_binary / save_predefined_cbc_binary: Loads/stores prebuilt binary CBC whitelists.
  * - main: Entry point of the program, orchestrates the processing of barcoded reads.
  * 
  * Dependencies:
@@ -23,6 +24,7 @@
  #include <string>
  #include <iostream>
  #include <fstream>
+ #include <sstream>
  #include <cstdint>
  #include <regex>
  #include "processreads.h"
@@ -46,6 +48,11 @@ void CBarcodedCounter::init() {
  bool parse_args(int argc, char** argv);
  bool load_predefined_cbc_visium();
  bool load_predefined_cbc_plain();
+ bool is_predefined_cbc_binary(const string& fn);
+ bool load_predefined_cbc_binary();
+ bool save_predefined_cbc_binary();
+ bool load_input_list(const string& input_name);
+ bool load_batch_manifest();
  
  // remember to include in class definition
  bool load_strings(vector<string>& vec, const string& fn)
@@ -62,38 +69,49 @@ void CBarcodedCounter::init() {
      return true;
  }
  
- bool CBarcodedCounter::prepare_anchor_dict(const vector<string>& vec)
+ // Each vector is a separate anchor panel (-d file)
+ bool CBarcodedCounter::prepare_anchor_dict(const vector<vector<string>>& panels)
  {
-     vector<kmer_t> anchors;
-     anchors.reserve(vec.size());
+     vector<vector<kmer_t>> anchors(panels.size());
+
+     if (panels.size() > 64) {
+         cerr << "Error: Too many anchor panels (max. 64): " << panels.size() << endl;
+         return false;
+     }
  
-     for (const auto& s : vec)
+     for (size_t p = 0; p < panels.size(); ++p)
      {
-         if (s.size() != params.leader_len.get()) {
-             cerr << "Error: Wrong anchor length: " << s << endl;
-             return false;
-         }
+         const auto& vec = panels[p];
+         anchors[p].reserve(vec.size());
+
+         for (const auto& s : vec)
+         {
+             if (s.size() != params.leader_len.get()) {
+                 cerr << "Error: Wrong anchor length: " << s << endl;
+                 return false;
+             }
  
-         kmer_t anchor = 0;
-         for (auto c : s) {
-			kmer_t x = char2bits[(uint8_t) c];
-			if (x > 3)
-			{
-				cerr << "Error: Anchor contains strange symbols: " << s << endl;
-				return false;
+             kmer_t anchor = 0;
+             for (auto c : s) {
+				kmer_t x = char2bits[(uint8_t) c];
+				if (x > 3)
+				{
+					cerr << "Error: Anchor contains strange symbols: " << s << endl;
+					return false;
+				}
+
+				anchor <<= 2;
+				anchor += x;
 			}
+             anchors[p].emplace_back(anchor);
+         }
 
-			anchor <<= 2;
-			anchor += x;
-		}
-         anchors.emplace_back(anchor);
+         for (size_t i = 0; i < anchors[p].size() && i < 30; i++) {
+            cout << vec[i] << " => " << anchors[p][i] << endl;
+         }
      }
-
-     for (size_t i = 0; i < anchors.size() && i < 30; i++) {
-        cout << vec[i] << " => " << anchors[i] << endl;
-    }
  
-     accepted_anchors = make_shared<AcceptedAnchors>(anchors, params.leader_len.get());
+     accepted_anchors = make_shared<AcceptedAnchors>(anchors, params.leader_len.get(), params.anchor_bitmap_max_len.get());
      return true;
  }
  
@@ -103,7 +121,7 @@ void CBarcodedCounter::init() {
      // Parses command-line arguments and sets the parameters for processing.
      // Returns false if any argument is invalid or missing required values.
      string input_name;
-     string dict_name;
+     vector<string> dict_names;
  
      for (int i = 1; i < argc; ++i)
      {
@@ -132,7 +150,15 @@ void CBarcodedCounter::init() {
              }
          }
          else if (string(argv[i])== "-d" && i + 1 < argc) {
-             dict_name = argv[++i];
+             dict_names.emplace_back(argv[++i]);
+         }
+         else if (argv[i] == "--anchor_bitmap_max_len"s && i + 1 < argc)
+         {
+             if (!params.anchor_bitmap_max_len.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for anchor_bitmap_max_len: " << argv[i] << endl;
+                 return false;
+             }
          }
 
  
@@ -176,6 +202,30 @@ void CBarcodedCounter::init() {
                  return false;
              }
          }
+         else if (argv[i] == "--n_gz_threads"s && i + 1 < argc)
+         {
+             if (!params.no_gz_threads.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for n_gz_threads: " << argv[i] << endl;
+                 return false;
+             }
+         }
+         else if (argv[i] == "--block_queue_depth"s && i + 1 < argc)
+         {
+             if (!params.no_blocks_in_queue.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for block_queue_depth: " << argv[i] << endl;
+                 return false;
+             }
+         }
+         else if (argv[i] == "--n_chunks_per_reader"s && i + 1 < argc)
+         {
+             if (!params.no_chunks_per_reader.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for n_chunks_per_reader: " << argv[i] << endl;
+                 return false;
+             }
+         }
          else if (argv[i] == "--zstd_level"s && i + 1 < argc)
          {
              if (!params.zstd_level.set(atoi(argv[++i])))
@@ -200,6 +250,26 @@ void CBarcodedCounter::init() {
                  return false;
              }
          }
+         else if (argv[i] == "--filter_universal_targets"s)
+             params.filter_universal_targets = true;
+         else if (argv[i] == "--collapse_duplicate_reads"s)
+             params.collapse_duplicate_reads = true;
+         else if (argv[i] == "--min_leader_count"s && i + 1 < argc)
+         {
+             if (!params.min_leader_count.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for min_leader_count: " << argv[i] << endl;
+                 return false;
+             }
+         }
+         else if (argv[i] == "--leader_sketch_mb"s && i + 1 < argc)
+         {
+             if (!params.leader_sketch_mb.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for leader_sketch_mb: " << argv[i] << endl;
+                 return false;
+             }
+         }
          else if (argv[i] == "--cbc_filtering_thr"s && i + 1 < argc)
          {
              if (!params.cbc_filtering_thr.set(atoi(argv[++i])))
@@ -264,6 +334,24 @@ void CBarcodedCounter::init() {
              params.allow_strange_cbc_umi_reads = true;
          else if (argv[i] == "--input_name"s && i + 1 < argc)
              input_name = argv[++i];
+         else if (argv[i] == "--batch_manifest"s && i + 1 < argc)
+             params.batch_manifest_file_name = argv[++i];
+         else if (argv[i] == "--cbc_cache"s && i + 1 < argc)
+             params.cbc_cache_file_name = argv[++i];
+         else if (argv[i] == "--cbc_shard"s && i + 1 < argc)
+         {
+             uint32_t shard_id = 0, no_shards = 0;
+             char sep = 0;
+             istringstream iss(argv[++i]);
+
+             if (!(iss >> shard_id >> sep >> no_shards) || sep != '/' || !params.no_cbc_shards.set(no_shards) || shard_id >= no_shards)
+             {
+                 cerr << "Incorrect value for cbc_shard (expected i/N with i < N): " << argv[i] << endl;
+                 return false;
+             }
+
+             params.cbc_shard_id = shard_id;
+         }
          else if (argv[i] == "--technology"s && i + 1 < argc)
          {
              ++i;
@@ -286,6 +374,11 @@ void CBarcodedCounter::init() {
                  cerr << "Wrong value for input_format: " << argv[i] << endl;
                  return false;
              }
+             if (params.input_format == input_format_t::cram)
+             {
+                 cerr << "CRAM input is not supported, convert it to BAM first" << endl;
+                 return false;
+             }
          }
          else if (argv[i] == "--output_format"s && i + 1 < argc)
          {
@@ -297,6 +390,8 @@ void CBarcodedCounter::init() {
                  return false;
              }
          }
+         else if (argv[i] == "--sorted_output"s)
+             params.sorted_output = true;
          else if (argv[i] == "--mode"s && i + 1 < argc)
          {
              ++i;
@@ -307,8 +402,38 @@ void CBarcodedCounter::init() {
                  return false;
              }
          }
+         else if (argv[i] == "--max_ram"s && i + 1 < argc)
+         {
+             if (!params.max_ram.set(atoi(argv[++i])))
+             {
+                 cerr << "Incorrect value for max_ram: " << argv[i] << endl;
+                 return false;
+             }
+         }
+         else if (argv[i] == "--fused_pipeline"s)
+             params.fused_pipeline = true;
+         else if (argv[i] == "--numa"s)
+             params.numa = true;
+         else if (argv[i] == "--mmap_input"s)
+             params.mmap_input = true;
+         else if (argv[i] == "--stats_json"s && i + 1 < argc)
+             params.stats_json_file_name = argv[++i];
+         else if (argv[i] == "--tmp_path"s && i + 1 < argc)
+             params.tmp_path = argv[++i];
+         else if (argv[i] == "--pair_extraction"s && i + 1 < argc)
+         {
+             ++i;
+             params.pair_extraction = pair_extraction_from_string(argv[i]);
+             if (params.pair_extraction == pair_extraction_t::unknown)
+             {
+                 cerr << "Wrong value for pair_extraction: " << argv[i] << endl;
+                 return false;
+             }
+         }
          else if (argv[i] == "--predefined_cbc"s && i + 1 < argc)
              params.predefined_cbc_fn = argv[++i];
+         else if (argv[i] == "--save_predefined_cbc"s && i + 1 < argc)
+             params.save_predefined_cbc_fn = argv[++i];
          else
          {
              cerr << "Unknown parameter: " << argv[i] << endl;
@@ -316,12 +441,13 @@ void CBarcodedCounter::init() {
          }
      }
 
-     vector<string> ad;
-         if (!dict_name.empty()) {
-             if (!load_strings(ad, dict_name)) {
-                 cerr << "Error: Could not load dictionary file\n";
-                 return false;
-             }
+     vector<vector<string>> ad(dict_names.size());
+         if (!dict_names.empty()) {
+             for (size_t j = 0; j < dict_names.size(); ++j)
+                 if (!load_strings(ad[j], dict_names[j])) {
+                     cerr << "Error: Could not load dictionary file " << dict_names[j] << "\n";
+                     return false;
+                 }
              if (!CBarcodedCounter::prepare_anchor_dict(ad)) {
                  cerr << "Error: Failed to process dictionary\n";
                  return false;
@@ -329,9 +455,9 @@ void CBarcodedCounter::init() {
          }
  
      // Validate input name and technology.
-     if (input_name.empty())
+     if (input_name.empty() == params.batch_manifest_file_name.empty())
      {
-         cerr << "No input name provided\n";
+         cerr << "Exactly one of --input_name and --batch_manifest must be provided\n";
          return false;
      }
  
@@ -341,13 +467,76 @@ void CBarcodedCounter::init() {
          return false;
      }
  
-     // Process input file and load predefined CBCs if specified.
+     // Leaders passing the sketch are counted exactly, so min_leader_count cannot be applied without the sketch
+     if (params.min_leader_count.get() > 1 && params.leader_sketch_mb.get() == 0)
+     {
+         cerr << "--min_leader_count above 1 requires the leader sketch (--leader_sketch_mb above 0)\n";
+         return false;
+     }
+ 
+     // Process input file (or batch manifest) and load predefined CBCs if specified.
+     if (!input_name.empty() && !load_input_list(input_name))
+         return false;
+
+     if (!params.batch_manifest_file_name.empty() && !load_batch_manifest())
+         return false;
+ 
+     if (!params.predefined_cbc_fn.empty())
+     {
+         if (is_predefined_cbc_binary(params.predefined_cbc_fn))
+         {
+             if (!load_predefined_cbc_binary())
+                 return false;
+         }
+         else if (params.technology == technology_t::visium)
+             load_predefined_cbc_visium();
+         else if (params.technology == technology_t::ten_x)
+             load_predefined_cbc_plain();
+     }
+
+     if (!params.save_predefined_cbc_fn.empty())
+     {
+         if (params.predefined_cbc_fn.empty())
+         {
+             cerr << "--save_predefined_cbc requires --predefined_cbc\n";
+             return false;
+         }
+
+         if (!save_predefined_cbc_binary())
+             return false;
+     }
+ 
+     return true;
+ }
+ 
+ // *********************************************************************************************
+ // Input list: lines <R1 file name>,<R2 file name>
+ bool load_input_list(const string& input_name)
+ {
      ifstream ifs(input_name);
-     string s1, s2, s;
+     string s;
+
+     if (!ifs)
+     {
+         cerr << "Cannot open input name file: " << input_name << endl;
+         return false;
+     }
+
+     params.cbc_file_names.clear();
+     params.read_file_names.clear();
  
      while (ifs >> s)
      {
          auto p = find(s.begin(), s.end(), ',');
+
+         // A single BAM file gives both CBC/UMI (from tags) and reads
+         if (p == s.end() && params.input_format == input_format_t::bam && CBamReader::IsBamName(s))
+         {
+             params.cbc_file_names.emplace_back(s);
+             params.read_file_names.emplace_back(s);
+             continue;
+         }
+
          if (p == s.end())
          {
              cerr << "Wrong line in input name file: " << s << endl;
@@ -357,18 +546,52 @@ void CBarcodedCounter::init() {
          params.cbc_file_names.emplace_back(s.begin(), p);
          params.read_file_names.emplace_back(p+1, s.end());
      }
- 
-     if (!params.predefined_cbc_fn.empty())
+
+     return true;
+ }
+
+ // *********************************************************************************************
+ // Batch manifest: lines <sample id> <input name file> <output name>; empty lines and lines starting with # are skipped
+ bool load_batch_manifest()
+ {
+     ifstream ifs(params.batch_manifest_file_name);
+     string line;
+
+     if (!ifs)
      {
-         if (params.technology == technology_t::visium)
-             load_predefined_cbc_visium();
-         else if (params.technology == technology_t::ten_x)
-             load_predefined_cbc_plain();
+         cerr << "Cannot open batch manifest: " << params.batch_manifest_file_name << endl;
+         return false;
      }
- 
+
+     params.batch_samples.clear();
+
+     while (getline(ifs, line))
+     {
+         if (line.empty() || line[0] == '#')
+             continue;
+
+         istringstream iss(line);
+         CParams::batch_sample_t sample;
+         string extra;
+
+         if (!(iss >> sample.sample_id >> sample.input_name >> sample.out_file_name) || (iss >> extra))
+         {
+             cerr << "Wrong line in batch manifest: " << line << endl;
+             return false;
+         }
+
+         params.batch_samples.emplace_back(sample);
+     }
+
+     if (params.batch_samples.empty())
+     {
+         cerr << "Empty batch manifest: " << params.batch_manifest_file_name << endl;
+         return false;
+     }
+
      return true;
  }
- 
+
  // *********************************************************************************************
  void usage()
  {
@@ -386,11 +609,26 @@ void CBarcodedCounter::init() {
          << "    --follower_len <int> - follower len " << params.follower_len.str() << endl
          << "    --gap_len <int> - gap len " << params.gap_len.str() << endl
          << "    --n_threads <int> - no. threads " << params.no_threads.str() << endl
+         << "    --n_gz_threads <int> - no. threads inflating each BGZF input file (0 is for auto) " << params.no_gz_threads.str() << endl
+         << "    --block_queue_depth <int> - max. no. of blocks queued between a reading thread and its consumer " << params.no_blocks_in_queue.str() << endl
+         << "    --n_chunks_per_reader <int> - no. of 64 MB chunks per reading thread " << params.no_chunks_per_reader.str() << endl
          << "    --canonical - turn on canonical k-mers (default: false); works only in single mode" << endl
          << "    --verbose <int> - verbosity level " << params.verbosity_level.str() << endl
+         << "    --pair_extraction <single_pass|rescan> - anchor-target extraction: one sweep per read or legacy per-leader rescan; both give the same counts (default: " << to_string(params.pair_extraction) << ")\n"
+         << "    --collapse_duplicate_reads - identical reads of a CBC are enumerated once and their pairs are weighted by the no. of copies (the same counts, less work for duplicated libraries)\n"
+         << "    --max_ram <int> - approx. memory limit in GB; if set, valid reads are spilled to buckets in tmp_path and counted bucket by bucket (0 means no limit) " << params.max_ram.str() << endl
+         << "    --fused_pipeline - read R2 files together with R1 files and keep all packed R2 reads in memory, so R2 is decompressed only once (default: " << params.fused_pipeline << ")\n"
+         << "    --numa - pin worker threads to NUMA nodes, load reads of each CBC into memory of its node and count it on that node (default: " << params.numa << ")\n"
+         << "    --mmap_input - memory-map uncompressed input files instead of reading them to buffers (default: " << params.mmap_input << ")\n"
+         << "    --batch_manifest <file_name> - process many samples one after another (instead of --input_name); lines: <sample_id> <input_name> <output_name>\n"
+         << "    --cbc_shard <i/N> - keep only CBCs of shard i of N (by CBC hash); shards of the same input have disjoint CBCs (default: 0/" << params.no_cbc_shards.get() << ")\n"
+         << "    --cbc_cache <file_name> - load the outcome of the CBC (R1) pass from the file if it matches the input files and parameters; otherwise compute and store it there\n"
+         << "    --tmp_path <path> - path for temporary bucket files (default: " << params.tmp_path << ")\n"
+         << "    --stats_json <file_name> - save per-stage wall/CPU time, peak RSS, I/O, record counts and thread wait times as JSON\n"
          << "Options - input:\n"
-         << "    -d <file_name> - file with accepted anchors (one k-mer per line or TSV with 'anchor' column)" << endl
-         << "    --input_format <fasta|fastq> - input format (default: fastq)\n"
+         << "    -d <file_name> - file with accepted anchors (one k-mer per line or TSV with 'anchor' column); can be repeated (max. 64) to evaluate several anchor panels in one run, the pairs of panel <i> are stored in <output_name>.panel<i>" << endl
+         << "    --anchor_bitmap_max_len <int> - max. leader len for which accepted anchors are kept in a direct-indexed bitmap (4^leader_len bits) instead of bloom+hash " << params.anchor_bitmap_max_len.str() << endl
+         << "    --input_format <fasta|fastq|bam> - input format; BAM lines of input name file can give a single file for R1 and R2 (default: fastq)\n"
          << "    --input_name <file_name> - file name with list of pairs (comma separated) of barcoded files; 1st contains CBC+UMI\n"
          << "    --technology <10x|visium> - sequencing technology (default: " << technology_str(params.technology) << ")\n"
          << "    --soft_cbc_umi_len_limit <int> - tolerance of CBC+UMI len " << params.soft_cbc_umi_len_limit.str() << endl
@@ -402,17 +640,22 @@ void CBarcodedCounter::init() {
          << "    --output_name <file_name> - output file name (default: " << params.out_file_name << ")\n"
          << "    --sample_id <int> - sample id (default: " << params.sample_id << ")\n"
          << "    --n_splits <int> - no. splits " << params.no_splits.str() << endl
+         << "    --sorted_output - records of each output file are globally sorted (SBLFC), so they can be merged or dumped by streaming\n"
          << "    --log_name <file_name> - path to cbc log files (default: " << params.cbc_log_file_name << "); if not provided, log will not be produced\n"
          << "    --filtered_input_path <string> - path to filtered input files (default: " << params.filtered_input_path << ")\n"
          << "    --export_filtered_input_mode <none|first|second|both> - specifies which reads will be outputted (default: " << to_string(params.export_filtered_input) << ")\n"
          << "    --max_count <int> - max. counter value " << params.max_count.str() << endl
          << "    --zstd_level <int> - internal compression level " << params.zstd_level.str() << endl
          << "Options - filtering:\n"
-         << "    --predefined_cbc <file_name> - path to file with predefined CBCs (default: " << params.predefined_cbc_fn << ")\n"
+         << "    --predefined_cbc <file_name> - path to file with predefined CBCs (text or binary made by --save_predefined_cbc) (default: " << params.predefined_cbc_fn << ")\n"
+         << "    --save_predefined_cbc <file_name> - store predefined CBCs in a binary file, which loads much faster in later runs\n"
          << "    --poly_ACGT_len <int> - all leaders containing polyACGT of this length will be filtered out (0 means no filtering) " << params.poly_ACGT_len.str() << endl
          << "    --artifacts <file_name> - path to artifacts, each leader containing artifact will be filtered out\n"
          << "    --apply_filter_illumina_adapters - if used leaders containing Illumina adapters will be filtered out\n"					
          << "    --leader_sample_counts_threshold <int> - keep only leaders with counts > leader_sample_counts_threshold " << params.rare_leader_thr.str() << endl	// kmer_counts_in_cbc_thr ?
+         << "    --filter_universal_targets - if used targets present under all anchors of a CBC (with > 1 anchors) are not stored\n"
+         << "    --min_leader_count <int> - leaders occurring fewer times in the sample are not counted (exact; needs the leader sketch) " << params.min_leader_count.str() << endl
+         << "    --leader_sketch_mb <int> - size of the leader count sketch used to drop leaders below min_leader_count or leader_sample_counts_threshold early (0 turns it off) " << params.leader_sketch_mb.str() << endl
  //		<< "Options - other:\n"
          ;
  }
@@ -460,39 +703,160 @@ void CBarcodedCounter::init() {
  }
  
  // *********************************************************************************************
- int main(int argc, char **argv)
+ // Binary whitelist: [magic: 8B][cbc_len: u64][no. CBCs: u64][sorted encoded CBCs: u64 each]
+ const char PREDEFINED_CBC_MAGIC[8] = { 'B', 'K', 'C', 'W', 'L', 1, 0, 0 };
+
+ // *********************************************************************************************
+ bool is_predefined_cbc_binary(const string& fn)
  {
-    CBarcodedCounter::init();
-    
-    if (!parse_args(argc, argv))
+     ifstream ifs(fn, ios::binary);
+     char magic[sizeof(PREDEFINED_CBC_MAGIC)];
+
+     return ifs.read(magic, sizeof(magic)) && equal(magic, magic + sizeof(magic), PREDEFINED_CBC_MAGIC);
+ }
+
+ // *********************************************************************************************
+ bool load_predefined_cbc_binary()
+ {
+     ifstream ifs(params.predefined_cbc_fn, ios::binary);
+     char magic[sizeof(PREDEFINED_CBC_MAGIC)];
+     uint64_t cbc_len = 0, no_cbcs = 0;
+
+     ifs.read(magic, sizeof(magic));
+     ifs.read((char*) &cbc_len, sizeof(cbc_len));
+     ifs.read((char*) &no_cbcs, sizeof(no_cbcs));
+
+     if (!ifs)
      {
-         usage();
-         return 1;
+         cerr << "Corrupted predefined CBC file: " << params.predefined_cbc_fn << endl;
+         return false;
      }
- 
-     CBarcodedCounter barcoded_counter;
+
+     if (cbc_len != params.cbc_len.get())
+     {
+         cerr << "Predefined CBC file " << params.predefined_cbc_fn << " is for CBC len " << cbc_len << " (cbc_len: " << params.cbc_len.get() << ")\n";
+         return false;
+     }
+
+     params.predefined_cbc.clear();
+     params.predefined_cbc_encoded.resize(no_cbcs);
+
+     if (!ifs.read((char*) params.predefined_cbc_encoded.data(), no_cbcs * sizeof(uint64_t)))
+     {
+         cerr << "Corrupted predefined CBC file: " << params.predefined_cbc_fn << endl;
+         return false;
+     }
+
+     return true;
+ }
+
+ // *********************************************************************************************
+ bool save_predefined_cbc_binary()
+ {
+     BaseCoding4 base_coding4;
+     vector<uint64_t> cbcs = params.predefined_cbc_encoded;
+
+     for (const auto& s : params.predefined_cbc)
+         if (s.size() == params.cbc_len.get())
+             cbcs.emplace_back(base_coding4.encode_bases_2b(s));
+
+     std::sort(cbcs.begin(), cbcs.end());
+     cbcs.erase(unique(cbcs.begin(), cbcs.end()), cbcs.end());
+     if (!cbcs.empty() && cbcs.back() == ~0ull)
+         cbcs.pop_back();
+
+     ofstream ofs(params.save_predefined_cbc_fn, ios::binary);
+     uint64_t cbc_len = params.cbc_len.get();
+     uint64_t no_cbcs = cbcs.size();
+
+     ofs.write(PREDEFINED_CBC_MAGIC, sizeof(PREDEFINED_CBC_MAGIC));
+     ofs.write((const char*) &cbc_len, sizeof(cbc_len));
+     ofs.write((const char*) &no_cbcs, sizeof(no_cbcs));
+     ofs.write((const char*) cbcs.data(), no_cbcs * sizeof(uint64_t));
+
+     if (!ofs)
+     {
+         cerr << "Cannot write: " << params.save_predefined_cbc_fn << endl;
+         return false;
+     }
+
+     return true;
+ }
+
+ // *********************************************************************************************
+ // *********************************************************************************************
+ // prev (if given) is the counter of the previous sample, whose shared resources are taken over and then released
+ void process_sample(unique_ptr<CBarcodedCounter>& prev)
+ {
+     auto barcoded_counter = make_unique<CBarcodedCounter>();
      std::cout << "setting params" << std::endl;
-     barcoded_counter.SetParams(params);
+     barcoded_counter->SetParams(params, prev.get());
+     prev.reset();
      
      std::cout << "processing CBC" << std::endl;
-     barcoded_counter.ProcessCBC();
+     barcoded_counter->ProcessCBC();
     
      std::cout << "checking for filter" << std::endl;
      if (((uint32_t)params.export_filtered_input) & (uint32_t)export_filtered_input_t::first)
-         barcoded_counter.ProcessExportFilteredCBCReads();
+         barcoded_counter->ProcessExportFilteredCBCReads();
  
      if (params.counting_mode == counting_mode_t::filter)
      {
          if (((uint32_t)params.export_filtered_input) & (uint32_t)export_filtered_input_t::second)
-             barcoded_counter.ProcessExportFilteredReads();
-         
-         return 0;
+             barcoded_counter->ProcessExportFilteredReads();
      }
-     std::cout << "processing reads" << std::endl;
-     barcoded_counter.ProcessReads();
+     else
+     {
+         std::cout << "processing reads" << std::endl;
+         barcoded_counter->ProcessReads();
  
-     barcoded_counter.ShowTimings();
+         barcoded_counter->ShowTimings();
+     }
+
+     prev = move(barcoded_counter);
+ }
+
+ // *********************************************************************************************
+ int main(int argc, char **argv)
+ {
+    CBarcodedCounter::init();
+    
+    if (!parse_args(argc, argv))
+     {
+         usage();
+         return 1;
+     }
+ 
+     if (!params.stats_json_file_name.empty())
+         run_stats.Enable();
+
+     unique_ptr<CBarcodedCounter> barcoded_counter;
+
+     if (params.batch_samples.empty())
+         process_sample(barcoded_counter);
+     else
+     {
+         // Anchors, CBC whitelist and all parameters are loaded once and shared by the samples
+         string cbc_log_file_name = params.cbc_log_file_name;
+
+         for (const auto& sample : params.batch_samples)
+         {
+             std::cout << "sample " << sample.sample_id << ": " << sample.input_name << std::endl;
+
+             if (!load_input_list(sample.input_name))
+                 return 1;
+
+             params.sample_id = sample.sample_id;
+             params.out_file_name = sample.out_file_name;
+             if (params.export_cbc_logs)
+                 params.cbc_log_file_name = cbc_log_file_name + "." + to_string(sample.sample_id);
+
+             process_sample(barcoded_counter);
+         }
+     }
+
+     if (!params.stats_json_file_name.empty())
+         run_stats.SaveJson(params.stats_json_file_name, "bkc_filter");
  
      return 0;
  }
- 
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "processreads.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <random>
+namespace fs = std::filesystem;
+
+#include "../../libs/refresh/hash_tables/lib/murmur_hash.h"
+
+// *********************************************************************************************
+// Cache of the CBC pass (--cbc_cache): valid reads bitmaps, no. of reads per file and relabelled read ids of CBCs,
+// i.e., everything ProcessReads needs from ProcessCBC. Layout (all integers u64):
+//   [magic: 8B][key len][key][no. files]
+//   per file: [no. reads][no. reads after cleanup][valid reads bitmap: (no. reads + 63) / 64 words]
+//   [no. CBCs] per CBC: [cbc][no. reads][read ids]
+//   [magic: 8B]
+// The key lists the parameters of the CBC pass and the names, sizes and modification times of R1 files,
+// so the cache is silently recomputed if any of them changes
+// *********************************************************************************************
+
+const char CBC_CACHE_MAGIC[8] = { 'B', 'K', 'C', 'C', 'A', 'C', 1, 0 };
+
+// *********************************************************************************************
+string CBarcodedCounter::cbc_cache_key() const
+{
+	string key;
+
+	key += "cbc_len=" + to_string(cbc_len) + ";umi_len=" + to_string(umi_len) +
+		";soft_cbc_umi_len_limit=" + to_string(soft_cbc_umi_len_limit) + ";allow_strange=" + to_string(allow_strange_cbc_umi_reads) +
+		";cbc_correction=" + to_string(apply_cbc_correction) + ";cbc_filtering_thr=" + to_string(cbc_filtering_thr) +
+		";input_format=" + to_string((int) input_format) + ";cbc_shard=" + to_string(cbc_shard_id) + "/" + to_string(no_cbc_shards);
+
+	refresh::MurMur64Hash mh;
+	uint64_t whitelist_hash = predefined_cbc.size();
+	for (auto x : predefined_cbc)
+		whitelist_hash = mh(whitelist_hash ^ x);
+
+	key += ";whitelist=" + to_string(predefined_cbc.size()) + ":" + to_string(whitelist_hash);
+
+	for (const auto& fn : cbc_file_names)
+	{
+		error_code ec;
+		auto size = fs::file_size(fn, ec);
+		auto mtime = fs::last_write_time(fn, ec).time_since_epoch().count();
+
+		key += ";" + fn + ":" + to_string(ec ? 0 : size) + ":" + to_string(ec ? 0 : mtime);
+	}
+
+	return key;
+}
+
+// *********************************************************************************************
+bool CBarcodedCounter::load_cbc_cache()
+{
+	ifstream ifs(cbc_cache_file_name, ios::binary);
+
+	if (!ifs)
+		return false;
+
+	error_code ec;
+	uint64_t file_size = fs::file_size(cbc_cache_file_name, ec);
+	if (ec)
+		return false;
+
+	auto read_u64 = [&ifs] {
+		uint64_t x = 0;
+		ifs.read((char*) &x, sizeof(x));
+		return x;
+	};
+
+	// Counts read from the file are checked against the bytes left before anything is allocated,
+	// so a truncated or damaged cache cannot force huge allocations
+	auto fits = [&](uint64_t count, uint64_t item_size) {
+		if (!ifs)
+			return false;
+		auto pos = ifs.tellg();
+		return pos >= 0 && (uint64_t) pos <= file_size && count <= (file_size - (uint64_t) pos) / item_size;
+	};
+
+	auto corrupted = [&] {
+		std::cerr << "Corrupted CBC cache (ignored): " + cbc_cache_file_name + "\n";
+		file_no_reads.clear();
+		file_no_reads_after_cleanup.clear();
+		valid_reads.clear();
+		global_cbc_dict.clear();
+		no_sample_reads = 0;
+		return false;
+	};
+
+	char magic[sizeof(CBC_CACHE_MAGIC)];
+	string key = cbc_cache_key();
+
+	if (!ifs.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), CBC_CACHE_MAGIC))
+		return false;
+
+	uint64_t key_len = read_u64();
+	if (!ifs || key_len != key.size())
+		return false;
+
+	string stored_key(key_len, ' ');
+	if (!ifs.read(stored_key.data(), key_len) || stored_key != key)
+	{
+		if (verbosity_level >= 1)
+			std::cerr << "CBC cache " + cbc_cache_file_name + " is outdated\n";
+		return false;
+	}
+
+	uint64_t no_files = read_u64();
+	if (!ifs || no_files != file_names.size())
+		return false;
+
+	file_no_reads.assign(no_files, 0);
+	file_no_reads_after_cleanup.assign(no_files, 0);
+	valid_reads.assign(no_files, {});
+
+	vector<uint64_t> words;
+	no_sample_reads = 0;
+
+	for (uint64_t i = 0; i < no_files; ++i)
+	{
+		file_no_reads[i] = read_u64();
+		file_no_reads_after_cleanup[i] = read_u64();
+		no_sample_reads += file_no_reads[i];
+
+		if (!fits(file_no_reads[i] / 64 + (file_no_reads[i] % 64 != 0), sizeof(uint64_t)) || file_no_reads_after_cleanup[i] > file_no_reads[i])
+			return corrupted();
+
+		words.resize((file_no_reads[i] + 63) / 64);
+		if (!ifs.read((char*) words.data(), words.size() * sizeof(uint64_t)))
+			return corrupted();
+
+		auto& vr = valid_reads[i];
+		vr.resize(file_no_reads[i]);
+		for (uint64_t j = 0; j < file_no_reads[i]; ++j)
+			vr[j] = (words[j / 64] >> (j % 64)) & 1;
+	}
+
+	global_cbc_dict.clear();
+
+	// Each CBC takes at least its id and no. of reads
+	uint64_t no_cbcs = read_u64();
+	if (!fits(no_cbcs, 2 * sizeof(uint64_t)))
+		return corrupted();
+
+	global_cbc_dict.reserve(no_cbcs);
+
+	for (uint64_t i = 0; i < no_cbcs; ++i)
+	{
+		cbc_t cbc = read_u64();
+		uint64_t no_reads = read_u64();
+
+		if (!fits(no_reads, sizeof(readfid_t)))
+			return corrupted();
+
+		auto& reads = global_cbc_dict[cbc];
+		reads.resize(no_reads);
+		if (!ifs.read((char*) reads.data(), no_reads * sizeof(readfid_t)))
+			return corrupted();
+	}
+
+	if (!ifs.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), CBC_CACHE_MAGIC))
+		return corrupted();
+
+	if (verbosity_level >= 1)
+		std::cerr << "CBC pass loaded from cache " + cbc_cache_file_name + " (" + to_string(no_cbcs) + " CBCs)\n";
+
+	return true;
+}
+
+// *********************************************************************************************
+// Stored to a temporary file renamed at the end, so concurrent runs never see a partial cache
+bool CBarcodedCounter::save_cbc_cache()
+{
+	string tmp_name = cbc_cache_file_name + ".tmp." + to_string(random_device{}());
+	ofstream ofs(tmp_name, ios::binary);
+
+	if (!ofs)
+	{
+		std::cerr << "Cannot create CBC cache: " + cbc_cache_file_name + "\n";
+		return false;
+	}
+
+	auto write_u64 = [&ofs](uint64_t x) {
+		ofs.write((const char*) &x, sizeof(x));
+	};
+
+	string key = cbc_cache_key();
+
+	ofs.write(CBC_CACHE_MAGIC, sizeof(CBC_CACHE_MAGIC));
+	write_u64(key.size());
+	ofs.write(key.data(), key.size());
+
+	write_u64(valid_reads.size());
+
+	vector<uint64_t> words;
+
+	for (size_t i = 0; i < valid_reads.size(); ++i)
+	{
+		auto& vr = valid_reads[i];
+
+		write_u64(vr.size());
+		write_u64(file_no_reads_after_cleanup[i]);
+
+		words.assign((vr.size() + 63) / 64, 0);
+		for (size_t j = 0; j < vr.size(); ++j)
+			if (vr[j])
+				words[j / 64] |= 1ull << (j % 64);
+
+		ofs.write((const char*) words.data(), words.size() * sizeof(uint64_t));
+	}
+
+	write_u64(global_cbc_dict.size());
+
+	for (const auto& x : global_cbc_dict)
+	{
+		write_u64(x.first);
+		write_u64(x.second.size());
+		ofs.write((const char*) x.second.data(), x.second.size() * sizeof(readfid_t));
+	}
+
+	ofs.write(CBC_CACHE_MAGIC, sizeof(CBC_CACHE_MAGIC));
+	ofs.close();
+
+	error_code ec;
+	if (!ofs || (fs::rename(tmp_name, cbc_cache_file_name, ec), ec))
+	{
+		std::cerr << "Cannot write CBC cache: " + cbc_cache_file_name + "\n";
+		fs::remove(tmp_name, ec);
+		return false;
+	}
+
+	return true;
+}
+
+// EOF
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <cinttypes>
+#include <algorithm>
+#include <bit>
+
+#include "../../libs/refresh/sort/lib/pdqsort_par.h"
+#include "../common/defs.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Hamming-1 lookups in a set of CBCs (pigeonhole split into two halves)
+// A CBC at distance 1 from a query has the same high half (and differs in the low one) or the same low half,
+// so candidates are taken from two sorted flat arrays: CBCs ordered by the high half and CBCs ordered by the low half.
+// Memory is 2 x 8B per CBC, instead of 4 x cbc_len map entries per CBC.
+class CCbcCorrectionIndex
+{
+	uint32_t low_bits = 0;
+	cbc_t low_mask = 0;
+
+	vector<cbc_t> by_high;			// sorted by (high, low), i.e., just sorted
+	vector<cbc_t> by_low;			// sorted by (low, high)
+
+	// *********************************************************************************************
+	bool low_less(cbc_t a, cbc_t b) const
+	{
+		if ((a & low_mask) != (b & low_mask))
+			return (a & low_mask) < (b & low_mask);
+		return a < b;
+	}
+
+	// *********************************************************************************************
+	static bool is_hamming_1(cbc_t a, cbc_t b)
+	{
+		cbc_t x = a ^ b;
+		x = (x | (x >> 1)) & 0x5555555555555555ull;
+
+		return popcount(x) == 1;
+	}
+
+public:
+	// *********************************************************************************************
+	void Build(vector<cbc_t> cbcs, uint32_t cbc_len)
+	{
+		low_bits = 2 * (cbc_len / 2);
+		low_mask = (1ull << low_bits) - 1;
+
+		refresh::sort::pdqsort(cbcs.begin(), cbcs.end());
+		cbcs.erase(unique(cbcs.begin(), cbcs.end()), cbcs.end());
+
+		by_low = cbcs;
+		refresh::sort::pdqsort(by_low.begin(), by_low.end(), [this](cbc_t a, cbc_t b) { return low_less(a, b); });
+
+		by_high = move(cbcs);
+	}
+
+	// *********************************************************************************************
+	size_t Size() const
+	{
+		return by_high.size();
+	}
+
+	// *********************************************************************************************
+	// Returns true if there is exactly one CBC at Hamming distance 1 from cbc
+	bool FindUniqueNeighbour(cbc_t cbc, cbc_t& neighbour) const
+	{
+		uint32_t no_found = 0;
+
+		auto check = [&](cbc_t x) {
+			if (is_hamming_1(x, cbc))
+			{
+				neighbour = x;
+				++no_found;
+			}
+		};
+
+		cbc_t high = cbc & ~low_mask;
+
+		for (auto p = lower_bound(by_high.begin(), by_high.end(), high); p != by_high.end() && (*p & ~low_mask) == high && no_found < 2; ++p)
+			check(*p);
+
+		cbc_t low = cbc & low_mask;
+
+		for (auto p = lower_bound(by_low.begin(), by_low.end(), low, [this](cbc_t a, cbc_t b) { return low_less(a, b); });
+			p != by_low.end() && (*p & low_mask) == low && no_found < 2; ++p)
+			check(*p);
+
+		return no_found == 1;
+	}
+
+	// *********************************************************************************************
+	void Clear()
+	{
+		vector<cbc_t>().swap(by_high);
+		vector<cbc_t>().swap(by_low);
+	}
+};
+
+// EOF
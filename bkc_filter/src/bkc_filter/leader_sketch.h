@@ -0,0 +1,234 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cinttypes>
+
+#include "../../libs/refresh/hash_tables/lib/hash_set.h"
+#include "../../libs/refresh/hash_tables/lib/murmur_hash.h"
+#include "../../libs/refresh/sort/lib/pdqsort_par.h"
+#include "../common/dna_packing.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Count-min sketch of leader occurrences in the whole sample, filled concurrently by the reads loading threads.
+// Estimates never underestimate, so dropping leaders with Estimate() < min_count never drops a leader
+// that occurs at least min_count times (only some rarer ones can survive, depending on the sketch size).
+// Memory is fixed (no_rows * width 32-bit counters) whatever the leader length is.
+// For an exact threshold the leaders passing the sketch are counted exactly in one more pass over the reads
+// (CExactCounts per thread, then SetExactCounts()), after which IsFrequent() decides by these counts.
+class CLeaderSketch
+{
+	static constexpr uint32_t no_rows = 4;
+
+	uint64_t width_mask;
+	unique_ptr<atomic<uint32_t>[]> counters;
+	uint32_t min_count;
+
+	bool exact = false;
+	uint64_t no_frequent_leaders = 0;
+	refresh::hash_set_lp<uint64_t, equal_to<uint64_t>, refresh::MurMur64Hash> frequent_leaders;
+
+	// *********************************************************************************************
+	// Row positions from a single 64-bit hash (double hashing)
+	void positions(uint64_t leader, uint64_t* pos) const
+	{
+		uint64_t h = refresh::MurMur64Hash{}(leader);
+		uint64_t h1 = h & 0xffffffffull;
+		uint64_t h2 = (h >> 32) | 1;
+
+		for (uint32_t i = 0; i < no_rows; ++i)
+			pos[i] = i * (width_mask + 1) + ((h1 + i * h2) & width_mask);
+	}
+
+public:
+	// *********************************************************************************************
+	// Exact counts of leaders of a single thread: leaders are buffered and the sorted buffer is collapsed
+	// into the counts, so memory is bounded by the no. of distinct leaders (plus the buffer)
+	class CExactCounts
+	{
+		static constexpr size_t max_buffer_size = 1 << 20;
+
+		vector<uint64_t> buffer;
+		vector<pair<uint64_t, uint32_t>> counts;		// sorted by leader
+		vector<pair<uint64_t, uint32_t>> counts_tmp;
+
+		void flush()
+		{
+			if (buffer.empty())
+				return;
+
+			refresh::sort::pdqsort(buffer.begin(), buffer.end());
+
+			counts_tmp.clear();
+			counts_tmp.reserve(counts.size() + buffer.size());
+
+			auto p = counts.begin();
+
+			for (size_t i = 0; i < buffer.size(); )
+			{
+				size_t j = i + 1;
+				while (j < buffer.size() && buffer[j] == buffer[i])
+					++j;
+
+				for (; p != counts.end() && p->first < buffer[i]; ++p)
+					counts_tmp.emplace_back(*p);
+
+				if (p != counts.end() && p->first == buffer[i])
+					counts_tmp.emplace_back(buffer[i], (uint32_t) (p++->second + (j - i)));
+				else
+					counts_tmp.emplace_back(buffer[i], (uint32_t) (j - i));
+
+				i = j;
+			}
+
+			counts_tmp.insert(counts_tmp.end(), p, counts.end());
+			swap(counts, counts_tmp);
+
+			buffer.clear();
+		}
+
+	public:
+		void Add(uint64_t leader)
+		{
+			buffer.emplace_back(leader);
+
+			if (buffer.size() >= max_buffer_size)
+				flush();
+		}
+
+		vector<pair<uint64_t, uint32_t>>& Counts()
+		{
+			flush();
+			counts_tmp.clear();
+			counts_tmp.shrink_to_fit();
+
+			return counts;
+		}
+	};
+
+	// *********************************************************************************************
+	// size_in_bytes is rounded down to a power of two per row
+	CLeaderSketch(size_t size_in_bytes, uint32_t _min_count) :
+		min_count(_min_count)
+	{
+		uint64_t width = 1024;
+		while (width * 2 * no_rows * sizeof(uint32_t) <= size_in_bytes)
+			width *= 2;
+
+		width_mask = width - 1;
+		counters.reset(new atomic<uint32_t>[width * no_rows]);
+
+		for (uint64_t i = 0; i < width * no_rows; ++i)
+			counters[i].store(0, memory_order_relaxed);
+	}
+
+	// *********************************************************************************************
+	void Add(uint64_t leader)
+	{
+		uint64_t pos[no_rows];
+		positions(leader, pos);
+
+		for (uint32_t i = 0; i < no_rows; ++i)
+			counters[pos[i]].fetch_add(1, memory_order_relaxed);
+	}
+
+	// *********************************************************************************************
+	// Adds leaders of all (leader, follower) windows of the read; anchors (if not null) restrict the counted leaders
+	template<typename ANCHORS> void AddRead(const dna_packed_view_t& read, uint32_t leader_len, uint32_t gap_len, uint32_t follower_len, const ANCHORS* anchors)
+	{
+		dna_packed_for_each_window(read, leader_len, gap_len, follower_len, [this, anchors](uint64_t leader, uint64_t) {
+			if (!anchors || anchors->IsAccepted(leader))
+				Add(leader);
+			});
+	}
+
+	// *********************************************************************************************
+	// As AddRead(), but only leaders passing the sketch are counted (exactly) in exact_counts
+	template<typename ANCHORS> void AddReadExact(const dna_packed_view_t& read, uint32_t leader_len, uint32_t gap_len, uint32_t follower_len, const ANCHORS* anchors,
+		CExactCounts& exact_counts) const
+	{
+		dna_packed_for_each_window(read, leader_len, gap_len, follower_len, [this, anchors, &exact_counts](uint64_t leader, uint64_t) {
+			if ((!anchors || anchors->IsAccepted(leader)) && Estimate(leader) >= min_count)
+				exact_counts.Add(leader);
+			});
+	}
+
+	// *********************************************************************************************
+	// Merges exact counts of all threads; from now on only leaders occurring at least min_count times are frequent
+	void SetExactCounts(vector<CExactCounts>& thread_counts)
+	{
+		vector<pair<uint64_t, uint32_t>> counts;
+
+		for (auto& x : thread_counts)
+		{
+			auto& tc = x.Counts();
+			counts.insert(counts.end(), tc.begin(), tc.end());
+			tc.clear();
+			tc.shrink_to_fit();
+		}
+
+		refresh::sort::pdqsort(counts.begin(), counts.end());
+
+		vector<uint64_t> leaders;
+
+		for (size_t i = 0; i < counts.size(); )
+		{
+			uint64_t sum = 0;
+			size_t j = i;
+			for (; j < counts.size() && counts[j].first == counts[i].first; ++j)
+				sum += counts[j].second;
+
+			if (sum >= min_count)
+				leaders.emplace_back(counts[i].first);
+
+			i = j;
+		}
+
+		frequent_leaders.reserve(leaders.size());
+		for (auto x : leaders)
+			frequent_leaders.insert(x);
+
+		no_frequent_leaders = leaders.size();
+		exact = true;
+	}
+
+	// *********************************************************************************************
+	uint64_t NoFrequentLeaders() const
+	{
+		return no_frequent_leaders;
+	}
+
+	// *********************************************************************************************
+	uint32_t Estimate(uint64_t leader) const
+	{
+		uint64_t pos[no_rows];
+		positions(leader, pos);
+
+		uint32_t r = counters[pos[0]].load(memory_order_relaxed);
+		for (uint32_t i = 1; i < no_rows; ++i)
+			r = min(r, counters[pos[i]].load(memory_order_relaxed));
+
+		return r;
+	}
+
+	// *********************************************************************************************
+	bool IsFrequent(uint64_t leader) const
+	{
+		if (exact)
+			return frequent_leaders.check(leader);
+
+		return Estimate(leader) >= min_count;
+	}
+
+	// *********************************************************************************************
+	size_t SizeInBytes() const
+	{
+		return (width_mask + 1) * no_rows * sizeof(uint32_t);
+	}
+};
+
+// EOF
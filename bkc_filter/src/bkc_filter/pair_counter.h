@@ -0,0 +1,399 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <cinttypes>
+#include <algorithm>
+
+#include "../../libs/refresh/sort/lib/pdqsort_par.h"
+#include "../../libs/refresh/hash_tables/lib/murmur_hash.h"
+#include "../common/defs.h"
+
+using namespace std;
+
+struct leader_follower_t {
+	leader_t leader;
+	follower_t follower;
+
+	leader_follower_t() = default;
+	leader_follower_t(leader_t _leader, follower_t _follower) :
+		leader(_leader), follower(_follower) {}
+	leader_follower_t(const leader_follower_t&) = default;
+	leader_follower_t(leader_follower_t&&) = default;
+	leader_follower_t& operator=(const leader_follower_t&) = default;
+	leader_follower_t& operator=(leader_follower_t&&) = default;
+
+	bool operator<(const leader_follower_t& rhs) const {
+		if (this->leader != rhs.leader)
+			return this->leader < rhs.leader;
+		return this->follower < rhs.follower;
+	}
+
+	bool operator==(const leader_follower_t& rhs) const 
+	{
+		return this->leader == rhs.leader && this->follower == rhs.follower;
+	}
+};
+
+struct leader_follower_count_t : public leader_follower_t
+{
+	uint64_t count;
+
+	leader_follower_count_t() = default;
+	leader_follower_count_t(leader_t _leader, follower_t _follower, uint64_t _count) :
+		leader_follower_t(_leader, _follower),
+		count(_count)
+	{}
+	leader_follower_count_t(const leader_follower_count_t&) = default;
+	leader_follower_count_t(const leader_follower_t& x) : leader_follower_t(x), count(1) {};
+	leader_follower_count_t(leader_follower_count_t&&) = default;
+	leader_follower_count_t& operator=(const leader_follower_count_t&) = default;
+	leader_follower_count_t& operator=(leader_follower_count_t&&) = default;
+
+	bool operator<(const leader_follower_count_t& rhs) {
+		if (this->leader != rhs.leader)
+			return this->leader < rhs.leader;
+		return this->follower < rhs.follower;
+	}
+
+	bool operator==(const leader_follower_t& rhs)
+	{
+		return this->leader == rhs.leader && this->follower == rhs.follower;
+	}
+
+	bool equal_lf(const leader_follower_t& rhs)
+	{
+		return this->leader == rhs.leader && this->follower == rhs.follower;
+	}
+};
+
+// *********************************************************************************************
+// Counts (leader, follower) pairs of a single CBC; the result is sorted by (leader, follower) as after sorting and collapsing all pairs
+// Pairs are counted in a small open-addressing table, so duplicated pairs are not stored and only distinct ones are sorted.
+// When the no. of distinct pairs exceeds max_table_size, the table is spilled and further pairs are collected in a vector
+// that is LSD radix sorted (only on the bits used by the k-mers) and merged with the spilled counts.
+// The vector is merged in batches (at least min_batch_size pairs and no fewer than the merged counts, so merging
+// stays linear in total), so memory is bounded by the no. of distinct pairs rather than by the no. of all pairs.
+class CPairCounter
+{
+	struct entry_t {
+		leader_t leader;
+		follower_t follower;
+		uint64_t count;				// 0 for empty slots
+	};
+
+	static constexpr size_t initial_table_size = 1 << 10;
+	static constexpr size_t min_batch_size = 1 << 20;
+
+	static constexpr uint32_t radix_bits = 11;
+	static constexpr uint32_t radix_size = 1u << radix_bits;
+
+	uint32_t leader_bits;
+	uint32_t follower_bits;
+	size_t max_table_size;
+
+	refresh::MurMur64Hash mh;
+
+	bool table_mode = true;
+	vector<entry_t> table;
+	size_t table_mask = 0;
+	vector<uint32_t> used_slots;
+
+	vector<leader_follower_count_t> spilled;					// unsorted counts (of the spilled table and of pairs with count > 1)
+	vector<leader_follower_count_t> merged, merged_tmp;		// sorted and collapsed counts of the batches merged so far
+	vector<leader_follower_t> pairs, pairs_tmp;
+	vector<array<uint32_t, radix_size>> histograms;
+
+	// *********************************************************************************************
+	static bool lf_less(const leader_follower_t& a, const leader_follower_t& b)
+	{
+		return a < b;
+	}
+
+	// *********************************************************************************************
+	size_t slot(leader_t leader, follower_t follower) const
+	{
+		return mh(follower ^ (leader * 0x9E3779B97F4A7C15ull)) & table_mask;
+	}
+
+	// *********************************************************************************************
+	void insert(leader_t leader, follower_t follower, uint64_t count)
+	{
+		for (size_t i = slot(leader, follower); ; i = (i + 1) & table_mask)
+		{
+			auto& e = table[i];
+
+			if (!e.count)
+			{
+				e.leader = leader;
+				e.follower = follower;
+				e.count = count;
+				used_slots.emplace_back((uint32_t) i);
+				return;
+			}
+
+			if (e.leader == leader && e.follower == follower)
+			{
+				e.count += count;
+				return;
+			}
+		}
+	}
+
+	// *********************************************************************************************
+	void resize_table(size_t new_size)
+	{
+		vector<entry_t> entries;
+		entries.reserve(used_slots.size());
+
+		for (auto i : used_slots)
+		{
+			entries.emplace_back(table[i]);
+			table[i].count = 0;
+		}
+
+		used_slots.clear();
+
+		table.resize(new_size, entry_t{ 0, 0, 0 });
+		table_mask = new_size - 1;
+
+		for (const auto& e : entries)
+			insert(e.leader, e.follower, e.count);
+	}
+
+	// *********************************************************************************************
+	void spill_table()
+	{
+		spilled.clear();
+		spilled.reserve(used_slots.size());
+
+		for (auto i : used_slots)
+		{
+			spilled.emplace_back(table[i].leader, table[i].follower, table[i].count);
+			table[i].count = 0;
+		}
+
+		used_slots.clear();
+		table_mode = false;
+	}
+
+	// *********************************************************************************************
+	// Digit at bits [pos, pos + radix_bits) of the key [leader][follower] (follower_bits wide)
+	uint32_t digit(const leader_follower_t& x, uint32_t pos) const
+	{
+		uint64_t v;
+
+		if (pos + radix_bits <= follower_bits)
+			v = x.follower >> pos;
+		else if (pos >= follower_bits)
+			v = x.leader >> (pos - follower_bits);
+		else
+			v = (x.follower >> pos) | (x.leader << (follower_bits - pos));
+
+		return (uint32_t) (v & (radix_size - 1));
+	}
+
+	// *********************************************************************************************
+	// LSD radix sort on the used bits only; digits with a single value in all pairs are skipped
+	void radix_sort_pairs()
+	{
+		uint32_t no_digits = (leader_bits + follower_bits + radix_bits - 1) / radix_bits;
+
+		histograms.resize(no_digits);
+		for (auto& h : histograms)
+			h.fill(0);
+
+		for (const auto& x : pairs)
+			for (uint32_t d = 0; d < no_digits; ++d)
+				++histograms[d][digit(x, d * radix_bits)];
+
+		pairs_tmp.resize(pairs.size());
+
+		for (uint32_t d = 0; d < no_digits; ++d)
+		{
+			auto& h = histograms[d];
+
+			if (*max_element(h.begin(), h.end()) == pairs.size())
+				continue;
+
+			uint32_t sum = 0;
+			for (auto& c : h)
+			{
+				uint32_t tmp = c;
+				c = sum;
+				sum += tmp;
+			}
+
+			for (const auto& x : pairs)
+				pairs_tmp[h[digit(x, d * radix_bits)]++] = x;
+
+			swap(pairs, pairs_tmp);
+		}
+	}
+
+	// *********************************************************************************************
+	void gather_from_table(vector<leader_follower_count_t>& kmer_pair_counts)
+	{
+		kmer_pair_counts.reserve(used_slots.size());
+
+		for (auto i : used_slots)
+		{
+			kmer_pair_counts.emplace_back(table[i].leader, table[i].follower, table[i].count);
+			table[i].count = 0;
+		}
+
+		used_slots.clear();
+
+		refresh::sort::pdqsort(kmer_pair_counts.begin(), kmer_pair_counts.end(), lf_less);
+	}
+
+	// *********************************************************************************************
+	// Merges the current batch (pairs and spilled counts) with the merged counts into out (sorted and collapsed)
+	void merge_batch(vector<leader_follower_count_t>& out)
+	{
+		radix_sort_pairs();
+		refresh::sort::pdqsort(spilled.begin(), spilled.end(), lf_less);
+
+		out.clear();
+
+		auto p = merged.begin();
+		auto q = spilled.begin();
+
+		auto append = [&](const leader_follower_count_t& x) {
+			if (!out.empty() && out.back().equal_lf(x))
+				out.back().count += x.count;
+			else
+				out.emplace_back(x);
+		};
+
+		// Appends counts (from merged and spilled) smaller than bound (all if bound is null)
+		auto append_counts = [&](const leader_follower_t* bound) {
+			while (true)
+			{
+				bool in_p = p != merged.end() && (!bound || lf_less(*p, *bound));
+				bool in_q = q != spilled.end() && (!bound || lf_less(*q, *bound));
+
+				if (in_p && (!in_q || !lf_less(*q, *p)))
+					append(*p++);
+				else if (in_q)
+					append(*q++);
+				else
+					break;
+			}
+		};
+
+		for (const auto& x : pairs)
+		{
+			append_counts(&x);
+			append(leader_follower_count_t(x));
+		}
+
+		append_counts(nullptr);
+
+		pairs.clear();
+		spilled.clear();
+	}
+
+	// *********************************************************************************************
+	void flush_batch()
+	{
+		merge_batch(merged_tmp);
+		swap(merged, merged_tmp);
+		merged_tmp.clear();
+	}
+
+	// *********************************************************************************************
+	void gather_from_pairs(vector<leader_follower_count_t>& kmer_pair_counts)
+	{
+		merge_batch(kmer_pair_counts);
+	}
+
+public:
+	CPairCounter(uint32_t leader_len = 32, uint32_t follower_len = 32, size_t max_table_size = 1 << 14) :
+		leader_bits(2 * leader_len),
+		follower_bits(2 * follower_len),
+		max_table_size(max_table_size)
+	{
+		Reset();
+	}
+
+	// *********************************************************************************************
+	void Reset()
+	{
+		for (auto i : used_slots)
+			table[i].count = 0;
+		used_slots.clear();
+
+		table.resize(initial_table_size, entry_t{ 0, 0, 0 });
+		table_mask = initial_table_size - 1;
+		table_mode = true;
+
+		spilled.clear();
+		merged.clear();
+		pairs.clear();
+	}
+
+	// *********************************************************************************************
+	// count > 1 for pairs of collapsed duplicate reads (in the vector mode such pairs go to spilled counts)
+	void Add(leader_t leader, follower_t follower, uint64_t count = 1)
+	{
+		if (!table_mode)
+		{
+			if (count == 1)
+				pairs.emplace_back(leader, follower);
+			else
+				spilled.emplace_back(leader, follower, count);
+
+			if (pairs.size() + spilled.size() >= max(min_batch_size, merged.size()))
+				flush_batch();
+			return;
+		}
+
+		insert(leader, follower, count);
+
+		// Max. load factor is 0.5
+		if (2 * used_slots.size() > table.size())
+		{
+			if (used_slots.size() > max_table_size)
+				spill_table();
+			else
+				resize_table(2 * table.size());
+		}
+	}
+
+	// *********************************************************************************************
+	bool IsTableMode() const
+	{
+		return table_mode;
+	}
+
+	// *********************************************************************************************
+	// Stores pairs counts (sorted by (leader, follower)) and resets the counter
+	void Gather(vector<leader_follower_count_t>& kmer_pair_counts)
+	{
+		kmer_pair_counts.clear();
+
+		if (table_mode)
+			gather_from_table(kmer_pair_counts);
+		else
+			gather_from_pairs(kmer_pair_counts);
+
+		Reset();
+	}
+
+	// *********************************************************************************************
+	void ReleaseMemory()
+	{
+		Reset();
+
+		vector<entry_t>(initial_table_size, entry_t{ 0, 0, 0 }).swap(table);
+		vector<uint32_t>().swap(used_slots);
+		vector<leader_follower_count_t>().swap(spilled);
+		vector<leader_follower_count_t>().swap(merged);
+		vector<leader_follower_count_t>().swap(merged_tmp);
+		vector<leader_follower_t>().swap(pairs);
+		vector<leader_follower_t>().swap(pairs_tmp);
+	}
+};
+
+// EOF
@@ -35,6 +35,30 @@ inline counting_mode_t counting_mode_from_string(const std::string& str) {
 	}
 }
 
+// *********************************************************************************************
+inline pair_extraction_t pair_extraction_from_string(const std::string& str) {
+	if (str == "single_pass")
+		return pair_extraction_t::single_pass;
+	else if (str == "rescan")
+		return pair_extraction_t::rescan;
+	else
+	{
+		return pair_extraction_t::unknown;
+	}
+}
+
+// *********************************************************************************************
+inline std::string to_string(pair_extraction_t pair_extraction) {
+	switch (pair_extraction) {
+	case pair_extraction_t::single_pass:
+		return "single_pass";
+	case pair_extraction_t::rescan:
+		return "rescan";
+	default:
+		return "unknown";
+	}
+}
+
 // *********************************************************************************************
 inline std::string to_string(output_format_t output_format) {
 	switch (output_format) {
@@ -85,6 +109,9 @@ struct CParams
 	param_t<uint32_t> soft_cbc_umi_len_limit{ 0, 1'000'000'000, 0 };
 	param_t<uint32_t> no_splits{ 1, 256, 1 };
 	param_t<uint32_t> no_threads{ 0, 256, 8 };
+	param_t<uint32_t> no_gz_threads{ 0, 256, 0 };			// auto
+	param_t<uint32_t> no_blocks_in_queue{ 1, 64, 3 };
+	param_t<uint32_t> no_chunks_per_reader{ 1, 64, 3 };
 	param_t<uint32_t> max_count{ 1, ~0u, 65535 };
 	param_t<uint32_t> zstd_level{ 0, 19, 6 };
 	bool canonical_mode{ false };
@@ -92,22 +119,52 @@ struct CParams
 	vector<string> cbc_file_names;
 	vector<string> read_file_names;
 	string out_file_name{ "./results.bkc" };
+
+	// Batch mode (--batch_manifest): samples processed one after another with the same parameters
+	struct batch_sample_t
+	{
+		uint32_t sample_id;
+		string input_name;
+		string out_file_name;
+	};
+
+	string batch_manifest_file_name;
+	vector<batch_sample_t> batch_samples;
+
+	param_t<uint32_t> no_cbc_shards{ 1, 1 << 16, 1 };
+	uint32_t cbc_shard_id{ 0 };
+	string cbc_cache_file_name;
 	param_t<uint32_t> poly_ACGT_len{ 0, 31, 0 };
 	string artifacts;
 	bool apply_filter_illumina_adapters{ false };
 	param_t<uint32_t> verbosity_level{ 0, 2, 0 };
-	param_t<uint32_t> rare_leader_thr{ 0, 255, 5 };
+	param_t<uint32_t> rare_leader_thr{ 0, 255, 0 };
+	param_t<uint32_t> min_leader_count{ 1, 1u << 30, 1 };
+	param_t<uint32_t> leader_sketch_mb{ 0, 1 << 16, 128 };
+	bool filter_universal_targets{ false };
+	bool collapse_duplicate_reads{ false };
 	bool apply_cbc_correction{ false };
 	param_t<uint32_t> cbc_filtering_thr{ 0, ~0u, 0 };			// auto
 	technology_t technology{ technology_t::ten_x };
 	vector<string> predefined_cbc;
+	vector<uint64_t> predefined_cbc_encoded;		// loaded from a binary whitelist
 	bool export_cbc_logs{ false };
 	string predefined_cbc_fn;
+	string save_predefined_cbc_fn;
 	string cbc_log_file_name;
 	export_filtered_input_t export_filtered_input { export_filtered_input_t::none };
 	string filtered_input_path{};
 	bool allow_strange_cbc_umi_reads{ false };
 	input_format_t input_format{ input_format_t::fastq };
 	output_format_t output_format {output_format_t::bkc};
+	bool sorted_output{ false };
+	pair_extraction_t pair_extraction{ pair_extraction_t::single_pass };
+	param_t<uint32_t> max_ram{ 0, 1 << 20, 0 };				// in GB; 0 - no limit
+	string tmp_path{ "./" };
+	bool fused_pipeline{ false };
+	bool numa{ false };
+	bool mmap_input{ false };
+	string stats_json_file_name;
     string accepted_anchors_path;
+	param_t<uint32_t> anchor_bitmap_max_len{ 0, 16, 14 };
 };
@@ -30,9 +30,39 @@ void CBarcodedCounter::join_threads(vector<thread>& threads)
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::SetParams(const CParams& params)
+// In batch mode prev is the counter of the previous sample; its thread pool, memory pools and encoded CBC whitelist
+// are taken over, as they do not depend on the sample
+void CBarcodedCounter::SetParams(const CParams& params, CBarcodedCounter* prev)
 {
 	no_threads = params.no_threads.get();
+
+	numa_topology.reset();
+	if (params.numa)
+	{
+		numa_topology = make_unique<CNumaTopology>();
+		if (numa_topology->NoNodes() < 2)
+		{
+			std::cerr << "Warning: single NUMA node found, NUMA mode is not used\n";
+			numa_topology.reset();
+		}
+	}
+
+	if (prev && prev->thread_pool)
+	{
+		thread_pool = move(prev->thread_pool);
+		memory_pools = move(prev->memory_pools);
+	}
+	else if (numa_topology)
+	{
+		// Worker 0 is the calling thread, which is not pinned, so also the dedicated threads it creates are not
+		uint32_t pool_size = max(no_threads, 1);
+		thread_pool = make_unique<CThreadPool>(pool_size, [this, pool_size](uint32_t i) {
+			numa_topology->PinCurrentThread(numa_topology->NodeForThread(i, pool_size));
+			});
+	}
+	else
+		thread_pool = make_unique<CThreadPool>(max(no_threads, 1));
+
 	cbc_len = params.cbc_len.get();
 	umi_len = params.umi_len.get();
 	soft_cbc_umi_len_limit = params.soft_cbc_umi_len_limit.get();
@@ -41,11 +71,30 @@ void CBarcodedCounter::SetParams(const CParams& params)
 	leader_len = params.leader_len.get();
 	follower_len = params.follower_len.get();
 	gap_len = params.gap_len.get();
-	min_leader_count = 1;					// currently fixed
+	min_leader_count = params.min_leader_count.get();
 	rare_leader_thr = params.rare_leader_thr.get();
 	no_splits = params.no_splits.get();
+	no_blocks_in_queue = params.no_blocks_in_queue.get();
+	no_chunks_per_file = params.no_chunks_per_reader.get();
+	no_panels = accepted_anchors ? accepted_anchors->NoPanels() : 1;
 	max_count = params.max_count.get();
 	zstd_level = params.zstd_level.get();
+	pair_extraction = params.pair_extraction;
+	max_ram = ((uint64_t) params.max_ram.get()) << 30;
+	tmp_path = params.tmp_path;
+	no_gz_threads = params.no_gz_threads.get();
+	mmap_input = params.mmap_input;
+	no_cbc_shards = params.no_cbc_shards.get();
+	cbc_shard_id = params.cbc_shard_id;
+	cbc_cache_file_name = params.cbc_cache_file_name;
+
+	fused_pipeline = params.fused_pipeline;
+	if (fused_pipeline && (max_ram || counting_mode == counting_mode_t::filter || 
+		((uint32_t) params.export_filtered_input) & (uint32_t) export_filtered_input_t::second))
+	{
+		std::cerr << "Warning: fused pipeline is not used with --max_ram, filter mode or export of filtered R2 reads\n";
+		fused_pipeline = false;
+	}
 
 	if (counting_mode == counting_mode_t::single)
 		follower_len = 0;
@@ -62,23 +111,49 @@ void CBarcodedCounter::SetParams(const CParams& params)
 
 	poly_ACGT_filter = PolyACGTFilter(params.poly_ACGT_len.get());
 
-	// artifacts_filter = ArtifactsFilter(params.artifacts);
-	// if (params.apply_filter_illumina_adapters)
-	// 	artifacts_filter.Add(12, IlluminaAdaptersStatic::Get12Mers());
+	artifacts_filter = ArtifactsFilter(params.artifacts);
+	if (params.apply_filter_illumina_adapters)
+		artifacts_filter.Add(12, IlluminaAdaptersStatic::Get12Mers());
+
+	filter_leaders = rare_leader_thr > 0 || params.poly_ACGT_len.get() > 0 || !params.artifacts.empty() || params.apply_filter_illumina_adapters;
+	filter_universal_targets = params.filter_universal_targets;
+	collapse_duplicate_reads = params.collapse_duplicate_reads;
+
+	// A leader of a CBC occurs at least as many times in the whole sample, so leaders with approximate sample count
+	// below min_leader_count or not above rare_leader_thr can be dropped already in the enumeration
+	// (for min_leader_count the sketch is made exact before counting, see count_exact_leaders())
+	uint32_t sketch_min_count = max<uint32_t>((uint32_t) min_leader_count, rare_leader_thr + 1);
+	leader_sketch.reset();
+	if (sketch_min_count > 1 && params.leader_sketch_mb.get() > 0)
+		leader_sketch = make_unique<CLeaderSketch>((size_t) params.leader_sketch_mb.get() << 20, sketch_min_count);
 
 	verbosity_level = params.verbosity_level.get();
 
+	select_window_kernels();
+
 	apply_cbc_correction = params.apply_cbc_correction;
 	cbc_filtering_thr = params.cbc_filtering_thr.get();
 
 	input_format = params.input_format;
+	fastq_records = input_format != input_format_t::fasta;
 	filtered_input_in_FASTA = input_format == input_format_t::fasta;
 	output_format = params.output_format;
+	sorted_output = params.sorted_output;
 
-	predefined_cbc.clear();
+	if (prev)
+		predefined_cbc = move(prev->predefined_cbc);
+	else
+	{
+		predefined_cbc = params.predefined_cbc_encoded;
 
-	for (const auto& s : params.predefined_cbc)
-		predefined_cbc.insert(base_coding4.encode_bases_2b(s));
+		for (const auto& s : params.predefined_cbc)
+			predefined_cbc.emplace_back(base_coding4.encode_bases_2b(s));
+
+		std::sort(predefined_cbc.begin(), predefined_cbc.end());
+		predefined_cbc.erase(unique(predefined_cbc.begin(), predefined_cbc.end()), predefined_cbc.end());
+		if (!predefined_cbc.empty() && predefined_cbc.back() == ~0ull)
+			predefined_cbc.pop_back();
+	}
 
 	if (params.export_cbc_logs)
 	{
@@ -106,6 +181,7 @@ void CBarcodedCounter::SetParams(const CParams& params)
 void CBarcodedCounter::set_CBC_file_names()
 {
 	file_names = cbc_file_names;
+	bam_view = bam_view_t::cbc_umi;
 
 	fn_queue = make_unique<parallel_queue<pair<int, string>>>(cbc_file_names.size());
 
@@ -119,6 +195,7 @@ void CBarcodedCounter::set_CBC_file_names()
 void CBarcodedCounter::set_read_file_names()
 {
 	file_names = read_file_names;
+	bam_view = bam_view_t::read;
 
 	fn_queue = make_unique<parallel_queue<pair<int, string>>>(read_file_names.size());
 
@@ -131,18 +208,34 @@ void CBarcodedCounter::set_read_file_names()
 // *********************************************************************************************
 void CBarcodedCounter::start_reading_threads()
 {
-	reading_threads.clear();
-	reading_threads.reserve(no_reading_threads);
+	start_reading_threads(reading_threads, fn_queue.get(), memory_pools, block_queues, bam_view);
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::start_reading_threads(vector<thread>& threads, parallel_queue<pair<int, string>>* p_fn_queue,
+	vector<unique_ptr<CMemoryPool<char>>>& pools, vector<unique_ptr<block_queue_t>>& queues, bam_view_t view)
+{
+	threads.clear();
+	threads.reserve(no_reading_threads);
 
 	for (int i = 0; i < no_reading_threads; ++i)
 	{
-		reading_threads.push_back(thread([&, i] {
+		threads.push_back(thread([&, i, p_fn_queue, p_pools = &pools, p_queues = &queues, view] {
 			int thread_id = i;
 			pair<int, string> id_fn;
-			CFastXReader fqx(input_format == input_format_t::fastq);
+			CFastXReader fqx(fastq_records);
 			memory_chunk<char> mc;
 
-			while (fn_queue->pop(id_fn))
+			auto& my_memory_pool = (*p_pools)[thread_id];
+			auto& my_block_queue = (*p_queues)[thread_id];
+
+			fqx.SetNoGzThreads(no_gz_threads ? no_gz_threads : max(no_threads / no_reading_threads - 2, 1));
+			fqx.SetUseMmap(mmap_input);
+			fqx.SetBamView(view, cbc_len, umi_len);
+			if (mmap_input)
+				my_memory_pool->SetExternalRelease(CFastXReader::ReleaseMappedRange);
+
+			while (p_fn_queue->pop(id_fn))
 			{
 				if(verbosity_level >= 2)
 					std::cerr << "Reading thread " + to_string(thread_id) + " opens: " + id_fn.second + "\n";
@@ -158,13 +251,30 @@ void CBarcodedCounter::start_reading_threads()
 					exit(1);
 				}
 
+				if (fqx.IsMapped())
+				{
+					// Record-aligned views into the mapped file go through the same queue (in order), with no copying
+					char* data;
+					size_t size;
+
+					while (!fqx.Eof() && fqx.NextMappedRange(data, size, chunk_size))
+					{
+						my_memory_pool->PopExternal(mc, data, size);
+						timed_push(*my_block_queue, make_pair(id_fn.first, move(mc)));
+					}
+
+					// The mapping must live until all its views are processed
+					my_memory_pool->WaitForExternal();
+					continue;
+				}
+
 				while (!fqx.Eof())
 				{
-					memory_pools[thread_id]->Pop(mc);
+					my_memory_pool->Pop(mc);
 
 					if (!fqx.ReadBlock(mc))
 					{
-						memory_pools[thread_id]->Push(mc);
+						my_memory_pool->Unpop(mc);
 						break;
 					}
 					else
@@ -172,14 +282,14 @@ void CBarcodedCounter::start_reading_threads()
 //						cerr << "Reading thread " + to_string(thread_id) + " loaded block of size: " + to_string(mc.size()) + "\n";
 					}
 
-					block_queues[thread_id]->push(make_pair(id_fn.first, move(mc)));
+					timed_push(*my_block_queue, make_pair(id_fn.first, move(mc)));
 				}
 			}
 
 			if (verbosity_level >= 2)
 				std::cerr << "Reading thread " + to_string(thread_id) + " completed\n";
 
-			block_queues[thread_id]->mark_completed();
+			my_block_queue->mark_completed();
 		}));
 	}
 }
@@ -201,24 +311,25 @@ void CBarcodedCounter::start_counting_threads()
 			int thread_id = i;
 
 			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			CReadReader read_reader(fastq_records);
 			read_desc_t read_desc;
 
 			auto& my_block_queue = block_queues[thread_id];
 			auto& my_memory_pool = memory_pools[thread_id];
-//			auto& my_cbc_dict = cbc_dict[thread_id];
 
-			unordered_map<cbc_t, vector<umi_readfid_t>, refresh::MurMur64Hash> my_cbc_dict;
-			my_cbc_dict.max_load_factor(0.8);
+			vector<vector<cbc_umi_readfid_t>> my_cbc_parts(no_cbc_partitions);
+			unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash> my_other_shard_cbc_counts;
+			const bool drop_other_shards = drop_other_shards_at_counting();
 
-			BaseCoding4 bc4;
+			uint8_t cbc_umi_packed[dna_packed_bytes(64)];
+			uint8_t cbc_umi_n_mask[dna_mask_bytes(64)];
 
 			int total_no_reads = 0;
 
 			int file_id = -1;
 			int file_read_id = 0;
 
-			while (my_block_queue->pop(id_mc))
+			while (timed_pop(*my_block_queue, id_mc))
 			{
 				if (id_mc.first != file_id)
 				{
@@ -246,11 +357,20 @@ void CBarcodedCounter::start_counting_threads()
 						continue;
 					}
 
-					cbc_t cbc = bc4.encode_bases_2b(read_desc.bases, read_desc.bases + cbc_len);
-					umi_t umi = bc4.encode_bases_2b(read_desc.bases + cbc_len, read_desc.bases + cbc_len + umi_len);
+					// CBC and UMI (up to 32 bases each) are packed at once
+					uint32_t cbc_umi_len = cbc_len + umi_len;
+					dna_pack(read_desc.bases, cbc_umi_len, cbc_umi_packed, cbc_umi_n_mask);
+
+					cbc_t cbc = dna_packed_has_n(cbc_umi_n_mask, cbc_umi_len, 0, cbc_len) ? ~0ull : dna_packed_kmer(cbc_umi_packed, cbc_umi_len, 0, cbc_len);
+					umi_t umi = dna_packed_has_n(cbc_umi_n_mask, cbc_umi_len, cbc_len, umi_len) ? ~0ull : dna_packed_kmer(cbc_umi_packed, cbc_umi_len, cbc_len, umi_len);
 
-					if (cbc != ~0ull && umi != ~0ull)
-						my_cbc_dict[cbc].emplace_back(umi, encode_read_id(id_mc.first, file_read_id++));
+					if (cbc != ~0ull && umi != ~0ull && drop_other_shards && !in_cbc_shard(cbc))
+					{
+						++my_other_shard_cbc_counts[cbc];
+						file_read_id++;
+					}
+					else if (cbc != ~0ull && umi != ~0ull)
+						my_cbc_parts[cbc_partition_id(cbc)].emplace_back(cbc, umi, encode_read_id(id_mc.first, file_read_id++));
 					else
 						file_read_id++;
 
@@ -266,13 +386,98 @@ void CBarcodedCounter::start_counting_threads()
 				my_memory_pool->Push(id_mc.second);
 			}
 
-			cbc_dict[thread_id] = move(my_cbc_dict);
+			thread_cbc_parts[thread_id] = move(my_cbc_parts);
+			thread_other_shard_cbc_counts[thread_id] = move(my_other_shard_cbc_counts);
 
 			if (verbosity_level >= 2)
 				std::cerr << "Counting thread " + to_string(thread_id) + " found " + to_string(total_no_reads) + " reads in total and completed\n";
 
 			no_sample_reads += total_no_reads;
+			run_stats.Add(CRunStats::counter_t::records_in, total_no_reads);
+
+			}));
+	}
+}
+
+// *********************************************************************************************
+// Fused pipeline: reads R2 files in parallel to R1 files and packs all reads (indexed by raw read id)
+void CBarcodedCounter::start_reads_packing_threads()
+{
+	r2_fn_queue = make_unique<parallel_queue<pair<int, string>>>(read_file_names.size());
+
+	for (int i = 0; i < (int) read_file_names.size(); ++i)
+		r2_fn_queue->push(make_pair(i, read_file_names[i]));
+
+	r2_fn_queue->mark_completed();
+
+	r2_block_queues.clear();
+	r2_memory_pools.clear();
+
+	for (int i = 0; i < no_reading_threads; ++i)
+	{
+		r2_block_queues.emplace_back(make_unique<block_queue_t>(no_blocks_in_queue));
+		r2_memory_pools.emplace_back(make_unique<CMemoryPool<char>>(no_chunks_per_file, chunk_size));
+	}
+
+	mma.clear();
+	mma.reserve(read_file_names.size());
+	for (int i = 0; i < (int) read_file_names.size(); ++i)
+		mma.push_back(make_unique<memory_monotonic_safe>(16 << 20, 1));
+
+	raw_sample_reads.clear();
+	raw_sample_reads.resize(read_file_names.size());
+
+	start_reading_threads(r2_reading_threads, r2_fn_queue.get(), r2_memory_pools, r2_block_queues, bam_view_t::read);
+
+	r2_packing_threads.clear();
+	r2_packing_threads.reserve(no_reading_threads);
+
+	for (int i = 0; i < no_reading_threads; ++i)
+	{
+		r2_packing_threads.push_back(thread([&, i] {
+			int thread_id = i;
+
+			pair<int, memory_chunk<char>> id_mc;
+			CReadReader read_reader(fastq_records);
+			read_desc_t read_desc;
+
+			auto& my_block_queue = r2_block_queues[thread_id];
+			auto& my_memory_pool = r2_memory_pools[thread_id];
 
+			uint64_t total_no_reads = 0;
+			CDnaPackedRead packed_read;
+
+			// Each file is read by a single reading thread, so its blocks come in order through a single queue
+			while (timed_pop(*my_block_queue, id_mc))
+			{
+				int file_id = id_mc.first;
+				auto& my_mma = mma[file_id];
+				auto& my_reads = raw_sample_reads[file_id];
+
+				read_reader.Assign(id_mc.second);
+
+				while (read_reader.GetRead(read_desc))
+				{
+					packed_read.Assign(read_desc.bases, strlen(read_desc.bases));
+
+					// Also reads to be dropped are counted here (valid reads are not known yet), which only makes the sketch less selective
+					if (leader_sketch)
+						leader_sketch->AddRead(packed_read.View(), leader_len, gap_len, follower_len, accepted_anchors.get());
+
+					uint8_t *p = (uint8_t*)(my_mma->allocate(packed_read.StoredSize()));
+					packed_read.Store(p);
+
+					my_reads.emplace_back(p);
+					++total_no_reads;
+				}
+
+				my_memory_pool->Push(id_mc.second);
+			}
+
+			if (verbosity_level >= 2)
+				std::cerr << "Reads packing thread " + to_string(thread_id) + " packed " + to_string(total_no_reads) + " reads in total and completed\n";
+
+			run_stats.Add(CRunStats::counter_t::records_in, total_no_reads);
 			}));
 	}
 }
@@ -296,6 +501,25 @@ std::string CBarcodedCounter::get_dedup_file_name(const std::string& input_path,
 	return out.string();
 }
 
+// *********************************************************************************************
+// Filtered reads are written as BGZF (compressed in parallel); returns nullptr if the file cannot be created
+unique_ptr<CBgzfWriter> CBarcodedCounter::open_filtered_file(int file_id, const uint32_t id)
+{
+	string out_fn = get_dedup_file_name(file_names[file_id], id);
+
+	FILE* f = fopen(out_fn.c_str(), "wb");
+
+	if (!f)
+	{
+		cerr << "Cannot create filtered file: " << file_names[file_id] << endl;
+		return nullptr;
+	}
+
+	setvbuf(f, nullptr, _IOFBF, gz_filtered_file_buffer_size);
+
+	return make_unique<CBgzfWriter>(f, out_fn, no_gz_threads ? no_gz_threads : max(no_threads / no_reading_threads - 1, 1));
+}
+
 // *********************************************************************************************
 void CBarcodedCounter::start_reads_exporting_threads()
 {
@@ -313,7 +537,7 @@ void CBarcodedCounter::start_reads_exporting_threads()
 			int thread_id = i;
 
 			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			CReadReader read_reader(fastq_records);
 			read_desc_t read_desc;
 
 			auto& my_block_queue = block_queues[thread_id];
@@ -328,9 +552,9 @@ void CBarcodedCounter::start_reads_exporting_threads()
 			uint64_t my_total_read_len = 0;
 			uint64_t my_total_no_reads = 0;
 
-			gzFile filtered_file = nullptr;
+			unique_ptr<CBgzfWriter> filtered_file;
 
-			while (my_block_queue->pop(id_mc))
+			while (timed_pop(*my_block_queue, id_mc))
 			{
 				if (id_mc.first != file_id)
 				{
@@ -338,16 +562,8 @@ void CBarcodedCounter::start_reads_exporting_threads()
 					file_read_id = 0;
 					file_read_id_raw = 0;
 
-					if (filtered_file)
-						gzclose(filtered_file);
-
-					string out_fn = get_dedup_file_name(file_names[file_id], 1);
-
-					filtered_file = gzopen(out_fn.c_str(), "w3");
-					if (filtered_file)
-						gzbuffer(filtered_file, gz_filtered_file_buffer_size);
-					else
-						cerr << "Cannot create filtered file: " << file_names[file_id] << endl;
+					filtered_file.reset();
+					filtered_file = open_filtered_file(file_id, 1);
 				}
 				//				cerr << "Counting thread " + to_string(thread_id) + " got block of size : " + to_string(id_mc.second.size()) + "\n";
 
@@ -368,17 +584,13 @@ void CBarcodedCounter::start_reads_exporting_threads()
 
 					if (filtered_file)
 					{
-						gzputs(filtered_file, read_desc.header);
-						gzputc(filtered_file, '\n');
-						gzputs(filtered_file, read_desc.bases);
-						gzputc(filtered_file, '\n');
+						filtered_file->PutLine(read_desc.header);
+						filtered_file->PutLine(read_desc.bases);
 
 						if (!filtered_input_in_FASTA)
 						{
-							gzputs(filtered_file, read_desc.plus);
-							gzputc(filtered_file, '\n');
-							gzputs(filtered_file, read_desc.quality);
-							gzputc(filtered_file, '\n');
+							filtered_file->PutLine(read_desc.plus);
+							filtered_file->PutLine(read_desc.quality);
 						}
 					}
 
@@ -397,12 +609,14 @@ void CBarcodedCounter::start_reads_exporting_threads()
 				my_memory_pool->Push(id_mc.second);
 			}
 
-			if (filtered_file)	
-				gzclose(filtered_file);
+			filtered_file.reset();
 
 			if (verbosity_level >= 2)
 				std::cerr << "Reads exporting thread " + to_string(thread_id) + " found " + to_string(total_no_reads) + " reads in total and completed\n";
 
+			run_stats.Add(CRunStats::counter_t::records_in, total_no_reads);
+			run_stats.Add(CRunStats::counter_t::records_out, my_total_no_reads);
+
 //			no_sample_reads += total_no_reads;
 
 //			a_total_no_reads += my_total_no_reads;
@@ -437,13 +651,17 @@ void CBarcodedCounter::start_reads_loading_threads()
 			int thread_id = i;
 
 			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			CReadReader read_reader(fastq_records);
 			read_desc_t read_desc;
 
 			auto& my_block_queue = block_queues[thread_id];
 			auto& my_memory_pool = memory_pools[thread_id];
 			auto& my_mma = mma[thread_id];
 
+			vector<CNumaArenaCache> my_numa_caches;
+			for (auto& arena : numa_arenas)
+				my_numa_caches.emplace_back(arena.get());
+
 			int total_no_reads = 0;
 
 			int file_id = -1;
@@ -453,9 +671,10 @@ void CBarcodedCounter::start_reads_loading_threads()
 			uint64_t my_total_read_len = 0;
 			uint64_t my_total_no_reads = 0;
 
-			gzFile filtered_file = nullptr;
+			unique_ptr<CBgzfWriter> filtered_file;
+			CDnaPackedRead packed_read;
 
-			while (my_block_queue->pop(id_mc))
+			while (timed_pop(*my_block_queue, id_mc))
 			{
 				if (id_mc.first != file_id)
 				{
@@ -465,16 +684,8 @@ void CBarcodedCounter::start_reads_loading_threads()
 
 					if (((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::second)
 					{
-						if (filtered_file)
-							gzclose(filtered_file);
-
-						string out_fn = get_dedup_file_name(file_names[file_id], 2);
-
-						filtered_file = gzopen(out_fn.c_str(), "w3");
-						if (filtered_file)
-							gzbuffer(filtered_file, gz_filtered_file_buffer_size);
-						else
-							cerr << "Cannot create filtered file: " << file_names[file_id] << endl;
+						filtered_file.reset();
+						filtered_file = open_filtered_file(file_id, 2);
 					}
 				}
 				//				cerr << "Counting thread " + to_string(thread_id) + " got block of size : " + to_string(id_mc.second.size()) + "\n";
@@ -496,17 +707,13 @@ void CBarcodedCounter::start_reads_loading_threads()
 
 					if (filtered_file)
 					{
-						gzputs(filtered_file, read_desc.header);
-						gzputc(filtered_file, '\n');
-						gzputs(filtered_file, read_desc.bases);
-						gzputc(filtered_file, '\n');
+						filtered_file->PutLine(read_desc.header);
+						filtered_file->PutLine(read_desc.bases);
 
 						if (!filtered_input_in_FASTA)
 						{
-							gzputs(filtered_file, read_desc.plus);
-							gzputc(filtered_file, '\n');
-							gzputs(filtered_file, read_desc.quality);
-							gzputc(filtered_file, '\n');
+							filtered_file->PutLine(read_desc.plus);
+							filtered_file->PutLine(read_desc.quality);
 						}
 					}
 
@@ -514,13 +721,17 @@ void CBarcodedCounter::start_reads_loading_threads()
 					my_total_read_len += read_len;
 
 #ifdef USE_READ_COMPRESSION
-					size_t pred_len = (read_len + 1 + 2) / 3;
-					uint8_t *p = (uint8_t*)(my_mma->allocate(pred_len));
-					size_t enc_len = base_coding3.encode_bases(read_desc.bases, read_len, p);
+					packed_read.Assign(read_desc.bases, read_len);
 
-					if (pred_len != enc_len)
-						std::cerr << to_string(read_len) + "   -   "  + to_string(pred_len) + " : " + to_string(enc_len) + "\n";
+					if (leader_sketch)
+						leader_sketch->AddRead(packed_read.View(), leader_len, gap_len, follower_len, accepted_anchors.get());
 
+					uint8_t* p = nullptr;
+					if (!my_numa_caches.empty())
+						p = my_numa_caches[read_numa_node[file_id][file_read_id]].Allocate(packed_read.StoredSize());
+					if (!p)
+						p = (uint8_t*)(my_mma->allocate(packed_read.StoredSize()));
+					packed_read.Store(p);
 #else
 					uint8_t* p = (uint8_t*)(my_mma->allocate(read_len + 1));
 					memcpy(p, read_desc.bases, read_len + 1);			// !!! Add compression of reads (at least 2 bases -> 1 byte) here
@@ -540,13 +751,160 @@ void CBarcodedCounter::start_reads_loading_threads()
 				my_memory_pool->Push(id_mc.second);
 			}
 
-			if (filtered_file)	
-				gzclose(filtered_file);
+			filtered_file.reset();
 
 			if (verbosity_level >= 2)
 				std::cerr << "Reads loading thread " + to_string(thread_id) + " found " + to_string(total_no_reads) + " reads in total and completed\n";
 
 			no_sample_reads += total_no_reads;
+			run_stats.Add(CRunStats::counter_t::records_in, total_no_reads);
+
+			a_total_no_reads += my_total_no_reads;
+			a_total_read_len += my_total_read_len;
+
+			}));
+	}
+}
+
+// *********************************************************************************************
+// Same as start_reads_loading_threads, but packed reads are appended to bucket files instead of memory arenas
+// Record in bucket file: [read id (8B)][packed len (4B)][packed read in the stored form (see dna_stored_view)]
+void CBarcodedCounter::start_reads_spilling_threads()
+{
+	reads_loading_threads.clear();
+	reads_loading_threads.reserve(no_reading_threads);
+
+	no_sample_reads = 0;
+
+	a_total_read_len = 0;
+	a_total_no_reads = 0;
+
+	for (int i = 0; i < no_reading_threads; ++i)
+	{
+		reads_loading_threads.push_back(thread([&, i] {
+			int thread_id = i;
+
+			pair<int, memory_chunk<char>> id_mc;
+			CReadReader read_reader(fastq_records);
+			read_desc_t read_desc;
+
+			auto& my_block_queue = block_queues[thread_id];
+			auto& my_memory_pool = memory_pools[thread_id];
+
+			vector<vector<uint8_t>> my_buffers(bucket_files.size());
+			vector<uint8_t> packed;
+
+			auto flush_buffer = [&](size_t bucket_id) {
+				auto& buf = my_buffers[bucket_id];
+				if (buf.empty())
+					return;
+
+				lock_guard<mutex> lck(*bucket_mtxs[bucket_id]);
+				if (fwrite(buf.data(), 1, buf.size(), bucket_files[bucket_id]) != buf.size())
+				{
+					std::cerr << "Error: Cannot write to bucket file: " + bucket_file_names[bucket_id] + "\n";
+					exit(1);
+				}
+				buf.clear();
+			};
+
+			int total_no_reads = 0;
+
+			int file_id = -1;
+			int file_read_id = 0;			// read id after relabelling
+			int file_read_id_raw = 0;		// read id before relabelling
+
+			uint64_t my_total_read_len = 0;
+			uint64_t my_total_no_reads = 0;
+
+			unique_ptr<CBgzfWriter> filtered_file;
+			CDnaPackedRead packed_read;
+
+			while (timed_pop(*my_block_queue, id_mc))
+			{
+				if (id_mc.first != file_id)
+				{
+					file_id = id_mc.first;
+					file_read_id = 0;
+					file_read_id_raw = 0;
+
+					if (((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::second)
+					{
+						filtered_file.reset();
+						filtered_file = open_filtered_file(file_id, 2);
+					}
+				}
+
+				read_reader.Assign(id_mc.second);
+
+				int no_reads = 0;
+
+				while (read_reader.GetRead(read_desc))
+				{
+					if (!valid_reads[file_id][file_read_id_raw])
+					{
+						++file_read_id_raw;
+						++no_reads;
+						continue;
+					}
+
+					int read_len = strlen(read_desc.bases);
+
+					if (filtered_file)
+					{
+						filtered_file->PutLine(read_desc.header);
+						filtered_file->PutLine(read_desc.bases);
+
+						if (!filtered_input_in_FASTA)
+						{
+							filtered_file->PutLine(read_desc.plus);
+							filtered_file->PutLine(read_desc.quality);
+						}
+					}
+
+					my_total_no_reads++;
+					my_total_read_len += read_len;
+
+					packed_read.Assign(read_desc.bases, read_len);
+
+					if (leader_sketch)
+						leader_sketch->AddRead(packed_read.View(), leader_len, gap_len, follower_len, accepted_anchors.get());
+
+					uint32_t enc_len = (uint32_t) packed_read.StoredSize();
+					packed.resize(enc_len);
+					packed_read.Store(packed.data());
+
+					uint64_t read_id = encode_read_id(file_id, file_read_id);
+					auto bucket_id = read_bucket[file_id][file_read_id];
+					auto& buf = my_buffers[bucket_id];
+
+					buf.insert(buf.end(), (uint8_t*) &read_id, (uint8_t*) &read_id + sizeof(read_id));
+					buf.insert(buf.end(), (uint8_t*) &enc_len, (uint8_t*) &enc_len + sizeof(enc_len));
+					buf.insert(buf.end(), packed.begin(), packed.begin() + enc_len);
+
+					if (buf.size() >= bucket_write_buffer_size)
+						flush_buffer(bucket_id);
+
+					++file_read_id;
+					++file_read_id_raw;
+					++no_reads;
+				}
+
+				total_no_reads += no_reads;
+
+				my_memory_pool->Push(id_mc.second);
+			}
+
+			for (size_t j = 0; j < my_buffers.size(); ++j)
+				flush_buffer(j);
+
+			filtered_file.reset();
+
+			if (verbosity_level >= 2)
+				std::cerr << "Reads spilling thread " + to_string(thread_id) + " found " + to_string(total_no_reads) + " reads in total and completed\n";
+
+			no_sample_reads += total_no_reads;
+			run_stats.Add(CRunStats::counter_t::records_in, total_no_reads);
 
 			a_total_no_reads += my_total_no_reads;
 			a_total_read_len += my_total_read_len;
@@ -561,14 +919,21 @@ void CBarcodedCounter::init_queues_and_pools()
 	block_queues.clear();
 
 	for(int i = 0; i < no_reading_threads; ++i)
-		block_queues.emplace_back(make_unique<parallel_queue<pair<int, memory_chunk<char>>>>(no_blocks_in_queue));
+		block_queues.emplace_back(make_unique<block_queue_t>(no_blocks_in_queue));
 
-	memory_pools.clear();
-
-	for (int i = 0; i < no_reading_threads; ++i)
+	// Pools are kept (all chunks are returned at the end of each stage), so only the missing ones are created
+	while (memory_pools.size() < (size_t) no_reading_threads)
 		memory_pools.emplace_back(make_unique<CMemoryPool<char>>(no_chunks_per_file, chunk_size));
 
-	cbc_dict.resize(no_reading_threads);
+	uint32_t cbc_partition_bits = min<uint32_t>(max_cbc_partition_bits, 2 * cbc_len);
+	no_cbc_partitions = 1u << cbc_partition_bits;
+	cbc_partition_shift = 2 * cbc_len - cbc_partition_bits;
+
+	thread_cbc_parts.clear();
+	thread_cbc_parts.resize(no_reading_threads);
+
+	thread_other_shard_cbc_counts.clear();
+	thread_other_shard_cbc_counts.resize(no_reading_threads);
 }
 
 // *********************************************************************************************
@@ -577,27 +942,32 @@ void CBarcodedCounter::reinit_queues()
 	block_queues.clear();
 
 	for(int i = 0; i < no_reading_threads; ++i)
-		block_queues.emplace_back(make_unique<parallel_queue<pair<int, memory_chunk<char>>>>(no_blocks_in_queue));
+		block_queues.emplace_back(make_unique<block_queue_t>(no_blocks_in_queue));
 }
 
 // *********************************************************************************************
 bool CBarcodedCounter::init_bkc_files()
 {
 	bkc_files.clear();
-	bkc_files.reserve(no_splits);
+	bkc_files.reserve(no_panels * no_splits);
 
 	bool r = true;
 
-	for (uint32_t i = 0; i < no_splits; ++i)
+	for (uint32_t p = 0; p < no_panels; ++p)
 	{
-		bkc_files.push_back(make_shared<CBKCFile>());
-		bkc_files.back()->SetParams(sample_id_size_in_bytes, barcode_size_in_bytes, leader_size_in_bytes, follower_size_in_bytes, counter_size_in_bytes,
-			cbc_len, leader_len, gap_len, follower_len, zstd_level);
-
-		if(no_splits == 1)
-			r &= bkc_files.back()->Create(out_file_name, output_format);
-		else
-			r &= bkc_files.back()->Create(out_file_name + "." + to_string(i), output_format);
+		string panel_file_name = no_panels == 1 ? out_file_name : out_file_name + ".panel" + to_string(p);
+
+		for (uint32_t i = 0; i < no_splits; ++i)
+		{
+			bkc_files.push_back(make_shared<CBKCFile>());
+			bkc_files.back()->SetParams(sample_id_size_in_bytes, barcode_size_in_bytes, leader_size_in_bytes, follower_size_in_bytes, counter_size_in_bytes,
+				cbc_len, leader_len, gap_len, follower_len, zstd_level);
+
+			if(no_splits == 1)
+				r &= bkc_files.back()->Create(panel_file_name, output_format);
+			else
+				r &= bkc_files.back()->Create(panel_file_name + "." + to_string(i), output_format);
+		}
 	}
 
 	if (!r)
@@ -607,147 +977,180 @@ bool CBarcodedCounter::init_bkc_files()
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::merge_cbc_dict()
+// Partitions are independent, so they are dynamically distributed over threads (largest first, as sizes are skewed)
+template<typename FUN> void CBarcodedCounter::run_for_cbc_partitions(FUN&& fun)
 {
-	vector<thread> threads;
+	vector<uint64_t> part_sizes(no_cbc_partitions, 0);
 
-	vector<cbc_t> cbcs;
-	atomic_int id{ 0 };
+	for (uint32_t i = 0; i < no_cbc_partitions; ++i)
+	{
+		if (i < cbc_parts.size())
+			part_sizes[i] += cbc_parts[i].size();
 
-	for (int i = 1; i < (int) cbc_dict.size(); ++i)
-		for (auto& x : cbc_dict[i])
-			if (!cbc_dict[0].count(x.first))
-				cbc_dict[0][x.first] = {};
+		for (auto& x : thread_cbc_parts)
+			if (i < x.size())
+				part_sizes[i] += x[i].size();
+	}
 
-	cbcs.reserve(cbc_dict[0].size());
+	CSizeScheduler scheduler;
+	scheduler.Prepare(part_sizes);
 
-	for (auto& x : cbc_dict[0])
-		cbcs.emplace_back(x.first);
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
+		CSizeScheduler::task_t task;
 
-	threads.reserve(no_threads);
+		while (scheduler.Next(task))
+			fun((uint32_t) task.item_id);
+		});
+}
+
+// *********************************************************************************************
+// Gathers parts of all counting threads and sorts them by (cbc, umi, readfid)
+void CBarcodedCounter::sort_cbc_partitions()
+{
+	cbc_parts.clear();
+	cbc_parts.resize(no_cbc_partitions);
+
+	run_for_cbc_partitions([&](uint32_t part_id) {
+		auto& part = cbc_parts[part_id];
 
-	for (int t = 0; t < no_threads; ++t)
-		threads.emplace_back([&] {
-		int curr_id;
+		size_t no_items = 0;
+		for (auto& x : thread_cbc_parts)
+			no_items += x[part_id].size();
 
-		vector<vector<umi_readfid_t>*> ptrs(cbc_dict.size(), nullptr);
+		part.reserve(no_items);
 
-		while (true)
+		for (auto& x : thread_cbc_parts)
 		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)cbcs.size())
-				break;
+			part.insert(part.end(), x[part_id].begin(), x[part_id].end());
+			clear_vec(x[part_id]);
+		}
 
-			cbc_t curr_cbc = cbcs[curr_id];
-			size_t no_items = 0;
+		refresh::sort::pdqsort(part.begin(), part.end());
+		});
 
-			for (int i = 0; i < (int) cbc_dict.size(); ++i)
-			{
-				auto p = cbc_dict[i].find(curr_cbc);
+	clear_vec(thread_cbc_parts);
+}
 
-				if (p == cbc_dict[i].end())
-					ptrs[i] = nullptr;
-				else
-				{
-					ptrs[i] = &(p->second);
-					no_items += p->second.size();
-				}
-			}
+// *********************************************************************************************
+void CBarcodedCounter::gather_cbc_stats()
+{
+	sort_cbc_partitions();
 
-			ptrs[0]->reserve(no_items);
+	vector<vector<pair<uint64_t, cbc_t>>> part_stats(no_cbc_partitions);
 
-			for (int i = 1; i < (int) cbc_dict.size(); ++i)
-			{
-				if (!ptrs[i])
-					continue;
+	run_for_cbc_partitions([&](uint32_t part_id) {
+		auto& part = cbc_parts[part_id];
+		auto& stats = part_stats[part_id];
 
-				ptrs[0]->insert(ptrs[0]->end(), ptrs[i]->begin(), ptrs[i]->end());
-				clear_vec(*ptrs[i]);
-			}
+		for (size_t i = 0; i < part.size(); )
+		{
+			size_t j = i + 1;
+			while (j < part.size() && part[j].cbc == part[i].cbc)
+				++j;
+
+			stats.emplace_back(j - i, part[i].cbc);
+			i = j;
 		}
-			});
+		});
+
+	// CBCs of other shards (if dropped while counting) are never present in partitions, so they are just appended
+	unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash> other_shard_counts;
+	for (auto& x : thread_other_shard_cbc_counts)
+	{
+		for (const auto& y : x)
+			other_shard_counts[y.first] += y.second;
+		x.clear();
+	}
+	thread_other_shard_cbc_counts.clear();
+
+	size_t no_cbcs = other_shard_counts.size();
+	for (auto& x : part_stats)
+		no_cbcs += x.size();
 
-	join_threads(threads);
+	cbc_stats.clear();
+	cbc_stats.reserve(no_cbcs);
 
-	for (int i = 1; i < (int) cbc_dict.size(); ++i)
-		cbc_dict[i].clear();
+	for (auto& x : part_stats)
+	{
+		cbc_stats.insert(cbc_stats.end(), x.begin(), x.end());
+		clear_vec(x);
+	}
+
+	for (const auto& x : other_shard_counts)
+		cbc_stats.emplace_back(x.second, x.first);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::sort_cbc_dict()
+// A CBC is corrected if there is exactly one trusted CBC at Hamming distance 1
+void CBarcodedCounter::find_CBC_corrections()
 {
-	atomic_int id{ 0 };
+	CCbcCorrectionIndex correction_index;
 
-	vector<thread> threads;
+	vector<cbc_t> trusted;
+	trusted.reserve(cbc_vec.size());
+	for (const auto& x : cbc_vec)
+		trusted.emplace_back(x.second);
 
-	vector<vector<umi_readfid_t>*> umis;
+	correction_index.Build(move(trusted), cbc_len);
 
-	umis.reserve(cbc_dict[0].size());
-	for (auto& x : cbc_dict[0])
-		umis.emplace_back(&(x.second));
+	vector<cbc_t> corrected(cbc_for_corr_vec.size(), ~0ull);
+	const size_t chunk_size = 1 << 12;
 
-	threads.reserve(no_threads);
+	thread_pool->ParallelForEach(cbc_for_corr_vec.size(), [&](size_t j) {
+		cbc_t neighbour;
+		if (correction_index.FindUniqueNeighbour(cbc_for_corr_vec[j].second, neighbour))
+			corrected[j] = neighbour;
+		}, chunk_size);
 
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
-		int curr_id = -1;
-		while (true)
-		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)umis.size())
-				break;
+	cbc_corrections.clear();
 
-			stable_sort(umis[curr_id]->begin(), umis[curr_id]->end());
-		}
-			});
+	for (size_t i = 0; i < cbc_for_corr_vec.size(); ++i)
+		if (corrected[i] != ~0ull)
+			cbc_corrections.emplace_back(cbc_for_corr_vec[i].second, corrected[i]);
 
-	join_threads(threads);
-}
+	std::sort(cbc_corrections.begin(), cbc_corrections.end());
 
-// *********************************************************************************************
-void CBarcodedCounter::gather_cbc_stats()
-{
-	cbc_stats.max_load_factor(0.8);
-	cbc_stats.reserve(cbc_dict[0].size());
+	if (verbosity_level >= 2)
+		std::cerr << "No. of corrected CBCs: " + to_string(cbc_corrections.size()) + " of " + to_string(cbc_for_corr_vec.size()) + "\n";
 
-	for (size_t i = 0; i < cbc_dict.size(); ++i)
-		for (const auto& x : cbc_dict[i])
-			cbc_stats[x.first] += x.second.size();
+	clear_vec(cbc_for_corr_vec);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::find_CBC_corrections()
+// Trusted CBCs of other shards are removed (so their records are removed with non-trusted CBCs); the side file
+// <output>.shard_stats allows to check that all shards used the same threshold
+void CBarcodedCounter::keep_cbc_shard()
 {
-	unordered_map<cbc_t, vector<cbc_t>> candidate_corrections;
+	uint64_t no_trusted = cbc_vec.size();
+	uint64_t trusted_thr = cbc_vec.empty() ? 0 : cbc_vec.back().first;
 
-	for (auto x : cbc_vec)
-	{
-		for (uint32_t i = 0; i < cbc_len; ++i)
-		{
-			auto xc = x.second;
-			uint32_t shift = 2 * i;
-			cbc_t mask = 3ull << shift;
+	cbc_vec.erase(remove_if(cbc_vec.begin(), cbc_vec.end(), [this](const pair<uint64_t, cbc_t>& x) {
+		return !in_cbc_shard(x.second); }), cbc_vec.end());
 
-			for (uint32_t j = 0; j < 4; ++j)
-			{
-				xc = (xc & ~mask) + (((cbc_t)j) << shift);
-				candidate_corrections[xc].emplace_back(x.second);
-			}
-		}
-	}
+	uint64_t no_shard_reads = 0;
+	for (const auto& x : cbc_vec)
+		no_shard_reads += x.first;
 
-	for (auto x : cbc_for_corr_vec)
-	{
-		auto p = candidate_corrections.find(x.second);
+	if (verbosity_level >= 2)
+		std::cerr << "CBC shard " + to_string(cbc_shard_id) + "/" + to_string(no_cbc_shards) + ": " + to_string(cbc_vec.size()) +
+			" of " + to_string(no_trusted) + " trusted CBCs\n";
 
-		if (p != candidate_corrections.end() && p->second.size() == 1)
-			correction_map[p->first] = p->second.front();
+	ofstream ofs(out_file_name + ".shard_stats");
+	if (!ofs)
+	{
+		cerr << "Cannot create shard stats file: " << out_file_name << ".shard_stats" << endl;
+		return;
 	}
 
-	clear_vec(cbc_for_corr_vec);
+	ofs << "cbc_shard\t" << cbc_shard_id << "/" << no_cbc_shards << "\n";
+	ofs << "trusted_thr\t" << trusted_thr << "\n";
+	ofs << "no_trusted_cbcs\t" << no_trusted << "\n";
+	ofs << "no_shard_cbcs\t" << cbc_vec.size() << "\n";
+	ofs << "no_shard_reads\t" << no_shard_reads << "\n";
 }
 
 // *********************************************************************************************
+// Corrected CBCs can go to another partition, so such records are moved in a second pass and touched partitions are resorted
 void CBarcodedCounter::remove_non_trusted_CBC()
 {
 	unordered_set<cbc_t> trusted_CBC;
@@ -757,47 +1160,106 @@ void CBarcodedCounter::remove_non_trusted_CBC()
 	for (auto x : cbc_vec)
 		trusted_CBC.insert(x.second);
 
-	global_cbc_umi_dict.max_load_factor(0.8);
+	vector<vector<vector<cbc_umi_readfid_t>>> moved(no_cbc_partitions);		// [src partition][dest partition]
+	vector<uint8_t> part_changed(no_cbc_partitions, 0);
 
-	for (size_t i = 0; i < cbc_dict.size(); ++i)
-	{
-		for (auto& x : cbc_dict[i])
+	run_for_cbc_partitions([&](uint32_t part_id) {
+		auto& part = cbc_parts[part_id];
+		size_t out = 0;
+
+		for (size_t i = 0; i < part.size(); ++i)
 		{
-			cbc_t cbc = x.first;
+			auto rec = part[i];
 
 			if (apply_cbc_correction)
 			{
-				auto p = correction_map.find(cbc);
-				if (p != correction_map.end())
-					cbc = p->second;
+				auto p = lower_bound(cbc_corrections.begin(), cbc_corrections.end(), make_pair(rec.cbc, cbc_t{ 0 }));
+				if (p != cbc_corrections.end() && p->first == rec.cbc)
+				{
+					rec.cbc = p->second;
+					part_changed[part_id] = 1;
+				}
 			}
 
-			if (trusted_CBC.count(cbc))
+			if (!trusted_CBC.count(rec.cbc))
+				continue;
+
+			uint32_t dest_id = cbc_partition_id(rec.cbc);
+
+			if (dest_id == part_id)
+				part[out++] = rec;
+			else
 			{
-				auto& r = global_cbc_umi_dict[cbc];
-				if (r.empty())
-					r.reserve(cbc_dict.size() - i);
-				r.emplace_back(move(x.second));
+				if (moved[part_id].empty())
+					moved[part_id].resize(no_cbc_partitions);
+				moved[part_id][dest_id].emplace_back(rec);
 			}
+		}
+
+		part.resize(out);
+		});
+
+	vector<vector<pair<cbc_t, vector<umi_readfid_t>>>> part_dicts(no_cbc_partitions);
+
+	run_for_cbc_partitions([&](uint32_t part_id) {
+		auto& part = cbc_parts[part_id];
 
-			clear_vec(x.second);
+		for (auto& x : moved)
+			if (!x.empty() && !x[part_id].empty())
+			{
+				part.insert(part.end(), x[part_id].begin(), x[part_id].end());
+				clear_vec(x[part_id]);
+				part_changed[part_id] = 1;
+			}
+
+		if (part_changed[part_id])
+			refresh::sort::pdqsort(part.begin(), part.end());
+
+		auto& dict = part_dicts[part_id];
+
+		for (size_t i = 0; i < part.size(); )
+		{
+			size_t j = i + 1;
+			while (j < part.size() && part[j].cbc == part[i].cbc)
+				++j;
+
+			dict.emplace_back(part[i].cbc, vector<umi_readfid_t>());
+			auto& umis = dict.back().second;
+			umis.reserve(j - i);
+
+			for (; i < j; ++i)
+				umis.emplace_back(part[i].umi, part[i].readfid);
 		}
 
-		cbc_dict[i].clear();
-	}
+		clear_vec(part);
+		});
+
+	clear_vec(cbc_parts);
+	clear_vec(moved);
 
-	clear_vec(cbc_dict);
+	size_t no_cbcs = 0;
+	for (auto& x : part_dicts)
+		no_cbcs += x.size();
+
+	global_cbc_umi_dict.max_load_factor(0.8);
+	global_cbc_umi_dict.reserve(no_cbcs);
+
+	// Records of a CBC are already sorted by (umi, readfid)
+	for (auto& x : part_dicts)
+	{
+		for (auto& y : x)
+			global_cbc_umi_dict.emplace(y.first, move(y.second));
+
+		clear_vec(x);
+	}
 }
 
 // *********************************************************************************************
 void CBarcodedCounter::remove_duplicated_UMI()
 {
-	atomic_int id{ 0 };
 	atomic_uint64_t total_no_after_removal { 0 };
 	atomic<uint64_t> a_total_no_reads_before_UMI_cleaning{ 0 };
 
-	vector<thread> threads;
-
 	vector<cbc_t> v_cbc;
 
 	global_cbc_dict.reserve(global_cbc_umi_dict.size());
@@ -814,95 +1276,53 @@ void CBarcodedCounter::remove_duplicated_UMI()
 		cbc_vec.emplace_back(0, x.first);
 	}
 
-	threads.reserve(no_threads);
+	// UMI groups are collapsed with a per-CBC random generator, so CBCs are not split (only ordered largest-first)
+	vector<uint64_t> cbc_sizes;
+	cbc_sizes.reserve(v_cbc.size());
+	for (auto x : v_cbc)
+		cbc_sizes.emplace_back(global_cbc_umi_dict[x].size());
 
-	for (int i_thread = 0; i_thread < no_threads; ++i_thread)
-		threads.emplace_back([&id, &v_cbc, this, &a_total_no_reads_before_UMI_cleaning, &total_no_after_removal] {
-		int curr_id = -1;
-		
-		vector<vector<umi_readfid_t>::iterator> p_src;
+	CSizeScheduler scheduler;
+	scheduler.Prepare(cbc_sizes);
 
-		while (true)
+	thread_pool->ParallelFor(no_threads, [&scheduler, &v_cbc, this, &a_total_no_reads_before_UMI_cleaning, &total_no_after_removal](uint32_t) {
+		CSizeScheduler::task_t task;
+		
+		while (scheduler.Next(task))
 		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)v_cbc.size())
-				break;
+			size_t curr_id = task.item_id;
 
 			mt19937_64 mt(v_cbc[curr_id]);
 
-			p_src.clear();
-
-			size_t cur_cbc_size = 0;
-			const umi_readfid_t umi_guard{ ~0ull, ~0ull };
-
 			auto& gd_src = global_cbc_umi_dict[v_cbc[curr_id]];
 			auto& gd_dest = global_cbc_dict[v_cbc[curr_id]];
 
-			for (auto& x : gd_src)
-			{
-				cur_cbc_size += x.size();
-				std::stable_sort(x.begin(), x.end());
-
-				// Add guard records
-				x.emplace_back(umi_guard);
-
-				p_src.emplace_back(x.begin());
-			}
-
-			a_total_no_reads_before_UMI_cleaning += cur_cbc_size;
+			// Records come sorted by (umi, readfid) from remove_non_trusted_CBC
+			if (!is_sorted(gd_src.begin(), gd_src.end()))
+				refresh::sort::pdqsort(gd_src.begin(), gd_src.end());
 
-			size_t no_streams = gd_src.size();
+			a_total_no_reads_before_UMI_cleaning += gd_src.size();
 
-			auto min_umi = *p_src[0];
-			size_t min_umi_id = 0;
+			gd_dest.reserve(gd_src.size());
 
-			for (size_t i = 1; i < no_streams; ++i)
+			// A single read of each UMI group is preserved; it is drawn in the order of increasing UMIs
+			for (size_t i = 0; i < gd_src.size(); )
 			{
-				if (*p_src[i] < min_umi)
-				{
-					min_umi = *p_src[i];
-					min_umi_id = i;
-				}
-			}
+				size_t j = i + 1;
+				while (j < gd_src.size() && gd_src[j].first == gd_src[i].first)
+					++j;
 
-			auto prev_umi = min_umi;
-			gd_dest.emplace_back(p_src[min_umi_id]->second);
-			++p_src[min_umi_id];
-			size_t no_same_umi = 1;
+				size_t no_same_umi = j - i;
 
-			while (true)
-			{
-				// Find min UMI
-				min_umi = *p_src[0];
-				size_t min_umi_id = 0;
-
-				for (size_t i = 1; i < no_streams; ++i)
+				if (no_same_umi > 1)
 				{
-					if (*p_src[i] < min_umi)
-					{
-						min_umi = *p_src[i];
-						min_umi_id = i;
-					}
-				}
-
-				if (min_umi.first != prev_umi.first)
-				{
-					if (no_same_umi > 1)
-					{
-						size_t id_to_preserve = mt() % no_same_umi;
-						gd_dest[gd_dest.size() - no_same_umi] = gd_dest[gd_dest.size() - id_to_preserve - 1];
-						gd_dest.resize(gd_dest.size() - no_same_umi + 1);
-					}
-					no_same_umi = 0;
+					size_t id_to_preserve = mt() % no_same_umi;
+					gd_dest.emplace_back(gd_src[j - id_to_preserve - 1].second);
 				}
+				else
+					gd_dest.emplace_back(gd_src[i].second);
 
-				if (min_umi == umi_guard)
-					break;
-
-				prev_umi = min_umi;
-				gd_dest.emplace_back(p_src[min_umi_id]->second);
-				++p_src[min_umi_id];
-				++no_same_umi;
+				i = j;
 			}
 
 			total_no_after_removal += gd_dest.size();
@@ -915,8 +1335,6 @@ void CBarcodedCounter::remove_duplicated_UMI()
 		}
 		});
 
-	join_threads(threads);
-
 	global_cbc_umi_dict.clear();
 
 	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
@@ -976,24 +1394,30 @@ void CBarcodedCounter::create_valid_reads_lists()
 	}
 
 	// Determine new read ids mapping
-	for (size_t file_id = 0; file_id < file_names.size(); ++file_id)
-	{
+	thread_pool->ParallelForEach(file_names.size(), [&](size_t file_id) {
 		uint32_t cnt = 0;
 
 		for (size_t i = 0; i < file_no_reads[file_id]; ++i)
 			if (valid_reads[file_id][i])
 				relabelling[file_id][i] = cnt++;
-	}
+		});
 
 	// Change read ids
+	vector<vector<uint64_t>*> read_lists;
+	read_lists.reserve(global_cbc_dict.size());
 	for (auto& x : global_cbc_dict)
-	{
-		for (auto& y : x.second)
+		read_lists.emplace_back(&x.second);
+
+	thread_pool->ParallelForEach(read_lists.size(), [&](size_t i) {
+		uint64_t file_id;
+		uint64_t read_id;
+
+		for (auto& y : *read_lists[i])
 		{
 			tie(file_id, read_id) = decode_read_id(y);
 			y = encode_read_id(file_id, relabelling[file_id][read_id]);
 		}
-	}
+		}, 64);
 
 	if (verbosity_level >= 2)
 		cout << "No. valid reads: " + to_string(no_valid_reads) + " of " + to_string(no_sample_reads) + " reads in sample\n";
@@ -1064,12 +1488,9 @@ int CBarcodedCounter::find_split(vector<pair<uint64_t, uint64_t>>& arr)
 // *********************************************************************************************
 void CBarcodedCounter::find_trusted_thr()
 {
-	cbc_vec.reserve(cbc_stats.size());
+	cbc_vec = move(cbc_stats);
 
-	for (auto& x : cbc_stats)
-		cbc_vec.emplace_back(x.second, x.first);
-
-	cbc_stats.clear();
+	clear_vec(cbc_stats);
 
 	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
 
@@ -1138,10 +1559,12 @@ void CBarcodedCounter::find_predefined_cbc()
 	cbc_vec.reserve(predefined_cbc.size());
 
 	for (auto& x : cbc_stats)
-		if (predefined_cbc.count(x.first))
-			cbc_vec.emplace_back(x.second, x.first);
+		if (binary_search(predefined_cbc.begin(), predefined_cbc.end(), x.second))
+			cbc_vec.emplace_back(x);
+		else if (apply_cbc_correction)
+			cbc_for_corr_vec.emplace_back(x);
 
-	cbc_stats.clear();
+	clear_vec(cbc_stats);
 
 	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
 
@@ -1156,7 +1579,7 @@ bool CBarcodedCounter::ProcessCBC()
 {
 	set_CBC_file_names();
 
-	times.emplace_back("", high_resolution_clock::now());
+	mark_stage("");
 
 	if (!no_threads || file_names.empty())
 		return false;
@@ -1165,19 +1588,41 @@ bool CBarcodedCounter::ProcessCBC()
 
 	init_queues_and_pools();
 
+	if (!cbc_cache_file_name.empty() && load_cbc_cache())
+	{
+		// R2 reads are not packed during ProcessCBC, so they are loaded in the regular way
+		fused_pipeline = false;
+		mi_collect(true);
+		mark_stage("Loading CBC cache");
+
+		return true;
+	}
+
+	if (fused_pipeline)
+		start_reads_packing_threads();
+
 	start_reading_threads();
 	start_counting_threads();
 
 	join_threads(reading_threads);
 	join_threads(counting_threads);
 
-	times.emplace_back("Reading and counting", high_resolution_clock::now());
+	if (fused_pipeline)
+	{
+		join_threads(r2_reading_threads);
+		join_threads(r2_packing_threads);
+
+		r2_block_queues.clear();
+		r2_memory_pools.clear();
+	}
+
+	mark_stage("Reading and counting");
 
 	if (verbosity_level >= 1)
 		std::cerr << "Gathering CBC statistics\n";
 	gather_cbc_stats();
 	mi_collect(true);
-	times.emplace_back("Gathering CBC statistics", high_resolution_clock::now());
+	mark_stage("Gathering CBC statistics");
 
 	if (!predefined_cbc.empty())
 	{
@@ -1187,7 +1632,16 @@ bool CBarcodedCounter::ProcessCBC()
 		find_predefined_cbc();
 
 		mi_collect(true);
-		times.emplace_back("Looking for predefined CBC in data", high_resolution_clock::now());
+		mark_stage("Looking for predefined CBC in data");
+
+		if (apply_cbc_correction)
+		{
+			if (verbosity_level >= 1)
+				std::cerr << "CBCs correction\n";
+			find_CBC_corrections();
+			mi_collect(true);
+			mark_stage("CBCs correction");
+		}
 	}
 	else
 	{
@@ -1195,7 +1649,7 @@ bool CBarcodedCounter::ProcessCBC()
 			std::cerr << "Looking for trusted threshold\n";
 		find_trusted_thr();		// !!! This can be parallelized
 		mi_collect(true);
-		times.emplace_back("Looking for trusted threshold", high_resolution_clock::now());
+		mark_stage("Looking for trusted threshold");
 
 		if (apply_cbc_correction)
 		{
@@ -1203,29 +1657,49 @@ bool CBarcodedCounter::ProcessCBC()
 				std::cerr << "CBCs correction\n";
 			find_CBC_corrections();
 			mi_collect(true);
-			times.emplace_back("CBCs correction", high_resolution_clock::now());
+			mark_stage("CBCs correction");
 		}
 	}
 
+	if (no_cbc_shards > 1)
+		keep_cbc_shard();
+
 	if (verbosity_level >= 1)
 		std::cerr << "Removing non-trusted CBCs\n";
 	remove_non_trusted_CBC();
 	mi_collect(true);
 	list_cbc_dict(".before_umi_deduplication");
-	times.emplace_back("Removing non-trusted CBCs", high_resolution_clock::now());
+	mark_stage("Removing non-trusted CBCs");
 
 	if (verbosity_level >= 1)
 		std::cerr << "Removing duplicated UMIs\n";
 	remove_duplicated_UMI();
 	list_cbc_dict(".after_umi_deduplication");
 	mi_collect(true);
-	times.emplace_back("Removing duplicated UMIs", high_resolution_clock::now());
+	mark_stage("Removing duplicated UMIs");
+
+	// R2 files do not depend on the valid reads lists, so their reading (I/O and decompression, bounded by the memory pools)
+	// can start now; the reads loading threads are started in ProcessReads
+	if (!fused_pipeline && !max_ram && counting_mode != counting_mode_t::filter &&
+		!(((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::first))
+	{
+		set_read_file_names();
+		reinit_queues();
+		start_reading_threads();
+		r2_reading_started = true;
+	}
 
 	if (verbosity_level >= 1)
 		std::cerr << "Creating valid reads list\n";
 	create_valid_reads_lists();
 	mi_collect(true);
-	times.emplace_back("Creating valid reads list", high_resolution_clock::now());
+	mark_stage("Creating valid reads list");
+
+	if (!cbc_cache_file_name.empty())
+	{
+		save_cbc_cache();
+		mark_stage("Saving CBC cache");
+	}
 
 	return true;
 }
@@ -1254,7 +1728,7 @@ bool CBarcodedCounter::ProcessExportFilteredCBCReads()
 	join_threads(reads_exporting_threads);
 	mi_collect(true);
 
-	times.emplace_back("CBC reads filtering", high_resolution_clock::now());
+	mark_stage("CBC reads filtering");
 
 	return true;
 }
@@ -1283,7 +1757,7 @@ bool CBarcodedCounter::ProcessExportFilteredReads()
 	join_threads(reads_exporting_threads);
 	mi_collect(true);
 
-	times.emplace_back("CBC reads filtering", high_resolution_clock::now());
+	mark_stage("CBC reads filtering");
 
 	return true;
 }
\ No newline at end of file
@@ -10,6 +10,10 @@
 #include <unordered_set>
 #include <random>
 #include <filesystem>
+#include <queue>
+#include <limits>
+#include <numeric>
+namespace fs = std::filesystem;
 
 #include "../../libs/refresh/hash_tables/lib/murmur_hash.h"
 #include "../../libs/refresh/sort/lib/pdqsort_par.h"
@@ -23,276 +27,479 @@
 #define USE_READ_COMPRESSION
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_leaders_from_read(uint8_t* bases, vector<leader_t>& kmer_leaders)
+// Reads are kept in the 2-bit stored form (dna_packing.h), so k-mers are taken straight from the packed bytes
+dna_packed_view_t CBarcodedCounter::read_view(uint64_t file_id, uint64_t read_id, CDnaPackedRead& packed_read)
 {
-	// cout<< leader_len << ", " << gap_len << ", " << follower_len << endl;
-	CKmer leader(leader_len, kmer_mode_t::direct);
-	CKmer follower(follower_len, kmer_mode_t::direct);
+#ifdef USE_READ_COMPRESSION
+	return dna_stored_view(sample_reads[file_id][read_id]);
+#else
+	packed_read.Assign((const char*)sample_reads[file_id][read_id], strlen((const char*)sample_reads[file_id][read_id]));
+	return packed_read.View();
+#endif
+}
 
-	int read_len = strlen((char*)bases);
-	int follower_start_pos = leader_len + gap_len;
+// *********************************************************************************************
+void CBarcodedCounter::enumerate_kmer_leaders_from_read(const dna_packed_view_t& read, vector<leader_t>& kmer_leaders)
+{
+	CDnaPackedWindows windows(read, leader_len, gap_len, follower_len);
+	leader_t leader;
 
-	if (leader_len + gap_len + follower_len > (uint32_t) read_len)
-		return;
+	while (windows.NextLeader(leader))
+		kmer_leaders.emplace_back(leader);
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t>& kmer_leaders)
+{
+	kmer_leaders.clear();
+
+	uint64_t file_id;
+	uint64_t read_id;
 
-	for(uint32_t i = 0; i < leader_len-1; ++i)
+	CDnaPackedRead packed_read;
+
+	for (auto x : global_cbc_dict[cbc])
 	{
-		uint64_t symbol = dna_code(bases[i]);
-		if (symbol < 4)
-			leader.insert(symbol);
-		else
-			leader.Reset();
+		tie(file_id, read_id) = decode_read_id(x);
+		enumerate_kmer_leaders_from_read(read_view(file_id, read_id, packed_read), kmer_leaders);
 	}
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::enumerate_kmer_pairs_from_read(const dna_packed_view_t& read, CPairCounter& pair_counter)
+{
+	CDnaPackedWindows windows(read, leader_len, gap_len, follower_len);
+	leader_t leader;
+	follower_t follower;
+
+	while (windows.Next(leader, follower))
+		if (!leader_sketch || leader_sketch->IsFrequent(leader))
+			pair_counter.Add(leader, follower);
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::enumerate_kmer_pairs_for_cbc(cbc_t cbc, CPairCounter& pair_counter)
+{
+	pair_counter.Reset();
+
+	uint64_t file_id;
+	uint64_t read_id;
 
-	for(uint32_t i = follower_start_pos; i < follower_start_pos + follower_len-1; ++i)
+	CDnaPackedRead packed_read;
+
+	for (auto x : global_cbc_dict[cbc])
 	{
-		uint64_t symbol = dna_code(bases[i]);
-		if (symbol < 4)
-			follower.insert(symbol);
-		else
-			follower.Reset();
+		tie(file_id, read_id) = decode_read_id(x);
+		enumerate_kmer_pairs_from_read(read_view(file_id, read_id, packed_read), pair_counter);
 	}
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::sort_and_gather_kmer_pairs_for_cbc(CPairCounter& pair_counter, vector<leader_follower_count_t>& kmer_pair_counts)
+{
+	pair_counter.Gather(kmer_pair_counts);
 
-	// leader and follower contain almost complete k-mers (without last symbols)
+#ifdef AGGRESIVE_MEMORY_SAVING
+	pair_counter.ReleaseMemory();
+	kmer_pair_counts.shrink_to_fit();
+#endif
+}
 
-	for (int i = follower_start_pos + follower_len - 1; i < read_len; ++i)
+// *********************************************************************************************
+namespace {
+	uint64_t isqrt(uint64_t x)
 	{
-		uint64_t t_symbol = dna_code(bases[i]);
-		uint64_t a_symbol = dna_code(bases[i - follower_len - gap_len]);
+		uint64_t r = (uint64_t) sqrtl((long double) x);
 
-		if (t_symbol < 4)
-			follower.insert(t_symbol);
-		else
-			follower.Reset();
+		while (r * r > x)
+			--r;
+		while ((r + 1) * (r + 1) <= x)
+			++r;
 
-		if (a_symbol < 4)
-			leader.insert(a_symbol);
-		else
-			leader.Reset();
+		return r;
+	}
+}
+
+// *********************************************************************************************
+// Distinct reads are hashed by their packed form (the same bases and N positions give the same pairs)
+namespace {
+	uint64_t packed_read_hash(const dna_packed_view_t& read)
+	{
+		refresh::MurMur64Hash mh;
+		uint64_t h = mh(((uint64_t) read.len << 1) | (uint64_t) read.any_n);
+
+		size_t no_bytes = dna_packed_bytes(read.len);
+		for (size_t i = 0; i < no_bytes; i += 8)
+			h = mh(h ^ dna_packing::load_le64(read.packed + i, no_bytes - i));
+
+		if (read.any_n)
+		{
+			no_bytes = dna_mask_bytes(read.len);
+			for (size_t i = 0; i < no_bytes; i += 8)
+				h = mh(h ^ dna_packing::load_le64(read.n_mask + i, no_bytes - i));
+		}
 
-		if (leader.is_full() && follower.is_full())
-		// using data_aligned_dir() instead of data_dir() to ensure the leader is in same format as dictionary
-			kmer_leaders.emplace_back(leader.data_aligned_dir());
+		return h;
+	}
+
+	bool packed_read_equal(const dna_packed_view_t& a, const dna_packed_view_t& b)
+	{
+		return a.len == b.len && a.any_n == b.any_n &&
+			memcmp(a.packed, b.packed, dna_packed_bytes(a.len)) == 0 &&
+			(!a.any_n || memcmp(a.n_mask, b.n_mask, dna_mask_bytes(a.len)) == 0);
 	}
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t>& kmer_leaders)
+// Reads [begin, end) of the CBC; with collapse_duplicate_reads identical reads are given once with their no. of copies
+// (packed_reads are the buffers of the views if reads are not kept in the packed form)
+void CBarcodedCounter::collect_cbc_reads(const cbc_t& cbc, size_t begin, size_t end, vector<weighted_read_t>& reads, vector<CDnaPackedRead>& packed_reads)
 {
-	kmer_leaders.clear();
+	const auto& read_ids = global_cbc_dict[cbc];
 
-	uint64_t file_id;
-	uint64_t read_id;
+	reads.clear();
+	reads.reserve(end - begin);
 
 #ifdef USE_READ_COMPRESSION
-	vector<uint8_t> decompressed_read;
+	CDnaPackedRead packed_read;
+#else
+	packed_reads.resize(end - begin);
 #endif
 
-	for (auto x : global_cbc_dict[cbc])
+	uint64_t file_id, read_id;
+
+	for (size_t i = begin; i < end; ++i)
 	{
-		tie(file_id, read_id) = decode_read_id(x);
+		tie(file_id, read_id) = decode_read_id(read_ids[i]);
 
 #ifdef USE_READ_COMPRESSION
-		base_coding3.decode_bases(sample_reads[file_id][read_id], decompressed_read);
-		enumerate_kmer_leaders_from_read(decompressed_read.data(), kmer_leaders);
+		reads.emplace_back(weighted_read_t{ read_view(file_id, read_id, packed_read), 1 });
 #else
-		enumerate_kmer_leaders_from_read(sample_reads[file_id][read_id], kmer_leaders);
+		reads.emplace_back(weighted_read_t{ read_view(file_id, read_id, packed_reads[i - begin]), 1 });
 #endif
 	}
+
+	if (!collapse_duplicate_reads || reads.size() < 2)
+		return;
+
+	// Open addressing (no. of distinct read + 1 in slots) with max. load factor 0.5
+	size_t table_size = 1;
+	while (table_size < 2 * reads.size())
+		table_size *= 2;
+
+	vector<uint32_t> slots(table_size, 0);
+	size_t no_distinct = 0;
+
+	for (size_t i = 0; i < reads.size(); ++i)
+	{
+		for (size_t j = packed_read_hash(reads[i].read) & (table_size - 1); ; j = (j + 1) & (table_size - 1))
+		{
+			if (!slots[j])
+			{
+				reads[no_distinct] = reads[i];
+				slots[j] = (uint32_t) ++no_distinct;
+				break;
+			}
+
+			if (packed_read_equal(reads[slots[j] - 1].read, reads[i].read))
+			{
+				++reads[slots[j] - 1].count;
+				break;
+			}
+		}
+	}
+
+	run_stats.Add(CRunStats::counter_t::reads_collapsed_in, reads.size());
+	run_stats.Add(CRunStats::counter_t::reads_collapsed_out, no_distinct);
+
+	reads.resize(no_distinct);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_pairs_from_read(uint8_t* bases, vector<leader_follower_t>& kmer_pairs)
+// Reads of the CBC are rescanned (from the packed bytes, without decoding) for every leader occurrence
+// (for collapsed duplicates a pair is added (copies of the leader read) * (copies of the scanned read) times)
+void CBarcodedCounter::extract_fafq_style_anchor_target_pairs(
+    const cbc_t& cbc,
+    CPairCounter& pair_counter)
 {
+    pair_counter.Reset();
 
-	CKmer leader(leader_len, kmer_mode_t::direct);
-	CKmer follower(follower_len, kmer_mode_t::direct);
+	if (!accepted_anchors)
+		std::cout << "anchor list not used" << endl;
 
-	int read_len = (int) strlen((char*)bases);
-	int follower_start_pos = leader_len + gap_len;
+	vector<weighted_read_t> reads;
+	vector<CDnaPackedRead> packed_reads;
 
-	if (leader_len + gap_len + follower_len > (uint32_t) read_len)
-		return;
+	collect_cbc_reads(cbc, 0, global_cbc_dict[cbc].size(), reads, packed_reads);
 
-	for(uint32_t i = 0; i < leader_len-1; ++i)
-	{
-		uint64_t symbol = dna_code(bases[i]);
-		if (symbol < 4)
-			leader.insert(symbol);
-		else
-			leader.Reset();
-	}
+	// 1. get anchors (leaders)
+	vector<pair<leader_t, uint64_t>> kmer_leaders;
+	leader_t read_leader;
+	follower_t follower;
 
-	for(uint32_t i = follower_start_pos; i < follower_start_pos + follower_len-1; ++i)
+	for (const auto& x : reads)
 	{
-		uint64_t symbol = dna_code(bases[i]);
-		if (symbol < 4)
-			follower.insert(symbol);
-		else
-			follower.Reset();
+		CDnaPackedWindows windows(x.read, leader_len, gap_len, follower_len);
+
+		while (windows.NextLeader(read_leader))
+			kmer_leaders.emplace_back(read_leader, x.count);
 	}
 
-	// leader and follower contain almost complete k-mers (without last symbols)
+    for (const auto& [leader, leader_count] : kmer_leaders) {
+        if (accepted_anchors && !accepted_anchors->IsAccepted(leader))
+			continue;
 
-	for (int i = follower_start_pos + follower_len - 1; i < read_len; ++i)
-	{
-		uint64_t t_symbol = dna_code(bases[i]);
-		uint64_t a_symbol = dna_code(bases[i - follower_len - gap_len]);
+		if (leader_sketch && !leader_sketch->IsFrequent(leader))
+			continue;
 
-		if (t_symbol < 4)
-			follower.insert(t_symbol);
-		else
-			follower.Reset();
+		// Search for target(s) in reads belonging to this CBC
+		for (const auto& x : reads) {
+			CDnaPackedWindows windows(x.read, leader_len, gap_len, follower_len);
 
-		if (a_symbol < 4)
-			leader.insert(a_symbol);
-		else
-			leader.Reset();
+			while (windows.Next(read_leader, follower))
+				if (read_leader == leader)
+					pair_counter.Add(leader, follower, leader_count * x.count);
+		}
+    }
+}
 
-		if (leader.is_full() && follower.is_full() && (min_leader_count <= 1 || valid_leaders.count(leader.data())))
-			kmer_pairs.emplace_back(leader.data_aligned_dir(), follower.data_aligned_dir());
-	}
+// *********************************************************************************************
+// Single sweep over the read emitting a pair for every window whose leader is accepted
+void CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read(const dna_packed_view_t& read, uint64_t count, CPairCounter& pair_counter)
+{
+	CDnaPackedWindows windows(read, leader_len, gap_len, follower_len);
+	leader_t leader;
+	follower_t follower;
+
+	const CLeaderSketch* sketch = leader_sketch.get();
+
+	while (windows.Next(leader, follower))
+		if ((!accepted_anchors || accepted_anchors->IsAccepted(leader)) && (!sketch || sketch->IsFrequent(leader)))
+			pair_counter.Add(leader, follower, count);
+}
+
+// *********************************************************************************************
+template<uint32_t LEADER_LEN, uint32_t GAP_LEN, uint32_t FOLLOWER_LEN>
+void CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read_fixed(const dna_packed_view_t& read, uint64_t count, CPairCounter& pair_counter)
+{
+	const AcceptedAnchors* anchors = accepted_anchors.get();
+	const CLeaderSketch* sketch = leader_sketch.get();
+
+	dna_packed_for_each_window<LEADER_LEN, GAP_LEN, FOLLOWER_LEN>(read, [anchors, sketch, count, &pair_counter](uint64_t leader, uint64_t follower) {
+		if ((!anchors || anchors->IsAccepted(leader)) && (!sketch || sketch->IsFrequent(leader)))
+			pair_counter.Add(leader, follower, count);
+		});
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::select_window_kernels()
+{
+	struct fixed_kernel_t {
+		uint32_t leader_len;
+		uint32_t gap_len;
+		uint32_t follower_len;
+		accepted_pairs_kernel_t kernel;
+	};
+
+	static const fixed_kernel_t fixed_kernels[] = {
+		{ 8, 0, 31, &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read_fixed<8, 0, 31> },
+		{ 12, 0, 31, &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read_fixed<12, 0, 31> },
+		{ 27, 0, 27, &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read_fixed<27, 0, 27> },
+		{ 31, 0, 31, &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read_fixed<31, 0, 31> },
+	};
+
+	accepted_pairs_kernel = &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read;
+
+	for (const auto& x : fixed_kernels)
+		if (x.leader_len == leader_len && x.gap_len == gap_len && x.follower_len == follower_len)
+		{
+			accepted_pairs_kernel = x.kernel;
+			break;
+		}
+
+	if (verbosity_level >= 2)
+		std::cerr << "Pair extraction kernel: " << (accepted_pairs_kernel == &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read ? "generic" : "fixed") 
+			<< " (" << leader_len << ", " << gap_len << ", " << follower_len << ")\n";
+}
+
+// *********************************************************************************************
+// Same pairs as extract_fafq_style_anchor_target_pairs (before weighting), but every read is scanned once
+void CBarcodedCounter::extract_single_pass_anchor_target_pairs(const cbc_t& cbc, CPairCounter& pair_counter)
+{
+	extract_single_pass_anchor_target_pairs(cbc, 0, global_cbc_dict[cbc].size(), pair_counter);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_pairs_for_cbc(cbc_t cbc, vector<leader_follower_t>& kmer_pairs)
+// Only reads [begin, end) of the CBC (counts are additive over reads, so parts of a CBC can be counted separately)
+void CBarcodedCounter::extract_single_pass_anchor_target_pairs(const cbc_t& cbc, size_t begin, size_t end, CPairCounter& pair_counter)
 {
-	kmer_pairs.clear();
+	pair_counter.Reset();
+
+	if (collapse_duplicate_reads)
+	{
+		vector<weighted_read_t> reads;
+		vector<CDnaPackedRead> packed_reads;
+
+		collect_cbc_reads(cbc, begin, end, reads, packed_reads);
+
+		for (const auto& x : reads)
+			(this->*accepted_pairs_kernel)(x.read, x.count, pair_counter);
+
+		return;
+	}
 
 	uint64_t file_id;
 	uint64_t read_id;
 
-#ifdef USE_READ_COMPRESSION
-	vector<uint8_t> decompressed_read;
-#endif
+	CDnaPackedRead packed_read;
+	const auto& read_ids = global_cbc_dict[cbc];
 
-	for (auto x : global_cbc_dict[cbc])
+	for (size_t i = begin; i < end; ++i)
 	{
-		tie(file_id, read_id) = decode_read_id(x);
+		tie(file_id, read_id) = decode_read_id(read_ids[i]);
+		(this->*accepted_pairs_kernel)(read_view(file_id, read_id, packed_read), 1, pair_counter);
+	}
+}
 
-#ifdef USE_READ_COMPRESSION
-		base_coding3.decode_bases(sample_reads[file_id][read_id], decompressed_read);
+// *********************************************************************************************
+// Sums counts of parts (each sorted by (leader, follower)) of a single CBC
+void CBarcodedCounter::merge_partial_kmer_pair_counts(vector<vector<leader_follower_count_t>>& parts, vector<leader_follower_count_t>& kmer_pair_counts)
+{
+	kmer_pair_counts.clear();
 
-		enumerate_kmer_pairs_from_read(decompressed_read.data(), kmer_pairs);
-#else
-		enumerate_kmer_pairs_from_read(sample_reads[file_id][read_id], kmer_pairs);
-#endif
+	for (auto& x : parts)
+	{
+		kmer_pair_counts.insert(kmer_pair_counts.end(), x.begin(), x.end());
+		clear_vec(x);
 	}
 
-#ifdef AGGRESIVE_MEMORY_SAVING
-	kmer_pairs.shrink_to_fit();
-#endif
+	refresh::sort::pdqsort(kmer_pair_counts.begin(), kmer_pair_counts.end(), [](const leader_follower_count_t& a, const leader_follower_count_t& b) {
+		return a.leader != b.leader ? a.leader < b.leader : a.follower < b.follower;
+		});
+
+	size_t out = 0;
+
+	for (size_t i = 0; i < kmer_pair_counts.size(); ++out)
+	{
+		kmer_pair_counts[out] = kmer_pair_counts[i];
+
+		for (++i; i < kmer_pair_counts.size() && kmer_pair_counts[i].leader == kmer_pair_counts[out].leader && kmer_pair_counts[i].follower == kmer_pair_counts[out].follower; ++i)
+			kmer_pair_counts[out].count += kmer_pair_counts[i].count;
+	}
+
+	kmer_pair_counts.resize(out);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::sort_and_gather_kmer_pairs_for_cbc(vector<leader_follower_t>& kmer_pairs, vector<leader_follower_count_t>& kmer_pair_counts)
+// The rescan extractor repeats the scan for every occurrence of a leader in the CBC, so each (leader, follower)
+// count is multiplied by the no. of occurrences of its leader. Apply the same weighting to the single-pass counts
+// (kmer_pair_counts is sorted by leader, so the no. of occurrences is the sum of counts in a leader run;
+// for already weighted counts the sum of a run is the square of the no. of occurrences).
+// Leaders rejected by is_valid_leader (rare_leader_thr, poly-ACGT, artifacts) are removed on the way, so the filter
+// sees the raw no. of occurrences in the unfiltered run in every extraction mode.
+void CBarcodedCounter::weight_and_filter_leaders(vector<leader_follower_count_t>& kmer_pair_counts, bool weighted)
 {
-//	std::sort(kmer_pairs.begin(), kmer_pairs.end());
-	refresh::sort::pdqsort(kmer_pairs.begin(), kmer_pairs.end());
+	auto p_dest = kmer_pair_counts.begin();
+	auto p_end = kmer_pair_counts.end();
 
-	kmer_pair_counts.clear();
+	for (auto p = kmer_pair_counts.begin(); p != p_end; )
+	{
+		auto q = p;
+		uint64_t sum = 0;
 
-	if (kmer_pairs.empty())
-		return;
+		for (; q != p_end && q->leader == p->leader; ++q)
+			sum += q->count;
 
-	kmer_pair_counts.emplace_back(kmer_pairs.front());
+		uint64_t no_occ = weighted ? isqrt(sum) : sum;
 
-	for (int i = 1; i < (int) kmer_pairs.size(); ++i)
-		if (kmer_pair_counts.back().equal_lf(kmer_pairs[i]))
-			kmer_pair_counts.back().count++;
-		else
+		if (filter_leaders && !is_valid_leader(p->leader, no_occ))
 		{
-			// if (poly_ACGT_filter.IsPolyACGT(kmer_pair_counts.back().leader, leader_len) ||
-			// 		artifacts_filter.ContainsArtifact(kmer_pair_counts.back().leader, leader_len))
-			// 	kmer_pair_counts.pop_back();
-			kmer_pair_counts.emplace_back(kmer_pairs[i]);
+			p = q;
+			continue;
 		}
-	// if (poly_ACGT_filter.IsPolyACGT(kmer_pair_counts.back().leader, leader_len) ||
-	// 		artifacts_filter.ContainsArtifact(kmer_pair_counts.back().leader, leader_len))
-	// 	kmer_pair_counts.pop_back();
 
-#ifdef AGGRESIVE_MEMORY_SAVING
-	clear_vec(kmer_pairs);
-	kmer_pair_counts.shrink_to_fit();
-#else
-	kmer_pairs.clear();
-#endif
+		if (!weighted)
+			for (auto r = p; r != q; ++r)
+				r->count *= no_occ;
+
+		p_dest = p == p_dest ? q : move(p, q, p_dest);
+		p = q;
+	}
+
+	kmer_pair_counts.erase(p_dest, p_end);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::extract_fafq_style_anchor_target_pairs(
-    const cbc_t& cbc,
-    vector<leader_follower_t>& kmer_pairs)
+bool CBarcodedCounter::is_valid_leader(leader_t leader, uint64_t no_occ) const
 {
-    kmer_pairs.clear();
+	if (no_occ <= rare_leader_thr)
+		return false;
 
-    vector<leader_t> kmer_leaders;
-    enumerate_kmer_leaders_for_cbc(cbc, kmer_leaders);  // 1. get anchors (leaders)
-	// std::cout<< "collecting accepted anchors" << endl;
-	// for (int i = 0; i < 30; i++) {
-	// 	cout << kmer_leaders[i] << endl;
-	// }
-	
-    for (const auto& leader : kmer_leaders) {
-        if (!accepted_anchors || accepted_anchors->IsAccepted(leader)) {
-			// cout << "leader raw = " << leader << endl;
-			// cout << "leader str = " << kmer_to_string(leader, leader_len) << endl;
-			if (!accepted_anchors) {
-				std::cout << "anchor list not used" << endl;
+	if (poly_ACGT_filter.IsPolyACGT(leader, leader_len))
+		return false;
+
+	return !artifacts_filter.ContainsArtifact(leader, leader_len);
+}
+
+// *********************************************************************************************
+// Targets present under all anchors of a CBC (only if > 1 anchors; otherwise the set is empty), as in bkc_carrots,
+// separately for each panel (universal[panel]); they are the intersection of the (sorted) follower lists of anchors
+void CBarcodedCounter::find_universal_targets(const vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<follower_t>>& universal)
+{
+	vector<uint32_t> no_anchors(no_panels, 0);
+
+	for (auto& x : universal)
+		x.clear();
+
+	auto intersect = [](vector<follower_t>& u, auto p, auto q) {
+		auto u_end = u.begin();
+
+		for (auto r = u.begin(); r != u.end() && p != q; )
+			if (*r < p->follower)
+				++r;
+			else if (p->follower < *r)
+				++p;
+			else
+			{
+				*u_end++ = *r++;
+				++p;
 			}
-			// if (accepted_anchors->IsAccepted(leader)) {
-			// 	std::cout<< "Anchor " << leader << " is accepted" << endl;
-			// }
-            // Search for target(s) in reads belonging to this CBC
-            for (const auto& read_id : global_cbc_dict[cbc]) {
-                uint64_t file_id, local_read_id;
-                tie(file_id, local_read_id) = decode_read_id(read_id);
 
-#ifdef USE_READ_COMPRESSION
-                vector<uint8_t> decompressed_read;
-                base_coding3.decode_bases(sample_reads[file_id][local_read_id], decompressed_read);
-                const uint8_t* bases = decompressed_read.data();
-#else
-                const uint8_t* bases = sample_reads[file_id][local_read_id];
-#endif
-                int read_len = (int)strlen((char*)bases);
-				
-                for (int i = 0; i <= read_len - (leader_len + gap_len + follower_len); ++i) {
-                    // extract candidate leader
-                    CKmer anchor_kmer(leader_len, kmer_mode_t::direct);
-                    bool valid_leader = true;
-                    for (int j = 0; j < leader_len; ++j) {
-                        uint64_t sym = dna_code(bases[i + j]);
-                        if (sym >= 4) { valid_leader = false; break; }
-                        anchor_kmer.insert(sym);
-                    }
-                    if (!valid_leader || anchor_kmer.data_aligned_dir() != leader) continue;
-
-                    // extract candidate follower
-                    CKmer target_kmer(follower_len, kmer_mode_t::direct);
-                    bool valid_follower = true;
-                    for (int j = 0; j < follower_len; ++j) {
-                        uint64_t sym = dna_code(bases[i + leader_len + gap_len + j]);
-                        if (sym >= 4) { valid_follower = false; break; }
-                        target_kmer.insert(sym);
-                    }
-                    if (!valid_follower) continue;
-
-                    kmer_pairs.emplace_back(leader, target_kmer.data_aligned_dir());
-                }
-            }
-        }
-    }
-	// std::cout<< "anchor list updated" <<endl;
+		u.erase(u_end, u.end());
+	};
+
+	auto p_end = kmer_pair_counts.end();
+
+	for (auto p = kmer_pair_counts.begin(); p != p_end; )
+	{
+		auto q = p;
+		for (; q != p_end && q->leader == p->leader; ++q)
+			;
+
+		uint64_t panel_mask = no_panels == 1 ? 1 : accepted_anchors->PanelMask(p->leader);
+
+		for (uint64_t m = panel_mask; m; m &= m - 1)
+		{
+			uint32_t panel = (uint32_t) countr_zero(m);
+
+			if (no_anchors[panel]++ == 0)
+				for (auto r = p; r != q; ++r)
+					universal[panel].emplace_back(r->follower);
+			else if (!universal[panel].empty())
+				intersect(universal[panel], p, q);
+		}
+
+		p = q;
+	}
+
+	for (uint32_t i = 0; i < no_panels; ++i)
+		if (no_anchors[i] < 2)
+			universal[i].clear();
 }
 
 // *********************************************************************************************
 void CBarcodedCounter::count_kmer_pairs()
 {
-	atomic_int id{ 0 };
-	atomic_uint64_t total_no_after_removal{ 0 };
-
-	vector<thread> threads;
 	vector<cbc_t> cbcs;
 	
 	total_no_kmer_pair_counts = 0;
@@ -302,20 +509,226 @@ void CBarcodedCounter::count_kmer_pairs()
 	for (auto& x : global_cbc_dict)
 		cbcs.emplace_back(x.first);
 
-	threads.reserve(no_threads);
+	if (sorted_output)
+		refresh::sort::pdqsort(cbcs.begin(), cbcs.end());
+
+	if (leader_sketch && min_leader_count > 1)
+	{
+		vector<CLeaderSketch::CExactCounts> exact_counts;
+		count_exact_leaders(cbcs, exact_counts);
+		set_exact_leader_counts(exact_counts);
+	}
+
+	count_kmer_pairs(cbcs);
+
+	if (verbosity_level >= 2)
+	{
+		std::cerr << "Total no. k-mer pair counts: " << total_no_kmer_pair_counts << endl;
+		std::cerr << "Sum of k-mer pair counts: " << sum_kmer_pair_counts << endl;
+	}
+}
+
+// *********************************************************************************************
+// Exact sample counts of the leaders passing the sketch, so min_leader_count is applied exactly
+// (rare_leader_thr alone needs no exact pass, as it is checked again per CBC)
+void CBarcodedCounter::count_exact_leaders(const vector<cbc_t>& cbcs, vector<CLeaderSketch::CExactCounts>& exact_counts)
+{
+	exact_counts.resize(no_threads);
+	atomic<size_t> next_cbc{ 0 };
+
+	thread_pool->ParallelFor(no_threads, [&](uint32_t thread_id) {
+		CDnaPackedRead packed_read;
+		uint64_t file_id;
+		uint64_t read_id;
+
+		for (size_t i = next_cbc++; i < cbcs.size(); i = next_cbc++)
+			for (auto x : global_cbc_dict[cbcs[i]])
+			{
+				tie(file_id, read_id) = decode_read_id(x);
+				leader_sketch->AddReadExact(read_view(file_id, read_id, packed_read), leader_len, gap_len, follower_len, accepted_anchors.get(), exact_counts[thread_id]);
+			}
+		});
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::set_exact_leader_counts(vector<CLeaderSketch::CExactCounts>& exact_counts)
+{
+	leader_sketch->SetExactCounts(exact_counts);
+	clear_vec(exact_counts);
+
+	if (verbosity_level >= 2)
+		std::cerr << "No. of leaders occurring at least min_leader_count times: " + to_string(leader_sketch->NoFrequentLeaders()) + "\n";
+
+	mark_stage("Exact leader counting");
+}
+
+// *********************************************************************************************
+// Greedy largest-first assignment of CBCs to the NUMA nodes (the least loaded node, by no. of reads, takes the next CBC)
+// If assign_reads is set, node arenas are created and the node of each (relabelled) read is recorded for the loading threads
+void CBarcodedCounter::assign_cbc_to_numa_nodes(bool assign_reads)
+{
+	uint32_t no_nodes = numa_topology->NoNodes();
+
+	vector<pair<uint64_t, cbc_t>> cbc_sizes;
+	cbc_sizes.reserve(global_cbc_dict.size());
+	for (auto& x : global_cbc_dict)
+		cbc_sizes.emplace_back(x.second.size(), x.first);
+
+	refresh::sort::pdqsort(cbc_sizes.begin(), cbc_sizes.end(), greater<pair<uint64_t, cbc_t>>());
+
+	vector<uint64_t> node_loads(no_nodes, 0);
+
+	cbc_numa_node.clear();
+	cbc_numa_node.reserve(cbc_sizes.size());
+
+	for (auto& x : cbc_sizes)
+	{
+		uint32_t node = (uint32_t) (min_element(node_loads.begin(), node_loads.end()) - node_loads.begin());
+		node_loads[node] += x.first;
+		cbc_numa_node[x.second] = node;
+	}
+
+	if (!assign_reads)
+		return;
+
+	numa_arenas.clear();
+	for (uint32_t i = 0; i < no_nodes; ++i)
+		numa_arenas.emplace_back(make_unique<CNumaArena>(numa_topology->NodeId(i)));
+
+	read_numa_node.clear();
+	read_numa_node.resize(file_names.size());
+	for (size_t i = 0; i < file_names.size(); ++i)
+		read_numa_node[i].resize(file_no_reads_after_cleanup[i], 0);
+
+	uint64_t file_id;
+	uint64_t read_id;
+
+	for (auto& x : global_cbc_dict)
+	{
+		uint8_t node = (uint8_t) cbc_numa_node[x.first];
+
+		for (auto y : x.second)
+		{
+			tie(file_id, read_id) = decode_read_id(y);
+			read_numa_node[file_id][read_id] = node;
+		}
+	}
+
+	if (verbosity_level >= 2)
+		for (uint32_t i = 0; i < no_nodes; ++i)
+			std::cerr << "NUMA node " << i << ": " << node_loads[i] << " reads\n";
+}
+
+// *********************************************************************************************
+// CBCs are processed largest-first; CBCs much larger than the average work per thread are split into read ranges,
+// which are counted (unweighted) by different threads and merged by the thread that completes the last part.
+// The weighting by leader occurrences makes the merged counts equal to the counts of both extractors.
+// With sorted_output CBCs (given in CBC order) are taken in order and their records pass the reordering window,
+// so each output file gets them in SBLFC order (records of a CBC are already sorted by (leader, follower)).
+void CBarcodedCounter::count_kmer_pairs(const vector<cbc_t>& cbcs)
+{
+	vector<uint64_t> cbc_sizes(cbcs.size());
+	uint64_t total_size = 0;
+
+	for (size_t i = 0; i < cbcs.size(); ++i)
+	{
+		cbc_sizes[i] = global_cbc_dict[cbcs[i]].size();
+		total_size += cbc_sizes[i];
+	}
+
+	uint64_t part_size = CSizeScheduler::PartSize(total_size, no_threads, min_cbc_part_size);
+
+	// One scheduler per NUMA node (a single one if NUMA mode is off); workers take tasks of their own node first
+	uint32_t no_nodes = (numa_topology && !cbc_numa_node.empty() && !sorted_output) ? numa_topology->NoNodes() : 1;
+	vector<vector<size_t>> node_items(no_nodes);
+	vector<CSizeScheduler> node_schedulers(no_nodes);
+
+	if (no_nodes == 1)
+	{
+		node_items[0].resize(cbcs.size());
+		iota(node_items[0].begin(), node_items[0].end(), 0);
+		node_schedulers[0].Prepare(cbc_sizes, part_size, !sorted_output);
+	}
+	else
+	{
+		vector<vector<uint64_t>> node_sizes(no_nodes);
+
+		for (size_t i = 0; i < cbcs.size(); ++i)
+		{
+			auto p = cbc_numa_node.find(cbcs[i]);
+			uint32_t node = p == cbc_numa_node.end() ? 0 : p->second;
+			node_items[node].emplace_back(i);
+			node_sizes[node].emplace_back(cbc_sizes[i]);
+		}
+
+		for (uint32_t i = 0; i < no_nodes; ++i)
+			node_schedulers[i].Prepare(node_sizes[i], part_size);
+	}
 
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
-		int curr_id = -1;
+	auto next_task = [&](CSizeScheduler::task_t& task) {
+		int my_node = CNumaTopology::CurrentNode();
+		uint32_t first_node = (my_node < 0 || (uint32_t) my_node >= no_nodes) ? 0 : (uint32_t) my_node;
 
-		vector<leader_follower_t> kmer_pairs;
+		for (uint32_t i = 0; i < no_nodes; ++i)
+		{
+			uint32_t node = (first_node + i) % no_nodes;
+			if (node_schedulers[node].Next(task))
+			{
+				task.item_id = node_items[node][task.item_id];
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	// Partial counts of split CBCs
+	struct partial_counts_t
+	{
+		vector<vector<leader_follower_count_t>> parts;
+		atomic<uint32_t> no_completed{ 0 };
+	};
+
+	vector<unique_ptr<partial_counts_t>> partial_counts(cbcs.size());
+
+	for (size_t i = 0; i < cbcs.size(); ++i)
+		if (auto no_parts = CSizeScheduler::NoParts(cbc_sizes[i], part_size); no_parts > 1)
+		{
+			partial_counts[i] = make_unique<partial_counts_t>();
+			partial_counts[i]->parts.resize(no_parts);
+		}
+
+	CReorderingWindow reordering_window(max_records_in_reordering_window);
+	vector<vector<bkc_record_t>> ordered_buffers(no_panels * no_splits);
+	vector<uint8_t> ordered_packed_buffer;
+
+	// Called only by the current writer of the reordering window
+	auto write_ordered = [&](vector<vector<bkc_record_t>>& records) {
+		for (uint32_t i = 0; i < records.size(); ++i)
+		{
+			ordered_buffers[i].insert(ordered_buffers[i].end(), records[i].begin(), records[i].end());
+
+			if ((int) ordered_buffers[i].size() >= max_records_in_buffer)
+			{
+				pack_records(ordered_buffers[i], ordered_packed_buffer);
+				bkc_files[i]->AddPacked(ordered_packed_buffer);
+				ordered_buffers[i].clear();
+			}
+		}
+	};
+
+	thread_pool->ParallelFor(no_threads, [&](uint32_t) {
+		CSizeScheduler::task_t task;
+
+		CPairCounter pair_counter(leader_len, follower_len);
 		vector<leader_follower_count_t> kmer_pair_counts;
+		vector<vector<follower_t>> universal_targets(no_panels);
 
 		vector<vector<bkc_record_t>> record_buffers;
 
 		vector<uint8_t> packed_buffer;
 
-		record_buffers.resize(no_splits);
+		record_buffers.resize(no_panels * no_splits);
 		// cout<< leader_len<< ", " << gap_len << ", " << follower_len << ", " << zstd_level << endl;
 
 //		zstd_in_memory zim{ (int) zstd_level };
@@ -323,19 +736,55 @@ void CBarcodedCounter::count_kmer_pairs()
 
 		while (true)
 		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)cbcs.size())
+			if (sorted_output)
+				reordering_window.WaitForRoom();
+
+			if (!next_task(task))
 				break;
 
-			// enumerate_kmer_pairs_for_cbc(cbcs[curr_id], kmer_pairs);
-			// std::cout << "extracting pairs fafq style" << endl;
-			extract_fafq_style_anchor_target_pairs(cbcs[curr_id], kmer_pairs);
-			// std::cout << "sort and gathering" << endl;
-			sort_and_gather_kmer_pairs_for_cbc(kmer_pairs, kmer_pair_counts);
-			// filter_rare_leader_sample_cbc(kmer_pair_counts);
-			store_kmer_pairs(cbcs[curr_id], kmer_pair_counts, record_buffers);
+			cbc_t cbc = cbcs[task.item_id];
+
+			if (task.no_parts > 1)
+			{
+				auto& partial = *partial_counts[task.item_id];
+
+				extract_single_pass_anchor_target_pairs(cbc, task.begin, task.end, pair_counter);
+				sort_and_gather_kmer_pairs_for_cbc(pair_counter, partial.parts[task.part_id]);
+
+				if (partial.no_completed.fetch_add(1) + 1 < task.no_parts)
+					continue;
+
+				merge_partial_kmer_pair_counts(partial.parts, kmer_pair_counts);
+				partial_counts[task.item_id].reset();
+			}
+			// enumerate_kmer_pairs_for_cbc(cbc, pair_counter);
+			else if (pair_extraction == pair_extraction_t::rescan)
+			{
+				extract_fafq_style_anchor_target_pairs(cbc, pair_counter);
+				sort_and_gather_kmer_pairs_for_cbc(pair_counter, kmer_pair_counts);
+			}
+			else
+			{
+				extract_single_pass_anchor_target_pairs(cbc, pair_counter);
+				sort_and_gather_kmer_pairs_for_cbc(pair_counter, kmer_pair_counts);
+			}
+
+			// Rescan counts (of a whole CBC) come already weighted
+			bool weighted = task.no_parts == 1 && pair_extraction == pair_extraction_t::rescan;
+
+			if (!weighted || filter_leaders)
+				weight_and_filter_leaders(kmer_pair_counts, weighted);
+
+			store_kmer_pairs(cbc, kmer_pair_counts, record_buffers, universal_targets);
+
+			if (sorted_output)
+			{
+				reordering_window.Put(task.item_id, record_buffers, write_ordered);
+				record_buffers.assign(no_panels * no_splits, {});
+				continue;
+			}
 
-			for (uint32_t i = 0; i < no_splits; ++i)
+			for (uint32_t i = 0; i < record_buffers.size(); ++i)
 				if ((int) record_buffers[i].size() >= max_records_in_buffer)
 				{
 					pack_records(record_buffers[i], packed_buffer);
@@ -350,20 +799,19 @@ void CBarcodedCounter::count_kmer_pairs()
 				}
 		}
 
-		for (uint32_t i = 0; i < no_splits; ++i)
+		for (uint32_t i = 0; i < record_buffers.size(); ++i)
 		{
 			pack_records(record_buffers[i], packed_buffer);
 			bkc_files[i]->AddPacked(packed_buffer);
 		}
 		});
 
-	join_threads(threads);
-
-	if (verbosity_level >= 2)
-	{
-		std::cerr << "Total no. k-mer pair counts: " << total_no_kmer_pair_counts << endl;
-		std::cerr << "Sum of k-mer pair counts: " << sum_kmer_pair_counts << endl;
-	}
+	for (uint32_t i = 0; i < ordered_buffers.size(); ++i)
+		if (!ordered_buffers[i].empty())
+		{
+			pack_records(ordered_buffers[i], ordered_packed_buffer);
+			bkc_files[i]->AddPacked(ordered_packed_buffer);
+		}
 }
 
 // *********************************************************************************************
@@ -398,23 +846,75 @@ void CBarcodedCounter::pack_records(vector<bkc_record_t>& records, vector<uint8_
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::store_kmer_pairs(cbc_t cbc, vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<bkc_record_t>>& record_buffers)
+// With filter_universal_targets the universal targets (of each panel) are not stored; they are found in weighted counts,
+// so the counts of the remaining pairs are the same as when the filter is applied afterwards (bkc_carrots)
+void CBarcodedCounter::store_kmer_pairs(cbc_t cbc, vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<bkc_record_t>>& record_buffers,
+	vector<vector<follower_t>>& universal)
 {
-	total_no_kmer_pair_counts += kmer_pair_counts.size();
-
 	string cbc_str = base_coding4.decode_bases_2b(cbc, cbc_len);
 
 	refresh::MurMur64Hash mh;
 
+	if (filter_universal_targets)
+		find_universal_targets(kmer_pair_counts, universal);
+
+	auto is_universal = [&universal, this](uint32_t panel, follower_t follower) {
+		return filter_universal_targets && !universal[panel].empty() && binary_search(universal[panel].begin(), universal[panel].end(), follower);
+	};
+
 	uint64_t sum = 0;
-	for (const auto& x : kmer_pair_counts)
+	uint64_t no_stored = 0;
+
+	if (no_panels == 1)
+		for (const auto& x : kmer_pair_counts)
+		{
+			if (is_universal(0, x.follower))
+				continue;
+
+			uint64_t h = mh(x.leader) % no_splits;
+
+			record_buffers[h].emplace_back(sample_id, cbc, x.leader, x.follower, x.count);
+			sum += x.count;
+			++no_stored;
+		}
+	else
 	{
-		uint64_t h = mh(x.leader) % no_splits;
+		// Pairs are grouped by leader, so its panel mask is looked up once per leader
+		leader_t prev_leader = ~leader_t(0);
+		uint64_t panel_mask = 0;
+		uint64_t h = 0;
 
-		record_buffers[h].emplace_back(sample_id, cbc, x.leader, x.follower, x.count);
-		sum += x.count;
+		for (const auto& x : kmer_pair_counts)
+		{
+			if (x.leader != prev_leader)
+			{
+				prev_leader = x.leader;
+				panel_mask = accepted_anchors->PanelMask(x.leader);
+				h = mh(x.leader) % no_splits;
+			}
+
+			bool stored = false;
+
+			for (uint64_t m = panel_mask; m; m &= m - 1)
+			{
+				uint32_t panel = (uint32_t) countr_zero(m);
+
+				if (is_universal(panel, x.follower))
+					continue;
+
+				record_buffers[panel * no_splits + h].emplace_back(sample_id, cbc, x.leader, x.follower, x.count);
+				stored = true;
+			}
+
+			if (stored)
+			{
+				sum += x.count;
+				++no_stored;
+			}
+		}
 	}
-	
+
+	total_no_kmer_pair_counts += no_stored;
 	sum_kmer_pair_counts += sum;
 
 #ifdef AGGRESIVE_MEMORY_SAVING
@@ -469,32 +969,258 @@ string CBarcodedCounter::kmer_to_string(uint64_t kmer, int len)
 }
 
 // *********************************************************************************************
-bool CBarcodedCounter::ProcessReads()
+// Average read len in the first block of the first read file (used only to estimate bucket sizes)
+uint64_t CBarcodedCounter::estimate_avg_read_len()
 {
-	set_read_file_names();
+	const uint64_t def_read_len = 150;
+	const size_t probe_size = 8 << 20;
 
-	std::cout<<"filenames set"<<endl;
+	CFastXReader fqx(fastq_records);
+	fqx.SetBamView(bam_view_t::read, cbc_len, umi_len);
+	
+	if (file_names.empty() || !fqx.Open(file_names.front()))
+		return def_read_len;
 
-	if (!no_threads || file_names.empty())
+	vector<char> probe(probe_size);
+	memory_chunk<char> mc(probe.data(), probe.size());
+
+	if (!fqx.ReadBlock(mc))
+		return def_read_len;
+
+	CReadReader read_reader(fastq_records);
+	read_desc_t read_desc;
+
+	uint64_t no_reads = 0;
+	uint64_t sum_len = 0;
+
+	read_reader.Assign(mc);
+	while (read_reader.GetRead(read_desc))
+	{
+		sum_len += strlen(read_desc.bases);
+		++no_reads;
+	}
+
+	return no_reads ? (sum_len + no_reads - 1) / no_reads : def_read_len;
+}
+
+// *********************************************************************************************
+// Distributes CBCs over buckets (largest first, to the least loaded bucket) so that packed reads of a single bucket
+// fit into half of the memory left after the fixed structures; the other half is left for the pair counting
+bool CBarcodedCounter::assign_cbc_to_buckets()
+{
+	uint64_t avg_read_len = estimate_avg_read_len();
+	uint64_t est_read_size = sizeof(readfid_t) + sizeof(uint32_t) + dna_stored_size((uint32_t) avg_read_len, false);
+
+	uint64_t no_valid_reads = 0;
+	uint64_t no_raw_reads = 0;
+
+	for (size_t i = 0; i < file_names.size(); ++i)
+	{
+		no_valid_reads += file_no_reads_after_cleanup[i];
+		no_raw_reads += file_no_reads[i];
+	}
+
+	uint64_t fixed_size = no_valid_reads * (sizeof(readfid_t) + sizeof(uint8_t*) + sizeof(bucket_id_t)) 
+		+ no_raw_reads / 8
+		+ no_reading_threads * no_chunks_per_file * chunk_size;
+
+	uint64_t bucket_budget = max_ram > fixed_size ? (max_ram - fixed_size) / 2 : 0;
+
+	if (bucket_budget < min_bucket_budget)
+	{
+		std::cerr << "Warning: max_ram is too low for " + to_string(no_valid_reads) + " reads; using buckets of " + to_string(min_bucket_budget >> 20) + " MB\n";
+		bucket_budget = min_bucket_budget;
+	}
+
+	vector<pair<uint64_t, cbc_t>> cbc_sizes;
+	cbc_sizes.reserve(global_cbc_dict.size());
+
+	uint64_t total_size = 0;
+
+	for (const auto& x : global_cbc_dict)
+	{
+		cbc_sizes.emplace_back(x.second.size() * est_read_size, x.first);
+		total_size += cbc_sizes.back().first;
+	}
+
+	// Buckets are counted one after another, so for sorted output each bucket gets a contiguous range of CBCs
+	if (sorted_output)
+		refresh::sort::pdqsort(cbc_sizes.begin(), cbc_sizes.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+	else
+		stable_sort(cbc_sizes.begin(), cbc_sizes.end(), greater<pair<uint64_t, cbc_t>>());
+
+	uint64_t no_buckets = max<uint64_t>((total_size + bucket_budget - 1) / bucket_budget, 1);
+
+	if (no_buckets > numeric_limits<bucket_id_t>::max())
+	{
+		std::cerr << "Warning: max_ram would need " + to_string(no_buckets) + " buckets, but at most " + to_string(numeric_limits<bucket_id_t>::max()) + 
+			" are possible; buckets will exceed their budget of " + to_string(bucket_budget >> 20) + " MB\n";
+		no_buckets = numeric_limits<bucket_id_t>::max();
+	}
+
+	if (verbosity_level >= 2)
+		std::cerr << "Est. size of valid reads: " + to_string(total_size >> 20) + " MB in " + to_string(no_buckets) + " buckets\n";
+
+	bucket_cbcs.clear();
+	bucket_cbcs.resize(no_buckets);
+
+	priority_queue<pair<uint64_t, uint32_t>, vector<pair<uint64_t, uint32_t>>, greater<pair<uint64_t, uint32_t>>> bucket_loads;
+	for (uint32_t i = 0; i < no_buckets; ++i)
+		bucket_loads.emplace(0, i);
+
+	read_bucket.clear();
+	read_bucket.resize(file_names.size());
+	for (size_t i = 0; i < file_names.size(); ++i)
+		read_bucket[i].resize(file_no_reads_after_cleanup[i], 0);
+
+	uint64_t file_id;
+	uint64_t read_id;
+
+	uint64_t prefix_size = 0;
+	vector<uint64_t> bucket_sizes(no_buckets, 0);
+
+	for (const auto& x : cbc_sizes)
+	{
+		uint32_t bucket_id;
+
+		if (sorted_output)
+		{
+			bucket_id = (uint32_t) min<uint64_t>(prefix_size * no_buckets / max<uint64_t>(total_size, 1), no_buckets - 1);
+			prefix_size += x.first;
+		}
+		else
+		{
+			auto [load, id] = bucket_loads.top();
+			bucket_loads.pop();
+
+			bucket_id = id;
+			bucket_loads.emplace(load + x.first, id);
+		}
+
+		bucket_cbcs[bucket_id].emplace_back(x.second);
+		bucket_sizes[bucket_id] += x.first;
+
+		for (auto y : global_cbc_dict[x.second])
+		{
+			tie(file_id, read_id) = decode_read_id(y);
+			read_bucket[file_id][read_id] = (bucket_id_t) bucket_id;
+		}
+	}
+
+	// E.g., for CBCs larger than the budget or if the no. of buckets is limited
+	uint64_t no_exceeding = count_if(bucket_sizes.begin(), bucket_sizes.end(), [bucket_budget](uint64_t x) { return x > bucket_budget; });
+	if (no_exceeding)
+		std::cerr << "Warning: " + to_string(no_exceeding) + " of " + to_string(no_buckets) + " buckets exceed their budget of " + to_string(bucket_budget >> 20) + 
+			" MB (the largest one: " + to_string(*max_element(bucket_sizes.begin(), bucket_sizes.end()) >> 20) + " MB), so max_ram can be exceeded\n";
+
+	bucket_file_names.clear();
+	bucket_files.clear();
+	bucket_mtxs.clear();
+
+	string base_name = fs::path(out_file_name).filename().string();
+
+	for (uint32_t i = 0; i < no_buckets; ++i)
+	{
+		bucket_file_names.emplace_back((fs::path(tmp_path) / (base_name + ".bucket." + to_string(i))).string());
+		bucket_files.emplace_back(fopen(bucket_file_names.back().c_str(), "wb"));
+		bucket_mtxs.emplace_back(make_unique<mutex>());
+
+		if (!bucket_files.back())
+		{
+			std::cerr << "Error: Cannot create bucket file: " + bucket_file_names.back() + "\n";
+
+			bucket_files.pop_back();
+			for (auto f : bucket_files)
+				fclose(f);
+			bucket_files.clear();
+
+			error_code ec;
+			bucket_file_names.pop_back();
+			for (const auto& fn : bucket_file_names)
+				fs::remove(fn, ec);
+			bucket_file_names.clear();
+
+			return false;
+		}
+
+		setvbuf(bucket_files.back(), nullptr, _IOFBF, 4 << 20);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Loads packed reads of a bucket and sets pointers in sample_reads (valid until next bucket is loaded)
+bool CBarcodedCounter::load_bucket(uint32_t bucket_id, vector<uint8_t>& bucket_data)
+{
+	const string& fn = bucket_file_names[bucket_id];
+
+	FILE* f = fopen(fn.c_str(), "rb");
+	if (!f)
+	{
+		std::cerr << "Error: Cannot open bucket file: " + fn + "\n";
 		return false;
+	}
 
-	no_reading_threads = max(min(no_threads / 2, (int)file_names.size()), 1);
+	bucket_data.clear();
+	bucket_data.shrink_to_fit();
+	bucket_data.resize(fs::file_size(fn));
+
+	bool ok = fread(bucket_data.data(), 1, bucket_data.size(), f) == bucket_data.size();
+	fclose(f);
+
+	if (!ok)
+	{
+		std::cerr << "Error: Cannot read bucket file: " + fn + "\n";
+		return false;
+	}
+
+	uint64_t file_id;
+	uint64_t read_id;
+	uint64_t x;
+	uint32_t len;
+
+	for (size_t pos = 0; pos + sizeof(x) + sizeof(len) <= bucket_data.size(); )
+	{
+		memcpy(&x, bucket_data.data() + pos, sizeof(x));
+		pos += sizeof(x);
+		memcpy(&len, bucket_data.data() + pos, sizeof(len));
+		pos += sizeof(len);
+
+		tie(file_id, read_id) = decode_read_id(x);
+		sample_reads[file_id][read_id] = bucket_data.data() + pos;
+		pos += len;
+	}
+
+	return true;
+}
 
+// *********************************************************************************************
+bool CBarcodedCounter::process_reads_bucketed()
+{
 	if (verbosity_level >= 1)
-		std::cerr << "Reads loading\n";
+		std::cerr << "Reads spilling to buckets\n";
+
+	if (!assign_cbc_to_buckets())
+		return false;
 
 	reinit_queues();
 
 	init_bkc_files();
 
 	start_reading_threads();
-	start_reads_loading_threads();
+	start_reads_spilling_threads();
 
 	join_threads(reading_threads);
 	join_threads(reads_loading_threads);
-	mi_collect(true);
 
-	std::cout<<"threads read loaded & joined"<<endl;
+	for (auto& f : bucket_files)
+		fclose(f);
+	bucket_files.clear();
+
+	clear_vec(read_bucket);
+	clear_vec(valid_reads);
+	mi_collect(true);
 
 	if (verbosity_level >= 2)
 	{
@@ -502,22 +1228,177 @@ bool CBarcodedCounter::ProcessReads()
 		std::cerr << "Total len of loaded reads: " << a_total_read_len << endl;
 	}
 
-	times.emplace_back("Reads loading", high_resolution_clock::now());
+	mark_stage("Reads spilling to buckets");
+
+	if (verbosity_level >= 1)
+		std::cerr << "Enumerating and counting leader-follower pairs in " + to_string(bucket_cbcs.size()) + " buckets\n";
+
+	sample_reads.resize(file_names.size());
+	for (int i = 0; i < (int) sample_reads.size(); ++i)
+		sample_reads[i].resize(file_no_reads_after_cleanup[i], nullptr);
+
+	total_no_kmer_pair_counts = 0;
+	sum_kmer_pair_counts = 0;
+
+	vector<uint8_t> bucket_data;
+	bool r = true;
+
+	// Exact leader counts need all the reads, so the buckets are read once more before counting
+	if (leader_sketch && min_leader_count > 1)
+	{
+		vector<CLeaderSketch::CExactCounts> exact_counts;
+
+		for (uint32_t i = 0; i < bucket_cbcs.size() && r; ++i)
+		{
+			r = load_bucket(i, bucket_data);
+			if (r)
+				count_exact_leaders(bucket_cbcs[i], exact_counts);
+		}
+
+		if (r)
+			set_exact_leader_counts(exact_counts);
+	}
+
+	for (uint32_t i = 0; i < bucket_cbcs.size() && r; ++i)
+	{
+		if (!load_bucket(i, bucket_data))
+		{
+			r = false;
+			break;
+		}
+
+		count_kmer_pairs(bucket_cbcs[i]);
+
+		for (auto cbc : bucket_cbcs[i])
+			clear_vec(global_cbc_dict[cbc]);
+		clear_vec(bucket_cbcs[i]);
+
+		fs::remove(bucket_file_names[i]);
+
+		if (verbosity_level >= 2)
+			std::cerr << "Bucket " + to_string(i) + " of size " + to_string(bucket_data.size() >> 20) + " MB processed\n";
+	}
+
+	if (!r)
+		for (const auto& fn : bucket_file_names)
+			fs::remove(fn);
+
+	clear_vec(bucket_data);
+	mi_collect(true);
 
-#if 0			// Currently not used
-	if (min_leader_count > 1)
+	if (verbosity_level >= 2)
+	{
+		std::cerr << "Total no. k-mer pair counts: " << total_no_kmer_pair_counts << endl;
+		std::cerr << "Sum of k-mer pair counts: " << sum_kmer_pair_counts << endl;
+	}
+
+	mark_stage("Enumerating and counting leader-follower pairs");
+
+	bkc_files.clear();
+
+	return r;
+}
+
+// *********************************************************************************************
+// Fused pipeline: packed R2 reads are already in memory, only the valid ones are relabelled
+bool CBarcodedCounter::assign_fused_reads()
+{
+	a_total_no_reads = 0;
+
+	sample_reads.resize(file_names.size());
+
+	for (size_t file_id = 0; file_id < file_names.size(); ++file_id)
+	{
+		auto& raw_reads = raw_sample_reads[file_id];
+
+		if (raw_reads.size() != file_no_reads[file_id])
+		{
+			std::cerr << "Error: Different no. of reads in " + cbc_file_names[file_id] + " (" + to_string(file_no_reads[file_id]) + ") and " + 
+				read_file_names[file_id] + " (" + to_string(raw_reads.size()) + ")\n";
+			return false;
+		}
+
+		sample_reads[file_id].resize(file_no_reads_after_cleanup[file_id], nullptr);
+
+		uint64_t file_read_id = 0;
+
+		for (size_t i = 0; i < raw_reads.size(); ++i)
+			if (valid_reads[file_id][i])
+				sample_reads[file_id][file_read_id++] = raw_reads[i];
+
+		a_total_no_reads += file_read_id;
+	}
+
+	clear_vec(raw_sample_reads);
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CBarcodedCounter::ProcessReads()
+{
+	// R2 file names are already set if their reading was started at the end of ProcessCBC
+	if (!r2_reading_started)
+		set_read_file_names();
+
+	std::cout<<"filenames set"<<endl;
+
+	if (!no_threads || file_names.empty())
+		return false;
+
+	no_reading_threads = max(min(no_threads / 2, (int)file_names.size()), 1);
+
+	if (max_ram)
+		return process_reads_bucketed();
+
+	if (numa_topology)
+		assign_cbc_to_numa_nodes(!fused_pipeline);
+
+	if (fused_pipeline)
 	{
 		if (verbosity_level >= 1)
-			std::cerr << "Enumerating and counting leader k-mers\n";
-		count_leaders();
-		times.emplace_back("Enumerating and counting leader k-mers", high_resolution_clock::now());
+			std::cerr << "Reads assigning (fused pipeline)\n";
+
+		init_bkc_files();
 
+		if (!assign_fused_reads())
+			return false;
+	}
+	else
+	{
 		if (verbosity_level >= 1)
-			std::cerr << "Determine valid leaders\n";
-		determine_valid_leaders();
-		times.emplace_back("Determine valid leaders", high_resolution_clock::now());
+			std::cerr << "Reads loading\n";
+
+		if (!r2_reading_started)
+		{
+			reinit_queues();
+			start_reading_threads();
+		}
+		r2_reading_started = false;
+
+		init_bkc_files();
+
+		start_reads_loading_threads();
+
+		join_threads(reading_threads);
+		join_threads(reads_loading_threads);
+
+		clear_vec(read_numa_node);
 	}
-#endif
+	mi_collect(true);
+
+	std::cout<<"threads read loaded & joined"<<endl;
+
+	if (verbosity_level >= 2)
+	{
+		std::cerr << "Total no. of loaded reads: " << a_total_no_reads << endl;
+		std::cerr << "Total len of loaded reads: " << a_total_read_len << endl;
+	}
+
+	mark_stage("Reads loading");
+
+	if (leader_sketch && verbosity_level >= 2)
+		std::cerr << "Leader sketch of " + to_string(leader_sketch->SizeInBytes() >> 20) + " MB used to drop rare leaders in enumeration\n";
 
 	// if (counting_mode == counting_mode_t::single)
 	// {
@@ -534,10 +1415,12 @@ bool CBarcodedCounter::ProcessReads()
 		std::cout<<"counting kmer pairs"<<endl;
 		count_kmer_pairs();
 		mi_collect(true);
-		times.emplace_back("Enumerating and counting leader-follower pairs", high_resolution_clock::now());
+		mark_stage("Enumerating and counting leader-follower pairs");
 	// }
 
 	mma.clear();
+	numa_arenas.clear();
+	cbc_numa_node.clear();
 
 	bkc_files.clear();
 
@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include <map>
 #include <thread>
+#include <mutex>
 #include <memory>
 #include <cinttypes>
 #include <chrono>
@@ -17,15 +18,27 @@
 #include "../../libs/refresh/memory_chunk/lib/memory_chunk.h"
 #include "../../libs/refresh/allocators/lib/memory_monotonic.h"
 #include "accepted_anchors.h"
+#include "leader_sketch.h"
+#include "pair_counter.h"
+#include "cbc_correction_index.h"
+#include "size_scheduler.h"
+#include "reordering_window.h"
 
 
 #include "../../src/bkc/memory_pool.h"
+#include "../../src/bkc/spsc_queue.h"
+#include "../../src/bkc/bam_reader.h"
+#include "../../src/bkc/gz_writer.h"
 #include "../../src/common/utils.h"
 #include "../../src/common/bkc_file.h"
+#include "../../src/common/dna_packing.h"
+#include "../../src/common/thread_pool.h"
+#include "../../src/common/numa.h"
+#include "../../src/common/run_stats.h"
 #include "params.h"
 
 #include "../../shared/filters/poly_ACGT_filter.h"
-// #include "../../shared/filters/artifacts_filter.h"
+#include "../../shared/filters/artifacts_filter.h"
 #include "../../shared/types/base_coding.h"
 #include "../../shared/types/common_types.h"
 
@@ -33,61 +46,8 @@ using namespace std;
 using namespace std::chrono;
 using namespace refresh;
 
-struct leader_follower_t {
-	leader_t leader;
-	follower_t follower;
-
-	leader_follower_t() = default;
-	leader_follower_t(leader_t _leader, follower_t _follower) :
-		leader(_leader), follower(_follower) {}
-	leader_follower_t(const leader_follower_t&) = default;
-	leader_follower_t(leader_follower_t&&) = default;
-	leader_follower_t& operator=(const leader_follower_t&) = default;
-	leader_follower_t& operator=(leader_follower_t&&) = default;
-
-	bool operator<(const leader_follower_t& rhs) const {
-		if (this->leader != rhs.leader)
-			return this->leader < rhs.leader;
-		return this->follower < rhs.follower;
-	}
-
-	bool operator==(const leader_follower_t& rhs) const 
-	{
-		return this->leader == rhs.leader && this->follower == rhs.follower;
-	}
-};
-
-struct leader_follower_count_t : public leader_follower_t
-{
-	uint64_t count;
-
-	leader_follower_count_t() = default;
-	leader_follower_count_t(leader_t _leader, follower_t _follower, uint64_t _count) :
-		leader_follower_t(_leader, _follower),
-		count(_count)
-	{}
-	leader_follower_count_t(const leader_follower_count_t&) = default;
-	leader_follower_count_t(const leader_follower_t& x) : leader_follower_t(x), count(1) {};
-	leader_follower_count_t(leader_follower_count_t&&) = default;
-	leader_follower_count_t& operator=(const leader_follower_count_t&) = default;
-	leader_follower_count_t& operator=(leader_follower_count_t&&) = default;
-
-	bool operator<(const leader_follower_count_t& rhs) {
-		if (this->leader != rhs.leader)
-			return this->leader < rhs.leader;
-		return this->follower < rhs.follower;
-	}
-
-	bool operator==(const leader_follower_t& rhs)
-	{
-		return this->leader == rhs.leader && this->follower == rhs.follower;
-	}
-
-	bool equal_lf(const leader_follower_t& rhs)
-	{
-		return this->leader == rhs.leader && this->follower == rhs.follower;
-	}
-};
+// Blocks (file id, chunk) handed over from a reading thread to its consuming thread
+using block_queue_t = CSpscQueue<pair<int, memory_chunk<char>>>;
 
 struct kmer_count_t
 {
@@ -122,19 +82,34 @@ struct kmer_count_t
 
 class CBarcodedCounter
 {
-	const size_t no_blocks_in_queue = 3;
-	const size_t no_chunks_per_file = 3;
+	size_t no_blocks_in_queue = 3;				// depth of the SPSC queue between a reading thread and its consumer
+	size_t no_chunks_per_file = 3;				// no. of chunks in the pool of a reading thread
 	const size_t chunk_size = 64 << 20;
 	const int gz_filtered_file_buffer_size = 16 << 20;
+	const uint64_t min_cbc_part_size = 1 << 14;			// in reads; smaller CBCs are never split in pair counting
 //	const bool filtered_input_in_FASTA = false;
 	bool filtered_input_in_FASTA = false;
 	bool canonical_mode = false;
 
 	vector<pair<string, time_point<high_resolution_clock>>> times;
 
+	// Closes a stage (for timings and --stats_json); an empty name just starts the first stage
+	void mark_stage(const string& name)
+	{
+		times.emplace_back(name, high_resolution_clock::now());
+
+		if (name.empty())
+			run_stats.Restart();
+		else
+			run_stats.EndStage(name);
+	}
+
 	vector<string> file_names;
 	int no_threads = 1;
+	unique_ptr<CThreadPool> thread_pool;				// shared by all parallel stages (pipeline threads are dedicated)
 	int no_reading_threads = 0;
+	int no_gz_threads = 0;						// per reading thread; 0 means auto
+	bool mmap_input = false;					// uncompressed input files are memory-mapped
 
 	string out_file_name = "./results.bkc";
 
@@ -148,7 +123,11 @@ class CBarcodedCounter
 	uint32_t gap_len = 0;
 	uint64_t min_leader_count = 1;
 	uint32_t no_splits = 1;
+	uint32_t no_panels = 1;				// no. of anchor panels; bkc_files[panel * no_splits + split]
 	uint32_t rare_leader_thr = 0;
+	bool filter_leaders = false;			// any of rare leader, poly-ACGT and artifacts post-filters
+	bool filter_universal_targets = false;
+	bool collapse_duplicate_reads = false;	// identical reads of a CBC are enumerated once (weighted)
 	uint32_t max_count = 65535;
 	uint32_t zstd_level = 6;
 	uint32_t verbosity_level = 0;
@@ -159,7 +138,13 @@ class CBarcodedCounter
 	export_filtered_input_t export_filtered_input = export_filtered_input_t::none;
 	string filtered_input_path;
 	input_format_t input_format;
+	bool fastq_records = true;					// FASTQ or BAM (converted to FASTQ records) input
+	bam_view_t bam_view = bam_view_t::read;		// for BAM input: CBC/UMI tags for the R1 pass, bases for the R2 pass
 	output_format_t output_format;
+	bool sorted_output = false;				// records of each output file in SBLFC order (CBCs written in CBC order)
+	pair_extraction_t pair_extraction = pair_extraction_t::single_pass;
+	uint64_t max_ram = 0;						// in bytes; 0 means all valid R2 reads are kept in memory
+	string tmp_path = "./";
 
 	vector<string> cbc_file_names;
 	vector<string> read_file_names;
@@ -179,35 +164,116 @@ class CBarcodedCounter
 	vector<thread> reads_exporting_threads;
 
 	vector<unique_ptr<CMemoryPool<char>>> memory_pools;
-	vector<unique_ptr<parallel_queue<pair<int, memory_chunk<char>>>>> block_queues;
+	vector<unique_ptr<block_queue_t>> block_queues;
 
 	unique_ptr<parallel_queue<pair<int, string>>> fn_queue;
 
+	// Fused pipeline: R2 files are read concurrently with R1 files (during ProcessCBC) and all R2 reads are packed
+	// into per-file stores indexed by raw read id, so ProcessReads does not need to decompress R2 once again
+	bool fused_pipeline = false;
+	bool r2_reading_started = false;			// R2 reading threads started at the end of ProcessCBC
+	vector<thread> r2_reading_threads;
+	vector<thread> r2_packing_threads;
+	vector<unique_ptr<CMemoryPool<char>>> r2_memory_pools;
+	vector<unique_ptr<block_queue_t>> r2_block_queues;
+	unique_ptr<parallel_queue<pair<int, string>>> r2_fn_queue;
+	vector<vector<uint8_t*>> raw_sample_reads;
+
 	using umi_t = uint64_t;
 	using readfid_t = uint64_t;
 	using umi_readfid_t = pair<umi_t, readfid_t>;
 
-	vector<unordered_map<cbc_t, vector<umi_readfid_t>, refresh::MurMur64Hash>> cbc_dict;
+	struct cbc_umi_readfid_t {
+		cbc_t cbc;
+		umi_t umi;
+		readfid_t readfid;
+
+		cbc_umi_readfid_t() = default;
+		cbc_umi_readfid_t(cbc_t cbc, umi_t umi, readfid_t readfid) : cbc(cbc), umi(umi), readfid(readfid) {}
+
+		bool operator<(const cbc_umi_readfid_t& x) const
+		{
+			if (cbc != x.cbc)
+				return cbc < x.cbc;
+			if (umi != x.umi)
+				return umi < x.umi;
+			return readfid < x.readfid;
+		}
+	};
+
+	// CBC dictionary is radix-partitioned by the top bits of CBC: counting threads append to flat per-partition buffers
+	// and each partition is then sorted by (cbc, umi, readfid) and processed independently
+	const uint32_t max_cbc_partition_bits = 8;
+	uint32_t no_cbc_partitions = 1;
+	uint32_t cbc_partition_shift = 0;
+
+	uint32_t cbc_partition_id(cbc_t cbc) const
+	{
+		return (uint32_t) (cbc >> cbc_partition_shift);
+	}
+
+	vector<vector<vector<cbc_umi_readfid_t>>> thread_cbc_parts;		// [thread][partition]
+	vector<vector<cbc_umi_readfid_t>> cbc_parts;					// [partition]
+
+	// CBC sharding (--cbc_shard i/N): each of N runs reads the whole input, but keeps only the CBCs hashed to its shard.
+	// CBC counts are collected for all CBCs, so trusted CBCs and corrections are the same in all shards. Without CBC
+	// correction, records of other shards are dropped already by the counting threads (only their counts are kept)
+	uint32_t cbc_shard_id = 0;
+	uint32_t no_cbc_shards = 1;
+	vector<unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash>> thread_other_shard_cbc_counts;	// [thread]
+
+	bool in_cbc_shard(cbc_t cbc) const
+	{
+		return no_cbc_shards == 1 || refresh::MurMur64Hash{}(cbc) % no_cbc_shards == cbc_shard_id;
+	}
+
+	bool drop_other_shards_at_counting() const
+	{
+		return no_cbc_shards > 1 && !apply_cbc_correction;
+	}
+
+	// CBC pass cache (--cbc_cache, see cbc_cache.cpp): if valid, ProcessCBC loads it instead of reading R1 files
+	string cbc_cache_file_name;
+
 	vector<pair<uint64_t, cbc_t>> cbc_vec, cbc_for_corr_vec;
-	unordered_map<cbc_t, vector<vector<umi_readfid_t>>, refresh::MurMur64Hash> global_cbc_umi_dict;
+	unordered_map<cbc_t, vector<umi_readfid_t>, refresh::MurMur64Hash> global_cbc_umi_dict;
 	unordered_map<cbc_t, vector<readfid_t>, refresh::MurMur64Hash> global_cbc_dict;
-	unordered_map<cbc_t, cbc_t, refresh::MurMur64Hash> correction_map;
-	unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash> cbc_stats;
+	vector<pair<cbc_t, cbc_t>> cbc_corrections;		// sorted by the CBC to correct
+	vector<pair<uint64_t, cbc_t>> cbc_stats;
 
-	unordered_set<cbc_t> predefined_cbc;
+	vector<cbc_t> predefined_cbc;						// sorted
 
 	vector<vector<bool>> valid_reads;
 	vector<unique_ptr<memory_monotonic_safe>> mma;
-	vector<vector<uint8_t*>> sample_reads;
+
+	// NUMA mode: pool workers are pinned to nodes, each CBC is assigned to a node, its reads are loaded into
+	// the node's arena and its counting is scheduled on the node's workers first
+	unique_ptr<CNumaTopology> numa_topology;			// nullptr if NUMA mode is off
+	vector<unique_ptr<CNumaArena>> numa_arenas;			// [node]
+	unordered_map<cbc_t, uint32_t, refresh::MurMur64Hash> cbc_numa_node;
+	vector<vector<uint8_t>> read_numa_node;				// [file][read id after relabelling]
+	vector<vector<uint8_t*>> sample_reads;				// reads in the 2-bit stored form (see dna_stored_view)
 	vector<uint64_t> file_no_reads;
 	vector<uint64_t> file_no_reads_after_cleanup;
 
 	const int max_records_in_buffer = 128 << 10;
 //	const int max_records_in_buffer = 2048 << 10;
+	const uint64_t max_records_in_reordering_window = 4 << 20;
 	vector<shared_ptr<CBKCFile>> bkc_files;
 
+	// Bucketed (--max_ram) mode: valid R2 reads are spilled to per-bucket temporary files and counted bucket by bucket
+	const size_t bucket_write_buffer_size = 256 << 10;
+	const uint64_t min_bucket_budget = 64ull << 20;
+	using bucket_id_t = uint16_t;
+
+	vector<vector<bucket_id_t>> read_bucket;
+	vector<vector<cbc_t>> bucket_cbcs;
+	vector<string> bucket_file_names;
+	vector<FILE*> bucket_files;
+	vector<unique_ptr<mutex>> bucket_mtxs;
+
 	vector<unordered_map<uint64_t, uint64_t, refresh::MurMur64Hash>> leader_counts;
-	unordered_set<uint64_t> valid_leaders;
+	unique_ptr<CLeaderSketch> leader_sketch;		// leader counts for min_leader_count (made exact before counting) and rare_leader_thr prefiltering
 
 	atomic<uint64_t> total_no_kmer_leaders_counts;
 	atomic<uint64_t> sum_kmer_leaders_counts;
@@ -222,9 +288,8 @@ class CBarcodedCounter
 	atomic<uint64_t> a_total_no_reads;
 
 	PolyACGTFilter poly_ACGT_filter;
-	// ArtifactsFilter artifacts_filter;
+	ArtifactsFilter artifacts_filter;
 	BaseCoding4 base_coding4;
-	BaseCoding3 base_coding3;
 
 	uint64_t encode_read_id(uint64_t file_id, uint64_t read_no)
 	{
@@ -244,20 +309,25 @@ class CBarcodedCounter
 	}
 
 	std::string get_dedup_file_name(const std::string& input_path, const uint32_t id);
+	unique_ptr<CBgzfWriter> open_filtered_file(int file_id, const uint32_t id);
 
 	void join_threads(vector<thread>& threads);
 	void start_reading_threads();
+	void start_reading_threads(vector<thread>& threads, parallel_queue<pair<int, string>>* p_fn_queue,
+		vector<unique_ptr<CMemoryPool<char>>>& pools, vector<unique_ptr<block_queue_t>>& queues, bam_view_t view);
+	void start_reads_packing_threads();
 	void start_counting_threads();
 	void start_reads_loading_threads();
 	void start_reads_exporting_threads();
+	void start_reads_spilling_threads();
 
 	void init_queues_and_pools();
 	void reinit_queues();
 
 	bool init_bkc_files();
 
-	void merge_cbc_dict();
-	void sort_cbc_dict();
+	template<typename FUN> void run_for_cbc_partitions(FUN&& fun);
+	void sort_cbc_partitions();
 	void gather_cbc_stats();
 
 	double calc_dist(vector<pair<uint64_t, uint64_t>>::iterator p, vector<pair<uint64_t, uint64_t>>::iterator q);
@@ -266,38 +336,70 @@ class CBarcodedCounter
 	void find_predefined_cbc();
 
 	void find_CBC_corrections();
+	void keep_cbc_shard();
+
+	string cbc_cache_key() const;
+	bool load_cbc_cache();
+	bool save_cbc_cache();
 	void remove_non_trusted_CBC();
 	void remove_duplicated_UMI();
 
 	void create_valid_reads_lists();
+	void assign_cbc_to_numa_nodes(bool assign_reads);
 
 	void list_cbc_dict(const string& suffix);
 
 	string kmer_to_string(uint64_t kmer, int len);
 
-	void enumerate_kmer_leaders_from_read(uint8_t* bases, vector<leader_t>& kmer_leaders);
+	dna_packed_view_t read_view(uint64_t file_id, uint64_t read_id, CDnaPackedRead& packed_read);
+	void enumerate_kmer_leaders_from_read(const dna_packed_view_t& read, vector<leader_t>& kmer_leaders);
 	void enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t>& kmer_leaders);
-	void count_leaders();
-	void determine_valid_leaders();
 
-	void enumerate_kmer_pairs_from_read(uint8_t* bases, vector<leader_follower_t>& kmer_pairs);
+	// Read of a CBC with its no. of copies (> 1 only for collapsed duplicates)
+	struct weighted_read_t
+	{
+		dna_packed_view_t read;
+		uint64_t count;
+	};
+
+	void collect_cbc_reads(const cbc_t& cbc, size_t begin, size_t end, vector<weighted_read_t>& reads, vector<CDnaPackedRead>& packed_reads);
+
+	void enumerate_kmer_pairs_from_read(const dna_packed_view_t& read, CPairCounter& pair_counter);
 	void enumerate_kmers_from_read(uint8_t* bases, vector<kmer_t>& kmers);
 
-	void enumerate_kmer_pairs_for_cbc(cbc_t cbc, vector<leader_follower_t>& kmer_pairs);
+	void enumerate_kmer_pairs_for_cbc(cbc_t cbc, CPairCounter& pair_counter);
 	void enumerate_kmers_for_cbc(cbc_t cbc, vector<kmer_t>& kmers);
 
-    void extract_fafq_style_anchor_target_pairs(const cbc_t& cbc, vector<leader_follower_t>& kmer_pairs);
-
-	void sort_and_gather_kmer_pairs_for_cbc(vector<leader_follower_t>& kmer_pairs, vector<leader_follower_count_t>& kmer_pair_counts);
+    void extract_fafq_style_anchor_target_pairs(const cbc_t& cbc, CPairCounter& pair_counter);
+	void enumerate_accepted_kmer_pairs_from_read(const dna_packed_view_t& read, uint64_t count, CPairCounter& pair_counter);
+	template<uint32_t LEADER_LEN, uint32_t GAP_LEN, uint32_t FOLLOWER_LEN>
+	void enumerate_accepted_kmer_pairs_from_read_fixed(const dna_packed_view_t& read, uint64_t count, CPairCounter& pair_counter);
+
+	// Per-read kernel of the single-pass extractor: instantiated for common (leader, gap, follower) lengths,
+	// generic otherwise; selected once (in SetParams); pairs are added count times (no. of copies of the read)
+	using accepted_pairs_kernel_t = void (CBarcodedCounter::*)(const dna_packed_view_t&, uint64_t, CPairCounter&);
+	accepted_pairs_kernel_t accepted_pairs_kernel = &CBarcodedCounter::enumerate_accepted_kmer_pairs_from_read;
+	void select_window_kernels();
+	void extract_single_pass_anchor_target_pairs(const cbc_t& cbc, CPairCounter& pair_counter);
+	void extract_single_pass_anchor_target_pairs(const cbc_t& cbc, size_t begin, size_t end, CPairCounter& pair_counter);
+	void merge_partial_kmer_pair_counts(vector<vector<leader_follower_count_t>>& parts, vector<leader_follower_count_t>& kmer_pair_counts);
+	void weight_and_filter_leaders(vector<leader_follower_count_t>& kmer_pair_counts, bool weighted);
+
+	void sort_and_gather_kmer_pairs_for_cbc(CPairCounter& pair_counter, vector<leader_follower_count_t>& kmer_pair_counts);
 	void sort_and_gather_kmers_for_cbc(vector<kmer_t>& kmers, vector<kmer_count_t>& kmer_counts);
 
-	void filter_rare_leader_sample_cbc(vector<leader_follower_count_t>& kmer_pair_counts);
+	bool is_valid_leader(leader_t leader, uint64_t no_occ) const;
+	void find_universal_targets(const vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<follower_t>>& universal);
 	void filter_rare_kmer_sample_cbc(vector<kmer_count_t>& kmer_counts);
 
-	void store_kmer_pairs(cbc_t cbc, vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<bkc_record_t>> &record_buffers);
+	void store_kmer_pairs(cbc_t cbc, vector<leader_follower_count_t>& kmer_pair_counts, vector<vector<bkc_record_t>> &record_buffers,
+		vector<vector<follower_t>>& universal);
 	void store_kmers(cbc_t cbc, vector<kmer_count_t>& kmer_pair_counts, vector<vector<bkc_record_t>> &record_buffers);
 
 	void count_kmer_pairs();
+	void count_kmer_pairs(const vector<cbc_t>& cbcs);
+	void count_exact_leaders(const vector<cbc_t>& cbcs, vector<CLeaderSketch::CExactCounts>& exact_counts);
+	void set_exact_leader_counts(vector<CLeaderSketch::CExactCounts>& exact_counts);
 	void count_kmers();
 
 	void pack_records(vector<bkc_record_t>& records, vector<uint8_t>& packed_buffer);
@@ -305,12 +407,18 @@ class CBarcodedCounter
 	void set_CBC_file_names();
 	void set_read_file_names();
 
+	uint64_t estimate_avg_read_len();
+	bool assign_cbc_to_buckets();
+	bool load_bucket(uint32_t bucket_id, vector<uint8_t>& bucket_data);
+	bool process_reads_bucketed();
+	bool assign_fused_reads();
+
 	
 
 public:
 	CBarcodedCounter() = default;
 
-	void SetParams(const CParams& params);
+	void SetParams(const CParams& params, CBarcodedCounter* prev = nullptr);
 
 	void ShowTimings() {
 		if(verbosity_level > 0)
@@ -321,7 +429,7 @@ public:
 	bool ProcessExportFilteredCBCReads();
 	bool ProcessExportFilteredReads();
 	bool ProcessReads();
-	static bool prepare_anchor_dict(const std::vector<std::string>& vec);
+	static bool prepare_anchor_dict(const std::vector<std::vector<std::string>>& panels);
 	static array<uint8_t, 256> char2bits;
 	static void init();
 	static shared_ptr<AcceptedAnchors> accepted_anchors;
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <cinttypes>
+
+#include "../common/bkc_file.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Window restoring the item order of outputs (--sorted_output): items (CBCs) are completed by the counting threads
+// in any order, but their records (one vector per output file) are handed to the writer in item order.
+// Only one thread acts as the writer at a time (the one that completed an item while no one was writing), so the
+// writer needs no own synchronization. Items have to be taken by the threads in item order and WaitForRoom() is called
+// only between items, so the missing item is always being processed and the window is eventually drained.
+class CReorderingWindow
+{
+	mutex mtx;
+	condition_variable cv_room;
+
+	map<size_t, vector<vector<bkc_record_t>>> pending;
+	size_t next_item = 0;
+	uint64_t no_pending_records = 0;
+	uint64_t max_pending_records;
+	bool writer_active = false;
+
+	// *********************************************************************************************
+	static uint64_t no_records(const vector<vector<bkc_record_t>>& records)
+	{
+		uint64_t r = 0;
+		for (const auto& x : records)
+			r += x.size();
+
+		return r;
+	}
+
+public:
+	// *********************************************************************************************
+	CReorderingWindow(uint64_t _max_pending_records) :
+		max_pending_records(_max_pending_records)
+	{}
+
+	// *********************************************************************************************
+	// Waits while the window is full
+	void WaitForRoom()
+	{
+		unique_lock<mutex> lck(mtx);
+		cv_room.wait(lck, [this] { return no_pending_records <= max_pending_records; });
+	}
+
+	// *********************************************************************************************
+	// Records are moved out; writer(records) is called (without the lock held) for the consecutive ready items
+	template<typename WRITER> void Put(size_t item_id, vector<vector<bkc_record_t>>& records, WRITER&& writer)
+	{
+		unique_lock<mutex> lck(mtx);
+
+		no_pending_records += no_records(records);
+		pending.emplace(item_id, move(records));
+
+		if (writer_active)
+			return;
+
+		writer_active = true;
+
+		vector<vector<vector<bkc_record_t>>> ready;
+
+		while (true)
+		{
+			for (auto p = pending.begin(); p != pending.end() && p->first == next_item; ++next_item)
+			{
+				ready.emplace_back(move(p->second));
+				p = pending.erase(p);
+			}
+
+			if (ready.empty())
+				break;
+
+			lck.unlock();
+
+			uint64_t no_written = 0;
+			for (auto& x : ready)
+			{
+				no_written += no_records(x);
+				writer(x);
+			}
+			ready.clear();
+
+			lck.lock();
+
+			no_pending_records -= no_written;
+			cv_room.notify_all();
+		}
+
+		writer_active = false;
+	}
+};
+
+// EOF
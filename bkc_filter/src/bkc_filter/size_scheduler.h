@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cinttypes>
+
+using namespace std;
+
+// *********************************************************************************************
+// Largest-first (or in-order) distribution of items (CBCs, partitions) over threads
+// Items larger than max_part_size are split into parts (ranges [begin, end) of their elements), so that a single
+// huge item does not keep one thread busy at the end while the others are idle
+class CSizeScheduler
+{
+public:
+	struct task_t
+	{
+		size_t item_id;
+		uint64_t begin;
+		uint64_t end;
+		uint32_t part_id;
+		uint32_t no_parts;
+	};
+
+private:
+	vector<task_t> tasks;
+	atomic<size_t> next_task{ 0 };
+
+public:
+	// *********************************************************************************************
+	// Part size that allows for balancing: at least min_part_size, but items are split only if larger than
+	// a fraction of the work of a single thread
+	static uint64_t PartSize(uint64_t total_size, uint32_t no_threads, uint64_t min_part_size)
+	{
+		return max<uint64_t>(total_size / (4 * max<uint32_t>(no_threads, 1)), min_part_size);
+	}
+
+	// *********************************************************************************************
+	static uint32_t NoParts(uint64_t size, uint64_t max_part_size)
+	{
+		return (max_part_size && size > max_part_size) ? (uint32_t) ((size + max_part_size - 1) / max_part_size) : 1;
+	}
+
+	// *********************************************************************************************
+	// max_part_size == 0 means no splitting; without largest_first tasks are given in item order
+	void Prepare(const vector<uint64_t>& sizes, uint64_t max_part_size = 0, bool largest_first = true)
+	{
+		tasks.clear();
+		tasks.reserve(sizes.size());
+
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			uint64_t size = sizes[i];
+			uint32_t no_parts = NoParts(size, max_part_size);
+
+			for (uint32_t j = 0; j < no_parts; ++j)
+				tasks.push_back(task_t{ i, size * j / no_parts, size * (j + 1) / no_parts, j, no_parts });
+		}
+
+		if (largest_first)
+			stable_sort(tasks.begin(), tasks.end(), [](const task_t& a, const task_t& b) {
+				return a.end - a.begin > b.end - b.begin;
+				});
+
+		next_task = 0;
+	}
+
+	// *********************************************************************************************
+	// Can be called concurrently
+	bool Next(task_t& task)
+	{
+		size_t id = next_task.fetch_add(1);
+		if (id >= tasks.size())
+			return false;
+
+		task = tasks[id];
+
+		return true;
+	}
+
+	// *********************************************************************************************
+	size_t Size() const
+	{
+		return tasks.size();
+	}
+};
+
+// EOF
@@ -0,0 +1,167 @@
+#include <iostream>
+#include <fstream>
+#include "params.h"
+#include "merger.h"
+
+void usage();
+bool parse_args(int argc, char** argv);
+bool load_input_list(const string& file_name);
+
+
+CParams params;
+
+
+// *********************************************************************************************
+void usage()
+{
+    cerr
+        << "BKC-merge: merging BKC files with summing counts of the same k-mer pairs (v.1.0.0)\n";
+    cerr
+        << "Usage:\n"
+        << "    bkc_merge [options]\n"
+        << "    --input_name <file_name> - BKC file name (can be used many times, e.g., for chunk outputs)\n"
+        << "    --input_list <file_name> - file with BKC file names (one per line)\n"
+        << "    --output_name <file_name> - output BKC file name (default: " << params.output_file_name << ")\n"
+        << "    --n_splits <int> - no. splits of input files " << params.no_splits.str() << endl
+        << "    --n_out_splits <int> - no. splits of output file (0 - the same as n_splits) " << params.no_out_splits.str() << endl
+        << "    --n_threads <int> - no. threads " << params.no_threads.str() << endl
+        << "    --max_count <int> - max. counter value " << params.max_count.str() << endl
+        << "    --zstd_level <int> - zstd compression level " << params.zstd_level.str() << endl
+        << "    --max_run_mb <int> - max. memory (per thread) for records sorted in memory; larger splits are sorted into temporary runs " << params.max_run_mb.str() << endl
+        << "    --tmp_path <path> - path for temporary runs (default: " << params.tmp_path << ")\n"
+        << "    --presorted - input files are sorted (e.g., outputs of bkc_merge or bkc_filter --sorted_output), so they are streamed instead of sorted in memory\n";
+}
+
+// *********************************************************************************************
+bool load_input_list(const string& file_name)
+{
+	ifstream ifs(file_name);
+
+	if (!ifs)
+	{
+		cerr << "Cannot open: " << file_name << endl;
+		return false;
+	}
+
+	string line;
+
+	while (getline(ifs, line))
+	{
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+			line.pop_back();
+
+		if (!line.empty())
+			params.input_file_names.emplace_back(line);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+bool parse_args(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (argv[i] == "--n_splits"s && i + 1 < argc)
+		{
+			if (!params.no_splits.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_splits: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--n_out_splits"s && i + 1 < argc)
+		{
+			if (!params.no_out_splits.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_out_splits: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--n_threads"s && i + 1 < argc)
+		{
+			if (!params.no_threads.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_threads: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--max_count"s && i + 1 < argc)
+		{
+			if (!params.max_count.set(atoll(argv[++i])))
+			{
+				cerr << "Incorrect value for max_count: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--zstd_level"s && i + 1 < argc)
+		{
+			if (!params.zstd_level.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for zstd_level: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--max_run_mb"s && i + 1 < argc)
+		{
+			if (!params.max_run_mb.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for max_run_mb: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--tmp_path"s && i + 1 < argc)
+		{
+			params.tmp_path = argv[++i];
+		}
+		else if (argv[i] == "--input_name"s && i + 1 < argc)
+		{
+			params.input_file_names.emplace_back(argv[++i]);
+		}
+		else if (argv[i] == "--input_list"s && i + 1 < argc)
+		{
+			if (!load_input_list(argv[++i]))
+				return false;
+		}
+		else if (argv[i] == "--output_name"s && i + 1 < argc)
+		{
+			params.output_file_name = argv[++i];
+		}
+		else if (argv[i] == "--presorted"s)
+		{
+			params.presorted = true;
+		}
+		else
+		{
+			cerr << "Unknown parameter: " << argv[i] << endl;
+			return false;
+		}
+	}
+
+	if (params.input_file_names.empty())
+		return false;
+
+	return true;
+}
+
+// *********************************************************************************************
+int main(int argc, char **argv)
+{
+	if (!parse_args(argc, argv))
+	{
+		usage();
+		return 1;
+	}
+
+	CMerger merger;
+
+	if (!merger.SetParams(params))
+		return 1;
+
+	if (!merger.Merge())
+		return 1;
+
+    return 0;
+}
+
+// EOF
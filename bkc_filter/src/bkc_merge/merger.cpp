@@ -0,0 +1,528 @@
+#include "merger.h"
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+
+#include "../common/utils.h"
+#include "../../libs/refresh/hash_tables/lib/murmur_hash.h"
+
+namespace fs = std::filesystem;
+
+// *********************************************************************************************
+bool CMerger::merge_source_t::next()
+{
+	if (!streamed)
+	{
+		valid = pos < records.size();
+		if (valid)
+			curr = records[pos++];
+
+		return valid;
+	}
+
+	bkc_record_t prev = curr;
+	bool had_prev = valid;
+
+	valid = file->GetRecord(curr.sample_id, curr.barcode, curr.leader, curr.follower, curr.count);
+
+	// Reported by merge_partition (this runs in a worker thread)
+	if (valid && had_prev && key_less(curr, prev))
+	{
+		unsorted = true;
+		valid = false;
+	}
+
+	return valid;
+}
+
+// *********************************************************************************************
+bool CMerger::SetParams(const CParams& _params)
+{
+	params = _params;
+
+	if (params.input_file_names.empty())
+	{
+		cerr << "No input files\n";
+		return false;
+	}
+
+	no_out_splits = params.no_out_splits.get() ? params.no_out_splits.get() : params.no_splits.get();
+
+	return true;
+}
+
+// *********************************************************************************************
+string CMerger::split_name(const string& base_name, uint32_t split_id, uint32_t no_splits) const
+{
+	if (no_splits > 1)
+		return base_name + "." + to_string(split_id);
+
+	return base_name;
+}
+
+// *********************************************************************************************
+// All inputs must be produced with the same k-mer lengths; sample id size is the largest one
+bool CMerger::check_inputs()
+{
+	bool first = true;
+
+	for (const auto& base_name : params.input_file_names)
+		for (uint32_t i = 0; i < params.no_splits.get(); ++i)
+		{
+			string fn = split_name(base_name, i, params.no_splits.get());
+			CBKCFile bkc_file;
+
+			if (!bkc_file.Open(fn))
+			{
+				cerr << "Cannot open: " << fn << endl;
+				return false;
+			}
+
+			uint8_t sample_id_size, barcode_size, leader_size, follower_size, counter_size;
+			uint8_t barcode_len, leader_len, follower_len;
+
+			bkc_file.GetSizes(sample_id_size, barcode_size, leader_size, follower_size, counter_size);
+			bkc_file.GetLens(barcode_len, leader_len, follower_len, counter_size);
+
+			if (first)
+			{
+				barcode_size_in_bytes = barcode_size;
+				leader_size_in_bytes = leader_size;
+				follower_size_in_bytes = follower_size;
+				barcode_len_in_symbols = barcode_len;
+				leader_len_in_symbols = leader_len;
+				follower_len_in_symbols = follower_len;
+				gap_len_in_symbols = bkc_file.GetGapLen();
+				first = false;
+			}
+			else if (barcode_len != barcode_len_in_symbols || leader_len != leader_len_in_symbols || follower_len != follower_len_in_symbols ||
+				bkc_file.GetGapLen() != gap_len_in_symbols)
+			{
+				cerr << "Incompatible k-mer lengths in: " << fn << endl;
+				return false;
+			}
+
+			sample_id_size_in_bytes = max(sample_id_size_in_bytes, sample_id_size);
+		}
+
+	counter_size_in_bytes = no_bytes(params.max_count.get());
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CMerger::open_outputs()
+{
+	out_files.clear();
+
+	for (uint32_t i = 0; i < no_out_splits; ++i)
+	{
+		string fn = split_name(params.output_file_name, i, no_out_splits);
+
+		out_files.emplace_back(make_unique<CBKCFile>());
+		out_files.back()->SetParams(sample_id_size_in_bytes, barcode_size_in_bytes, leader_size_in_bytes, follower_size_in_bytes, counter_size_in_bytes,
+			barcode_len_in_symbols, leader_len_in_symbols, gap_len_in_symbols, follower_len_in_symbols, params.zstd_level.get());
+
+		if (!out_files.back()->Create(fn, output_format_t::bkc))
+		{
+			cerr << "Cannot create: " << fn << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+void CMerger::sort_and_sum(vector<bkc_record_t>& records)
+{
+	sort(records.begin(), records.end(), key_less);
+
+	size_t out = 0;
+
+	for (size_t i = 0; i < records.size(); ++out)
+	{
+		records[out] = records[i];
+
+		for (++i; i < records.size() && key_equal(records[i], records[out]); ++i)
+			records[out].count = add_saturated(records[out].count, records[i].count);
+	}
+
+	records.resize(out);
+}
+
+// *********************************************************************************************
+string CMerger::run_name(uint32_t split_id, uint32_t run_id) const
+{
+	return (fs::path(params.tmp_path) / fs::path(params.output_file_name).filename()).string() + ".run." + to_string(split_id) + "." + to_string(run_id) + ".bkc";
+}
+
+// *********************************************************************************************
+bool CMerger::open_streamed_source(merge_source_t& source, const string& file_name, bool temporary)
+{
+	source.file_name = file_name;
+	source.file = make_unique<CBKCFile>();
+	source.streamed = true;
+	source.temporary = temporary;
+
+	if (!source.file->Open(file_name, temporary ? run_read_buffer_size : 0))
+	{
+		cerr << "Cannot open: " << file_name << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Temporary runs have the layout of the output files
+bool CMerger::store_run(const string& file_name, vector<bkc_record_t>& records)
+{
+	CBKCFile run;
+	vector<bkc_record_t> part;
+	vector<uint8_t> packed_buffer;
+
+	run.SetParams(sample_id_size_in_bytes, barcode_size_in_bytes, leader_size_in_bytes, follower_size_in_bytes, counter_size_in_bytes,
+		barcode_len_in_symbols, leader_len_in_symbols, gap_len_in_symbols, follower_len_in_symbols, run_zstd_level);
+
+	if (!run.Create(file_name, output_format_t::bkc))
+	{
+		cerr << "Cannot create: " << file_name << endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < records.size(); i += max_records_in_buffer)
+	{
+		part.assign(records.begin() + i, records.begin() + min(records.size(), i + max_records_in_buffer));
+		pack_records(part, packed_buffer);
+		run.AddPacked(packed_buffer);
+	}
+
+	return run.Close();
+}
+
+// *********************************************************************************************
+// Sources of a partition: presorted input files are streamed; otherwise records of all inputs are collected up to
+// max_run_mb, sorted and summed and, unless this halved them, stored as a temporary run (the rest stays in memory)
+bool CMerger::prepare_sources(uint32_t split_id, vector<merge_source_t>& sources, uint32_t& no_runs)
+{
+	size_t max_run_records = max<size_t>(((size_t) params.max_run_mb.get() << 20) / sizeof(bkc_record_t), 1);
+	vector<bkc_record_t> records;
+	vector<bkc_record_t> frame_records;
+
+	auto flush = [&] {
+		sort_and_sum(records);
+
+		if (2 * records.size() < max_run_records)
+			return true;
+
+		string fn = run_name(split_id, no_runs++);
+		sources.emplace_back();
+
+		if (!store_run(fn, records) || !open_streamed_source(sources.back(), fn, true))
+			return false;
+
+		records.clear();
+
+		return true;
+	};
+
+	auto add = [&](const bkc_record_t& rec) {
+		records.emplace_back(rec);
+
+		return records.size() < max_run_records || flush();
+	};
+
+	for (const auto& base_name : params.input_file_names)
+	{
+		string fn = split_name(base_name, split_id, params.no_splits.get());
+
+		if (params.presorted)
+		{
+			sources.emplace_back();
+			if (!open_streamed_source(sources.back(), fn, false))
+				return false;
+			continue;
+		}
+
+		CBKCFile file;
+
+		if (!file.Open(fn))
+		{
+			cerr << "Cannot open: " << fn << endl;
+			return false;
+		}
+
+		if (file.IsIndexed())
+		{
+			for (size_t i = 0; i < file.GetFrames().size(); ++i)
+			{
+				if (!file.ReadFrame(i, frame_records))
+				{
+					cerr << "Cannot read frame " << i << " from: " << fn << endl;
+					return false;
+				}
+
+				for (const auto& rec : frame_records)
+					if (!add(rec))
+						return false;
+			}
+		}
+		else
+		{
+			bkc_record_t rec;
+
+			while (file.GetRecord(rec.sample_id, rec.barcode, rec.leader, rec.follower, rec.count))
+				if (!add(rec))
+					return false;
+		}
+	}
+
+	if (!records.empty())
+	{
+		sort_and_sum(records);
+
+		sources.emplace_back();
+		sources.back().file_name = "(in memory)";
+		sources.back().records = move(records);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// K-way merge of sources; fun(rec) gets the records in key order with counts of the same key summed
+template<typename FUN> bool CMerger::merge_sources(uint32_t split_id, vector<merge_source_t>& sources, FUN&& fun)
+{
+	auto heap_cmp = [&](uint32_t a, uint32_t b) {
+		return key_less(sources[b].curr, sources[a].curr);
+	};
+
+	priority_queue<uint32_t, vector<uint32_t>, decltype(heap_cmp)> heap(heap_cmp);
+
+	auto check_sorted = [&](const merge_source_t& source) {
+		if (!source.unsorted)
+			return true;
+
+		cerr << "Error: Input is not sorted: " + source.file_name + " (split " + to_string(split_id) + "; run without --presorted)\n";
+		return false;
+	};
+
+	for (uint32_t i = 0; i < sources.size(); ++i)
+		if (sources[i].next())
+			heap.push(i);
+		else if (!check_sorted(sources[i]))
+			return false;
+
+	bkc_record_t acc;
+	bool acc_valid = false;
+
+	while (!heap.empty())
+	{
+		uint32_t id = heap.top();
+		heap.pop();
+
+		const auto& rec = sources[id].curr;
+
+		if (acc_valid && key_equal(acc, rec))
+			acc.count = add_saturated(acc.count, rec.count);
+		else
+		{
+			if (acc_valid)
+				fun(acc);
+
+			acc = rec;
+			acc.count = min<uint64_t>(acc.count, params.max_count.get());
+			acc_valid = true;
+		}
+
+		if (sources[id].next())
+			heap.push(id);
+		else if (!check_sorted(sources[id]))
+			return false;
+	}
+
+	if (acc_valid)
+		fun(acc);
+
+	return true;
+}
+
+// *********************************************************************************************
+// While there are more than max_merge_fan_in sources, groups of them are merged into temporary runs
+bool CMerger::reduce_sources(uint32_t split_id, vector<merge_source_t>& sources, uint32_t& no_runs)
+{
+	while (sources.size() > max_merge_fan_in)
+	{
+		vector<merge_source_t> group(make_move_iterator(sources.begin()), make_move_iterator(sources.begin() + max_merge_fan_in));
+		sources.erase(sources.begin(), sources.begin() + max_merge_fan_in);
+
+		string fn = run_name(split_id, no_runs++);
+		vector<bkc_record_t> records;
+		bool ok = true;
+
+		CBKCFile run;
+		vector<uint8_t> packed_buffer;
+
+		run.SetParams(sample_id_size_in_bytes, barcode_size_in_bytes, leader_size_in_bytes, follower_size_in_bytes, counter_size_in_bytes,
+			barcode_len_in_symbols, leader_len_in_symbols, gap_len_in_symbols, follower_len_in_symbols, run_zstd_level);
+
+		if (!run.Create(fn, output_format_t::bkc))
+		{
+			cerr << "Cannot create: " << fn << endl;
+			ok = false;
+		}
+		else
+		{
+			ok = merge_sources(split_id, group, [&](const bkc_record_t& rec) {
+				records.emplace_back(rec);
+				if ((int) records.size() >= max_records_in_buffer)
+				{
+					pack_records(records, packed_buffer);
+					run.AddPacked(packed_buffer);
+					records.clear();
+				}
+				});
+
+			pack_records(records, packed_buffer);
+			run.AddPacked(packed_buffer);
+
+			ok = run.Close() && ok;
+		}
+
+		remove_temporary(group);
+
+		sources.emplace_back();
+		if (!ok || !open_streamed_source(sources.back(), fn, true))
+			return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+void CMerger::remove_temporary(vector<merge_source_t>& sources)
+{
+	error_code ec;
+
+	for (auto& x : sources)
+	{
+		x.file.reset();
+		if (x.temporary)
+			fs::remove(x.file_name, ec);
+	}
+}
+
+// *********************************************************************************************
+void CMerger::pack_records(vector<bkc_record_t>& records, vector<uint8_t>& packed_buffer)
+{
+	vector<uint8_t> rec_prev, rec_curr;
+
+	packed_buffer.clear();
+
+	for (auto& x : records)
+	{
+		rec_curr.clear();
+
+		append_int_msb(rec_curr, x.sample_id, sample_id_size_in_bytes);
+		append_int_msb(rec_curr, x.barcode, barcode_size_in_bytes);
+		append_int_msb(rec_curr, x.leader, leader_size_in_bytes);
+		append_int_msb(rec_curr, x.follower, follower_size_in_bytes);
+		append_int_msb(rec_curr, x.count, counter_size_in_bytes);
+
+		encode_shared_prefix(packed_buffer, rec_prev, rec_curr);
+
+		swap(rec_prev, rec_curr);
+	}
+}
+
+// *********************************************************************************************
+bool CMerger::merge_partition(uint32_t split_id)
+{
+	vector<merge_source_t> sources;
+	uint32_t no_runs = 0;
+
+	if (!prepare_sources(split_id, sources, no_runs) || !reduce_sources(split_id, sources, no_runs))
+	{
+		remove_temporary(sources);
+		return false;
+	}
+
+	// If the no. of splits is unchanged, records of this partition go only to the corresponding output file (which stays sorted)
+	bool same_splits = no_out_splits == params.no_splits.get();
+	vector<vector<bkc_record_t>> record_buffers(same_splits ? 1 : no_out_splits);
+	vector<uint8_t> packed_buffer;
+
+	auto* out_file = same_splits ? out_files[split_id].get() : nullptr;
+	auto flush = [&](uint32_t out_id) {
+		pack_records(record_buffers[out_id], packed_buffer);
+		(out_file ? out_file : out_files[out_id].get())->AddPacked(packed_buffer);
+		record_buffers[out_id].clear();
+	};
+
+	refresh::MurMur64Hash mh;
+
+	// Re-splitting uses the same function as bkc_filter (hash of leader)
+	bool ok = merge_sources(split_id, sources, [&](const bkc_record_t& rec) {
+		uint32_t out_id = same_splits ? 0 : mh(rec.leader) % no_out_splits;
+
+		record_buffers[out_id].emplace_back(rec);
+		if ((int)record_buffers[out_id].size() >= max_records_in_buffer)
+			flush(out_id);
+		});
+
+	remove_temporary(sources);
+
+	if (!ok)
+		return false;
+
+	for (uint32_t i = 0; i < record_buffers.size(); ++i)
+		flush(i);
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CMerger::Merge()
+{
+	if (!check_inputs() || !open_outputs())
+		return false;
+
+	atomic<uint32_t> split_id{ 0 };
+	atomic<bool> ok{ true };
+
+	vector<thread> threads;
+	uint32_t no_threads = min(params.no_threads.get(), params.no_splits.get());
+
+	for (uint32_t i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+			while (ok)
+			{
+				uint32_t curr_id = split_id.fetch_add(1);
+				if (curr_id >= params.no_splits.get())
+					break;
+
+				if (!merge_partition(curr_id))
+					ok = false;
+			}
+			});
+
+	for (auto& t : threads)
+		t.join();
+
+	for (auto& f : out_files)
+		if (!f->Close())
+		{
+			cerr << "Cannot close output file\n";
+			ok = false;
+		}
+
+	return ok;
+}
+
+// EOF
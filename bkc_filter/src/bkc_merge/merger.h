@@ -0,0 +1,99 @@
+#pragma once
+#include "params.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "../common/bkc_file.h"
+
+// *********************************************************************************************
+// K-way merge of BKC files (e.g., outputs of chunks of a sample) with summing counts of the same SBLFC key
+// Each input split is a separate partition, so partitions are merged in parallel
+// Inputs written by bkc/bkc_filter are sorted only within CBCs (unless bkc_filter --sorted_output is used), so by default
+// records of a split (of all inputs) are sorted in memory in batches of max_run_mb and the batches that do not fit
+// are stored as temporary sorted runs; with presorted inputs the files are streamed.
+// At most max_merge_fan_in sources are merged at once (more are first merged in groups into temporary runs),
+// so memory does not depend on the input size or on the no. of inputs.
+class CMerger
+{
+	const int max_records_in_buffer = 128 << 10;
+	const size_t max_merge_fan_in = 32;
+	const size_t run_read_buffer_size = 1 << 20;
+	const uint32_t run_zstd_level = 1;
+
+	// Single sorted stream of records (from a file or from a sorted in-memory copy of a file)
+	struct merge_source_t {
+		string file_name;
+		unique_ptr<CBKCFile> file;
+		vector<bkc_record_t> records;
+		size_t pos = 0;
+		bool streamed = false;
+		bkc_record_t curr;
+		bool valid = false;
+		bool unsorted = false;		// a streamed file turned out not to be sorted (next() then returns false)
+		bool temporary = false;		// a temporary run (removed after merging)
+
+		bool next();
+	};
+
+	CParams params;
+	uint32_t no_out_splits = 1;
+
+	uint8_t sample_id_size_in_bytes = 0;
+	uint8_t barcode_size_in_bytes = 0;
+	uint8_t leader_size_in_bytes = 0;
+	uint8_t follower_size_in_bytes = 0;
+	uint8_t counter_size_in_bytes = 0;
+	uint8_t barcode_len_in_symbols = 0;
+	uint8_t leader_len_in_symbols = 0;
+	uint8_t gap_len_in_symbols = 0;
+	uint8_t follower_len_in_symbols = 0;
+
+	vector<unique_ptr<CBKCFile>> out_files;
+
+	static bool key_less(const bkc_record_t& a, const bkc_record_t& b)
+	{
+		if (a.sample_id != b.sample_id)
+			return a.sample_id < b.sample_id;
+		if (a.barcode != b.barcode)
+			return a.barcode < b.barcode;
+		if (a.leader != b.leader)
+			return a.leader < b.leader;
+		return a.follower < b.follower;
+	}
+
+	static bool key_equal(const bkc_record_t& a, const bkc_record_t& b)
+	{
+		return a.sample_id == b.sample_id && a.barcode == b.barcode && a.leader == b.leader && a.follower == b.follower;
+	}
+
+	uint64_t add_saturated(uint64_t a, uint64_t b) const
+	{
+		uint64_t s = a + b;
+		return s > params.max_count.get() ? params.max_count.get() : s;
+	}
+
+	string split_name(const string& base_name, uint32_t split_id, uint32_t no_splits) const;
+	bool check_inputs();
+	bool open_outputs();
+
+	string run_name(uint32_t split_id, uint32_t run_id) const;
+	bool open_streamed_source(merge_source_t& source, const string& file_name, bool temporary);
+	bool store_run(const string& file_name, vector<bkc_record_t>& records);
+	bool prepare_sources(uint32_t split_id, vector<merge_source_t>& sources, uint32_t& no_runs);
+	template<typename FUN> bool merge_sources(uint32_t split_id, vector<merge_source_t>& sources, FUN&& fun);
+	bool reduce_sources(uint32_t split_id, vector<merge_source_t>& sources, uint32_t& no_runs);
+	void remove_temporary(vector<merge_source_t>& sources);
+	void sort_and_sum(vector<bkc_record_t>& records);
+	void pack_records(vector<bkc_record_t>& records, vector<uint8_t>& packed_buffer);
+	bool merge_partition(uint32_t split_id);
+
+public:
+	CMerger() = default;
+
+	bool SetParams(const CParams& _params);
+	bool Merge();
+};
+
+// EOF
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+#include "../common/defs.h"
+
+// *********************************************************************************************
+struct CParams
+{
+	param_t<uint32_t> no_splits{ 1, 256, 1 };
+	param_t<uint32_t> no_out_splits{ 0, 256, 0 };		// 0 means the same as no_splits
+	param_t<uint32_t> no_threads{ 1, 256, 8 };
+	param_t<uint32_t> max_count{ 1, ~0u, 65535 };
+	param_t<uint32_t> zstd_level{ 0, 19, 6 };
+	param_t<uint32_t> max_run_mb{ 1, 1 << 20, 1024 };
+	vector<string> input_file_names{ };
+	string output_file_name{ "./merged.bkc" };
+	string tmp_path{ "./" };
+	bool presorted = false;
+};
+
+// EOF
@@ -1,5 +1,11 @@
+#include <iostream>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
 #include "bkc_file.h"
 #include "utils.h"
+#include "run_stats.h"
 
 // *********************************************************************************************
 void CBKCFile::SetParams(uint8_t _sample_id_size_in_bytes, uint8_t _barcode_size_in_bytes, uint8_t _leader_size_in_bytes, uint8_t _follower_size_in_bytes, uint8_t _counter_size_in_bytes,
@@ -30,43 +36,45 @@ bool CBKCFile::Create(const string& file_name, const output_format_t _output_for
 
 	output_format = _output_format;
 
-	if (f.is_opened())
-		f.close();
-
-	f.set_compression_level(zstd_level);
-	f.set_io_buffer_size(BUFFER_SIZE);
-
-	switch (output_format)
-	{
-	case output_format_t::bkc:
-		f.open_writing(file_name.c_str(),
-			[&](FILE* f) {
-				uint8_t to_save[] = { 'B', 'K', 'C', 1, 1, 0,
-					(uint8_t)ordering,
-					sample_id_size_in_bytes,
-					barcode_size_in_bytes,
-					leader_size_in_bytes,
-					follower_size_in_bytes,
-					counter_size_in_bytes,
-					barcode_len_in_symbols,
-					leader_len_in_symbols,
-					follower_len_in_symbols,
-					gap_len_in_symbols };
-		return fwrite(to_save, 1, sizeof(to_save), f) == sizeof(to_save);
-			});
-		break;
-	case output_format_t::splash:
-		f.open_writing(file_name.c_str());
-		break;
-	default:
-		open_mode = open_mode_t::none;
+	if (output_format != output_format_t::bkc && output_format != output_format_t::splash)
 		return false;
-	}
 
-	if (!f.is_opened())
+	f = fopen(file_name.c_str(), "wb");
+	if (!f)
 		return false;
 
-	if(output_format == output_format_t::splash)
+	setvbuf(f, nullptr, _IOFBF, BUFFER_SIZE);
+	file_pos = 0;
+	frames.clear();
+
+	rec_len = sample_id_size_in_bytes + barcode_size_in_bytes + leader_size_in_bytes + follower_size_in_bytes + counter_size_in_bytes;
+
+	if (output_format == output_format_t::bkc)
+	{
+		format_version = BKC_FORMAT_VERSION;
+
+		uint8_t to_save[] = { 'B', 'K', 'C', format_version, 0, 0,
+			(uint8_t)ordering,
+			sample_id_size_in_bytes,
+			barcode_size_in_bytes,
+			leader_size_in_bytes,
+			follower_size_in_bytes,
+			counter_size_in_bytes,
+			barcode_len_in_symbols,
+			leader_len_in_symbols,
+			follower_len_in_symbols,
+			gap_len_in_symbols };
+
+		if (fwrite(to_save, 1, sizeof(to_save), f) != sizeof(to_save))
+		{
+			fclose(f);
+			f = nullptr;
+			return false;
+		}
+
+		file_pos = sizeof(to_save);
+	}
+	else
 		save_header();
 
 	open_mode = open_mode_t::writing;
@@ -75,58 +83,87 @@ bool CBKCFile::Create(const string& file_name, const output_format_t _output_for
 }
 
 // *********************************************************************************************
-bool CBKCFile::Open(const string& file_name)
+bool CBKCFile::Open(const string& file_name, size_t buffer_size)
 {
 	lock_guard<mutex> lck(mtx);
 
 	if (open_mode != open_mode_t::none)
 		return false;
 
-	if (f.is_opened())
-		f.close();
+	f = fopen(file_name.c_str(), "rb");
+	if (!f)
+		return false;
 
-/*	switch (output_format)
+	setvbuf(f, nullptr, _IOFBF, buffer_size ? buffer_size : BUFFER_SIZE);
+
+	bool ok = true;
+
+	if (getc(f) != 'B')	ok = false;
+	if (getc(f) != 'K')	ok = false;
+	if (getc(f) != 'C')	ok = false;
+
+	int ver_major = getc(f);
+	int ver_minor = getc(f);
+	int ver_patch = getc(f);
+
+	if (ver_major == 1 && ver_minor == 1 && ver_patch == 0)
+		format_version = 1;
+	else if (ver_major == 2 && ver_minor == 0 && ver_patch == 0)
+		format_version = 2;
+	else
+		ok = false;
+
+	ordering = (Header::ordering_t)getc(f);
+	sample_id_size_in_bytes = getc(f);
+	barcode_size_in_bytes = getc(f);
+	leader_size_in_bytes = getc(f);
+	follower_size_in_bytes = getc(f);
+	counter_size_in_bytes = getc(f);
+	barcode_len_in_symbols = getc(f);
+	leader_len_in_symbols = getc(f);
+	follower_len_in_symbols = getc(f);
+	gap_len_in_symbols = getc(f);
+
+	if (feof(f) || !ok)
 	{
-	case output_format_t::bkc:*/
-		f.open_reading(file_name.c_str(),
-			[&](FILE* f) {
-				if (getc(f) != 'B')	return false;
-				if (getc(f) != 'K')	return false;
-				if (getc(f) != 'C')	return false;
-				if (getc(f) != 1)	return false;
-				if (getc(f) != 1)	return false;
-				if (getc(f) != 0)	return false;
-
-				ordering = (Header::ordering_t)getc(f);
-				sample_id_size_in_bytes = getc(f);
-				barcode_size_in_bytes = getc(f);
-				leader_size_in_bytes = getc(f);
-				follower_size_in_bytes = getc(f);
-				counter_size_in_bytes = getc(f);
-				barcode_len_in_symbols = getc(f);
-				leader_len_in_symbols = getc(f);
-				follower_len_in_symbols = getc(f);
-				gap_len_in_symbols = getc(f);
-
-				if (feof(f))
-					return false;
-
-				return true;
-			});
-/*		break;
-	case output_format_t::splash:
-		f.open_writing(file_name.c_str());
-		break;
-	default:
-		open_mode = open_mode_t::none;
+		fclose(f);
+		f = nullptr;
 		return false;
-	}*/
+	}
 
-	if (!f.is_opened())
-		return false;
+	read_pos = ftell(f);
+	frames.clear();
+
+	if (format_version >= 2)
+	{
+		if (!load_index())
+		{
+			cerr << "Error: Missing or corrupted frame index in file: " << file_name << endl;
+			fclose(f);
+			f = nullptr;
+			return false;
+		}
+
+		fseek(f, read_pos, SEEK_SET);
+	}
+	else
+	{
+		fseek(f, 0, SEEK_END);
+		data_end = ftell(f);
+		fseek(f, read_pos, SEEK_SET);
+	}
+
+	read_pos_lost = false;
+
+	d_stream = ZSTD_createDStream();
+	ZSTD_initDStream(d_stream);
 
-//	if (output_format == output_format_t::splash)
-//		save_header();
+	in_buffer.resize(ZSTD_DStreamInSize());
+	dec_buffer.resize(max<size_t>(ZSTD_DStreamOutSize(), 1 << 20));
+	zin = { in_buffer.data(), 0, 0 };
+	dec_pos = dec_size = 0;
+
+	rec_prev.clear();
 
 	open_mode = open_mode_t::reading;
 
@@ -138,28 +175,306 @@ bool CBKCFile::Open(const string& file_name)
 // *********************************************************************************************
 bool CBKCFile::Close()
 {
-	f.close();
+	lock_guard<mutex> lck(mtx);
+
+	bool r = true;
+
+	if (open_mode == open_mode_t::writing && output_format == output_format_t::bkc && f)
+		r = save_index();
+
+	if (f)
+	{
+		r &= fclose(f) == 0;
+		f = nullptr;
+	}
+
+	if (d_stream)
+	{
+		ZSTD_freeDStream(d_stream);
+		d_stream = nullptr;
+	}
+
 	open_mode = open_mode_t::none;
 
-	return true;
+	return r;
 }
 
 // *********************************************************************************************
+// In splash format the header is a part of compressed data (the first frame)
 void CBKCFile::save_header()
 {
+	vector<uint8_t> header = {
+		sample_id_size_in_bytes,
+		barcode_size_in_bytes,
+		leader_size_in_bytes,
+		follower_size_in_bytes,
+		counter_size_in_bytes,
+		barcode_len_in_symbols,
+		leader_len_in_symbols,
+		follower_len_in_symbols,
+		gap_len_in_symbols };
+
+	vector<uint8_t> frame;
+	bkc_frame_desc_t desc{};
+
+	if (compress_frame(header, frame))
+		write_frame(frame, desc);
+}
 
-	if (!f.is_opened_for_writing())
-		return;
+// *********************************************************************************************
+bool CBKCFile::compress_frame(const vector<uint8_t>& packed, vector<uint8_t>& frame)
+{
+	// Compression contexts are reused by each thread
+	struct cctx_t {
+		ZSTD_CCtx* ctx = ZSTD_createCCtx();
+		~cctx_t() { ZSTD_freeCCtx(ctx); }
+	};
+	thread_local cctx_t cctx;
+
+	frame.resize(ZSTD_compressBound(packed.size()));
+
+	size_t r = ZSTD_compressCCtx(cctx.ctx, frame.data(), frame.size(), packed.data(), packed.size(), (int) zstd_level);
+	if (ZSTD_isError(r))
+	{
+		cerr << "Error: zstd compression failed: " << ZSTD_getErrorName(r) << endl;
+		frame.clear();
+		return false;
+	}
+
+	frame.resize(r);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Must be called under lock
+bool CBKCFile::write_frame(const vector<uint8_t>& frame, const bkc_frame_desc_t& desc)
+{
+	if (!f || fwrite(frame.data(), 1, frame.size(), f) != frame.size())
+	{
+		cerr << "Error: Cannot write to output file\n";
+		return false;
+	}
 
-	save_int_lsb(f, sample_id_size_in_bytes, 1);
-	save_int_lsb(f, barcode_size_in_bytes, 1);
-	save_int_lsb(f, leader_size_in_bytes, 1);
-	save_int_lsb(f, follower_size_in_bytes, 1);
-	save_int_lsb(f, counter_size_in_bytes, 1);
-	save_int_lsb(f, barcode_len_in_symbols, 1);
-	save_int_lsb(f, leader_len_in_symbols, 1);
-	save_int_lsb(f, follower_len_in_symbols, 1);
-	save_int_lsb(f, gap_len_in_symbols, 1);
+	frames.emplace_back(desc);
+	frames.back().offset = file_pos;
+	frames.back().size = frame.size();
+	file_pos += frame.size();
+
+	return true;
+}
+
+// *********************************************************************************************
+// Walks through the prefix-encoded records of a packed buffer and collects its key ranges
+bool CBKCFile::describe_frame(const vector<uint8_t>& packed, bkc_frame_desc_t& desc)
+{
+	thread_local vector<uint8_t> rec;
+	uint64_t sample_id, barcode, leader, follower, count;
+
+	desc = bkc_frame_desc_t{};
+	desc.min_barcode = desc.min_leader = desc.lowest_leader = numeric_limits<uint64_t>::max();
+
+	rec.resize(rec_len);
+
+	for (size_t pos = 0; pos < packed.size(); )
+	{
+		size_t no_same = packed[pos++];
+		size_t no_new = rec_len - no_same;
+
+		if (no_same > rec_len || pos + no_new > packed.size())
+			return false;
+
+		copy_n(packed.begin() + pos, no_new, rec.begin() + no_same);
+		pos += no_new;
+
+		unpack_record(rec, sample_id, barcode, leader, follower, count);
+
+		++desc.no_records;
+
+		if (barcode < desc.min_barcode || (barcode == desc.min_barcode && leader < desc.min_leader))
+		{
+			desc.min_barcode = barcode;
+			desc.min_leader = leader;
+		}
+		if (barcode > desc.max_barcode || (barcode == desc.max_barcode && leader > desc.max_leader))
+		{
+			desc.max_barcode = barcode;
+			desc.max_leader = leader;
+		}
+
+		desc.lowest_leader = min(desc.lowest_leader, leader);
+		desc.highest_leader = max(desc.highest_leader, leader);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Must be called under lock
+bool CBKCFile::save_index()
+{
+	uint64_t index_offset = file_pos;
+
+	for (const auto& x : frames)
+	{
+		save_int_lsb(f, x.offset, 8);
+		save_int_lsb(f, x.size, 8);
+		save_int_lsb(f, x.no_records, 8);
+		save_int_lsb(f, x.min_barcode, 8);
+		save_int_lsb(f, x.min_leader, 8);
+		save_int_lsb(f, x.max_barcode, 8);
+		save_int_lsb(f, x.max_leader, 8);
+		save_int_lsb(f, x.lowest_leader, 8);
+		save_int_lsb(f, x.highest_leader, 8);
+	}
+
+	save_int_lsb(f, index_offset, 8);
+	save_int_lsb(f, (uint64_t) frames.size(), 8);
+
+	if (fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC), f) != sizeof(INDEX_MAGIC))
+	{
+		cerr << "Error: Cannot write to output file\n";
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CBKCFile::load_index()
+{
+	auto load_u64 = [](const uint8_t* p) {
+		uint64_t x = 0;
+		for (int i = 7; i >= 0; --i)
+			x = (x << 8) + p[i];
+		return x;
+	};
+
+	uint8_t trailer[TRAILER_SIZE];
+
+	if (fseek(f, 0, SEEK_END) != 0)
+		return false;
+
+	uint64_t file_size = ftell(f);
+
+	if (file_size < read_pos + TRAILER_SIZE)
+		return false;
+
+	fseek(f, file_size - TRAILER_SIZE, SEEK_SET);
+	if (fread(trailer, 1, TRAILER_SIZE, f) != TRAILER_SIZE)
+		return false;
+
+	if (memcmp(trailer + 16, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+		return false;
+
+	uint64_t index_offset = load_u64(trailer);
+	uint64_t no_frames = load_u64(trailer + 8);
+
+	if (index_offset < read_pos || index_offset + no_frames * INDEX_ENTRY_SIZE + TRAILER_SIZE != file_size)
+		return false;
+
+	vector<uint8_t> index(no_frames * INDEX_ENTRY_SIZE);
+
+	fseek(f, index_offset, SEEK_SET);
+	if (fread(index.data(), 1, index.size(), f) != index.size())
+		return false;
+
+	frames.resize(no_frames);
+
+	for (uint64_t i = 0; i < no_frames; ++i)
+	{
+		const uint8_t* p = index.data() + i * INDEX_ENTRY_SIZE;
+		auto& x = frames[i];
+
+		x.offset = load_u64(p);
+		x.size = load_u64(p + 8);
+		x.no_records = load_u64(p + 16);
+		x.min_barcode = load_u64(p + 24);
+		x.min_leader = load_u64(p + 32);
+		x.max_barcode = load_u64(p + 40);
+		x.max_leader = load_u64(p + 48);
+		x.lowest_leader = load_u64(p + 56);
+		x.highest_leader = load_u64(p + 64);
+
+		if (x.offset < read_pos || x.offset + x.size > index_offset)
+			return false;
+	}
+
+	data_end = index_offset;
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CBKCFile::fill_dec_buffer()
+{
+	while (true)
+	{
+		if (zin.pos == zin.size)
+		{
+			lock_guard<mutex> lck(mtx);
+
+			if (read_pos_lost)
+			{
+				fseek(f, read_pos, SEEK_SET);
+				read_pos_lost = false;
+			}
+
+			zin.size = fread(in_buffer.data(), 1, min<uint64_t>(in_buffer.size(), data_end - read_pos), f);
+			zin.pos = 0;
+			read_pos += zin.size;
+
+			if (zin.size == 0)
+				return false;
+		}
+
+		ZSTD_outBuffer zout{ dec_buffer.data(), dec_buffer.size(), 0 };
+
+		size_t r = ZSTD_decompressStream(d_stream, &zout, &zin);
+		if (ZSTD_isError(r))
+		{
+			cerr << "Error: zstd decompression failed: " << ZSTD_getErrorName(r) << endl;
+			return false;
+		}
+
+		if (zout.pos)
+		{
+			dec_pos = 0;
+			dec_size = zout.pos;
+			return true;
+		}
+	}
+}
+
+// *********************************************************************************************
+bool CBKCFile::get_byte(uint8_t& x)
+{
+	if (dec_pos == dec_size && !fill_dec_buffer())
+		return false;
+
+	x = dec_buffer[dec_pos++];
+
+	return true;
+}
+
+// *********************************************************************************************
+size_t CBKCFile::read_bytes(uint8_t* dest, size_t size)
+{
+	size_t readed = 0;
+
+	while (readed < size)
+	{
+		if (dec_pos == dec_size && !fill_dec_buffer())
+			break;
+
+		size_t to_copy = min(size - readed, dec_size - dec_pos);
+		memcpy(dest + readed, dec_buffer.data() + dec_pos, to_copy);
+
+		readed += to_copy;
+		dec_pos += to_copy;
+	}
+
+	return readed;
 }
 
 // *********************************************************************************************
@@ -207,34 +522,125 @@ void CBKCFile::AddRecords(vector<bkc_record_t>& records)
 // *********************************************************************************************
 void CBKCFile::AddPacked(vector<uint8_t>& packed)
 {
-	lock_guard<mutex> lck(mtx);
+	if (packed.empty())
+		return;
+
+	thread_local vector<uint8_t> frame;
+	bkc_frame_desc_t desc;
+
+	if (!describe_frame(packed, desc))
+	{
+		cerr << "Error: Corrupted packed records\n";
+		return;
+	}
 
-	f.write((char*) packed.data(), packed.size());
+	if (!compress_frame(packed, frame))
+		return;
+
+	unique_lock<mutex> lck(mtx, try_to_lock);
+	if (!lck.owns_lock())
+	{
+		CWaitTimer timer(CRunStats::counter_t::bkc_lock_wait_ns);
+		lck.lock();
+	}
+
+	write_frame(frame, desc);
+	run_stats.Add(CRunStats::counter_t::records_out, desc.no_records);
+}
+
+// *********************************************************************************************
+bool CBKCFile::ReadFrame(size_t frame_id, vector<bkc_record_t>& records)
+{
+	thread_local vector<uint8_t> frame;
+	thread_local vector<uint8_t> packed;
+	thread_local vector<uint8_t> rec;
+
+	records.clear();
+
+	if (!IsIndexed() || frame_id >= frames.size())
+		return false;
+
+	const auto& desc = frames[frame_id];
+
+	frame.resize(desc.size);
+
+	{
+		lock_guard<mutex> lck(mtx);
+
+		fseek(f, desc.offset, SEEK_SET);
+		read_pos_lost = true;
+
+		if (fread(frame.data(), 1, frame.size(), f) != frame.size())
+			return false;
+	}
+
+	auto raw_size = ZSTD_getFrameContentSize(frame.data(), frame.size());
+	if (raw_size == ZSTD_CONTENTSIZE_ERROR || raw_size == ZSTD_CONTENTSIZE_UNKNOWN)
+	{
+		cerr << "Error: Corrupted zstd frame\n";
+		return false;
+	}
+
+	packed.resize(raw_size);
+
+	size_t r = ZSTD_decompress(packed.data(), packed.size(), frame.data(), frame.size());
+	if (ZSTD_isError(r) || r != raw_size)
+	{
+		cerr << "Error: zstd decompression failed: " << ZSTD_getErrorName(r) << endl;
+		return false;
+	}
+
+	records.reserve(desc.no_records);
+	rec.resize(rec_len);
+
+	for (size_t pos = 0; pos < packed.size(); )
+	{
+		size_t no_same = packed[pos++];
+		size_t no_new = rec_len - no_same;
+
+		if (no_same > rec_len || pos + no_new > packed.size())
+			return false;
+
+		copy_n(packed.begin() + pos, no_new, rec.begin() + no_same);
+		pos += no_new;
+
+		records.emplace_back();
+		auto& x = records.back();
+		unpack_record(rec, x.sample_id, x.barcode, x.leader, x.follower, x.count);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+void CBKCFile::unpack_record(vector<uint8_t>& rec, uint64_t& sample_id, uint64_t& barcode, uint64_t& leader, uint64_t& follower, uint64_t& count)
+{
+	auto p = rec.begin();
+
+	load_int_msb(p, sample_id, sample_id_size_in_bytes);
+	load_int_msb(p, barcode, barcode_size_in_bytes);
+	load_int_msb(p, leader, leader_size_in_bytes);
+	load_int_msb(p, follower, follower_size_in_bytes);
+	load_int_msb(p, count, counter_size_in_bytes);
 }
 
 // *********************************************************************************************
 bool CBKCFile::GetRecord(uint64_t& sample_id, uint64_t& barcode, uint64_t& leader, uint64_t& follower, uint64_t& count)
 {
-	char no_same_symbols;
+	uint8_t no_same_symbols;
 
-	if (!f.get(no_same_symbols))
+	if (!get_byte(no_same_symbols))
 		return false;
 
 	rec_curr.assign(rec_prev.begin(), rec_prev.begin() + no_same_symbols);
 	rec_curr.resize(rec_len);
-	if (f.read((char*)rec_curr.data() + no_same_symbols, rec_len - no_same_symbols) != rec_len - no_same_symbols)
+	if (read_bytes(rec_curr.data() + no_same_symbols, rec_len - no_same_symbols) != rec_len - no_same_symbols)
 		return false;
 
-	auto p = rec_curr.begin();
-
 	switch (ordering)
 	{
 	case Header::default_ordering:
-		load_int_msb(p, sample_id, sample_id_size_in_bytes);
-		load_int_msb(p, barcode, barcode_size_in_bytes);
-		load_int_msb(p, leader, leader_size_in_bytes);
-		load_int_msb(p, follower, follower_size_in_bytes);
-		load_int_msb(p, count, counter_size_in_bytes);
+		unpack_record(rec_curr, sample_id, barcode, leader, follower, count);
 		break;
 	default:
 		return false;
@@ -254,4 +660,14 @@ void CBKCFile::GetLens(uint8_t& _barcode_len_in_symbols, uint8_t& _leader_len_in
 	_counter_size_in_bytes = counter_size_in_bytes;
 }
 
+// *********************************************************************************************
+void CBKCFile::GetSizes(uint8_t& _sample_id_size_in_bytes, uint8_t& _barcode_size_in_bytes, uint8_t& _leader_size_in_bytes, uint8_t& _follower_size_in_bytes, uint8_t& _counter_size_in_bytes)
+{
+	_sample_id_size_in_bytes = sample_id_size_in_bytes;
+	_barcode_size_in_bytes = barcode_size_in_bytes;
+	_leader_size_in_bytes = leader_size_in_bytes;
+	_follower_size_in_bytes = follower_size_in_bytes;
+	_counter_size_in_bytes = counter_size_in_bytes;
+}
+
 // EOF
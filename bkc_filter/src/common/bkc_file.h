@@ -10,6 +10,7 @@
 using namespace std;
 
 #include "../../shared/types/satc_data.h"
+#include "../../libs/zstd/lib/zstd.h"
 #include "defs.h"
 
 struct bkc_record_t {
@@ -42,16 +43,84 @@ struct bkc_record_t {
 	bkc_record_t& operator=(bkc_record_t&&) = default;
 };
 
+// *********************************************************************************************
+// Location and content summary of a single zstd frame in a file
+// Records in a frame come from many CBCs in processing order, so the index keeps the key range rather than first/last record
+struct bkc_frame_desc_t {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t no_records;
+	uint64_t min_barcode;			// (min_barcode, min_leader) is the smallest (barcode, leader) key in the frame
+	uint64_t min_leader;
+	uint64_t max_barcode;			// (max_barcode, max_leader) is the largest (barcode, leader) key in the frame
+	uint64_t max_leader;
+	uint64_t lowest_leader;			// range of leaders only (for anchor queries)
+	uint64_t highest_leader;
+
+	bool may_contain_barcode(uint64_t barcode) const
+	{
+		return min_barcode <= barcode && barcode <= max_barcode;
+	}
+
+	bool may_contain_leader(uint64_t leader) const
+	{
+		return lowest_leader <= leader && leader <= highest_leader;
+	}
+
+	bool may_contain(uint64_t barcode, uint64_t leader) const
+	{
+		return may_contain_barcode(barcode) && may_contain_leader(leader) &&
+			(barcode > min_barcode || leader >= min_leader) &&
+			(barcode < max_barcode || leader <= max_leader);
+	}
+};
+
+// *********************************************************************************************
+// Each packed buffer is compressed (outside the lock) into an independent zstd frame; frames are appended after the raw header
+// BKC v2 (bkc format): each frame starts with a reset shared-prefix state and the file ends with a frame index:
+//   [header: 16B][frame 0]...[frame n-1][index: n x 9 x u64][index offset: u64][no. frames: u64][magic: 8B]
+//   so frames can be decoded independently (and skipped using the index)
+// BKC v1 files (no index) are still readable sequentially
 class CBKCFile
 {
 	enum class open_mode_t {none, reading, writing};
 	open_mode_t open_mode{ open_mode_t::none };
 
 	const int BUFFER_SIZE = 16 << 20;
+	static constexpr uint8_t BKC_FORMAT_VERSION = 2;
+	static constexpr uint8_t INDEX_MAGIC[8] = { 'B', 'K', 'C', 'I', 'D', 'X', 2, 0 };
+	static constexpr size_t INDEX_ENTRY_SIZE = 9 * 8;
+	static constexpr size_t TRAILER_SIZE = 2 * 8 + sizeof(INDEX_MAGIC);
 
 	mutex mtx;
 
-	refresh::zstd_file f{ 9 };
+	FILE* f = nullptr;
+	uint64_t file_pos = 0;
+	uint8_t format_version = 0;
+	vector<bkc_frame_desc_t> frames;
+
+	// Reading: frames are decompressed as a single stream
+	ZSTD_DStream* d_stream = nullptr;
+	vector<uint8_t> in_buffer;
+	ZSTD_inBuffer zin{ nullptr, 0, 0 };
+	vector<uint8_t> dec_buffer;
+	size_t dec_pos = 0;
+	size_t dec_size = 0;
+	uint64_t data_end = 0;				// position of the index (or file size) - end of compressed records
+	uint64_t read_pos = 0;				// position of the stream reader in the file
+	bool read_pos_lost = false;			// set when ReadFrame moved the file position
+
+	bool fill_dec_buffer();
+	bool get_byte(uint8_t& x);
+	size_t read_bytes(uint8_t* dest, size_t size);
+	
+	bool compress_frame(const vector<uint8_t>& packed, vector<uint8_t>& frame);
+	bool write_frame(const vector<uint8_t>& frame, const bkc_frame_desc_t& desc);
+	bool describe_frame(const vector<uint8_t>& packed, bkc_frame_desc_t& desc);
+	void unpack_record(vector<uint8_t>& rec, uint64_t& sample_id, uint64_t& barcode, uint64_t& leader, uint64_t& follower, uint64_t& count);
+
+	bool save_index();
+	bool load_index();
 
 	uint8_t sample_id_size_in_bytes;
 	uint8_t barcode_size_in_bytes;
@@ -85,15 +154,26 @@ public:
 		uint8_t _barcode_len_in_symbols, uint8_t _leader_len_in_symbols, uint8_t _gap_len_in_symbols, uint8_t _follower_len_in_symbols, uint32_t _zstd_level);
 
 	bool Create(const string& file_name, const output_format_t _output_format);
-	bool Open(const string& file_name);
+	// buffer_size - size of the file buffer (0 for the default one); small buffers for many files opened at once
+	bool Open(const string& file_name, size_t buffer_size = 0);
 	bool Close();
 
 //	void AddRecord(uint64_t sample_id, uint64_t barcode, uint64_t leader, uint64_t follower, uint64_t count);
 //	void AddRecords(vector<bkc_record_t> &records);
 	void AddPacked(vector<uint8_t>& packed);
+	// Frames are known for v2 files (reading) and for files being written
+	const vector<bkc_frame_desc_t>& GetFrames() const { return frames; }
+	uint32_t GetFormatVersion() const { return format_version; }
+	bool IsIndexed() const { return open_mode == open_mode_t::reading && format_version >= 2; }
+
+	// Can be called concurrently (also with GetRecord)
+	bool ReadFrame(size_t frame_id, vector<bkc_record_t>& records);
+
 	bool GetRecord(uint64_t &sample_id, uint64_t &barcode, uint64_t &leader, uint64_t &follower, uint64_t &count);
 
 	void GetLens(uint8_t& _barcode_len_in_symbols, uint8_t& _leader_len_in_symbols, uint8_t& _follower_len_in_symbols, uint8_t& _counter_size_in_bytes);
+	void GetSizes(uint8_t& _sample_id_size_in_bytes, uint8_t& _barcode_size_in_bytes, uint8_t& _leader_size_in_bytes, uint8_t& _follower_size_in_bytes, uint8_t& _counter_size_in_bytes);
+	uint8_t GetGapLen() const { return gap_len_in_symbols; }
 };
 
 // EOF
\ No newline at end of file
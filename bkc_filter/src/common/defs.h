@@ -11,6 +11,7 @@ enum class technology_t { unknown, ten_x, visium };
 enum class counting_mode_t { unknown, single, pair, filter };
 enum class output_format_t { unknown, bkc, splash };
 enum class export_filtered_input_t { none = 0, first = 1, second = 2, both = 3 };
+enum class pair_extraction_t { unknown, single_pass, rescan };
 
 const string BKC_VERSION = "1.1.0";
 const string BKC_DATE = "2024-11-26";
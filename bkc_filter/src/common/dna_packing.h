@@ -0,0 +1,510 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <bit>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define DNA_PACKING_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define DNA_PACKING_NEON
+#endif
+
+using namespace std;
+
+// *********************************************************************************************
+// 2-bit packing of DNA reads
+// Bases are coded as A-0, C-1, G-2, T-3 (as in BaseCoding4 and dna_code). A packed read is:
+//   - bases: 4 bases per byte, the 1st base in the highest bits of the 1st byte (so a k-mer is a big-endian load and a shift)
+//   - n_mask: 8 bases per byte, bit i of byte b is set if base 8b+i is not one of ACGT (its code is 0)
+// Arrays have exactly dna_packed_bytes(len) / dna_mask_bytes(len) bytes (no padding is required)
+// *********************************************************************************************
+
+// *********************************************************************************************
+constexpr size_t dna_packed_bytes(size_t len)
+{
+	return (len + 3) / 4;
+}
+
+// *********************************************************************************************
+constexpr size_t dna_mask_bytes(size_t len)
+{
+	return (len + 7) / 8;
+}
+
+namespace dna_packing
+{
+	// *********************************************************************************************
+	inline uint64_t bswap64(uint64_t x)
+	{
+#if defined(__GNUC__)
+		return __builtin_bswap64(x);
+#else
+		x = ((x & 0x00ff00ff00ff00ffull) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffull);
+		x = ((x & 0x0000ffff0000ffffull) << 16) | ((x >> 16) & 0x0000ffff0000ffffull);
+		return (x << 32) | (x >> 32);
+#endif
+	}
+
+	// *********************************************************************************************
+	// Loads up to 8 bytes (avail of them are readable), missing bytes are zeros
+	inline uint64_t load_le64(const uint8_t* p, size_t avail)
+	{
+		uint64_t x = 0;
+		memcpy(&x, p, avail < 8 ? avail : 8);
+
+		if constexpr (endian::native == endian::big)
+			x = bswap64(x);
+
+		return x;
+	}
+
+	// *********************************************************************************************
+	inline uint64_t load_be64(const uint8_t* p, size_t avail)
+	{
+		uint64_t x = 0;
+		memcpy(&x, p, avail < 8 ? avail : 8);
+
+		if constexpr (endian::native == endian::little)
+			x = bswap64(x);
+
+		return x;
+	}
+
+	// *********************************************************************************************
+	inline void store_be64(uint8_t* p, uint64_t x, size_t no_bytes)
+	{
+		if constexpr (endian::native == endian::little)
+			x = bswap64(x);
+
+		memcpy(p, &x, no_bytes);
+	}
+
+	// *********************************************************************************************
+	// 32 bases -> packed word + 32 bits of the N-mask
+	inline void pack_32_scalar(const char* bases, uint64_t& word, uint32_t& n_bits)
+	{
+		word = 0;
+		n_bits = 0;
+
+		for (int i = 0; i < 32; ++i)
+		{
+			uint64_t c;
+			switch (bases[i])
+			{
+			case 'A': c = 0; break;
+			case 'C': c = 1; break;
+			case 'G': c = 2; break;
+			case 'T': c = 3; break;
+			default: c = 0; n_bits |= 1u << i;
+			}
+
+			word = (word << 2) + c;
+		}
+	}
+
+#ifdef DNA_PACKING_AVX2
+	// *********************************************************************************************
+	// For A, C, G, T: ((c >> 1) ^ (c >> 2)) & 3 gives 0, 1, 2, 3
+	__attribute__((target("avx2"))) inline void pack_32_avx2(const char* bases, uint64_t& word, uint32_t& n_bits)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*) bases);
+
+		__m256i valid = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('C'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('T'))));
+
+		n_bits = ~(uint32_t) _mm256_movemask_epi8(valid);
+
+		// Shifts are on 16-bit lanes, so bits from the neighbour byte are removed by the final mask
+		__m256i codes = _mm256_xor_si256(_mm256_srli_epi16(x, 1), _mm256_srli_epi16(x, 2));
+		codes = _mm256_and_si256(_mm256_and_si256(codes, _mm256_set1_epi8(3)), valid);
+
+		// [c0, c1] -> 4 * c0 + c1; then [p0, p1] -> 16 * p0 + p1 (4 bases in the lowest byte of each 32-bit lane)
+		__m256i pairs = _mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0104));
+		__m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00010010));
+
+		__m256i bytes = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+			0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+		bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+
+		word = bswap64((uint64_t) _mm_cvtsi128_si64(_mm256_castsi256_si128(bytes)));
+	}
+
+	// *********************************************************************************************
+	inline bool has_avx2()
+	{
+		static const bool r = __builtin_cpu_supports("avx2");
+		return r;
+	}
+#endif
+
+#ifdef DNA_PACKING_NEON
+	// *********************************************************************************************
+	inline uint32_t pack_16_neon(const char* bases, uint32_t& n_bits)
+	{
+		uint8x16_t x = vld1q_u8((const uint8_t*) bases);
+
+		uint8x16_t valid = vorrq_u8(vorrq_u8(vceqq_u8(x, vdupq_n_u8('A')), vceqq_u8(x, vdupq_n_u8('C'))),
+			vorrq_u8(vceqq_u8(x, vdupq_n_u8('G')), vceqq_u8(x, vdupq_n_u8('T'))));
+
+		// N-mask: one bit per byte
+		static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+		uint8x16_t inv = vandq_u8(vmvnq_u8(valid), vld1q_u8(bit_weights));
+		n_bits = vaddv_u8(vget_low_u8(inv)) | ((uint32_t) vaddv_u8(vget_high_u8(inv)) << 8);
+
+		uint8x16_t codes = vandq_u8(vandq_u8(veorq_u8(vshrq_n_u8(x, 1), vshrq_n_u8(x, 2)), vdupq_n_u8(3)), valid);
+
+		// [c0, c1] -> 4 * c0 + c1 (16-bit lanes); [p0, p1] -> 16 * p0 + p1 (32-bit lanes)
+		uint16x8_t c16 = vreinterpretq_u16_u8(codes);
+		uint16x8_t pairs = vorrq_u16(vshlq_n_u16(vandq_u16(c16, vdupq_n_u16(0xff)), 2), vshrq_n_u16(c16, 8));
+		uint32x4_t p32 = vreinterpretq_u32_u16(pairs);
+		uint32x4_t quads = vorrq_u32(vshlq_n_u32(vandq_u32(p32, vdupq_n_u32(0xffff)), 4), vshrq_n_u32(p32, 16));
+
+		uint8x8_t b = vmovn_u16(vcombine_u16(vmovn_u32(quads), vdup_n_u16(0)));
+
+		uint32_t r;
+		memcpy(&r, &b, 4);
+
+		return __builtin_bswap32(r);
+	}
+
+	// *********************************************************************************************
+	inline void pack_32_neon(const char* bases, uint64_t& word, uint32_t& n_bits)
+	{
+		uint32_t n_lo, n_hi;
+		uint64_t hi = pack_16_neon(bases, n_lo);
+		uint64_t lo = pack_16_neon(bases + 16, n_hi);
+
+		word = (hi << 32) | lo;
+		n_bits = n_lo | (n_hi << 16);
+	}
+#endif
+
+	// *********************************************************************************************
+	inline void pack_32(const char* bases, uint64_t& word, uint32_t& n_bits)
+	{
+#if defined(DNA_PACKING_AVX2)
+		if (has_avx2())
+			pack_32_avx2(bases, word, n_bits);
+		else
+			pack_32_scalar(bases, word, n_bits);
+#elif defined(DNA_PACKING_NEON)
+		pack_32_neon(bases, word, n_bits);
+#else
+		pack_32_scalar(bases, word, n_bits);
+#endif
+	}
+}
+
+// *********************************************************************************************
+// Packs len bases; returns true if there is any non-ACGT base
+inline bool dna_pack(const char* bases, size_t len, uint8_t* packed, uint8_t* n_mask)
+{
+	size_t no_full = len / 32;
+	uint64_t word;
+	uint32_t n_bits;
+	uint32_t any_n = 0;
+
+	for (size_t i = 0; i < no_full; ++i)
+	{
+		dna_packing::pack_32(bases + 32 * i, word, n_bits);
+		dna_packing::store_be64(packed + 8 * i, word, 8);
+
+		for (int j = 0; j < 4; ++j)
+			n_mask[4 * i + j] = (uint8_t) (n_bits >> (8 * j));
+		any_n |= n_bits;
+	}
+
+	size_t rest = len - 32 * no_full;
+
+	if (rest)
+	{
+		char tail[32];
+		memcpy(tail, bases + 32 * no_full, rest);
+		memset(tail + rest, 'A', 32 - rest);
+
+		dna_packing::pack_32(tail, word, n_bits);
+		dna_packing::store_be64(packed + 8 * no_full, word, (rest + 3) / 4);
+
+		for (size_t j = 0; j < (rest + 7) / 8; ++j)
+			n_mask[4 * no_full + j] = (uint8_t) (n_bits >> (8 * j));
+		any_n |= n_bits;
+	}
+
+	return any_n != 0;
+}
+
+// *********************************************************************************************
+// k-mer (1 <= k <= 32) starting at pos (pos + k <= len); the same value as CKmer::data_aligned_dir() for this window
+inline uint64_t dna_packed_kmer(const uint8_t* packed, size_t len, size_t pos, uint32_t k)
+{
+	size_t b = pos / 4;
+	uint32_t off = 2 * (pos % 4);
+
+	uint64_t x = dna_packing::load_be64(packed + b, dna_packed_bytes(len) - b) << off;
+	if (off + 2 * k > 64)
+		x |= packed[b + 8] >> (8 - off);
+
+	return x >> (64 - 2 * k);
+}
+
+// *********************************************************************************************
+// True if any of bases [pos, pos + k) (k <= 32, pos + k <= len) is not ACGT
+inline bool dna_packed_has_n(const uint8_t* n_mask, size_t len, size_t pos, uint32_t k)
+{
+	size_t b = pos / 8;
+	uint32_t off = pos % 8;
+
+	uint64_t x = dna_packing::load_le64(n_mask + b, dna_mask_bytes(len) - b) >> off;
+	if (off + k > 64)
+		x |= (uint64_t) n_mask[b + 8] << (64 - off);
+
+	return (x & (~0ull >> (64 - k))) != 0;
+}
+
+// *********************************************************************************************
+// Packed read (does not own the data)
+struct dna_packed_view_t
+{
+	const uint8_t* packed = nullptr;
+	const uint8_t* n_mask = nullptr;			// can be nullptr if !any_n
+	uint32_t len = 0;
+	bool any_n = false;
+
+	uint64_t kmer(size_t pos, uint32_t k) const
+	{
+		return dna_packed_kmer(packed, len, pos, k);
+	}
+
+	bool has_n(size_t pos, uint32_t k) const
+	{
+		return any_n && dna_packed_has_n(n_mask, len, pos, k);
+	}
+};
+
+// *********************************************************************************************
+// Enumerates windows [leader][gap][follower] of a packed read, skipping windows with N in the leader or follower
+class CDnaPackedWindows
+{
+	const dna_packed_view_t& read;
+	uint32_t leader_len;
+	uint32_t follower_offset;
+	uint32_t follower_len;
+	uint32_t pos = 0;
+	uint32_t end_pos = 0;
+
+public:
+	CDnaPackedWindows(const dna_packed_view_t& read, uint32_t leader_len, uint32_t gap_len, uint32_t follower_len) :
+		read(read),
+		leader_len(leader_len),
+		follower_offset(leader_len + gap_len),
+		follower_len(follower_len)
+	{
+		uint32_t window_len = leader_len + gap_len + follower_len;
+		end_pos = read.len >= window_len ? read.len - window_len + 1 : 0;
+	}
+
+	// *********************************************************************************************
+	bool Next(uint64_t& leader, uint64_t& follower)
+	{
+		for (; pos < end_pos; ++pos)
+		{
+			if (read.has_n(pos, leader_len) || read.has_n(pos + follower_offset, follower_len))
+				continue;
+
+			leader = read.kmer(pos, leader_len);
+			follower = read.kmer(pos + follower_offset, follower_len);
+			++pos;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// *********************************************************************************************
+	// Leader only (the follower is still required to be free of Ns)
+	bool NextLeader(uint64_t& leader)
+	{
+		for (; pos < end_pos; ++pos)
+		{
+			if (read.has_n(pos, leader_len) || read.has_n(pos + follower_offset, follower_len))
+				continue;
+
+			leader = read.kmer(pos, leader_len);
+			++pos;
+
+			return true;
+		}
+
+		return false;
+	}
+};
+
+// *********************************************************************************************
+// Same windows as CDnaPackedWindows (in the same order), for lengths known at compile time
+// The leader and follower are rolled base by base (no unaligned loads per window) and Ns are tracked by the position
+// of the last N in each of them, so reads without Ns take a branch-free path
+template<uint32_t LEADER_LEN, uint32_t GAP_LEN, uint32_t FOLLOWER_LEN, typename FUN>
+inline void dna_packed_for_each_window(const dna_packed_view_t& read, FUN&& fun)
+{
+	static_assert(LEADER_LEN >= 1 && LEADER_LEN <= 32 && FOLLOWER_LEN >= 1 && FOLLOWER_LEN <= 32);
+
+	constexpr uint32_t follower_offset = LEADER_LEN + GAP_LEN;
+	constexpr uint32_t window_len = LEADER_LEN + GAP_LEN + FOLLOWER_LEN;
+	constexpr uint64_t leader_mask = LEADER_LEN == 32 ? ~0ull : (1ull << (2 * LEADER_LEN)) - 1;
+	constexpr uint64_t follower_mask = FOLLOWER_LEN == 32 ? ~0ull : (1ull << (2 * FOLLOWER_LEN)) - 1;
+
+	if (read.len < window_len)
+		return;
+
+	const uint8_t* packed = read.packed;
+	const uint8_t* n_mask = read.n_mask;
+	const uint32_t end_pos = read.len - window_len + 1;
+
+	auto base = [packed](uint32_t i) -> uint64_t {
+		return (packed[i >> 2] >> (6 - 2 * (i & 3))) & 3;
+	};
+
+	uint64_t leader = 0;
+	uint64_t follower = 0;
+
+	for (uint32_t i = 0; i + 1 < LEADER_LEN; ++i)
+		leader = (leader << 2) | base(i);
+	for (uint32_t i = follower_offset; i + 1 < window_len; ++i)
+		follower = (follower << 2) | base(i);
+
+	if (!read.any_n)
+	{
+		for (uint32_t pos = 0; pos < end_pos; ++pos)
+		{
+			leader = ((leader << 2) | base(pos + LEADER_LEN - 1)) & leader_mask;
+			follower = ((follower << 2) | base(pos + window_len - 1)) & follower_mask;
+
+			fun(leader, follower);
+		}
+
+		return;
+	}
+
+	auto is_n = [n_mask](uint32_t i) -> bool {
+		return (n_mask[i >> 3] >> (i & 7)) & 1;
+	};
+
+	// Positions + 1 of the last N in the leader / follower input streams (0 - none)
+	uint32_t leader_last_n = 0;
+	uint32_t follower_last_n = 0;
+
+	for (uint32_t i = 0; i + 1 < LEADER_LEN; ++i)
+		if (is_n(i))
+			leader_last_n = i + 1;
+	for (uint32_t i = follower_offset; i + 1 < window_len; ++i)
+		if (is_n(i))
+			follower_last_n = i + 1;
+
+	for (uint32_t pos = 0; pos < end_pos; ++pos)
+	{
+		uint32_t leader_in = pos + LEADER_LEN - 1;
+		uint32_t follower_in = pos + window_len - 1;
+
+		leader = ((leader << 2) | base(leader_in)) & leader_mask;
+		follower = ((follower << 2) | base(follower_in)) & follower_mask;
+
+		if (is_n(leader_in))
+			leader_last_n = leader_in + 1;
+		if (is_n(follower_in))
+			follower_last_n = follower_in + 1;
+
+		if (leader_last_n <= pos && follower_last_n <= pos + follower_offset)
+			fun(leader, follower);
+	}
+}
+
+// *********************************************************************************************
+// Generic version (lengths known at run time)
+template<typename FUN>
+inline void dna_packed_for_each_window(const dna_packed_view_t& read, uint32_t leader_len, uint32_t gap_len, uint32_t follower_len, FUN&& fun)
+{
+	CDnaPackedWindows windows(read, leader_len, gap_len, follower_len);
+	uint64_t leader, follower;
+
+	while (windows.Next(leader, follower))
+		fun(leader, follower);
+}
+
+// *********************************************************************************************
+// Stored (in-memory) form of a packed read: [len << 1 | any_n: 4B][bases: dna_packed_bytes(len)][n_mask: dna_mask_bytes(len), only if any_n]
+// Records are byte-aligned, so they can be placed in memory arenas and bucket files as they are
+// *********************************************************************************************
+
+// *********************************************************************************************
+inline size_t dna_stored_size(uint32_t len, bool any_n)
+{
+	return sizeof(uint32_t) + dna_packed_bytes(len) + (any_n ? dna_mask_bytes(len) : 0);
+}
+
+// *********************************************************************************************
+inline dna_packed_view_t dna_stored_view(const uint8_t* stored)
+{
+	uint32_t header;
+	memcpy(&header, stored, sizeof(header));
+
+	dna_packed_view_t view;
+
+	view.len = header >> 1;
+	view.any_n = header & 1;
+	view.packed = stored + sizeof(header);
+	view.n_mask = view.any_n ? view.packed + dna_packed_bytes(view.len) : nullptr;
+
+	return view;
+}
+
+// *********************************************************************************************
+// Packed read with own buffers, which are reused for consecutive reads
+class CDnaPackedRead
+{
+	vector<uint8_t> packed;
+	vector<uint8_t> n_mask;
+	dna_packed_view_t view;
+
+public:
+	void Assign(const char* bases, size_t len)
+	{
+		packed.resize(dna_packed_bytes(len));
+		n_mask.resize(dna_mask_bytes(len));
+
+		view.any_n = dna_pack(bases, len, packed.data(), n_mask.data());
+		view.packed = packed.data();
+		view.n_mask = n_mask.data();
+		view.len = (uint32_t) len;
+	}
+
+	const dna_packed_view_t& View() const
+	{
+		return view;
+	}
+
+	size_t StoredSize() const
+	{
+		return dna_stored_size(view.len, view.any_n);
+	}
+
+	// dest must have StoredSize() bytes
+	void Store(uint8_t* dest) const
+	{
+		uint32_t header = (view.len << 1) | (view.any_n ? 1 : 0);
+
+		memcpy(dest, &header, sizeof(header));
+		memcpy(dest + sizeof(header), packed.data(), packed.size());
+		if (view.any_n)
+			memcpy(dest + sizeof(header) + packed.size(), n_mask.data(), n_mask.size());
+	}
+};
+
+// EOF
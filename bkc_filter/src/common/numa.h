@@ -0,0 +1,278 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+#include <cinttypes>
+#include <filesystem>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// *********************************************************************************************
+// NUMA topology (from sysfs, no libnuma needed) and thread pinning
+// On other systems (or if sysfs is not available) there is a single node and pinning does nothing
+// Nodes are indexed 0..NoNodes()-1 over the nodes having CPUs (memory-only nodes are skipped);
+// the sysfs node ids (which can be sparse) are kept in node_ids and are what mbind expects
+class CNumaTopology
+{
+	vector<vector<int>> node_cpus;
+	vector<uint32_t> node_ids;
+
+	static inline thread_local int current_node = -1;
+
+	// *********************************************************************************************
+	// Parses cpulist format, e.g., "0-15,32-47"
+	static vector<int> parse_cpu_list(const string& str)
+	{
+		vector<int> cpus;
+		stringstream ss(str);
+		string range;
+
+		while (getline(ss, range, ','))
+		{
+			auto p = range.find('-');
+			int first = atoi(range.c_str());
+			int last = p == string::npos ? first : atoi(range.c_str() + p + 1);
+
+			for (int i = first; i <= last; ++i)
+				cpus.push_back(i);
+		}
+
+		return cpus;
+	}
+
+public:
+	// *********************************************************************************************
+	CNumaTopology()
+	{
+#if defined(__linux__)
+		vector<pair<uint32_t, vector<int>>> nodes;
+		error_code ec;
+
+		for (filesystem::directory_iterator it("/sys/devices/system/node", ec), it_end; !ec && it != it_end; it.increment(ec))
+		{
+			string name = it->path().filename().string();
+			if (name.size() <= 4 || name.compare(0, 4, "node") != 0 || 
+				!all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+				continue;
+
+			ifstream ifs(it->path() / "cpulist");
+			if (!ifs)
+				continue;
+
+			string line;
+			getline(ifs, line);
+
+			auto cpus = parse_cpu_list(line);
+			if (!cpus.empty())
+				nodes.emplace_back((uint32_t) stoul(name.substr(4)), move(cpus));
+		}
+
+		std::sort(nodes.begin(), nodes.end());
+
+		for (auto& x : nodes)
+		{
+			node_ids.push_back(x.first);
+			node_cpus.emplace_back(move(x.second));
+		}
+#endif
+
+		if (node_cpus.empty())
+		{
+			node_ids.push_back(0);
+			node_cpus.emplace_back();
+		}
+	}
+
+	// *********************************************************************************************
+	uint32_t NoNodes() const
+	{
+		return (uint32_t) node_cpus.size();
+	}
+
+	// *********************************************************************************************
+	// System (sysfs) id of the node, e.g., for binding memory to it
+	uint32_t NodeId(uint32_t node) const
+	{
+		return node < node_ids.size() ? node_ids[node] : 0;
+	}
+
+	// *********************************************************************************************
+	// Node for the i-th of no_threads threads (threads are spread evenly, in contiguous groups)
+	uint32_t NodeForThread(uint32_t i, uint32_t no_threads) const
+	{
+		return no_threads ? (uint32_t) ((uint64_t) i * NoNodes() / no_threads) : 0;
+	}
+
+	// *********************************************************************************************
+	// Restricts the calling thread to the CPUs of the node
+	bool PinCurrentThread(uint32_t node) const
+	{
+		current_node = (int) node;
+
+#if defined(__linux__)
+		if (node >= node_cpus.size() || node_cpus[node].empty())
+			return false;
+
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		for (auto cpu : node_cpus[node])
+			CPU_SET(cpu, &cpu_set);
+
+		return sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// *********************************************************************************************
+	// Node the calling thread was pinned to (-1 if not pinned)
+	static int CurrentNode()
+	{
+		return current_node;
+	}
+};
+
+// *********************************************************************************************
+// Thread-safe monotonic arena with memory bound to a single NUMA node (pages are placed on the node
+// at first touch, whichever thread touches them). Memory is released only in the destructor.
+// node is the system node id (CNumaTopology::NodeId), not the index of the node in the topology
+class CNumaArena
+{
+	const size_t block_size;
+	const uint32_t node;
+
+	mutex mtx;
+	vector<pair<uint8_t*, size_t>> blocks;
+	uint8_t* curr = nullptr;
+	size_t left = 0;
+
+	// *********************************************************************************************
+	uint8_t* allocate_block(size_t size)
+	{
+#if defined(__linux__)
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return nullptr;
+
+#if defined(SYS_mbind)
+		// MPOL_PREFERRED (1): falls back to other nodes if the node is out of memory
+		const int mpol_preferred = 1;
+		unsigned long node_mask[16] = { 0 };
+
+		if (node < 64 * 16)
+		{
+			node_mask[node / 64] = 1ul << (node % 64);
+			syscall(SYS_mbind, p, size, mpol_preferred, node_mask, 64 * 16 + 1, 0);
+		}
+#endif
+		return (uint8_t*) p;
+#else
+		return (uint8_t*) malloc(size);
+#endif
+	}
+
+	// *********************************************************************************************
+	void release_block(uint8_t* p, size_t size)
+	{
+#if defined(__linux__)
+		munmap(p, size);
+#else
+		free(p);
+#endif
+	}
+
+public:
+	// *********************************************************************************************
+	CNumaArena(uint32_t node, size_t block_size = 64 << 20) :
+		block_size(block_size),
+		node(node)
+	{}
+
+	CNumaArena(const CNumaArena&) = delete;
+
+	// *********************************************************************************************
+	~CNumaArena()
+	{
+		for (auto& x : blocks)
+			release_block(x.first, x.second);
+	}
+
+	// *********************************************************************************************
+	// Returns nullptr if the memory cannot be allocated
+	uint8_t* Allocate(size_t size)
+	{
+		lock_guard<mutex> lck(mtx);
+
+		if (size > left)
+		{
+			size_t new_size = max(size, block_size);
+			uint8_t* p = allocate_block(new_size);
+			if (!p)
+				return nullptr;
+
+			blocks.emplace_back(p, new_size);
+			curr = p;
+			left = new_size;
+		}
+
+		uint8_t* r = curr;
+		curr += size;
+		left -= size;
+
+		return r;
+	}
+};
+
+// *********************************************************************************************
+// Per-thread front of a CNumaArena: takes larger chunks from the arena, so the arena lock is rarely taken
+class CNumaArenaCache
+{
+	CNumaArena* arena = nullptr;
+	uint8_t* curr = nullptr;
+	size_t left = 0;
+	size_t chunk_size;
+
+public:
+	// *********************************************************************************************
+	CNumaArenaCache(CNumaArena* arena = nullptr, size_t chunk_size = 1 << 20) :
+		arena(arena),
+		chunk_size(chunk_size)
+	{}
+
+	// *********************************************************************************************
+	uint8_t* Allocate(size_t size)
+	{
+		if (size > left)
+		{
+			size_t new_size = max(size, chunk_size);
+			curr = arena->Allocate(new_size);
+			if (!curr)
+			{
+				left = 0;
+				return nullptr;
+			}
+			left = new_size;
+		}
+
+		uint8_t* r = curr;
+		curr += size;
+		left -= size;
+
+		return r;
+	}
+};
+
+// EOF
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cinttypes>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+// *********************************************************************************************
+// Run-wide performance counters and per-stage snapshots, reported as JSON (--stats_json)
+// Counters are updated by many threads (relaxed atomics); wait times are summed over all threads,
+// so a wait of 10s in 4 threads contributes 40s
+class CRunStats
+{
+public:
+	enum class counter_t {
+		bytes_read,					// from disk (compressed for gzipped inputs)
+		bytes_decompressed,
+		records_in,					// input reads parsed
+		records_out,				// records written to output files (BKC records, exported reads)
+		reads_collapsed_in,			// reads of CBCs before collapsing duplicates (--collapse_duplicate_reads)
+		reads_collapsed_out,		// distinct reads of CBCs after collapsing duplicates
+		mem_pool_pop_wait_ns,		// CMemoryPool::Pop waiting for a free chunk
+		queue_pop_wait_ns,			// parallel_queue::pop (waiting mostly at an empty queue)
+		queue_push_wait_ns,			// parallel_queue::push (waiting mostly at a full queue)
+		bkc_lock_wait_ns,			// CBKCFile::AddPacked waiting for the file lock
+		no_counters
+	};
+
+private:
+	static constexpr size_t no_counters = (size_t) counter_t::no_counters;
+
+	static constexpr const char* counter_names[no_counters] = {
+		"bytes_read", "bytes_decompressed", "records_in", "records_out", "reads_collapsed_in", "reads_collapsed_out",
+		"mem_pool_pop_wait_s", "queue_pop_wait_s", "queue_push_wait_s", "bkc_lock_wait_s"
+	};
+
+	struct snapshot_t
+	{
+		chrono::steady_clock::time_point wall;
+		double cpu_user = 0;
+		double cpu_sys = 0;
+		uint64_t peak_rss = 0;
+		array<uint64_t, no_counters> counters{};
+	};
+
+	struct stage_t
+	{
+		string name;
+		snapshot_t begin;
+		snapshot_t end;
+	};
+
+	atomic<bool> enabled{ false };
+	array<atomic<uint64_t>, no_counters> counters{};
+
+	snapshot_t start;
+	snapshot_t last;
+	vector<stage_t> stages;
+
+	// *********************************************************************************************
+	snapshot_t take_snapshot() const
+	{
+		snapshot_t s;
+
+		s.wall = chrono::steady_clock::now();
+
+#if defined(__linux__) || defined(__APPLE__)
+		rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru) == 0)
+		{
+			s.cpu_user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+			s.cpu_sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+#if defined(__APPLE__)
+			s.peak_rss = (uint64_t) ru.ru_maxrss;				// bytes
+#else
+			s.peak_rss = (uint64_t) ru.ru_maxrss << 10;			// KB
+#endif
+		}
+#endif
+
+		for (size_t i = 0; i < no_counters; ++i)
+			s.counters[i] = counters[i].load(memory_order_relaxed);
+
+		return s;
+	}
+
+	// *********************************************************************************************
+	static bool is_time_counter(size_t i)
+	{
+		return i >= (size_t) counter_t::mem_pool_pop_wait_ns;
+	}
+
+	// *********************************************************************************************
+	static string escape(const string& str)
+	{
+		string r;
+
+		for (char c : str)
+		{
+			if (c == '"' || c == '\\')
+				r.push_back('\\');
+			r.push_back(c);
+		}
+
+		return r;
+	}
+
+	// *********************************************************************************************
+	static void write_entry(ostream& os, const string& name, const snapshot_t& a, const snapshot_t& b, const string& indent)
+	{
+		os << indent << "\"name\": \"" << escape(name) << "\",\n";
+		os << indent << "\"wall_s\": " << chrono::duration<double>(b.wall - a.wall).count() << ",\n";
+		os << indent << "\"cpu_user_s\": " << b.cpu_user - a.cpu_user << ",\n";
+		os << indent << "\"cpu_sys_s\": " << b.cpu_sys - a.cpu_sys << ",\n";
+		os << indent << "\"peak_rss_bytes\": " << b.peak_rss;
+
+		for (size_t i = 0; i < no_counters; ++i)
+		{
+			uint64_t delta = b.counters[i] - a.counters[i];
+
+			os << ",\n" << indent << "\"" << counter_names[i] << "\": ";
+			if (is_time_counter(i))
+				os << delta * 1e-9;
+			else
+				os << delta;
+		}
+
+		os << "\n";
+	}
+
+public:
+	// *********************************************************************************************
+	CRunStats()
+	{
+		start = last = take_snapshot();
+	}
+
+	// *********************************************************************************************
+	// Wait timers are active only if enabled (the other counters are always updated)
+	void Enable(bool _enabled = true)
+	{
+		enabled.store(_enabled, memory_order_relaxed);
+	}
+
+	// *********************************************************************************************
+	bool Enabled() const
+	{
+		return enabled.load(memory_order_relaxed);
+	}
+
+	// *********************************************************************************************
+	void Add(counter_t counter, uint64_t value)
+	{
+		counters[(size_t) counter].fetch_add(value, memory_order_relaxed);
+	}
+
+	// *********************************************************************************************
+	// Closes the stage started at the previous call (or at Restart); not thread-safe
+	void EndStage(const string& name)
+	{
+		auto now = take_snapshot();
+
+		stages.push_back(stage_t{ name, last, now });
+		last = now;
+	}
+
+	// *********************************************************************************************
+	// Next stage starts now (the time since the previous stage is not reported as a stage)
+	void Restart()
+	{
+		last = take_snapshot();
+	}
+
+	// *********************************************************************************************
+	bool SaveJson(const string& file_name, const string& tool_name) const
+	{
+		ofstream ofs(file_name);
+
+		if (!ofs)
+		{
+			cerr << "Cannot create stats file: " << file_name << endl;
+			return false;
+		}
+
+		auto now = take_snapshot();
+
+		ofs << setprecision(6) << fixed;
+		ofs << "{\n";
+		ofs << "  \"tool\": \"" << escape(tool_name) << "\",\n";
+		ofs << "  \"total\": {\n";
+		write_entry(ofs, "total", start, now, "    ");
+		ofs << "  },\n";
+		ofs << "  \"stages\": [";
+
+		for (size_t i = 0; i < stages.size(); ++i)
+		{
+			ofs << (i ? ",\n" : "\n") << "    {\n";
+			write_entry(ofs, stages[i].name, stages[i].begin, stages[i].end, "      ");
+			ofs << "    }";
+		}
+
+		ofs << "\n  ]\n";
+		ofs << "}\n";
+
+		return (bool) ofs;
+	}
+};
+
+inline CRunStats run_stats;
+
+// *********************************************************************************************
+// Adds the lifetime of the object (in ns) to a wait counter; does nothing if stats are not enabled
+class CWaitTimer
+{
+	CRunStats::counter_t counter;
+	bool active;
+	chrono::steady_clock::time_point t_start;
+
+public:
+	// *********************************************************************************************
+	CWaitTimer(CRunStats::counter_t counter) :
+		counter(counter),
+		active(run_stats.Enabled())
+	{
+		if (active)
+			t_start = chrono::steady_clock::now();
+	}
+
+	CWaitTimer(const CWaitTimer&) = delete;
+
+	// *********************************************************************************************
+	~CWaitTimer()
+	{
+		if (active)
+			run_stats.Add(counter, (uint64_t) chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t_start).count());
+	}
+};
+
+// *********************************************************************************************
+template<typename QUEUE, typename T> bool timed_pop(QUEUE& queue, T& x)
+{
+	CWaitTimer timer(CRunStats::counter_t::queue_pop_wait_ns);
+
+	return queue.pop(x);
+}
+
+// *********************************************************************************************
+template<typename QUEUE, typename T> void timed_push(QUEUE& queue, T&& x)
+{
+	CWaitTimer timer(CRunStats::counter_t::queue_push_wait_ns);
+
+	queue.push(forward<T>(x));
+}
+
+// EOF
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cinttypes>
+
+using namespace std;
+
+// *********************************************************************************************
+// Long-lived worker pool shared by all processing stages
+// The calling thread always takes part in the work and, while waiting, executes queued tasks,
+// so parallel loops can be nested (or called from pool tasks) without deadlocks.
+// Tasks must not block on each other (e.g., producers and consumers of a bounded queue must be separate threads).
+class CThreadPool
+{
+	vector<thread> workers;
+	deque<function<void()>> tasks;
+
+	mutex mtx;
+	condition_variable cv;
+	bool stop = false;
+
+	// *********************************************************************************************
+	void worker_loop()
+	{
+		while (true)
+		{
+			function<void()> task;
+
+			{
+				unique_lock<mutex> lck(mtx);
+				cv.wait(lck, [this] { return stop || !tasks.empty(); });
+
+				if (tasks.empty())
+					return;
+
+				task = move(tasks.front());
+				tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+
+	// *********************************************************************************************
+	bool try_run_one()
+	{
+		function<void()> task;
+
+		{
+			lock_guard<mutex> lck(mtx);
+			if (tasks.empty())
+				return false;
+
+			task = move(tasks.front());
+			tasks.pop_front();
+		}
+
+		task();
+
+		return true;
+	}
+
+	// *********************************************************************************************
+	void enqueue(function<void()> task)
+	{
+		{
+			lock_guard<mutex> lck(mtx);
+			tasks.emplace_back(move(task));
+		}
+		cv.notify_one();
+	}
+
+public:
+	// *********************************************************************************************
+	// Set of tasks that can be waited for
+	class CTaskGroup
+	{
+		CThreadPool& pool;
+		atomic<size_t> no_pending{ 0 };
+		mutex mtx;
+		condition_variable cv;
+
+	public:
+		CTaskGroup(CThreadPool& pool) : pool(pool) {}
+		CTaskGroup(const CTaskGroup&) = delete;
+		~CTaskGroup() { Wait(); }
+
+		// *********************************************************************************************
+		void Run(function<void()> task)
+		{
+			++no_pending;
+
+			pool.enqueue([this, task = move(task)] {
+				task();
+
+				lock_guard<mutex> lck(mtx);
+				if (--no_pending == 0)
+					cv.notify_all();
+				});
+		}
+
+		// *********************************************************************************************
+		void Wait()
+		{
+			while (no_pending)
+			{
+				if (pool.try_run_one())
+					continue;
+
+				unique_lock<mutex> lck(mtx);
+				cv.wait(lck, [this] { return no_pending == 0; });
+			}
+
+			// The last task can still hold the mutex just after the counter dropped to 0
+			lock_guard<mutex> lck(mtx);
+		}
+	};
+
+	// *********************************************************************************************
+	// no_threads is the total no. of threads doing the work, i.e., including the calling one
+	// on_start(i) is called in the i-th worker (i in [1, no_threads)) before it takes any task, e.g., to pin it
+	explicit CThreadPool(uint32_t no_threads, function<void(uint32_t)> on_start = nullptr)
+	{
+		for (uint32_t i = 1; i < no_threads; ++i)
+			workers.emplace_back([this, i, on_start] {
+				if (on_start)
+					on_start(i);
+				worker_loop();
+				});
+	}
+
+	// *********************************************************************************************
+	~CThreadPool()
+	{
+		{
+			lock_guard<mutex> lck(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+
+		for (auto& t : workers)
+			t.join();
+	}
+
+	// *********************************************************************************************
+	uint32_t Size() const
+	{
+		return (uint32_t) workers.size() + 1;
+	}
+
+	// *********************************************************************************************
+	// Runs fun(worker_id) for worker_id in [0, no_workers) concurrently and waits for all of them
+	// Each call is a worker loop, which usually takes items from a shared (atomic) counter
+	void ParallelFor(uint32_t no_workers, const function<void(uint32_t)>& fun)
+	{
+		CTaskGroup group(*this);
+
+		for (uint32_t i = 1; i < no_workers; ++i)
+			group.Run([&fun, i] { fun(i); });
+
+		if (no_workers)
+			fun(0);
+
+		group.Wait();
+	}
+
+	// *********************************************************************************************
+	// Runs fun(i) for i in [0, no_items), dynamically distributed in chunks of grain items
+	void ParallelForEach(size_t no_items, const function<void(size_t)>& fun, size_t grain = 1)
+	{
+		atomic<size_t> next{ 0 };
+
+		ParallelFor(Size(), [&](uint32_t) {
+			while (true)
+			{
+				size_t begin = next.fetch_add(grain);
+				if (begin >= no_items)
+					break;
+
+				size_t end = min(begin + grain, no_items);
+				for (size_t i = begin; i < end; ++i)
+					fun(i);
+			}
+			});
+	}
+};
+
+// EOF